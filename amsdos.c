@@ -25,21 +25,29 @@ u16 header_checksum(struct amsdos_header_s *header)
 
 void amsdos_new(FILE *fp, struct amsdos_header_s *dest, const char *file_name, u16 entry_addr, u16 exec_addr)
 {
-    u16 data_length;
+    long data_length;
+
+    assert(fp);
+
+    fseek(fp, 0, SEEK_END);
+    data_length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    amsdos_new_header(dest, file_name, data_length, entry_addr, exec_addr);
+}
+
+void amsdos_new_header(struct amsdos_header_s *dest, const char *file_name, long data_length,
+                       u16 entry_addr, u16 exec_addr)
+{
     struct cpm_diren_s filename_diren;
     u8 file_type;
     u16 data_location;
 
-    assert(fp);
     assert(dest);
     assert(file_name);
 
     memset(dest, 0, sizeof(*dest));
 
-    fseek(fp, 0, SEEK_END);
-    data_length = (u16) ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
     denormalize_filename(file_name, &filename_diren);
 
     file_type = strnicmp((char *) filename_diren.ext, "bas", 3) == 0 ? 0 : 2;
@@ -60,10 +68,28 @@ void amsdos_new(FILE *fp, struct amsdos_header_s *dest, const char *file_name, u
     dest->filetype = file_type;
     dest->data_location = data_location;
     dest->first_block = 0;
-    dest->logical_length = data_length;
     dest->entry_address = exec_addr;
-    memcpy(&dest->_unused_file_length, &data_length, 2);
-    dest->check_sum = header_checksum(dest);
+    amsdos_set_length(dest, data_length);
+}
+
+long amsdos_get_length(struct amsdos_header_s *header)
+{
+    assert(header);
+
+    return header->_unused_file_length[0]
+        | (long) header->_unused_file_length[1] << 8
+        | (long) header->_unused_file_length[2] << 16;
+}
+
+void amsdos_set_length(struct amsdos_header_s *header, long data_length)
+{
+    assert(header);
+
+    header->logical_length = (u16) data_length;
+    header->_unused_file_length[0] = (u8) data_length;
+    header->_unused_file_length[1] = (u8) (data_length >> 8);
+    header->_unused_file_length[2] = (u8) (data_length >> 16);
+    header->check_sum = header_checksum(header);
 }
 
 int amsdos_header_exists(struct amsdos_header_s *header)
@@ -91,19 +117,19 @@ char *get_filetype(u8 filetype)
     return "Unrecognized filetype";
 }
 
-void amsdos_print_header(struct amsdos_header_s *header)
+void amsdos_print_header(FILE *out, struct amsdos_header_s *header)
 {
     assert(header);
 
-    printf("AMSDOS Header\n");
-    printf("-------------\n");
-    printf("User number          : %d\n", header->user_number);
-    printf("Filename             : %.8s\n", header->filename);
-    printf("Extension            : %.3s\n", header->extension);
-    printf("Filetype             : %s\n", get_filetype(header->filetype));
-    printf("Data length          : 0x%.4x (%d)\n", header->data_length, header->data_length);
-    printf("Loading address      : 0x%.4x\n", header->data_location);
-    printf("Logical length       : 0x%.4x (%d)\n", header->logical_length, header->logical_length);
-    printf("Entry adress         : 0x%.4x\n", header->entry_address);
-    printf("Checksum:            : 0x%.4x\n", header->check_sum);
+    fprintf(out, "AMSDOS Header\n");
+    fprintf(out, "-------------\n");
+    fprintf(out, "User number          : %d\n", header->user_number);
+    fprintf(out, "Filename             : %.8s\n", header->filename);
+    fprintf(out, "Extension            : %.3s\n", header->extension);
+    fprintf(out, "Filetype             : %s\n", get_filetype(header->filetype));
+    fprintf(out, "Data length          : 0x%.4x (%d)\n", header->data_length, header->data_length);
+    fprintf(out, "Loading address      : 0x%.4x\n", header->data_location);
+    fprintf(out, "Logical length       : 0x%.4x (%d)\n", header->logical_length, header->logical_length);
+    fprintf(out, "Entry adress         : 0x%.4x\n", header->entry_address);
+    fprintf(out, "Checksum:            : 0x%.4x\n", header->check_sum);
 }
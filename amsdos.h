@@ -22,13 +22,17 @@ struct amsdos_header_s {
     u8 _unused3[36];
     u8 _unused_file_length[3]; /* 24-bit file length */
     u16 check_sum;
-    u8 _unused4[60];
+    u8 _unused4[59];
 };
 #pragma pack(pop)
 
 void amsdos_new(FILE *fp, struct amsdos_header_s *dest, const char *file_name, u16 entry_addr, u16 exec_addr);
+void amsdos_new_header(struct amsdos_header_s *dest, const char *file_name, long data_length,
+                       u16 entry_addr, u16 exec_addr);
+long amsdos_get_length(struct amsdos_header_s *header);
+void amsdos_set_length(struct amsdos_header_s *header, long data_length);
 int amsdos_header_exists(struct amsdos_header_s *header);
-void amsdos_print_header(struct amsdos_header_s *header);
+void amsdos_print_header(FILE *out, struct amsdos_header_s *header);
 
 
 #endif
@@ -0,0 +1,875 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "archive.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "gzip.h"
+#include "prefetch.h"
+#include "shadow.h"
+
+#if defined (_WIN32)
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_dir(path) mkdir(path, 0777)
+#endif
+
+struct chunk_store_s {
+    FILE *fp;                           /* Archive being written */
+    struct archive_chunk_s *chunks;
+    u32 num_chunks;
+    u32 capacity;
+    u32 *table;                         /* Open addressing, chunk index + 1 */
+    u32 table_size;
+    u32 data_offset;
+    unsigned long stored_bytes;
+};
+
+struct recipe_s {
+    u32 *refs;
+    u32 num_refs;
+    u32 capacity;
+};
+
+static
+void *xrealloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    return ptr;
+}
+
+static
+u32 table_slot(const u8 hash[HASH_SIZE], u32 table_size)
+{
+    u32 h;
+
+    memcpy(&h, hash, sizeof(h));
+
+    return h & (table_size - 1);
+}
+
+static
+void grow_table(struct chunk_store_s *store)
+{
+    u32 i;
+
+    store->table_size = store->table_size ? store->table_size * 2 : 4096;
+    free(store->table);
+    store->table = (u32 *) calloc(store->table_size, sizeof(u32));
+    if (!store->table) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < store->num_chunks; i++) {
+        u32 slot = table_slot(store->chunks[i].hash, store->table_size);
+
+        while (store->table[slot]) {
+            slot = (slot + 1) & (store->table_size - 1);
+        }
+
+        store->table[slot] = i + 1;
+    }
+}
+
+/* Compares data with a stored chunk of the same size and hash, so chunks
+   whose hashes collide are never merged */
+static
+int chunk_equals(struct chunk_store_s *store, const struct archive_chunk_s *chunk, const u8 *data)
+{
+    u8 buffer[ARCHIVE_RAW_CHUNK_SIZE];
+    u32 done;
+    int equal;
+
+    equal = fseek(store->fp, chunk->offset, SEEK_SET) == 0;
+
+    for (done = 0; equal && done < chunk->size; ) {
+        size_t n = chunk->size - done < sizeof(buffer) ? chunk->size - done : sizeof(buffer);
+
+        equal = fread(buffer, 1, n, store->fp) == n && memcmp(buffer, data + done, n) == 0;
+        done += n;
+    }
+
+    /* Back to the end, where the next chunk is written */
+    if (fseek(store->fp, store->data_offset, SEEK_SET) != 0) {
+        fprintf(stderr, "Error writing to archive.\n");
+        exit(1);
+    }
+
+    return equal;
+}
+
+static
+u32 store_chunk(struct chunk_store_s *store, const u8 *data, u32 size)
+{
+    struct archive_chunk_s *chunk;
+    u8 hash[HASH_SIZE];
+    u32 slot;
+
+    hash_buffer(data, size, hash);
+
+    if ((store->num_chunks + 1) * 2 > store->table_size) {
+        grow_table(store);
+    }
+
+    slot = table_slot(hash, store->table_size);
+
+    while (store->table[slot]) {
+        chunk = &store->chunks[store->table[slot] - 1];
+
+        if (   chunk->size == size
+            && memcmp(chunk->hash, hash, HASH_SIZE) == 0
+            && chunk_equals(store, chunk, data)) {
+            return store->table[slot] - 1;
+        }
+
+        slot = (slot + 1) & (store->table_size - 1);
+    }
+
+    if (store->num_chunks == store->capacity) {
+        store->capacity = store->capacity ? store->capacity * 2 : 1024;
+        store->chunks = (struct archive_chunk_s *) xrealloc(store->chunks,
+                            store->capacity * sizeof(struct archive_chunk_s));
+    }
+
+    chunk = &store->chunks[store->num_chunks];
+    memcpy(chunk->hash, hash, HASH_SIZE);
+    chunk->offset = store->data_offset;
+    chunk->size   = size;
+
+    if (fwrite(data, 1, size, store->fp) != size) {
+        fprintf(stderr, "Error writing to archive.\n");
+        exit(1);
+    }
+
+    store->data_offset  += size;
+    store->stored_bytes += size;
+    store->table[slot]   = ++store->num_chunks;
+
+    return store->num_chunks - 1;
+}
+
+static
+void add_ref(struct recipe_s *recipe, u32 ref)
+{
+    if (recipe->num_refs == recipe->capacity) {
+        recipe->capacity = recipe->capacity ? recipe->capacity * 2 : 256;
+        recipe->refs = (u32 *) xrealloc(recipe->refs, recipe->capacity * sizeof(u32));
+    }
+
+    recipe->refs[recipe->num_refs++] = ref;
+}
+
+static
+void add_raw_chunks(struct chunk_store_s *store, struct recipe_s *recipe,
+                    FILE *fp, long offset, long size)
+{
+    u8 buffer[ARCHIVE_RAW_CHUNK_SIZE];
+
+    fseek(fp, offset, SEEK_SET);
+
+    while (offset < size) {
+        size_t n = size - offset < ARCHIVE_RAW_CHUNK_SIZE ? size - offset : ARCHIVE_RAW_CHUNK_SIZE;
+
+        n = fread(buffer, 1, n, fp);
+        if (n == 0) {
+            break;
+        }
+
+        add_ref(recipe, store_chunk(store, buffer, (u32) n));
+        offset += n;
+    }
+}
+
+/* Walks the image in the order of ARCHIVE_LAYOUT_CPCEMU. Sectors that belong
+   to CP/M blocks are read through the block mapping, so identical files share
+   chunks even when the sector skew of the images differ. Shared by packing and
+   unpacking, which pass a reader or a writer respectively. */
+typedef int (*layout_fn)(void *ctx, FILE *fp, int what, int track, int sector, u8 *buf, int size);
+
+#define LAYOUT_DISC_INFO    0
+#define LAYOUT_TRACK_INFO   1
+#define LAYOUT_BLOCK        2
+#define LAYOUT_SECTOR       3
+
+static
+int walk_cpcemu_layout(FILE *fp, layout_fn fn, void *ctx)
+{
+    u8 covered[NUM_TRACK][NUM_SECTOR];
+    u8 block[SIZ_SECTOR * 8];
+    int num_blocks;
+    int track;
+    int sector;
+    int i;
+
+    assert(g_block_size <= (int) sizeof(block));
+
+    if (fn(ctx, fp, LAYOUT_DISC_INFO, 0, 0, block, sizeof(struct cpcemu_disc_info_s)) != 0) {
+        return -1;
+    }
+
+    for (track = 0; track < NUM_TRACK; track++) {
+        if (fn(ctx, fp, LAYOUT_TRACK_INFO, track, 0, block, sizeof(struct cpcemu_track_info_s)) != 0) {
+            return -1;
+        }
+    }
+
+    memset(covered, 0, sizeof(covered));
+    num_blocks = cpm_num_blocks();
+
+    for (i = 0; i < num_blocks; i++) {
+        int s;
+
+        convert_AL_to_track_sector((u8) i, &track, &sector);
+        add_offset_to_track_sector(&track, &sector, g_num_sector_per_block - 1);
+
+        if (track >= NUM_TRACK) {
+            break;
+        }
+
+        convert_AL_to_track_sector((u8) i, &track, &sector);
+
+        for (s = 0; s < g_num_sector_per_block; s++) {
+            covered[track][sector] = 1;
+            add_offset_to_track_sector(&track, &sector, 1);
+        }
+
+        if (fn(ctx, fp, LAYOUT_BLOCK, i, 0, block, g_block_size) != 0) {
+            return -1;
+        }
+    }
+
+    for (track = 0; track < NUM_TRACK; track++) {
+        for (sector = 0; sector < NUM_SECTOR; sector++) {
+            if (covered[track][sector]) {
+                continue;
+            }
+
+            if (fn(ctx, fp, LAYOUT_SECTOR, track, sector, block, SIZ_SECTOR) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static
+void read_block(FILE *fp, int block, u8 *buf)
+{
+    int track;
+    int sector;
+    int s;
+
+    convert_AL_to_track_sector((u8) block, &track, &sector);
+
+    for (s = 0; s < g_num_sector_per_block; s++) {
+        read_logical_sector(fp, track, sector, buf + s * SIZ_SECTOR);
+        add_offset_to_track_sector(&track, &sector, 1);
+    }
+}
+
+static
+void write_block(FILE *fp, int block, u8 *buf)
+{
+    int track;
+    int sector;
+    int s;
+
+    convert_AL_to_track_sector((u8) block, &track, &sector);
+
+    for (s = 0; s < g_num_sector_per_block; s++) {
+        write_logical_sector(fp, track, sector, buf + s * SIZ_SECTOR);
+        add_offset_to_track_sector(&track, &sector, 1);
+    }
+}
+
+struct pack_walk_s {
+    struct chunk_store_s *store;
+    struct recipe_s *recipe;
+};
+
+static
+int pack_chunk(void *ctx, FILE *fp, int what, int track, int sector, u8 *buf, int size)
+{
+    struct pack_walk_s *walk = (struct pack_walk_s *) ctx;
+
+    switch (what) {
+    case LAYOUT_DISC_INFO:
+        read_disc_info(fp, (struct cpcemu_disc_info_s *) buf);
+        break;
+    case LAYOUT_TRACK_INFO:
+        read_track_info(fp, (u8) track, (struct cpcemu_track_info_s *) buf);
+        break;
+    case LAYOUT_BLOCK:
+        read_block(fp, track, buf);
+        break;
+    case LAYOUT_SECTOR:
+        read_logical_sector(fp, (u8) track, (u8) sector, buf);
+        break;
+    }
+
+    add_ref(walk->recipe, store_chunk(walk->store, buf, size));
+
+    return 0;
+}
+
+static
+int hash_file(FILE *fp, u8 hash[HASH_SIZE])
+{
+    struct hash_s state;
+    u8 buffer[ARCHIVE_RAW_CHUNK_SIZE];
+    size_t n;
+
+    hash_init(&state, 0);
+    fseek(fp, 0, SEEK_SET);
+
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        hash_update(&state, buffer, n);
+    }
+
+    hash_final(&state, hash);
+
+    return ferror(fp) ? -1 : 0;
+}
+
+/* The CP/M layout is only bit exact if every physical sector of a track is
+   reached by exactly one logical sector */
+static
+int skew_is_permutation(void)
+{
+    u8 seen[NUM_SECTOR];
+    int i;
+
+    memset(seen, 0, sizeof(seen));
+
+    for (i = 0; i < NUM_SECTOR; i++) {
+        if (g_sector_skew_table[i] >= NUM_SECTOR || seen[g_sector_skew_table[i]]) {
+            return 0;
+        }
+
+        seen[g_sector_skew_table[i]] = 1;
+    }
+
+    return 1;
+}
+
+/* The path an image is stored under: relative, without . components, and
+   with each .. taking away the component before it, or nothing at the
+   start. Every stored path is thus one unpack accepts. */
+static
+char *stored_path(const char *path)
+{
+    char *stored;
+    size_t len;
+
+    stored = (char *) xrealloc(NULL, strlen(path) + 1);
+    len    = 0;
+
+    while (*path) {
+        size_t n = strcspn(path, "/");
+
+        if (n == 2 && strncmp(path, "..", 2) == 0) {
+            while (len > 0 && stored[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+        } else if (n > 0 && !(n == 1 && *path == '.')) {
+            if (len > 0) {
+                stored[len++] = '/';
+            }
+            memcpy(stored + len, path, n);
+            len += n;
+        }
+
+        path += n;
+        if (*path == '/') {
+            path++;
+        }
+    }
+
+    stored[len] = 0;
+
+    return stored;
+}
+
+/* fp is the whole image, read into memory ahead of time */
+static
+int pack_image(struct chunk_store_s *store, const char *path, FILE *fp, FILE *out, unsigned long *image_size)
+{
+    struct archive_image_s image;
+    struct recipe_s recipe;
+    char *stored;
+    long size;
+
+    memset(&image, 0, sizeof(image));
+    memset(&recipe, 0, sizeof(recipe));
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+
+    if (hash_file(fp, image.hash) != 0) {
+        fprintf(stderr, "Failed to read file %s.\n", path);
+        return -1;
+    }
+
+    if (check_disc_info(fp) && cpm_init(fp) == 0 && skew_is_permutation()) {
+        struct pack_walk_s walk;
+
+        walk.store  = store;
+        walk.recipe = &recipe;
+
+        image.layout = ARCHIVE_LAYOUT_CPCEMU;
+        walk_cpcemu_layout(fp, pack_chunk, &walk);
+        add_raw_chunks(store, &recipe, fp, CPCEMU_INFO_OFFSET + SIZ_TOTAL, size);
+    } else {
+        image.layout = ARCHIVE_LAYOUT_RAW;
+        add_raw_chunks(store, &recipe, fp, 0, size);
+    }
+
+    stored = stored_path(path);
+
+    image.path_size = strlen(stored) + 1;
+    image.size      = size;
+    image.num_refs  = recipe.num_refs;
+
+    fwrite(&image, 1, sizeof(image), out);
+    fwrite(stored, 1, image.path_size, out);
+    fwrite(recipe.refs, sizeof(u32), recipe.num_refs, out);
+
+    free(recipe.refs);
+    free(stored);
+
+    *image_size = size;
+
+    return 0;
+}
+
+int archive_pack(const char *archive_file_name, struct corpus_s *corpus, int queue_depth)
+{
+    struct archive_header_s header;
+    struct chunk_store_s store;
+    struct prefetch_s *prefetch;
+    FILE *recipes;
+    char **paths;
+    unsigned long total_bytes;
+    int num_paths;
+    int num_images;
+    int i;
+
+    assert(archive_file_name);
+    assert(corpus);
+
+    memset(&store, 0, sizeof(store));
+    memset(&header, 0, sizeof(header));
+
+    /* Chunks are read back to confirm a hash match */
+    store.fp = fopen(archive_file_name, "wb+");
+    if (!store.fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", archive_file_name);
+        return -1;
+    }
+
+    /* Recipes are collected aside, and appended after the chunk table */
+    recipes = tmpfile();
+    if (!recipes) {
+        fprintf(stderr, "Failed to create temporary file.\n");
+        fclose(store.fp);
+        return -1;
+    }
+
+    fwrite(&header, 1, sizeof(header), store.fp);
+    store.data_offset = sizeof(header);
+
+    total_bytes = 0;
+    num_images  = 0;
+
+    /* Deflated images share no chunks with anything, so they are left out */
+    paths     = (char **) xrealloc(NULL, (corpus->num_paths + 1) * sizeof(char *));
+    num_paths = 0;
+
+    for (i = 0; i < corpus->num_paths; i++) {
+        if (gzip_is_name(corpus->paths[i])) {
+            fprintf(stderr, "Skipped %s, compressed images are not archived.\n", corpus->paths[i]);
+        } else {
+            paths[num_paths++] = corpus->paths[i];
+        }
+    }
+
+    /* Chunking an image overlaps with reading the next ones */
+    prefetch = prefetch_start(paths, num_paths, queue_depth);
+
+    for (i = 0; i < num_paths; i++) {
+        struct shadow_s shadow;
+        unsigned long image_size;
+        u8 *data;
+        long size;
+        int result;
+
+        data = prefetch_wait(prefetch, i, &size);
+        if (!data) {
+            fprintf(stderr, "Failed to open file %s.\n", paths[i]);
+            prefetch_done(prefetch, i);
+            continue;
+        }
+
+        result = -1;
+        if (shadow_adopt(&shadow, paths[i], data, size) == 0) {
+            result = pack_image(&store, paths[i], shadow.fp, recipes, &image_size);
+            shadow_close(&shadow);
+        }
+
+        prefetch_done(prefetch, i);
+
+        if (result != 0) {
+            continue;
+        }
+
+        total_bytes += image_size;
+        num_images++;
+    }
+
+    prefetch_finish(prefetch);
+    free(paths);
+
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    header.version       = ARCHIVE_VERSION;
+    header.num_chunks    = store.num_chunks;
+    header.num_images    = num_images;
+    header.chunks_offset = store.data_offset;
+    header.images_offset = store.data_offset + store.num_chunks * sizeof(struct archive_chunk_s);
+
+    fwrite(store.chunks, sizeof(struct archive_chunk_s), store.num_chunks, store.fp);
+
+    fseek(recipes, 0, SEEK_SET);
+    {
+        u8 buffer[ARCHIVE_RAW_CHUNK_SIZE];
+        size_t n;
+
+        while ((n = fread(buffer, 1, sizeof(buffer), recipes)) > 0) {
+            fwrite(buffer, 1, n, store.fp);
+        }
+    }
+    fclose(recipes);
+
+    fseek(store.fp, 0, SEEK_SET);
+    fwrite(&header, 1, sizeof(header), store.fp);
+
+    free(store.chunks);
+    free(store.table);
+
+    if (fclose(store.fp) != 0) {
+        fprintf(stderr, "Error writing to file %s.\n", archive_file_name);
+        return -1;
+    }
+
+    printf("Packed %d images (%lu bytes) into %lu unique chunks (%lu bytes).\n",
+           num_images, total_bytes, (unsigned long) store.num_chunks, store.stored_bytes);
+
+    return num_images == num_paths ? 0 : -1;
+}
+
+struct unpack_walk_s {
+    FILE *archive;
+    struct archive_chunk_s *chunks;
+    u32 num_chunks;
+    u32 *refs;
+    u32 num_refs;
+    u32 next_ref;
+};
+
+static
+int read_chunk(struct unpack_walk_s *walk, u8 *buf, u32 size)
+{
+    struct archive_chunk_s *chunk;
+    u32 ref;
+
+    if (walk->next_ref >= walk->num_refs) {
+        return -1;
+    }
+
+    ref = walk->refs[walk->next_ref++];
+    if (ref >= walk->num_chunks || walk->chunks[ref].size > size) {
+        return -1;
+    }
+
+    chunk = &walk->chunks[ref];
+
+    fseek(walk->archive, chunk->offset, SEEK_SET);
+    if (fread(buf, 1, chunk->size, walk->archive) != chunk->size) {
+        return -1;
+    }
+
+    return (int) chunk->size;
+}
+
+static
+int unpack_chunk(void *ctx, FILE *fp, int what, int track, int sector, u8 *buf, int size)
+{
+    struct unpack_walk_s *walk = (struct unpack_walk_s *) ctx;
+
+    if (read_chunk(walk, buf, size) != size) {
+        return -1;
+    }
+
+    switch (what) {
+    case LAYOUT_DISC_INFO:
+        write_disc_info(fp, (struct cpcemu_disc_info_s *) buf);
+        break;
+    case LAYOUT_TRACK_INFO:
+        write_track_info(fp, (u8) track, (struct cpcemu_track_info_s *) buf);
+
+        /* The block mapping depends on the first track info */
+        if (track == 0 && cpm_init(fp) != 0) {
+            return -1;
+        }
+        break;
+    case LAYOUT_BLOCK:
+        write_block(fp, track, buf);
+        break;
+    case LAYOUT_SECTOR:
+        write_logical_sector(fp, (u8) track, (u8) sector, buf);
+        break;
+    }
+
+    return 0;
+}
+
+static
+void make_parent_dirs(char *path)
+{
+    char *p;
+
+    for (p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            make_dir(path);
+            *p = '/';
+        }
+    }
+}
+
+static
+int restore_image(struct unpack_walk_s *walk, struct archive_image_s *image, const char *dest_path)
+{
+    u8 hash[HASH_SIZE];
+    u8 buffer[ARCHIVE_RAW_CHUNK_SIZE];
+    FILE *fp;
+    int result;
+
+    fp = fopen(dest_path, "wb+");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", dest_path);
+        return -1;
+    }
+
+    result = 0;
+
+    if (image->layout == ARCHIVE_LAYOUT_CPCEMU) {
+        result = walk_cpcemu_layout(fp, unpack_chunk, walk);
+        fseek(fp, CPCEMU_INFO_OFFSET + SIZ_TOTAL, SEEK_SET);
+    }
+
+    while (result == 0 && walk->next_ref < walk->num_refs) {
+        int n = read_chunk(walk, buffer, sizeof(buffer));
+
+        if (n < 0) {
+            result = -1;
+            break;
+        }
+
+        fwrite(buffer, 1, n, fp);
+    }
+
+    if (result == 0) {
+        fflush(fp);
+
+        if (hash_file(fp, hash) != 0 || memcmp(hash, image->hash, HASH_SIZE) != 0) {
+            result = -1;
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        result = -1;
+    }
+
+    if (result != 0) {
+        fprintf(stderr, "Failed to restore %s, archive is corrupt.\n", dest_path);
+    }
+
+    return result;
+}
+
+/* Tells whether path stays below the directory it is restored into, that is
+   it is relative and has no .. component */
+static
+int path_is_safe(const char *path)
+{
+    const char *component;
+
+    if (*path == '/') {
+        return 0;
+    }
+
+    for (component = path; component; component = strchr(component, '/')) {
+        if (*component == '/') {
+            component++;
+        }
+        if (strncmp(component, "..", 2) == 0 && (component[2] == '/' || component[2] == 0)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static
+int name_selected(const char *path, char **names, int num_names)
+{
+    const char *base;
+    int i;
+
+    if (num_names == 0) {
+        return 1;
+    }
+
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    for (i = 0; i < num_names; i++) {
+        if (strcmp(path, names[i]) == 0 || strcmp(base, names[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int archive_unpack(const char *archive_file_name, const char *dest_dir,
+                   char **names, int num_names)
+{
+    struct archive_header_s header;
+    struct unpack_walk_s walk;
+    FILE *fp;
+    int num_restored;
+    int num_failed;
+    u32 i;
+
+    assert(archive_file_name);
+    assert(dest_dir);
+
+    fp = fopen(archive_file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s.\n", archive_file_name);
+        return -1;
+    }
+
+    if (   fread(&header, 1, sizeof(header), fp) != sizeof(header)
+        || memcmp(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0
+        || header.version != ARCHIVE_VERSION) {
+        fprintf(stderr, "%s is not a valid archive.\n", archive_file_name);
+        fclose(fp);
+        return -1;
+    }
+
+    memset(&walk, 0, sizeof(walk));
+    walk.archive    = fp;
+    walk.num_chunks = header.num_chunks;
+    walk.chunks     = (struct archive_chunk_s *) xrealloc(NULL, (header.num_chunks + 1) * sizeof(struct archive_chunk_s));
+
+    fseek(fp, header.chunks_offset, SEEK_SET);
+    if (fread(walk.chunks, sizeof(struct archive_chunk_s), header.num_chunks, fp) != header.num_chunks) {
+        fprintf(stderr, "%s is not a valid archive.\n", archive_file_name);
+        free(walk.chunks);
+        fclose(fp);
+        return -1;
+    }
+
+    num_restored = 0;
+    num_failed   = 0;
+
+    fseek(fp, header.images_offset, SEEK_SET);
+
+    for (i = 0; i < header.num_images; i++) {
+        struct archive_image_s image;
+        char *path;
+        char *dest_path;
+        const char *relative;
+        long next;
+
+        if (fread(&image, 1, sizeof(image), fp) != sizeof(image) || image.path_size == 0) {
+            num_failed++;
+            break;
+        }
+
+        path = (char *) xrealloc(NULL, image.path_size);
+        fread(path, 1, image.path_size, fp);
+        path[image.path_size - 1] = 0;
+
+        next = ftell(fp) + image.num_refs * sizeof(u32);
+
+        if (!name_selected(path, names, num_names)) {
+            free(path);
+            fseek(fp, next, SEEK_SET);
+            continue;
+        }
+
+        walk.refs     = (u32 *) xrealloc(NULL, (image.num_refs + 1) * sizeof(u32));
+        walk.num_refs = image.num_refs;
+        walk.next_ref = 0;
+        fread(walk.refs, sizeof(u32), image.num_refs, fp);
+
+        /* Keep the restored images inside dest_dir */
+        if (!path_is_safe(path)) {
+            fprintf(stderr, "Skipped %s, its path leaves the destination directory.\n", path);
+            num_failed++;
+            free(walk.refs);
+            free(path);
+            fseek(fp, next, SEEK_SET);
+            continue;
+        }
+
+        relative = path;
+        while (strncmp(relative, "./", 2) == 0) {
+            relative += 2;
+        }
+
+        dest_path = (char *) xrealloc(NULL, strlen(dest_dir) + strlen(relative) + 2);
+        sprintf(dest_path, "%s/%s", dest_dir, relative);
+        make_parent_dirs(dest_path);
+
+        if (restore_image(&walk, &image, dest_path) == 0) {
+            num_restored++;
+        } else {
+            num_failed++;
+        }
+
+        free(dest_path);
+        free(walk.refs);
+        free(path);
+
+        fseek(fp, next, SEEK_SET);
+    }
+
+    free(walk.chunks);
+    fclose(fp);
+
+    printf("Restored %d images.\n", num_restored);
+
+    return num_failed == 0 ? 0 : -1;
+}
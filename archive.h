@@ -0,0 +1,69 @@
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include "types.h"
+#include "hash.h"
+#include "corpus.h"
+
+#define ARCHIVE_MAGIC           "SCPCARC"
+#define ARCHIVE_VERSION         1
+
+/* How an image was split into chunks */
+#define ARCHIVE_LAYOUT_CPCEMU   0       /* Disc info, track infos, CP/M blocks,
+                                           left over sectors, trailing bytes */
+#define ARCHIVE_LAYOUT_RAW      1       /* Fixed size slices of the file */
+
+#define ARCHIVE_RAW_CHUNK_SIZE  4096
+
+/* A content addressed store of image chunks. Every unique chunk is stored
+   once, and every image is a recipe of chunk references, in the order given
+   by its layout.
+
+                            +---------------------+
+                            | archive_header_s    |
+                            +---------------------+
+                            | Chunk data          |
+                            +---------------------+
+                            | archive_chunk_s[]   |
+                            +---------------------+
+                            | archive_image_s     |
+                            | path                |
+                            | u32 refs[num_refs]  |
+                            +---------------------+
+                            | ...                 |
+                            +---------------------+
+*/
+#pragma pack(push)
+#pragma pack(1)
+struct archive_header_s {
+    char magic[8];                      /* ARCHIVE_MAGIC */
+    u32 version;
+    u32 num_chunks;
+    u32 num_images;
+    u32 chunks_offset;
+    u32 images_offset;
+};
+
+struct archive_chunk_s {
+    u8 hash[HASH_SIZE];
+    u32 offset;
+    u32 size;
+};
+
+struct archive_image_s {
+    u32 path_size;                      /* Including the terminating zero */
+    u32 size;                           /* Image file size */
+    u32 num_refs;
+    u8 layout;                          /* ARCHIVE_LAYOUT_* */
+    u8 _unused[3];
+    u8 hash[HASH_SIZE];                 /* Hash of the whole image file */
+};
+#pragma pack(pop)
+
+/* Images are read ahead of the packing, with up to queue_depth reads in
+   flight */
+int archive_pack(const char *archive_file_name, struct corpus_s *corpus, int queue_depth);
+int archive_unpack(const char *archive_file_name, const char *dest_dir,
+                   char **names, int num_names);
+
+#endif
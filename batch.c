@@ -0,0 +1,527 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "batch.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "amsdos.h"
+#include "pool.h"
+
+#if defined (_WIN32)
+#include <direct.h>
+#define make_dir(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_dir(path) mkdir(path, 0777)
+#endif
+
+#define RECORD_SIZE     128
+#define MAX_PATH_LENGTH 4096
+#define SUB             0x1A
+
+struct batch_file_s {
+    struct cpm_diren_s entry;
+    struct amsdos_header_s header;
+    int has_header;
+    u8 *data;                           /* All records, header included */
+    long size;
+    char path[MAX_PATH_LENGTH];
+    int failed;
+};
+
+/* One sector read, placing part of a sector into the records of a file */
+struct batch_read_s {
+    int track;
+    int sector;
+    int file;
+    long offset;
+    int length;
+};
+
+struct batch_extract_s {
+    struct batch_file_s *files;
+};
+
+static
+int compare_reads(const void *a, const void *b)
+{
+    const struct batch_read_s *read_a = (const struct batch_read_s *) a;
+    const struct batch_read_s *read_b = (const struct batch_read_s *) b;
+
+    if (read_a->track != read_b->track) {
+        return read_a->track - read_b->track;
+    }
+
+    return read_a->sector - read_b->sector;
+}
+
+/* Lists the sector reads for every record of the file at first. Returns
+   the new number of reads, or -1 for a damaged entry or once max_reads is
+   reached, as duplicate entries can make more reads than the disk holds. */
+static
+int plan_reads(struct cpm_diren_s *table, int num_diren, int first, int file,
+               struct batch_read_s *reads, int num_reads, int max_reads)
+{
+    long extent_size;
+    int extent;
+    int index;
+
+    extent_size = (long) sizeof(table[first].AL) * g_block_size;
+
+    for (extent = 0; (index = cpm_find_extent(table, num_diren, &table[first], extent)) >= 0; extent++) {
+        struct cpm_diren_s *dir = &table[index];
+        long remaining;
+        unsigned k;
+
+        remaining = (long) dir->RC * RECORD_SIZE;
+
+        for (k = 0; k < sizeof(dir->AL) && dir->AL[k] && remaining > 0; k++) {
+            int track;
+            int sector;
+            int s;
+
+            if (dir->AL[k] >= cpm_num_blocks()) {
+                return -1;
+            }
+
+            convert_AL_to_track_sector(dir->AL[k], &track, &sector);
+
+            for (s = 0; s < g_num_sector_per_block && remaining > 0; s++) {
+                struct batch_read_s *read;
+
+                if (num_reads == max_reads) {
+                    return -1;
+                }
+
+                read = &reads[num_reads++];
+
+                read->track  = track;
+                read->sector = sector;
+                read->file   = file;
+                read->offset = extent * extent_size + (long) k * g_block_size + (long) s * SIZ_SECTOR;
+                read->length = remaining < SIZ_SECTOR ? (int) remaining : SIZ_SECTOR;
+
+                remaining -= read->length;
+                add_offset_to_track_sector(&track, &sector, 1);
+            }
+        }
+    }
+
+    return num_reads;
+}
+
+static
+void write_host_file(void *ctx, int job)
+{
+    struct batch_extract_s *extract = (struct batch_extract_s *) ctx;
+    struct batch_file_s *file = &extract->files[job];
+    const u8 *data;
+    long size;
+    FILE *fp;
+
+    data = file->data;
+    size = file->size;
+
+    if (file->has_header) {
+        data += sizeof(struct amsdos_header_s);
+        size -= sizeof(struct amsdos_header_s);
+
+        if (amsdos_get_length(&file->header) < size) {
+            size = amsdos_get_length(&file->header);
+        }
+    }
+
+    fp = fopen(file->path, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", file->path);
+        file->failed = 1;
+        return;
+    }
+
+    if ((size > 0 && fwrite(data, size, 1, fp) != 1) || fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write file %s.\n", file->path);
+        file->failed = 1;
+    }
+}
+
+static
+void format_attributes(char *dest, u8 attributes)
+{
+    dest[0] = attributes & CPM_ATTR_READ_ONLY ? 'R' : '-';
+    dest[1] = attributes & CPM_ATTR_SYSTEM    ? 'S' : '-';
+    dest[2] = attributes & CPM_ATTR_ARCHIVE   ? 'A' : '-';
+    dest[3] = 0;
+}
+
+static
+int write_manifest(const char *dest_dir, struct batch_file_s *files, int num_files)
+{
+    char path[MAX_PATH_LENGTH];
+    FILE *fp;
+    int i;
+
+    sprintf(path, "%s/%s", dest_dir, BATCH_MANIFEST);
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", path);
+        return -1;
+    }
+
+    fprintf(fp, "# path user attributes type load exec\n");
+
+    for (i = 0; i < num_files; i++) {
+        struct batch_file_s *file = &files[i];
+        char attributes[4];
+
+        format_attributes(attributes, cpm_get_attributes(&file->entry));
+
+        fprintf(fp, "%s %d %s", file->path + strlen(dest_dir) + 1, file->entry.user_number, attributes);
+
+        if (file->has_header) {
+            fprintf(fp, " %d %04x %04x\n", file->header.filetype,
+                    file->header.data_location, file->header.entry_address);
+        } else {
+            fprintf(fp, " - - -\n");
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write file %s.\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int batch_extract_all(FILE *fp, const char *dest_dir, int text, int num_workers)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    struct batch_file_s *files;
+    struct batch_read_s *reads;
+    struct batch_extract_s extract;
+    int num_diren;
+    int num_files;
+    int num_reads;
+    int max_reads;
+    int result;
+    int i;
+
+    assert(fp);
+    assert(dest_dir);
+
+    if (strlen(dest_dir) > MAX_PATH_LENGTH - 32) {
+        fprintf(stderr, "Directory name %s is too long.\n", dest_dir);
+        return -1;
+    }
+
+    num_diren = cpm_read_dir(fp, table);
+
+    /* At most one read for every sector of every directory entry */
+    max_reads = CPM_MAX_DIREN * sizeof(table[0].AL) * g_num_sector_per_block;
+    files = (struct batch_file_s *) calloc(CPM_MAX_DIREN, sizeof(*files));
+    reads = (struct batch_read_s *) malloc(max_reads * sizeof(*reads));
+    if (!files || !reads) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    make_dir(dest_dir);
+
+    num_files = 0;
+    num_reads = 0;
+    result    = 0;
+
+    for (i = 0; i < num_diren; i++) {
+        struct batch_file_s *file = &files[num_files];
+        char full_file_name[13];
+        int n;
+
+        if (   table[i].user_number > 15
+            || table[i].EX          != 0
+            || table[i].S2          != 0) {
+            continue;
+        }
+
+        normalize_filename(full_file_name, &table[i]);
+
+        n = plan_reads(table, num_diren, i, num_files, reads, num_reads, max_reads);
+        if (n < 0) {
+            fprintf(stderr, "Skipped %s, its directory entry is damaged.\n", full_file_name);
+            result = -1;
+            continue;
+        }
+
+        num_reads = n;
+
+        memcpy(&file->entry, &table[i], sizeof(file->entry));
+        file->size = (long) cpm_file_records(table, num_diren, i) * RECORD_SIZE;
+        file->data = (u8 *) calloc(file->size + 1, 1);
+        if (!file->data) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        if (table[i].user_number == 0) {
+            sprintf(file->path, "%s/%s", dest_dir, full_file_name);
+        } else {
+            sprintf(file->path, "%s/user%d", dest_dir, table[i].user_number);
+            make_dir(file->path);
+            sprintf(file->path, "%s/user%d/%s", dest_dir, table[i].user_number, full_file_name);
+        }
+
+        num_files++;
+    }
+
+    /* Read the sectors in the order they lie on the disk, not file by file */
+    qsort(reads, num_reads, sizeof(*reads), compare_reads);
+
+    for (i = 0; i < num_reads; i++) {
+        struct batch_read_s *read = &reads[i];
+        struct batch_file_s *file = &files[read->file];
+        u8 buffer[SIZ_SECTOR];
+
+        read_logical_sector(fp, read->track, read->sector, buffer);
+
+        if (read->offset + read->length <= file->size) {
+            memcpy(file->data + read->offset, buffer, read->length);
+        }
+    }
+
+    for (i = 0; i < num_files; i++) {
+        struct batch_file_s *file = &files[i];
+
+        if (file->size >= (long) sizeof(file->header)) {
+            memcpy(&file->header, file->data, sizeof(file->header));
+            file->has_header = amsdos_header_exists(&file->header);
+        }
+
+        if (!file->has_header && text) {
+            u8 *sub = (u8 *) memchr(file->data, SUB, file->size);
+
+            if (sub) {
+                file->size = sub - file->data;
+            }
+        }
+    }
+
+    extract.files = files;
+    pool_run(num_workers, num_files, write_host_file, &extract);
+
+    for (i = 0; i < num_files; i++) {
+        if (files[i].failed) {
+            result = -1;
+        } else {
+            printf("Extracted file %s.\n", files[i].path);
+        }
+
+        free(files[i].data);
+    }
+
+    if (write_manifest(dest_dir, files, num_files) != 0) {
+        result = -1;
+    }
+
+    free(files);
+    free(reads);
+
+    return result == 0 ? num_files : -1;
+}
+
+static
+u8 parse_attributes(const char *attributes)
+{
+    u8 result;
+
+    result = 0;
+
+    if (strchr(attributes, 'R')) {
+        result |= CPM_ATTR_READ_ONLY;
+    }
+
+    if (strchr(attributes, 'S')) {
+        result |= CPM_ATTR_SYSTEM;
+    }
+
+    if (strchr(attributes, 'A')) {
+        result |= CPM_ATTR_ARCHIVE;
+    }
+
+    return result;
+}
+
+/* Loads a host file, with room in front for an AMSDOS header */
+static
+u8 *load_host_file(const char *path, long *size)
+{
+    FILE *fp;
+    u8 *data;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", path);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    data = (u8 *) malloc(sizeof(struct amsdos_header_s) + *size + 1);
+    if (!data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if (*size > 0 && fread(data + sizeof(struct amsdos_header_s), *size, 1, fp) != 1) {
+        fprintf(stderr, "Failed to read file %s.\n", path);
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+static
+int insert_listed(FILE *fp, const char *src_dir, const char *relative_path, int user,
+                  const char *attributes, const char *type, const char *load, const char *exec)
+{
+    struct cpm_diren_s entry;
+    char path[MAX_PATH_LENGTH];
+    const char *file_name;
+    u8 attribute_bits;
+    u8 *data;
+    long size;
+    int result;
+
+    file_name = strrchr(relative_path, '/') ? strrchr(relative_path, '/') + 1 : relative_path;
+
+    if (!cpm_valid_filename(file_name) || !strcspn(file_name, ".") || user < 0 || user > 15) {
+        fprintf(stderr, "%s is not a valid file for user %d.\n", relative_path, user);
+        return -1;
+    }
+
+    if (strlen(src_dir) + strlen(relative_path) + 2 > sizeof(path)) {
+        fprintf(stderr, "Path of %s is too long.\n", relative_path);
+        return -1;
+    }
+
+    sprintf(path, "%s/%s", src_dir, relative_path);
+
+    data = load_host_file(path, &size);
+    if (!data) {
+        return -1;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    denormalize_filename(file_name, &entry);
+    entry.user_number = (u8) user;
+
+    attribute_bits = parse_attributes(attributes);
+
+    if (attribute_bits & CPM_ATTR_READ_ONLY) {
+        entry.ext[0] |= 0x80;
+    }
+
+    if (attribute_bits & CPM_ATTR_SYSTEM) {
+        entry.ext[1] |= 0x80;
+    }
+
+    if (attribute_bits & CPM_ATTR_ARCHIVE) {
+        entry.ext[2] |= 0x80;
+    }
+
+    if (strcmp(type, "-") != 0) {
+        struct amsdos_header_s header;
+
+        amsdos_new_header(&header, file_name, size, 0, 0);
+        header.user_number   = (u8) user;
+        header.filetype      = (u8) atoi(type);
+        header.data_location = (u16) strtol(load, NULL, 16);
+        header.entry_address = (u16) strtol(exec, NULL, 16);
+        amsdos_set_length(&header, size);
+
+        memcpy(data, &header, sizeof(header));
+        result = cpm_write_entry(fp, &entry, data, sizeof(header) + size);
+    } else {
+        result = cpm_write_entry(fp, &entry, data + sizeof(struct amsdos_header_s), size);
+    }
+
+    free(data);
+
+    if (result < 0) {
+        fprintf(stderr, "Failed to insert %s, not enough space on disk.\n", relative_path);
+        return -1;
+    }
+
+    printf("Wrote %s into disk.\n", relative_path);
+
+    return 0;
+}
+
+int batch_insert_all(FILE *fp, const char *src_dir)
+{
+    char path[MAX_PATH_LENGTH];
+    char line[MAX_PATH_LENGTH + 64];
+    FILE *manifest;
+    int num_written;
+    int failed;
+
+    assert(fp);
+    assert(src_dir);
+
+    if (strlen(src_dir) > MAX_PATH_LENGTH - 32) {
+        fprintf(stderr, "Directory name %s is too long.\n", src_dir);
+        return -1;
+    }
+
+    sprintf(path, "%s/%s", src_dir, BATCH_MANIFEST);
+
+    manifest = fopen(path, "r");
+    if (!manifest) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", path);
+        return -1;
+    }
+
+    num_written = 0;
+    failed      = 0;
+
+    while (fgets(line, sizeof(line), manifest)) {
+        char relative_path[MAX_PATH_LENGTH];
+        char attributes[8];
+        char type[8];
+        char load[8];
+        char exec[8];
+        int user;
+
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        if (sscanf(line, "%4095s %d %7s %7s %7s %7s", relative_path, &user,
+                   attributes, type, load, exec) != 6) {
+            fprintf(stderr, "Malformed manifest line: %s", line);
+            failed = 1;
+            continue;
+        }
+
+        if (insert_listed(fp, src_dir, relative_path, user, attributes, type, load, exec) != 0) {
+            failed = 1;
+        } else {
+            num_written++;
+        }
+    }
+
+    fclose(manifest);
+
+    return failed ? -1 : num_written;
+}
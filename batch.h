@@ -0,0 +1,23 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdio.h>
+
+/* Name of the sidecar manifest in extracted directories. It can not clash
+   with a CP/M file name. */
+#define BATCH_MANIFEST "sector-cpc.manifest"
+
+/* Extracts every file of the image into dest_dir, files of user 0 at the top
+   and other users in userN subdirectories. Sectors are read once, in track
+   order, and host files are written on num_workers threads. The user number,
+   attributes and AMSDOS header fields of every file go into the manifest.
+   Returns the number of files extracted, or -1 if any failed. */
+int batch_extract_all(FILE *fp, const char *dest_dir, int text, int num_workers);
+
+/* Inserts the files listed in the manifest of src_dir back with their user
+   numbers, attributes and AMSDOS headers. Returns the number of files
+   written, or -1 if any failed, in which case the image should not be
+   kept. */
+int batch_insert_all(FILE *fp, const char *src_dir);
+
+#endif
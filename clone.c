@@ -0,0 +1,402 @@
+#if defined (__linux__)
+#define _GNU_SOURCE
+#endif
+#define _POSIX_C_SOURCE 200809L
+
+#include "clone.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "gzip.h"
+#include "lock.h"
+#include "shadow.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_PWRITE
+#endif
+
+#if defined (__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+#define COPY_CHUNK      65536
+
+/* Loads a host file into memory */
+static
+u8 *load_host_file(const char *path, long *size)
+{
+    FILE *fp;
+    u8 *data;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", path);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    data = (u8 *) malloc(*size + 1);
+    if (!data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if (*size > 0 && fread(data, *size, 1, fp) != 1) {
+        fprintf(stderr, "Failed to read file %s.\n", path);
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+static
+int insert_edit(FILE *fp, const char *arg, int amsdos)
+{
+    const char *colon;
+    const char *name;
+    char *path;
+    u8 *data;
+    long size;
+    int result;
+
+    colon = strrchr(arg, ':');
+    path  = (char *) malloc(strlen(arg) + 1);
+
+    if (!path) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    strcpy(path, arg);
+
+    if (colon) {
+        path[colon - arg] = 0;
+        name = colon + 1;
+    } else {
+        name = strrchr(arg, '/') ? strrchr(arg, '/') + 1 : arg;
+    }
+
+    data   = load_host_file(path, &size);
+    result = -1;
+
+    if (data) {
+        result = cpm_insert_buffer(fp, name, data, size, 0, 0, amsdos);
+        free(data);
+    }
+
+    if (result == 0) {
+        printf("Wrote %s into disk.\n", name);
+    }
+
+    free(path);
+
+    return result;
+}
+
+static
+int apply_edits(FILE *fp, char **edits, int num_edits, int amsdos)
+{
+    int i;
+
+    for (i = 0; i < num_edits; i++) {
+        if (i + 1 == num_edits) {
+            fprintf(stderr, "Edit %s is missing its argument.\n", edits[i]);
+            return -1;
+        }
+
+        if (strcmp(edits[i], "insert") == 0) {
+            if (insert_edit(fp, edits[i + 1], amsdos) != 0) {
+                return -1;
+            }
+        } else if (strcmp(edits[i], "del") == 0) {
+            if (!cpm_del(fp, edits[i + 1])) {
+                fprintf(stderr, "File %s not found.\n", edits[i + 1]);
+                return -1;
+            }
+
+            printf("%s is deleted.\n", edits[i + 1]);
+        } else {
+            fprintf(stderr, "Unknown edit %s.\n", edits[i]);
+            return -1;
+        }
+
+        i++;
+    }
+
+    return 0;
+}
+
+#if defined (HAVE_PWRITE)
+/* Copies in_fd to out_fd, sharing blocks when the file system can. Returns
+   how the copy was made, or NULL on errors. */
+static
+const char *copy_fd(int in_fd, int out_fd, long size)
+{
+    char buffer[COPY_CHUNK];
+    long copied;
+
+#if defined (FICLONE)
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        return "reflink";
+    }
+#endif
+
+#if defined (HAVE_COPY_FILE_RANGE)
+    for (copied = 0; copied < size; ) {
+        ssize_t n = copy_file_range(in_fd, NULL, out_fd, NULL, size - copied, 0);
+
+        if (n <= 0) {
+            break;
+        }
+
+        copied += n;
+    }
+
+    if (copied == size) {
+        return "copy_file_range";
+    }
+
+    /* Not supported between these files, start over */
+    if (   lseek(in_fd, 0, SEEK_SET) != 0
+        || lseek(out_fd, 0, SEEK_SET) != 0
+        || ftruncate(out_fd, 0) != 0) {
+        return NULL;
+    }
+#endif
+
+    for (copied = 0; copied < size; ) {
+        ssize_t n = read(in_fd, buffer, sizeof(buffer));
+
+        if (n <= 0 || write(out_fd, buffer, n) != n) {
+            return NULL;
+        }
+
+        copied += n;
+    }
+
+    return "copy";
+}
+
+/* Writes the parts of edited that differ from original over out_fd: the
+   disc header, and every track header and sector on its own. Returns the
+   number of sectors written, or -1 on errors. */
+static
+int write_changes(int out_fd, const u8 *original, const u8 *edited, long size)
+{
+    long offset;
+    int num_sectors;
+
+    num_sectors = 0;
+
+    for (offset = 0; offset < size; ) {
+        long length;
+
+        if (offset < CPCEMU_INFO_OFFSET) {
+            length = CPCEMU_INFO_OFFSET;
+        } else if ((offset - CPCEMU_INFO_OFFSET) % SIZ_TRACK == 0) {
+            length = CPCEMU_TRACK_OFFSET;
+        } else {
+            length = SIZ_SECTOR;
+        }
+
+        if (offset + length > size) {
+            length = size - offset;
+        }
+
+        if (memcmp(original + offset, edited + offset, length) != 0) {
+            if (pwrite(out_fd, edited + offset, length, offset) != length) {
+                return -1;
+            }
+
+            num_sectors += length == SIZ_SECTOR;
+        }
+
+        offset += length;
+    }
+
+    return num_sectors;
+}
+
+static
+int write_clone(const char *base, const char *dest, const u8 *original, const u8 *edited, long size)
+{
+    struct stat st;
+    const char *method;
+    char *tmp_name;
+    int num_sectors;
+    int in_fd;
+    int out_fd;
+
+    tmp_name = (char *) malloc(strlen(dest) + 5);
+    if (!tmp_name) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    sprintf(tmp_name, "%s.tmp", dest);
+
+    in_fd = open(base, O_RDONLY);
+    if (in_fd < 0 || fstat(in_fd, &st) != 0 || st.st_size != size) {
+        fprintf(stderr, "Failed to open file %s.\n", base);
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        free(tmp_name);
+        return -1;
+    }
+
+    out_fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (out_fd < 0) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", tmp_name);
+        close(in_fd);
+        free(tmp_name);
+        return -1;
+    }
+
+    method      = copy_fd(in_fd, out_fd, size);
+    num_sectors = method ? write_changes(out_fd, original, edited, size) : -1;
+
+    if (num_sectors >= 0 && fsync(out_fd) != 0) {
+        num_sectors = -1;
+    }
+
+    close(in_fd);
+
+    if (close(out_fd) != 0) {
+        num_sectors = -1;
+    }
+
+    if (num_sectors >= 0 && rename(tmp_name, dest) != 0) {
+        num_sectors = -1;
+    }
+
+    if (num_sectors < 0) {
+        fprintf(stderr, "Failed to write %s.\n", dest);
+        remove(tmp_name);
+    } else {
+        printf("Cloned %s to %s by %s, %d sectors rewritten.\n", base, dest, method, num_sectors);
+    }
+
+    free(tmp_name);
+
+    return num_sectors;
+}
+#endif
+
+static
+int same_image(const char *a, const char *b)
+{
+#if defined (HAVE_PWRITE)
+    struct stat st_a;
+    struct stat st_b;
+
+    if (stat(a, &st_a) == 0 && stat(b, &st_b) == 0) {
+        return st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+    }
+#endif
+
+    return strcmp(a, b) == 0;
+}
+
+int clone_image(const char *base, const char *dest, char **edits, int num_edits, int amsdos,
+                double lock_timeout)
+{
+    struct shadow_s shadow;
+    struct lock_s base_lock;
+    struct lock_s dest_lock;
+    u8 *original;
+    u8 *edited;
+    int result;
+
+    assert(base);
+    assert(dest);
+    assert(edits || num_edits == 0);
+
+    if (same_image(base, dest)) {
+        fprintf(stderr, "%s and %s are the same image.\n", base, dest);
+        return -1;
+    }
+
+    if (lock_acquire_pair(&base_lock, base, &dest_lock, dest, lock_timeout) != 0) {
+        return -1;
+    }
+
+    result = shadow_open(&shadow, base);
+
+    if (result == 0 && cpm_init(shadow.fp) != 0) {
+        fprintf(stderr, "Unrecognized disk type\n");
+        shadow_close(&shadow);
+        result = -1;
+    }
+
+    if (result != 0) {
+        lock_release(&dest_lock);
+        lock_release(&base_lock);
+        return -1;
+    }
+
+    original = (u8 *) malloc(shadow.size + 1);
+    edited   = (u8 *) malloc(shadow.size + 1);
+
+    if (!original || !edited) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    memcpy(original, shadow.data, shadow.size);
+
+    result = apply_edits(shadow.fp, edits, num_edits, amsdos);
+
+    if (result == 0) {
+        fflush(shadow.fp);
+        fseek(shadow.fp, 0, SEEK_SET);
+
+        if (fread(edited, 1, shadow.size, shadow.fp) != (size_t) shadow.size) {
+            fprintf(stderr, "Failed to read %s back.\n", base);
+            result = -1;
+        }
+    }
+
+    if (result != 0) {
+        fprintf(stderr, "%s is not created.\n", dest);
+    } else if (gzip_is_name(base) || gzip_is_name(dest)) {
+        /* Compressed images share no blocks, they are written whole */
+        result = shadow_save_file(dest, edited, shadow.size);
+
+        if (result == 0) {
+            printf("Cloned %s to %s.\n", base, dest);
+        }
+    } else {
+#if defined (HAVE_PWRITE)
+        result = write_clone(base, dest, original, edited, shadow.size);
+#else
+        result = shadow_write_file(dest, edited, shadow.size);
+#endif
+    }
+
+    free(original);
+    free(edited);
+    shadow_close(&shadow);
+    lock_release(&dest_lock);
+    lock_release(&base_lock);
+
+    return result;
+}
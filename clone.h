@@ -0,0 +1,15 @@
+#ifndef CLONE_H_
+#define CLONE_H_
+
+/* Creates dest as a copy of base with a batch of edits applied. Each edit is
+   "insert HOST_FILE[:NAME]" or "del NAME", taking one or two entries of
+   edits. The copy is made with a reflink where the file system shares
+   blocks between files, copy_file_range where the kernel has it, and plain
+   reads and writes otherwise, and then only the sectors and headers the
+   edits changed are written over it. When base or dest is a .gz image
+   dest is written whole instead. dest appears once it is complete.
+   Returns the number of sectors rewritten, or -1 on errors. */
+int clone_image(const char *base, const char *dest, char **edits, int num_edits, int amsdos,
+                double lock_timeout);
+
+#endif
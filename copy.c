@@ -0,0 +1,320 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "copy.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpm.h"
+#include "lock.h"
+#include "shadow.h"
+
+#define RECORD_SIZE 128
+
+/* Records of one file, kept in memory between reading the source and
+   writing the destination, since the two may differ in geometry */
+struct copied_file_s {
+    struct cpm_diren_s entry;
+    u8 *data;
+    long size;
+    long capacity;
+};
+
+/* Everything read from one IMAGE:PATTERN argument */
+struct copied_source_s {
+    char *image;
+    struct copied_file_s files[CPM_MAX_DIREN];
+    int num_files;
+};
+
+static
+int records_sink(void *ctx, u8 *buf, size_t len)
+{
+    struct copied_file_s *file = (struct copied_file_s *) ctx;
+
+    if (file->size + (long) len > file->capacity) {
+        return -1;
+    }
+
+    memcpy(file->data + file->size, buf, len);
+    file->size += len;
+
+    return 0;
+}
+
+/* Splits IMAGE:NAME at the last colon. Returns a copy of the image part,
+   and points name at the rest, or sets it to NULL when there is no colon. */
+static
+char *split_image_name(const char *arg, const char **name)
+{
+    const char *colon;
+    char *image;
+    size_t len;
+
+    colon = strrchr(arg, ':');
+    len   = colon ? (size_t) (colon - arg) : strlen(arg);
+    *name = colon ? colon + 1 : NULL;
+
+    image = (char *) malloc(len + 1);
+    if (!image) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    memcpy(image, arg, len);
+    image[len] = 0;
+
+    return image;
+}
+
+/* Reads the records of every file matching pattern in fp. Returns the
+   number of files read, or -1 with nothing left allocated. */
+static
+int read_matching(FILE *fp, const char *pattern, struct copied_file_s *files)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    int num_diren;
+    int num_files;
+    int i;
+
+    num_diren = cpm_read_dir(fp, table);
+    num_files = 0;
+
+    for (i = 0; i < num_diren; i++) {
+        struct copied_file_s *file = &files[num_files];
+        char full_file_name[13];
+
+        if (   table[i].user_number == CPM_NO_FILE
+            || table[i].EX          != 0
+            || table[i].S2          != 0) {
+            continue;
+        }
+
+        normalize_filename(full_file_name, &table[i]);
+
+        if (!cpm_match_filename(pattern, full_file_name)) {
+            continue;
+        }
+
+        memcpy(&file->entry, &table[i], sizeof(file->entry));
+        file->size     = 0;
+        file->capacity = (long) cpm_file_records(table, num_diren, i) * RECORD_SIZE;
+        file->data     = (u8 *) malloc(file->capacity + 1);
+
+        if (!file->data) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        num_files++;
+
+        if (cpm_read_records(fp, table, num_diren, i, records_sink, file) != 0) {
+            fprintf(stderr, "Failed to read %s, its directory entry is damaged.\n", full_file_name);
+
+            while (num_files--) {
+                free(files[num_files].data);
+            }
+            return -1;
+        }
+    }
+
+    return num_files;
+}
+
+/* Reads the files of one source under a shared lock on its image, released
+   again before the next lock is taken */
+static
+int read_source(struct copied_source_s *copied, const char *source, int single,
+                double lock_timeout)
+{
+    struct shadow_s shadow;
+    struct lock_s lock;
+    const char *pattern;
+    int num_files;
+
+    copied->image     = split_image_name(source, &pattern);
+    copied->num_files = 0;
+
+    if (!pattern || !*pattern) {
+        fprintf(stderr, "%s does not name a file, use IMAGE:FILE.\n", source);
+        return -1;
+    }
+
+    if (lock_acquire(&lock, copied->image, 0, lock_timeout) != 0) {
+        return -1;
+    }
+
+    if (shadow_map(&shadow, copied->image) != 0) {
+        lock_release(&lock);
+        return -1;
+    }
+
+    if (cpm_init(shadow.fp) != 0) {
+        fprintf(stderr, "Unrecognized disk type in %s.\n", copied->image);
+        num_files = -1;
+    } else {
+        num_files = read_matching(shadow.fp, pattern, copied->files);
+
+        if (num_files >= 0) {
+            copied->num_files = num_files;
+        }
+
+        if (num_files == 0) {
+            fprintf(stderr, "No file matches %s in %s.\n", pattern, copied->image);
+            num_files = -1;
+        } else if (single && num_files > 1) {
+            fprintf(stderr, "%s matches %d files, a new name needs a single one.\n", source, num_files);
+            num_files = -1;
+        }
+    }
+
+    shadow_close(&shadow);
+    lock_release(&lock);
+
+    return num_files;
+}
+
+/* Writes the files read from one source into the destination image */
+static
+int write_source(FILE *dest_fp, const char *dest_image, const char *new_name,
+                 struct copied_source_s *copied)
+{
+    int i;
+
+    for (i = 0; i < copied->num_files; i++) {
+        struct copied_file_s *file = &copied->files[i];
+        char full_file_name[13];
+        char dest_file_name[13];
+
+        normalize_filename(full_file_name, &file->entry);
+
+        if (new_name) {
+            struct cpm_diren_s renamed;
+            unsigned k;
+
+            /* Keep the attribute bits of the source name */
+            memset(&renamed, 0, sizeof(renamed));
+            denormalize_filename(new_name, &renamed);
+
+            for (k = 0; k < sizeof(renamed.file_name); k++) {
+                file->entry.file_name[k] = renamed.file_name[k] | (file->entry.file_name[k] & 0x80);
+            }
+
+            for (k = 0; k < sizeof(renamed.ext); k++) {
+                file->entry.ext[k] = renamed.ext[k] | (file->entry.ext[k] & 0x80);
+            }
+        }
+
+        normalize_filename(dest_file_name, &file->entry);
+
+        if (cpm_write_entry(dest_fp, &file->entry, file->data, file->size) < 0) {
+            fprintf(stderr, "Failed to copy %s into %s.\n", full_file_name, dest_image);
+            return -1;
+        }
+
+        printf("Copied %s:%s to %s:%s.\n", copied->image, full_file_name,
+               dest_image, dest_file_name);
+    }
+
+    return copied->num_files;
+}
+
+int copy_files(char **sources, int num_sources, const char *dest, double lock_timeout)
+{
+    struct copied_source_s *copied;
+    struct shadow_s shadow;
+    struct lock_s lock;
+    const char *new_name;
+    char *dest_image;
+    int num_copied;
+    int num_read;
+    int i;
+
+    assert(sources);
+    assert(dest);
+
+    dest_image = split_image_name(dest, &new_name);
+
+    if (new_name && !*new_name) {
+        new_name = NULL;
+    }
+
+    if (new_name && (!cpm_valid_filename(new_name) || !strcspn(new_name, "."))) {
+        fprintf(stderr, "%s is not a valid file name.\n", new_name);
+        free(dest_image);
+        return -1;
+    }
+
+    if (new_name && num_sources > 1) {
+        fprintf(stderr, "A new name needs a single source file.\n");
+        free(dest_image);
+        return -1;
+    }
+
+    copied = (struct copied_source_s *) calloc(num_sources, sizeof(*copied));
+    if (!copied) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    /* All sources are read before the destination is locked, so no lock is
+       held while waiting for another, and copies crossing between the same
+       images can not wait on each other forever */
+    num_copied = 0;
+
+    for (num_read = 0; num_read < num_sources && num_copied == 0; num_read++) {
+        if (read_source(&copied[num_read], sources[num_read], new_name != NULL, lock_timeout) < 0) {
+            num_copied = -1;
+        }
+    }
+
+    if (num_copied == 0 && lock_acquire(&lock, dest_image, 1, lock_timeout) == 0) {
+        if (shadow_open(&shadow, dest_image) != 0) {
+            num_copied = -1;
+        } else {
+            if (cpm_init(shadow.fp) != 0) {
+                fprintf(stderr, "Unrecognized disk type in %s.\n", dest_image);
+                num_copied = -1;
+            }
+
+            for (i = 0; i < num_sources && num_copied >= 0; i++) {
+                int n = write_source(shadow.fp, dest_image, new_name, &copied[i]);
+
+                num_copied = n < 0 ? -1 : num_copied + n;
+            }
+
+            if (num_copied > 0 && shadow_commit(&shadow) != 0) {
+                num_copied = -1;
+            }
+
+            shadow_close(&shadow);
+        }
+
+        lock_release(&lock);
+    } else {
+        num_copied = -1;
+    }
+
+    if (num_copied < 0) {
+        fprintf(stderr, "%s is left unchanged.\n", dest_image);
+    }
+
+    for (i = 0; i < num_read; i++) {
+        int k;
+
+        for (k = 0; k < copied[i].num_files; k++) {
+            free(copied[i].files[k].data);
+        }
+
+        free(copied[i].image);
+    }
+
+    free(copied);
+    free(dest_image);
+
+    return num_copied;
+}
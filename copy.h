@@ -0,0 +1,14 @@
+#ifndef COPY_H_
+#define COPY_H_
+
+/* Copies files between images without going through the host. Every source
+   is IMAGE:PATTERN, where the pattern may hold * and ? wildcards, and dest is
+   IMAGE or IMAGE:NEWNAME, the new name being allowed only when a single file
+   is copied. File records are moved as they are, so the AMSDOS header, user
+   number and attributes are kept. Sources are read first, each under its
+   own shared lock, and the destination is then locked and committed once,
+   after every source was copied, and left unchanged if any of them fails.
+   Returns the number of files copied, or -1 on errors. */
+int copy_files(char **sources, int num_sources, const char *dest, double lock_timeout);
+
+#endif
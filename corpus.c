@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "corpus.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+#define HAVE_DIRENT
+#endif
+
+static
+void add_path(struct corpus_s *corpus, const char *path)
+{
+    if (corpus->num_paths == corpus->capacity) {
+        corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 64;
+        corpus->paths = (char **) realloc(corpus->paths, corpus->capacity * sizeof(char *));
+        if (!corpus->paths) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    corpus->paths[corpus->num_paths] = (char *) malloc(strlen(path) + 1);
+    if (!corpus->paths[corpus->num_paths]) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    strcpy(corpus->paths[corpus->num_paths++], path);
+}
+
+#if defined (HAVE_DIRENT)
+static
+int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static
+int has_dsk_extension(const char *name)
+{
+    size_t len = strlen(name);
+
+    return (len > 4 && stricmp(name + len - 4, ".dsk") == 0)
+        || (len > 7 && stricmp(name + len - 7, ".dsk.gz") == 0);
+}
+
+static
+void add_directory(struct corpus_s *corpus, const char *dir_name)
+{
+    DIR *dir;
+    struct dirent *entry;
+    int first;
+
+    dir = opendir(dir_name);
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory %s.\n", dir_name);
+        return;
+    }
+
+    first = corpus->num_paths;
+
+    while ((entry = readdir(dir)) != NULL) {
+        char *path;
+        struct stat st;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        path = (char *) malloc(strlen(dir_name) + strlen(entry->d_name) + 2);
+        if (!path) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        sprintf(path, "%s/%s", dir_name, entry->d_name);
+
+        if (stat(path, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                add_directory(corpus, path);
+            } else if (has_dsk_extension(entry->d_name)) {
+                add_path(corpus, path);
+            }
+        }
+
+        free(path);
+    }
+
+    closedir(dir);
+
+    qsort(corpus->paths + first, corpus->num_paths - first, sizeof(char *), compare_paths);
+}
+#endif
+
+void corpus_init(struct corpus_s *corpus)
+{
+    assert(corpus);
+
+    memset(corpus, 0, sizeof(*corpus));
+}
+
+/* Adds every line of a list file, each of them a path, directory or glob */
+static
+void add_list(struct corpus_s *corpus, const char *list_file_name)
+{
+    char line[4096];
+    FILE *fp;
+
+    fp = fopen(list_file_name, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", list_file_name);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+
+        if (line[0] && line[0] != '#') {
+            corpus_add(corpus, line);
+        }
+    }
+
+    fclose(fp);
+}
+
+void corpus_add(struct corpus_s *corpus, const char *path)
+{
+#if defined (HAVE_DIRENT)
+    struct stat st;
+#endif
+
+    assert(corpus);
+    assert(path);
+
+    if (path[0] == '@') {
+        add_list(corpus, path + 1);
+        return;
+    }
+
+#if defined (HAVE_DIRENT)
+    if (strpbrk(path, "*?[")) {
+        glob_t matches;
+        size_t i;
+
+        if (glob(path, 0, NULL, &matches) == 0) {
+            for (i = 0; i < matches.gl_pathc; i++) {
+                corpus_add(corpus, matches.gl_pathv[i]);
+            }
+        }
+
+        globfree(&matches);
+        return;
+    }
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        add_directory(corpus, path);
+        return;
+    }
+#endif
+
+    add_path(corpus, path);
+}
+
+void corpus_free(struct corpus_s *corpus)
+{
+    int i;
+
+    assert(corpus);
+
+    for (i = 0; i < corpus->num_paths; i++) {
+        free(corpus->paths[i]);
+    }
+
+    free(corpus->paths);
+    memset(corpus, 0, sizeof(*corpus));
+}
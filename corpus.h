@@ -0,0 +1,17 @@
+#ifndef CORPUS_H_
+#define CORPUS_H_
+
+/* A list of disk image paths, collected from files, directories and glob
+   patterns given on the command line, or listed one per line in a file
+   given as @list. */
+struct corpus_s {
+    char **paths;
+    int num_paths;
+    int capacity;
+};
+
+void corpus_init(struct corpus_s *corpus);
+void corpus_add(struct corpus_s *corpus, const char *path);
+void corpus_free(struct corpus_s *corpus);
+
+#endif
@@ -4,13 +4,14 @@
 #include <string.h>
 
 #include "platformdef.h"
+#include "trace.h"
 
 const char *CPCEMU_HEADER_STD   = "MV - CPCEMU Disk-File\r\nDisk-Info\r\n";
 const char *CPCEMU_HEADER_EX    = "EXTENDED CPC DSK File\r\nDisk-Info\r\n";
 const char *CPCEMU_CREATOR      = "AMS-DSK\r\n";
 const char *CPCEMU_TRACK_HEADER = "Track-Info\r\n";
 
-u8 g_sector_skew_table[NUM_SECTOR];
+THREAD_LOCAL u8 g_sector_skew_table[NUM_SECTOR];
 
 void read_disc_info(FILE *fp, struct cpcemu_disc_info_s *info)
 {
@@ -39,6 +40,8 @@ void read_track_info(FILE *fp, u8 track, struct cpcemu_track_info_s *track_info)
 
     offset_track = CPCEMU_INFO_OFFSET + (track * SIZ_TRACK);
 
+    TRACE_ACCESS(TRACE_READ_TRACK_INFO, track, TRACE_NO_SECTOR, TRACE_NO_SECTOR);
+
     fseek(fp, offset_track, SEEK_SET);
     fread(track_info, 1, sizeof(struct cpcemu_track_info_s), fp);
 }
@@ -52,6 +55,8 @@ void write_track_info(FILE *fp, u8 track, struct cpcemu_track_info_s *track_info
 
     offset_track = CPCEMU_INFO_OFFSET + (track * SIZ_TRACK);
 
+    TRACE_ACCESS(TRACE_WRITE_TRACK_INFO, track, TRACE_NO_SECTOR, TRACE_NO_SECTOR);
+
     fseek(fp, offset_track, SEEK_SET);
     fwrite(track_info, 1, sizeof(struct cpcemu_track_info_s), fp);
 }
@@ -79,6 +84,47 @@ int check_extended(FILE *fp)
     return strncmp("EXTENDED", disc_info.header, 8) == 0;
 }
 
+/* Returns non-zero if the image has a layout this layer can address: a single
+   sided disc with at least NUM_TRACK tracks of SIZ_TRACK bytes each */
+int check_disc_info(FILE *fp)
+{
+    struct cpcemu_disc_info_s disc_info;
+    long size;
+    int i;
+
+    assert(fp);
+
+    memset(&disc_info, 0, sizeof(disc_info));
+    read_disc_info(fp, &disc_info);
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+
+    if (size < CPCEMU_INFO_OFFSET + SIZ_TOTAL) {
+        return 0;
+    }
+
+    if (disc_info.num_heads != 1 || disc_info.num_tracks < NUM_TRACK) {
+        return 0;
+    }
+
+    if (strncmp("MV - CPC", disc_info.header, 8) == 0) {
+        return disc_info.track_size == SIZ_TRACK;
+    }
+
+    if (strncmp("EXTENDED", disc_info.header, 8) == 0) {
+        for (i = 0; i < NUM_TRACK; i++) {
+            if (disc_info.track_size_table[i] != SIZ_TRACK >> 8) {
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
 #if 0
 void read_physical_sector(FILE *fp, u8 track, u8 sector, u8 buffer[SIZ_SECTOR])
 {
@@ -93,38 +139,60 @@ void read_physical_sector(FILE *fp, u8 track, u8 sector, u8 buffer[SIZ_SECTOR])
 }
 #endif
 
-void read_logical_sector(FILE *fp, u8 track, u8 sector, u8 buffer[SIZ_SECTOR])
+long logical_sector_offset(u8 track, u8 sector)
 {
     int offset_track;
-    int logical_sector;
-    int offset_sector;
+    int physical_sector;
+
+    assert(track < NUM_TRACK);
+    assert(sector < NUM_SECTOR);
 
+    offset_track    = CPCEMU_INFO_OFFSET + (track * SIZ_TRACK);
+    physical_sector = g_sector_skew_table[sector];
+
+    return offset_track + CPCEMU_TRACK_OFFSET + physical_sector * SIZ_SECTOR;
+}
+
+void read_logical_sector(FILE *fp, u8 track, u8 sector, u8 buffer[SIZ_SECTOR])
+{
     assert(track < NUM_TRACK);
     assert(sector < NUM_SECTOR);
     /* printf("DEBUG - read_logical_sector (track: %d, sector: %d)\n", track, sector); */
 
-    offset_track   = CPCEMU_INFO_OFFSET + (track * SIZ_TRACK);
-    logical_sector = g_sector_skew_table[sector];
-    offset_sector  = CPCEMU_TRACK_OFFSET + logical_sector * SIZ_SECTOR;
+    TRACE_ACCESS(TRACE_READ_SECTOR, track, sector, g_sector_skew_table[sector]);
 
-    fseek(fp, offset_track + offset_sector, SEEK_SET);
+    fseek(fp, logical_sector_offset(track, sector), SEEK_SET);
     fread(buffer, 1, SIZ_SECTOR, fp);
 }
 
 void write_logical_sector(FILE *fp, u8 track, u8 sector, u8 buffer[SIZ_SECTOR])
 {
-    int offset_track;
-    int logical_sector;
-    int offset_sector;
-
     assert(track < NUM_TRACK);
     assert(sector < NUM_SECTOR);
     /* printf("DEBUG - write_logical_sector (track: %d, sector: %d)\n", track, sector); */
 
-    offset_track   = CPCEMU_INFO_OFFSET + (track * SIZ_TRACK);
-    logical_sector = g_sector_skew_table[sector];
-    offset_sector  = CPCEMU_TRACK_OFFSET + logical_sector * SIZ_SECTOR;
+    TRACE_ACCESS(TRACE_WRITE_SECTOR, track, sector, g_sector_skew_table[sector]);
 
-    fseek(fp, offset_track + offset_sector, SEEK_SET);
+    fseek(fp, logical_sector_offset(track, sector), SEEK_SET);
     fwrite(buffer, 1, SIZ_SECTOR, fp);
 }
+
+void read_track_data(FILE *fp, u8 track, u8 buffer[NUM_SECTOR * SIZ_SECTOR])
+{
+    assert(track < NUM_TRACK);
+
+    TRACE_ACCESS(TRACE_READ_TRACK, track, TRACE_NO_SECTOR, TRACE_NO_SECTOR);
+
+    fseek(fp, CPCEMU_INFO_OFFSET + (long) track * SIZ_TRACK + CPCEMU_TRACK_OFFSET, SEEK_SET);
+    fread(buffer, 1, NUM_SECTOR * SIZ_SECTOR, fp);
+}
+
+void write_track_data(FILE *fp, u8 track, u8 buffer[NUM_SECTOR * SIZ_SECTOR])
+{
+    assert(track < NUM_TRACK);
+
+    TRACE_ACCESS(TRACE_WRITE_TRACK, track, TRACE_NO_SECTOR, TRACE_NO_SECTOR);
+
+    fseek(fp, CPCEMU_INFO_OFFSET + (long) track * SIZ_TRACK + CPCEMU_TRACK_OFFSET, SEEK_SET);
+    fwrite(buffer, 1, NUM_SECTOR * SIZ_SECTOR, fp);
+}
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include "types.h"
+#include "platformdef.h"
 
 #define CPCEMU_INFO_OFFSET    0x100
 #define CPCEMU_TRACK_OFFSET   0x100
@@ -81,7 +82,7 @@ struct cpcemu_track_info_s {
 
 #pragma pack(pop)
 
-extern u8 g_sector_skew_table[NUM_SECTOR];
+extern THREAD_LOCAL u8 g_sector_skew_table[NUM_SECTOR];
 
 void read_disc_info(FILE *fp, struct cpcemu_disc_info_s *info);
 void write_disc_info(FILE *fp, struct cpcemu_disc_info_s *info);
@@ -89,7 +90,16 @@ void read_track_info(FILE *fp, u8 track, struct cpcemu_track_info_s *track_info)
 void write_track_info(FILE *fp, u8 track, struct cpcemu_track_info_s *track_info);
 int check_disk_type(FILE *fp, u8 sector_id);
 int check_extended(FILE *fp);
+int check_disc_info(FILE *fp);
+
+/* Offset in the image file of a logical sector, after the skew */
+long logical_sector_offset(u8 track, u8 sector);
+
 void read_logical_sector(FILE *fp, u8 track, u8 sector, u8 buffer[SIZ_SECTOR]);
 void write_logical_sector(FILE *fp, u8 track, u8 sector, u8 buffer[SIZ_SECTOR]);
 
+/* The sector data of a whole track in one access, in physical order */
+void read_track_data(FILE *fp, u8 track, u8 buffer[NUM_SECTOR * SIZ_SECTOR]);
+void write_track_data(FILE *fp, u8 track, u8 buffer[NUM_SECTOR * SIZ_SECTOR]);
+
 #endif
@@ -12,23 +12,23 @@
 #include "cpcemu.h"
 #include "amsdos.h"
 
-u8 allocation_table[(NUM_TRACK * NUM_SECTOR * SIZ_SECTOR) / 1024]; /* ?? Make it dynamic */
+THREAD_LOCAL u8 allocation_table[(NUM_TRACK * NUM_SECTOR * SIZ_SECTOR) / 1024]; /* ?? Make it dynamic */
 
 static struct DPB_s DPB_CPC_system = { 0x24, 3, 7, 0, 0x0AA, 0x3F, 0x0C0, 0, 0x10, 2, 2, 3 };
 static struct DPB_s DPB_CPC_data   = { 0x24, 3, 7, 0, 0x0B3, 0x3F, 0x0C0, 0, 0x10, 0, 2, 3 };
-static struct DPB_s *DPB;
+static THREAD_LOCAL struct DPB_s *DPB;
 
 static int g_num_diren = 32;
 static int g_record_size = 128;
 
-int g_base_track;
-int g_block_size;
-int g_num_sector_per_block;
-int g_diren_table_index;
-int g_num_record_per_sector;
-int g_num_record_per_block;
-int g_num_sector_in_diren_table;
-int g_num_file_per_sector;
+THREAD_LOCAL int g_base_track;
+THREAD_LOCAL int g_block_size;
+THREAD_LOCAL int g_num_sector_per_block;
+THREAD_LOCAL int g_diren_table_index;
+THREAD_LOCAL int g_num_record_per_sector;
+THREAD_LOCAL int g_num_record_per_block;
+THREAD_LOCAL int g_num_sector_in_diren_table;
+THREAD_LOCAL int g_num_file_per_sector;
 
 
 static
@@ -63,7 +63,6 @@ void hex_dump(u8 *buf, int offset, int len)
 #undef STRIDE
 }
 
-static
 void normalize_filename(char *full_file_name, struct cpm_diren_s *dir)
 {
     char file_name[9];
@@ -98,8 +97,8 @@ void normalize_filename(char *full_file_name, struct cpm_diren_s *dir)
 /* ?? Improve */
 void denormalize_filename(const char *full_file_name, struct cpm_diren_s *dest)
 {
-    char buffer[1024];
-    char *token;
+    const char *token;
+    const char *ext;
     int file_name_length;
     int ext_length;
     int i;
@@ -110,15 +109,17 @@ void denormalize_filename(const char *full_file_name, struct cpm_diren_s *dest)
     memset(dest->file_name, 0, sizeof(dest->file_name));
     memset(dest->ext, 0, sizeof(dest->ext));
 
-    strcpy(buffer, full_file_name);
+    /* Split on dots by hand, strtok keeps state between calls and can not
+       be used from several threads */
+    for (token = full_file_name; *token == '.'; token++) {
+    }
 
-    token = strtok(buffer, ".");
-    if (!token) {
+    if (!*token) {
         fprintf(stderr, "File name has no extension.\n");
         exit(1);
     }
 
-    file_name_length = strlen(token);
+    file_name_length = strcspn(token, ".");
     if (file_name_length > 8) {
         fprintf(stderr, "File name cannot be longer then 8 characters.\n");
         exit(1);
@@ -128,18 +129,19 @@ void denormalize_filename(const char *full_file_name, struct cpm_diren_s *dest)
         dest->file_name[i] = i < file_name_length ? toupper(token[i]) : ' ';
     }
 
-    token = strtok(NULL, ".");
+    for (ext = token + file_name_length; *ext == '.'; ext++) {
+    }
 
-    if (token) {
-        ext_length = strlen(token);
+    ext_length = strcspn(ext, ".");
 
+    if (ext_length) {
         if (ext_length > 3) {
             fprintf(stderr, "File extension cannot be longer then 3 characters.\n");
             exit(1);
         }
 
         for (i = 0; i < 3; i++) {
-            dest->ext[i] = i < ext_length ? toupper(token[i]) : ' ';
+            dest->ext[i] = i < ext_length ? toupper(ext[i]) : ' ';
         }
     }
 }
@@ -188,6 +190,8 @@ void init_alloc_table(FILE *fp)
 {
     int i;
 
+    memset(allocation_table, 0, sizeof(allocation_table));
+
     for (i = 0; i < g_num_sector_in_diren_table; i++) {
         u8 buffer[SIZ_SECTOR];
         int j;
@@ -242,7 +246,7 @@ int get_free_alloc_index(int base_index)
 {
     unsigned int i;
 
-    for (i = base_index; i < sizeof(allocation_table); i++) {
+    for (i = base_index; i < sizeof(allocation_table) && i <= DPB->dsm; i++) {
         if (!allocation_table[i]) {
             allocation_table[i] = 1;
             return i;
@@ -302,6 +306,10 @@ void init_sector_skew_table(FILE *fp)
         int sector_id = track_info.sector_info_table[i].sector_id;
         int logical_sector = sector_id - (is_system_disk ? CPM_SYSTEM_DISK : CPM_DATA_DISK);
 
+        if (logical_sector < 0 || logical_sector >= NUM_SECTOR) {
+            continue;
+        }
+
         g_sector_skew_table[logical_sector] = i;
     }
 }
@@ -402,7 +410,6 @@ int cpm_del(FILE *fp, const char *file_name)
     return file_deleted;
 }
 
-static
 void convert_AL_to_track_sector(u8 AL, int *track, int *sector)
 {
     int sector_offset;
@@ -412,7 +419,6 @@ void convert_AL_to_track_sector(u8 AL, int *track, int *sector)
     *sector       = sector_offset % NUM_SECTOR;
 }
 
-static
 void add_offset_to_track_sector(int *track, int *sector, int offset)
 {
     int new_track;
@@ -428,14 +434,11 @@ void add_offset_to_track_sector(int *track, int *sector, int offset)
     *sector = new_sector;
 }
 
-/* TODO: Revise this */
 void cpm_insert(FILE *fp, const char *file_name, u16 entry_addr, u16 exec_addr, int amsdos)
 {
     FILE *to_read;
-    int new_diren_index;
-    int cur_extent;
-    struct amsdos_header_s amsdos_header;
-    int amsdos_header_written;
+    const char *base_name;
+    u8 *data;
     long file_size;
 
     to_read = fopen(file_name, "rb");
@@ -443,98 +446,29 @@ void cpm_insert(FILE *fp, const char *file_name, u16 entry_addr, u16 exec_addr,
         fprintf(stderr, "Failed to open file %s for reading.\n", file_name);
         exit(1);
     }
-    cur_extent            = 0;
-    amsdos_header_written = 0;
 
     fseek(to_read, 0, SEEK_END);
     file_size = ftell(to_read);
     fseek(to_read, 0, SEEK_SET);
 
-    init_alloc_table(fp);
-
-    amsdos_new(to_read, &amsdos_header, file_name, entry_addr, exec_addr);
-
-    cpm_del(fp, file_name);
-
-    while (1) {
-        struct cpm_diren_s dir;
-        unsigned dir_index;
-
-        memset(&dir, 0, sizeof(dir));
-
-        new_diren_index = cpm_find_empty_diren_index(fp);
-        if (new_diren_index < 0) {
-            fprintf(stderr, "No empty slot left in directory entry table\n");
-            exit(1);
-        }
-
-        denormalize_filename(file_name, &dir);
-
-        dir.user_number = 0;
-        dir.EX = cur_extent;
-        dir.S1 = 0;
-        dir.S2 = 0;
-        dir.RC = 0;
-        memset(&dir.AL, 0, sizeof(dir.AL));
-
-        /* Filling Allocation Table, 16 entries, each 1024 bytes block */
-        for (dir_index = 0; dir_index < sizeof(dir.AL); dir_index++) {
-            int j, k;
-            int free_alloc_index;
-            int dest_track;
-            int dest_sector;
-            u8 sector_buffer[SIZ_SECTOR];
-
-            free_alloc_index = get_free_alloc_index(g_base_track + g_diren_table_index);
-
-            if (free_alloc_index < 0) {
-                fprintf(stderr, "No space left on disk.\n");
-                exit(1);
-            }
-
-            dir.AL[dir_index] = free_alloc_index;
-
-            for (j = 0; j < g_num_sector_per_block; j++) {
-                memset(sector_buffer, CPM_NO_FILE, SIZ_SECTOR);
-
-                for (k = 0; k < g_num_record_per_sector; k++) {
-                    size_t n;
-
-                    if (amsdos && !amsdos_header_written) {
-                        amsdos_header_written = 1;
-                        memcpy(sector_buffer, &amsdos_header, g_record_size);
-                        dir.RC += 1;
-                        continue;
-                    }
-
-                    n = fread(sector_buffer + k * g_record_size, 1, g_record_size, to_read);
-
-                    dir.RC += 1;
-
-                    if (feof(to_read) || n == 0 || ftell(to_read) == file_size) {
-                        convert_AL_to_track_sector(free_alloc_index, &dest_track, &dest_sector);
-                        add_offset_to_track_sector(&dest_track, &dest_sector, j);
-
-                        write_logical_sector(fp, dest_track, dest_sector, sector_buffer);
-                        cpm_write_diren(fp, &dir, new_diren_index);
+    data = (u8 *) malloc(file_size + 1);
+    if (!data || fread(data, 1, file_size, to_read) != (size_t) file_size) {
+        fprintf(stderr, "Failed to read file %s.\n", file_name);
+        exit(1);
+    }
 
-                        printf("Wrote %s into disk.\n", file_name);
-                        fclose(to_read);
-                        return;
-                    }
-                }
+    fclose(to_read);
 
-                convert_AL_to_track_sector(free_alloc_index, &dest_track, &dest_sector);
-                add_offset_to_track_sector(&dest_track, &dest_sector, j);
+    /* The file is named after the host file, without its directory */
+    base_name = strrchr(file_name, '/') ? strrchr(file_name, '/') + 1 : file_name;
 
-                write_logical_sector(fp, dest_track, dest_sector, sector_buffer);
-            }
-        }
+    if (cpm_insert_buffer(fp, base_name, data, file_size, entry_addr, exec_addr, amsdos) != 0) {
+        exit(1);
+    }
 
-        cpm_write_diren(fp, &dir, new_diren_index);
+    free(data);
 
-        cur_extent += 1;
-    }
+    printf("Wrote %s into disk.\n", file_name);
 }
 
 void cpm_dir(FILE *fp)
@@ -590,7 +524,7 @@ void cpm_dir(FILE *fp)
     }
 }
 
-static void print_tracks_sectors_info(int tracks_sectors[512][2], int tracks_sectors_c)
+static void print_tracks_sectors_info(FILE *out, int tracks_sectors[512][2], int tracks_sectors_c)
 {
     int i;
     int tracks[40];
@@ -646,13 +580,13 @@ static void print_tracks_sectors_info(int tracks_sectors[512][2], int tracks_sec
             }
         }
 
-        printf("db 0x%.2x, 0x%.2x, 0x%.2x\n", track, min_sector, max_sector);
+        fprintf(out, "db 0x%.2x, 0x%.2x, 0x%.2x\n", track, min_sector, max_sector);
     }
 
-    printf("db 0xff\n");
+    fprintf(out, "db 0xff\n");
 }
 
-void cpm_info(FILE *fp, const char *file_name, int tracks_only)
+int cpm_info(FILE *fp, FILE *out, const char *file_name, int tracks_only)
 {
     int i;
     int first_sector_id;
@@ -695,21 +629,21 @@ void cpm_info(FILE *fp, const char *file_name, int tracks_only)
             file_found = 1;
 
             if (!tracks_only) {
-                printf("Directory Entry: %.2d\n", dir.EX);
-                printf("-------------------\n");
-                printf(" U     FILE_NAME EX S1 S2  RC\n");
-                printf("%.2d %13s %.2d %.2d %.2d %.3d\n",
+                fprintf(out, "Directory Entry: %.2d\n", dir.EX);
+                fprintf(out, "-------------------\n");
+                fprintf(out, " U     FILE_NAME EX S1 S2  RC\n");
+                fprintf(out, "%.2d %13s %.2d %.2d %.2d %.3d\n",
                        dir.user_number, full_file_name, dir.EX, dir.S1, dir.S2, dir.RC);
-                printf("\n");
-                printf("Allocation blocks\n");
-                printf("-----------------\n");
+                fprintf(out, "\n");
+                fprintf(out, "Allocation blocks\n");
+                fprintf(out, "-----------------\n");
                 for (k = 0; k < 16; k++) {
-                    printf("%.2d ", dir.AL[k]);
+                    fprintf(out, "%.2d ", dir.AL[k]);
                 }
-                printf("\n");
-                printf("\n");
-                printf("Track, Sector pairs\n");
-                printf("-------------------\n");
+                fprintf(out, "\n");
+                fprintf(out, "\n");
+                fprintf(out, "Track, Sector pairs\n");
+                fprintf(out, "-------------------\n");
             }
 
             for (k = 0; k < 16; k++) {
@@ -730,7 +664,7 @@ void cpm_info(FILE *fp, const char *file_name, int tracks_only)
                 sector_id = sector + first_sector_id;
 
                 if (!tracks_only) {
-                    printf("0x%.2x, 0x%.2x\n", track, sector_id);
+                    fprintf(out, "0x%.2x, 0x%.2x\n", track, sector_id);
                 }
 
                 tracks_sectors[tracks_sectors_i][0] = track;
@@ -740,7 +674,7 @@ void cpm_info(FILE *fp, const char *file_name, int tracks_only)
                     add_offset_to_track_sector(&track, &sector, 1);
                     sector_id = sector + first_sector_id;
                     if (!tracks_only) {
-                        printf("0x%.2x, 0x%.2x\n", track, sector_id);
+                        fprintf(out, "0x%.2x, 0x%.2x\n", track, sector_id);
                     }
                     tracks_sectors[tracks_sectors_i][0] = track;
                     tracks_sectors[tracks_sectors_i++][1] = sector_id;
@@ -748,14 +682,14 @@ void cpm_info(FILE *fp, const char *file_name, int tracks_only)
             }
 
             if (!tracks_only) {
-                printf("\n");
+                fprintf(out, "\n");
             }
         }
     }
 
     if (!file_found) {
-        printf("File %s not found.\n", file_name);
-        exit(0);
+        fprintf(out, "File %s not found.\n", file_name);
+        return -1;
     }
 
     if (!tracks_only) {
@@ -773,14 +707,16 @@ void cpm_info(FILE *fp, const char *file_name, int tracks_only)
 
             memcpy(&amsdos_header, buffer, g_record_size);
 
-            amsdos_print_header(&amsdos_header);
+            amsdos_print_header(out, &amsdos_header);
         }
     }
 
     if (tracks_only) {
-        printf("; track number, first sector, last sector for the file %s\n", file_name);
-        print_tracks_sectors_info(tracks_sectors, tracks_sectors_i);
+        fprintf(out, "; track number, first sector, last sector for the file %s\n", file_name);
+        print_tracks_sectors_info(out, tracks_sectors, tracks_sectors_i);
     }
+
+    return 0;
 }
 
 /* Return -1 for exit early */
@@ -832,9 +768,26 @@ int cpm_dump_append_to_file(struct cpm_diren_s *dir, FILE **fp, u8 *buf, size_t
     return 0;
 }
 
+struct dump_file_s {
+    struct cpm_diren_s *dir;
+    FILE *write_file;
+    int text;
+};
+
+static
+int dump_file_sink(void *ctx, u8 *buf, size_t len)
+{
+    struct dump_file_s *dump_file = (struct dump_file_s *) ctx;
+
+    return cpm_dump_append_to_file(dump_file->dir, &dump_file->write_file, buf, len,
+                                   dump_file->text);
+}
+
+/* Passes the records of the extent to sink, without the AMSDOS header unless
+   raw is set, or hexdumps them when sink is NULL. Return -1 when the sink
+   asked to stop early */
 static
-void dump_extent(FILE *fp, struct cpm_diren_s *dir, int to_file, FILE **write_file,
-                    int text)
+int dump_extent(FILE *fp, struct cpm_diren_s *dir, int raw, cpm_sink_fn sink, void *ctx)
 {
     unsigned k;
     int record_counter;
@@ -860,6 +813,10 @@ void dump_extent(FILE *fp, struct cpm_diren_s *dir, int to_file, FILE **write_fi
             break;
         }
 
+        if (dir->AL[k] > DPB->dsm) {
+            return -1;
+        }
+
         convert_AL_to_track_sector(dir->AL[k], &track, &sector);
 
         for (s = 0; s < g_num_sector_per_block; s++) {
@@ -873,25 +830,16 @@ void dump_extent(FILE *fp, struct cpm_diren_s *dir, int to_file, FILE **write_fi
             read_logical_sector(fp, cur_track, cur_sector, block_buffer);
 
             for (r = 0; r < g_num_record_per_sector; r++) {
-                if (to_file) {
-                    int skip_early;
+                if (sink) {
+                    int skip_amsdos;
 
-                    skip_early = 0;
-                    if (r == 0) {
-                        int skip_amsdos;
-                        int has_amsdos_header;
-
-                        has_amsdos_header = amsdos_header_exists((struct amsdos_header_s *) block_buffer);
-                        skip_amsdos = dir->EX == 0 && cur_track == track && cur_sector == sector
-                            && has_amsdos_header;
-                        if (skip_amsdos) {
-                            continue;
-                        }
-                    }
-                    skip_early = cpm_dump_append_to_file(dir, write_file, block_buffer + r * g_record_size, g_record_size, text);
+                    /* The header record still counts towards RC */
+                    skip_amsdos = !raw && r == 0 && k == 0 && s == 0 && dir->EX == 0
+                        && amsdos_header_exists((struct amsdos_header_s *) block_buffer);
 
-                    if (skip_early == -1) {
-                        return;
+                    if (!skip_amsdos
+                        && sink(ctx, block_buffer + r * g_record_size, g_record_size) == -1) {
+                        return -1;
                     }
                 } else {
                     if (r == 0) {
@@ -901,23 +849,29 @@ void dump_extent(FILE *fp, struct cpm_diren_s *dir, int to_file, FILE **write_fi
                 }
 
                 if (is_last_AL && (record_counter + 1) >= dir->RC) {
-                    return;
+                    return 0;
                 }
 
                 record_counter++;
             }
         }
     }
+
+    return 0;
 }
 
 void cpm_dump(FILE *fp, const char *file_name, int to_file, int text)
 {
-    FILE *write_file;
+    struct dump_file_s dump_file;
+    cpm_sink_fn sink;
     int i;
     int file_found;
 
     file_found = 0;
-    write_file = 0;
+    sink       = to_file ? dump_file_sink : NULL;
+
+    memset(&dump_file, 0, sizeof(dump_file));
+    dump_file.text = text;
 
     for (i = 0; i < g_num_sector_in_diren_table; i++) {
         u8 buffer[SIZ_SECTOR];
@@ -942,15 +896,19 @@ void cpm_dump(FILE *fp, const char *file_name, int to_file, int text)
                 continue;
             }
 
-            dump_extent(fp, &dir, to_file, &write_file, text);
+            dump_file.dir = &dir;
 
-            while (find_dir_entry(fp, full_file_name, &extent_diren, extent_index++) != 0) {
-                dump_extent(fp, &extent_diren, to_file, &write_file, text);
+            if (dump_extent(fp, &dir, 0, sink, &dump_file) == 0) {
+                while (find_dir_entry(fp, full_file_name, &extent_diren, extent_index++) != 0) {
+                    if (dump_extent(fp, &extent_diren, 0, sink, &dump_file) != 0) {
+                        break;
+                    }
+                }
             }
 
-            if (write_file) {
+            if (dump_file.write_file) {
                 printf("Extracted file %s.\n", file_name);
-                fclose(write_file);
+                fclose(dump_file.write_file);
             }
             return;
         }
@@ -961,68 +919,1123 @@ void cpm_dump(FILE *fp, const char *file_name, int to_file, int text)
     }
 }
 
-void cpm_new(FILE *fp)
+int cpm_read_dir(FILE *fp, struct cpm_diren_s *dest)
 {
-    struct cpcemu_disc_info_s disk_info;
-    int track;
-    int sector;
-    u8 skew_table[] = { 0, 5, 1, 6, 2, 7, 3, 8, 4 }; /* ?? */
+    int i;
 
-    memcpy(g_sector_skew_table, skew_table, sizeof(skew_table));
+    assert(fp);
+    assert(dest);
 
-    init_disk_info(&disk_info, CPCEMU_HEADER_STD, CPCEMU_CREATOR, NUM_TRACK, 1, SIZ_TRACK);
-    write_disc_info(fp, &disk_info);
+    for (i = 0; i < g_num_sector_in_diren_table; i++) {
+        u8 buffer[SIZ_SECTOR];
 
-    for (track = 0; track < NUM_TRACK; track++) {
-        struct cpcemu_track_info_s track_info;
+        read_logical_sector(fp, g_base_track, i, buffer);
+        memcpy(dest + i * g_num_file_per_sector, buffer, g_num_file_per_sector * sizeof(*dest));
+    }
 
-        init_track_info(&track_info, CPCEMU_TRACK_HEADER, track, 0);
-        write_track_info(fp, track, &track_info);
+    return g_num_sector_in_diren_table * g_num_file_per_sector;
+}
 
-        for (sector = 0; sector < NUM_SECTOR; sector++) {
-            u8 buffer[SIZ_SECTOR];
+int cpm_find_extent(struct cpm_diren_s *table, int num_diren, struct cpm_diren_s *file, int extent)
+{
+    int i;
 
-            memset(buffer, CPM_NO_FILE, SIZ_SECTOR);
-            write_logical_sector(fp, track, sector, buffer);
+    assert(table);
+    assert(file);
+
+    for (i = 0; i < num_diren; i++) {
+        struct cpm_diren_s *dir = &table[i];
+        int k;
+
+        /* Extents past 31 carry their high bits in S2 */
+        if (   dir->user_number == CPM_NO_FILE
+            || dir->user_number != file->user_number
+            || dir->EX          != (extent & 0x1f)
+            || dir->S2          != (extent >> 5)) {
+            continue;
+        }
+
+        for (k = 0; k < 8; k++) {
+            if ((dir->file_name[k] & 0x7f) != (file->file_name[k] & 0x7f)) {
+                break;
+            }
+        }
+
+        if (k != 8) {
+            continue;
+        }
+
+        for (k = 0; k < 3; k++) {
+            if ((dir->ext[k] & 0x7f) != (file->ext[k] & 0x7f)) {
+                break;
+            }
+        }
+
+        if (k == 3) {
+            return i;
         }
     }
+
+    return -1;
 }
 
+int cpm_find_file(struct cpm_diren_s *table, int num_diren, const char *file_name)
+{
+    int i;
+
+    assert(table);
+    assert(file_name);
+
+    for (i = 0; i < num_diren; i++) {
+        char full_file_name[13];
+
+        if (   table[i].user_number == CPM_NO_FILE
+            || table[i].EX          != 0
+            || table[i].S2          != 0) {
+            continue;
+        }
+
+        normalize_filename(full_file_name, &table[i]);
+
+        if (stricmp(full_file_name, file_name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
 
-void cpm_init(FILE *fp)
+int cpm_file_records(struct cpm_diren_s *table, int num_diren, int first)
 {
-    int is_system_disk;
+    int extent;
+    int index;
+    int sum_RC;
 
-    is_system_disk = check_disk_type(fp, CPM_SYSTEM_DISK);
+    sum_RC = 0;
 
-    if (is_system_disk) {
-        DPB = &DPB_CPC_system;
-    } else if (check_disk_type(fp, CPM_DATA_DISK)) {
-        DPB = &DPB_CPC_data;
-    } else {
-        printf("Unrecognized disk type\n");
-        return;
+    for (extent = 0; (index = cpm_find_extent(table, num_diren, &table[first], extent)) >= 0; extent++) {
+        sum_RC += table[index].RC;
     }
 
-    g_base_track                 = check_disk_type(fp, CPM_SYSTEM_DISK) ? 2 : 0;
-    g_block_size                 = g_record_size << DPB->bsh;
-    g_num_sector_per_block       = g_block_size / SIZ_SECTOR;
-    g_diren_table_index          = ((DPB->drm + 1) * g_num_diren) / g_block_size;
-    g_num_record_per_sector      = SIZ_SECTOR / g_record_size;
-    g_num_record_per_block       = g_block_size / g_record_size;
-    g_num_sector_in_diren_table  = ((DPB->drm + 1) * g_num_diren) / SIZ_SECTOR;
-    g_num_file_per_sector        = SIZ_SECTOR / g_num_diren;
+    return sum_RC;
+}
 
-#if 0
-    printf("g_base_track                 = %d\n", g_base_track);
-    printf("g_block_size                 = %d\n", g_block_size);
-    printf("g_num_sector_per_block       = %d\n", g_num_sector_per_block);
-    printf("g_diren_table_index          = %d\n", g_diren_table_index);
-    printf("g_num_record_per_sector      = %d\n", g_num_record_per_sector);
-    printf("g_num_record_per_block       = %d\n", g_num_record_per_block);
-    printf("g_num_sector_in_diren_table  = %d\n", g_num_sector_in_diren_table);
-    printf("g_num_file_per_sector        = %d\n", g_num_file_per_sector);
-#endif
+static
+int read_file(FILE *fp, struct cpm_diren_s *table, int num_diren, int first, int raw,
+              cpm_sink_fn sink, void *ctx)
+{
+    int extent;
+    int index;
 
-    init_sector_skew_table(fp);
+    assert(fp);
+    assert(table);
+    assert(sink);
+
+    for (extent = 0; (index = cpm_find_extent(table, num_diren, &table[first], extent)) >= 0; extent++) {
+        if (dump_extent(fp, &table[index], raw, sink, ctx) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int cpm_read_file(FILE *fp, struct cpm_diren_s *table, int num_diren, int first,
+                  cpm_sink_fn sink, void *ctx)
+{
+    return read_file(fp, table, num_diren, first, 0, sink, ctx);
+}
+
+int cpm_read_records(FILE *fp, struct cpm_diren_s *table, int num_diren, int first,
+                     cpm_sink_fn sink, void *ctx)
+{
+    return read_file(fp, table, num_diren, first, 1, sink, ctx);
+}
+
+/* Maps offset through the extent that holds it, the block in its AL and the
+   sector in that block, and reads only the sectors covering the range.
+   Offsets start after the AMSDOS header, and reads stop at the length the
+   header gives, or at the last record of files without one. Returns the
+   number of bytes read, or -1 when an extent points outside the disk. */
+long cpm_read_at(FILE *fp, struct cpm_diren_s *table, int num_diren, int first,
+                 long offset, u8 *dest, long len)
+{
+    struct amsdos_header_s header;
+    int records_per_extent;
+    long data_end;
+    long pos;
+    long done;
+
+    assert(fp);
+    assert(table);
+    assert(dest || len == 0);
+
+    if (offset < 0 || len < 0) {
+        return -1;
+    }
+
+    records_per_extent = sizeof(table->AL) * g_num_record_per_block;
+    data_end           = (long) cpm_file_records(table, num_diren, first) * g_record_size;
+    pos                = offset;
+
+    if (cpm_read_amsdos_header(fp, &table[first], &header)) {
+        long data_length = amsdos_get_length(&header);
+
+        if (g_record_size + data_length < data_end) {
+            data_end = g_record_size + data_length;
+        }
+
+        pos += g_record_size;
+    }
+
+    for (done = 0; done < len && pos < data_end; ) {
+        struct cpm_diren_s *dir;
+        u8 buffer[SIZ_SECTOR];
+        int record;
+        int record_in_extent;
+        int index;
+        int track;
+        int sector;
+        u8 AL;
+        long n;
+
+        record           = pos / g_record_size;
+        record_in_extent = record % records_per_extent;
+
+        index = cpm_find_extent(table, num_diren, &table[first], record / records_per_extent);
+        if (index < 0) {
+            break;
+        }
+
+        dir = &table[index];
+
+        if (record_in_extent >= dir->RC) {
+            break;
+        }
+
+        AL = dir->AL[record_in_extent / g_num_record_per_block];
+        if (!AL || AL > DPB->dsm) {
+            return -1;
+        }
+
+        convert_AL_to_track_sector(AL, &track, &sector);
+        add_offset_to_track_sector(&track, &sector,
+                                   (record_in_extent % g_num_record_per_block) / g_num_record_per_sector);
+        read_logical_sector(fp, track, sector, buffer);
+
+        n = SIZ_SECTOR - pos % SIZ_SECTOR;
+        if (n > len - done) {
+            n = len - done;
+        }
+        if (n > data_end - pos) {
+            n = data_end - pos;
+        }
+
+        memcpy(dest + done, buffer + pos % SIZ_SECTOR, n);
+        done += n;
+        pos  += n;
+    }
+
+    return done;
+}
+
+int cpm_read(FILE *fp, const char *file_name, long offset, long len)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    u8 buffer[4096];
+    int num_diren;
+    int first;
+
+    assert(fp);
+    assert(file_name);
+
+    num_diren = cpm_read_dir(fp, table);
+
+    first = cpm_find_file(table, num_diren, file_name);
+    if (first < 0) {
+        fprintf(stderr, "File %s not found.\n", file_name);
+        return -1;
+    }
+
+    while (len > 0) {
+        long n;
+
+        n = cpm_read_at(fp, table, num_diren, first, offset,
+                        buffer, len < (long) sizeof(buffer) ? len : (long) sizeof(buffer));
+        if (n < 0) {
+            fprintf(stderr, "File %s has a broken allocation table.\n", file_name);
+            return -1;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        fwrite(buffer, 1, n, stdout);
+        offset += n;
+        len    -= n;
+    }
+
+    return 0;
+}
+
+int cpm_read_amsdos_header(FILE *fp, struct cpm_diren_s *dir, struct amsdos_header_s *dest)
+{
+    u8 buffer[SIZ_SECTOR];
+    int track;
+    int sector;
+
+    assert(fp);
+    assert(dir);
+    assert(dest);
+
+    if (dir->EX != 0 || !dir->AL[0] || dir->AL[0] > DPB->dsm) {
+        return 0;
+    }
+
+    convert_AL_to_track_sector(dir->AL[0], &track, &sector);
+    read_logical_sector(fp, track, sector, buffer);
+    memcpy(dest, buffer, sizeof(*dest));
+
+    return amsdos_header_exists(dest);
+}
+
+int cpm_num_blocks(void)
+{
+    return DPB->dsm + 1;
+}
+
+u8 cpm_get_attributes(struct cpm_diren_s *dir)
+{
+    u8 attributes;
+
+    assert(dir);
+
+    attributes = 0;
+
+    if (dir->ext[0] & 0x80) {
+        attributes |= CPM_ATTR_READ_ONLY;
+    }
+
+    if (dir->ext[1] & 0x80) {
+        attributes |= CPM_ATTR_SYSTEM;
+    }
+
+    if (dir->ext[2] & 0x80) {
+        attributes |= CPM_ATTR_ARCHIVE;
+    }
+
+    return attributes;
+}
+
+/* CP/M style wildcards, '*' matches any run of characters and '?' matches
+   exactly one */
+int cpm_match_filename(const char *pattern, const char *full_file_name)
+{
+    assert(pattern);
+    assert(full_file_name);
+
+    for (; *pattern; pattern++, full_file_name++) {
+        if (*pattern == '*') {
+            for (; *full_file_name; full_file_name++) {
+                if (cpm_match_filename(pattern + 1, full_file_name)) {
+                    return 1;
+                }
+            }
+
+            return cpm_match_filename(pattern + 1, full_file_name);
+        }
+
+        if (!*full_file_name) {
+            return 0;
+        }
+
+        if (   *pattern != '?'
+            && toupper((unsigned char) *pattern) != toupper((unsigned char) *full_file_name)) {
+            return 0;
+        }
+    }
+
+    return *full_file_name == 0;
+}
+
+int cpm_valid_filename(const char *full_file_name)
+{
+    const char *dot;
+    const char *c;
+
+    assert(full_file_name);
+
+    dot = strchr(full_file_name, '.');
+
+    if (   dot == full_file_name
+        || (dot && strchr(dot + 1, '.'))
+        || (dot ? dot - full_file_name : (long) strlen(full_file_name)) > 8
+        || (dot && strlen(dot + 1) > 3)) {
+        return 0;
+    }
+
+    for (c = full_file_name; *c; c++) {
+        if (!isprint((unsigned char) *c) || isspace((unsigned char) *c) || strchr("<>,;:=?*[]/\\", *c)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Writes data as the records of file_name in user 0, creating the file if
+   needed. An existing file keeps its attributes. */
+int cpm_write_file(FILE *fp, const char *file_name, const u8 *data, long size)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    struct cpm_diren_s file;
+    int num_diren;
+    int first;
+
+    assert(fp);
+    assert(file_name);
+
+    memset(&file, 0, sizeof(file));
+    denormalize_filename(file_name, &file);
+
+    num_diren = cpm_read_dir(fp, table);
+
+    first = cpm_find_extent(table, num_diren, &file, 0);
+    if (first >= 0) {
+        memcpy(&file, &table[first], sizeof(file));
+    }
+
+    return cpm_write_entry(fp, &file, data, size);
+}
+
+int cpm_file_cost(long size, int *num_blocks, int *num_extents)
+{
+    struct cpm_diren_s dir;
+    int num_records;
+
+    assert(num_blocks);
+    assert(num_extents);
+
+    /* Even an empty file holds one record */
+    num_records = (size + g_record_size - 1) / g_record_size;
+    if (num_records == 0) {
+        num_records = 1;
+    }
+
+    *num_blocks  = (num_records + g_num_record_per_block - 1) / g_num_record_per_block;
+    *num_extents = (*num_blocks + (int) sizeof(dir.AL) - 1) / (int) sizeof(dir.AL);
+
+    return num_records;
+}
+
+void cpm_capacity(int *num_blocks, int *num_diren)
+{
+    assert(num_blocks);
+    assert(num_diren);
+
+    *num_blocks = DPB->dsm + 1 - g_diren_table_index;
+    *num_diren  = DPB->drm + 1;
+}
+
+void cpm_geometry(int *num_tracks, int *num_sectors, int *sector_size)
+{
+    long track_bytes;
+
+    assert(num_tracks);
+    assert(num_sectors);
+    assert(sector_size);
+
+    track_bytes  = (long) DPB->spt * g_record_size;
+    *sector_size = g_record_size << DPB->psh;
+    *num_sectors = (int) (track_bytes / *sector_size);
+    *num_tracks  = DPB->off + (int) (((long) (DPB->dsm + 1) * g_block_size + track_bytes - 1) / track_bytes);
+}
+
+/* Writes data as the records of the file with the user number and name of
+   entry, attribute bits aside, creating it if needed. Every extent gets the
+   user number and name of entry, attribute bits included. The file keeps the
+   blocks it already has, sectors whose contents do not change are not
+   written, and new blocks and extents are only allocated when the file grows.
+   Blocks past the new end are released. Returns the number of newly allocated
+   blocks, or -1 if the file does not fit. */
+int cpm_write_entry(FILE *fp, const struct cpm_diren_s *entry, const u8 *data, long size)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    struct cpm_diren_s file;
+    int slots[CPM_MAX_DIREN];
+    int blocks[256];
+    u8 dirty[CPM_MAX_DIREN];
+    int num_diren;
+    int num_slots;
+    int num_blocks;
+    int num_old_blocks;
+    int num_records;
+    int num_extents;
+    int num_free_slots;
+    int blocks_per_extent;
+    int records_per_extent;
+    int first;
+    int i;
+
+    assert(fp);
+    assert(entry);
+    assert(data || size == 0);
+
+    num_diren = cpm_read_dir(fp, table);
+
+    memcpy(&file, entry, sizeof(file));
+
+    first = cpm_find_extent(table, num_diren, &file, 0);
+
+    blocks_per_extent  = sizeof(file.AL);
+    records_per_extent = blocks_per_extent * g_num_record_per_block;
+
+    num_slots      = 0;
+    num_old_blocks = 0;
+
+    if (first >= 0) {
+        int extent;
+        int index;
+
+        for (extent = 0; (index = cpm_find_extent(table, num_diren, &file, extent)) >= 0; extent++) {
+            int k;
+
+            slots[num_slots++] = index;
+
+            for (k = 0; k < blocks_per_extent && table[index].AL[k]; k++) {
+                if (table[index].AL[k] > DPB->dsm) {
+                    continue;
+                }
+
+                /* Only duplicate extents hold more blocks than the disk */
+                if (num_old_blocks == (int) (sizeof(blocks) / sizeof(blocks[0]))) {
+                    char full_file_name[13];
+
+                    normalize_filename(full_file_name, &file);
+                    fprintf(stderr, "File %s has a broken allocation table.\n", full_file_name);
+                    return -1;
+                }
+
+                blocks[num_old_blocks++] = table[index].AL[k];
+            }
+        }
+    }
+
+    num_records = cpm_file_cost(size, &num_blocks, &num_extents);
+
+    if (num_blocks > (int) (sizeof(blocks) / sizeof(blocks[0]))) {
+        fprintf(stderr, "No space left on disk.\n");
+        return -1;
+    }
+
+    num_free_slots = num_slots;
+    for (i = 0; i < num_diren; i++) {
+        if (table[i].user_number == CPM_NO_FILE) {
+            num_free_slots++;
+        }
+    }
+
+    if (num_extents > num_free_slots) {
+        fprintf(stderr, "No empty slot left in directory entry table\n");
+        return -1;
+    }
+
+    if (num_blocks > num_old_blocks) {
+        init_alloc_table(fp);
+
+        for (i = num_old_blocks; i < num_blocks; i++) {
+            blocks[i] = get_free_alloc_index(g_base_track + g_diren_table_index);
+
+            if (blocks[i] < 0) {
+                fprintf(stderr, "No space left on disk.\n");
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < num_blocks; i++) {
+        int track;
+        int sector;
+        int s;
+
+        convert_AL_to_track_sector((u8) blocks[i], &track, &sector);
+
+        for (s = 0; s < g_num_sector_per_block; s++) {
+            u8 old_buffer[SIZ_SECTOR];
+            u8 buffer[SIZ_SECTOR];
+            long offset;
+
+            offset = (long) (i * g_num_sector_per_block + s) * SIZ_SECTOR;
+
+            memset(buffer, CPM_NO_FILE, SIZ_SECTOR);
+            if (offset < size) {
+                memcpy(buffer, data + offset, size - offset < SIZ_SECTOR ? size - offset : SIZ_SECTOR);
+            }
+
+            read_logical_sector(fp, track, sector, old_buffer);
+
+            if (memcmp(old_buffer, buffer, SIZ_SECTOR) != 0) {
+                write_logical_sector(fp, track, sector, buffer);
+            }
+
+            add_offset_to_track_sector(&track, &sector, 1);
+        }
+    }
+
+    memset(dirty, 0, sizeof(dirty));
+
+    for (i = 0; i < num_extents; i++) {
+        struct cpm_diren_s dir;
+        int slot;
+        int k;
+
+        if (i < num_slots) {
+            slot = slots[i];
+        } else {
+            for (slot = 0; table[slot].user_number != CPM_NO_FILE; slot++) {
+            }
+        }
+
+        memcpy(&dir, &file, sizeof(dir));
+        dir.EX = i;
+        dir.S1 = 0;
+        dir.S2 = 0;
+        dir.RC = num_records - i * records_per_extent > records_per_extent
+            ? records_per_extent
+            : num_records - i * records_per_extent;
+        memset(dir.AL, 0, sizeof(dir.AL));
+
+        for (k = 0; k < blocks_per_extent && i * blocks_per_extent + k < num_blocks; k++) {
+            dir.AL[k] = blocks[i * blocks_per_extent + k];
+        }
+
+        if (memcmp(&table[slot], &dir, sizeof(dir)) != 0) {
+            memcpy(&table[slot], &dir, sizeof(dir));
+            dirty[slot / g_num_file_per_sector] = 1;
+        }
+    }
+
+    for (i = num_extents; i < num_slots; i++) {
+        table[slots[i]].user_number = CPM_NO_FILE;
+        dirty[slots[i] / g_num_file_per_sector] = 1;
+    }
+
+    for (i = 0; i < g_num_sector_in_diren_table; i++) {
+        if (dirty[i]) {
+            write_logical_sector(fp, g_base_track, i, (u8 *) &table[i * g_num_file_per_sector]);
+        }
+    }
+
+    return num_blocks > num_old_blocks ? num_blocks - num_old_blocks : 0;
+}
+
+int cpm_insert_buffer(FILE *fp, const char *file_name, const u8 *data, long size,
+                      u16 entry_addr, u16 exec_addr, int amsdos)
+{
+    struct amsdos_header_s header;
+    u8 *file_data;
+    int result;
+
+    assert(fp);
+    assert(file_name);
+    assert(data || size == 0);
+
+    if (!cpm_valid_filename(file_name) || !strcspn(file_name, ".")) {
+        fprintf(stderr, "%s is not a valid file name.\n", file_name);
+        return -1;
+    }
+
+    if (!amsdos) {
+        return cpm_write_file(fp, file_name, data, size) < 0 ? -1 : 0;
+    }
+
+    file_data = (u8 *) malloc(sizeof(header) + size);
+    if (!file_data) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    amsdos_new_header(&header, file_name, size, entry_addr, exec_addr);
+    memcpy(file_data, &header, sizeof(header));
+    if (size) {
+        memcpy(file_data + sizeof(header), data, size);
+    }
+
+    result = cpm_write_file(fp, file_name, file_data, sizeof(header) + size);
+    free(file_data);
+
+    return result < 0 ? -1 : 0;
+}
+
+struct extract_s {
+    cpm_sink_fn sink;
+    void *ctx;
+    long remaining;                     /* -1 without an AMSDOS header */
+};
+
+static
+int extract_sink(void *ctx, u8 *buf, size_t len)
+{
+    struct extract_s *extract = (struct extract_s *) ctx;
+
+    if (extract->remaining >= 0) {
+        if ((long) len > extract->remaining) {
+            len = extract->remaining;
+        }
+        extract->remaining -= len;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    return extract->sink(extract->ctx, buf, len);
+}
+
+int cpm_extract_sink(FILE *fp, const char *file_name, cpm_sink_fn sink, void *ctx)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    struct amsdos_header_s header;
+    struct extract_s extract;
+    int num_diren;
+    int first;
+
+    assert(fp);
+    assert(file_name);
+    assert(sink);
+
+    num_diren = cpm_read_dir(fp, table);
+
+    first = cpm_find_file(table, num_diren, file_name);
+    if (first < 0) {
+        return -1;
+    }
+
+    extract.sink      = sink;
+    extract.ctx       = ctx;
+    extract.remaining = -1;
+
+    if (cpm_read_amsdos_header(fp, &table[first], &header)) {
+        extract.remaining = amsdos_get_length(&header);
+    }
+
+    cpm_read_file(fp, table, num_diren, first, extract_sink, &extract);
+
+    return 0;
+}
+
+struct extract_buffer_s {
+    u8 *dest;
+    long dest_size;
+    long length;
+};
+
+static
+int extract_buffer_sink(void *ctx, u8 *buf, size_t len)
+{
+    struct extract_buffer_s *extract = (struct extract_buffer_s *) ctx;
+
+    if (extract->length < extract->dest_size) {
+        long n = extract->dest_size - extract->length;
+
+        memcpy(extract->dest + extract->length, buf, (long) len < n ? (long) len : n);
+    }
+
+    extract->length += len;
+
+    return 0;
+}
+
+long cpm_extract_buffer(FILE *fp, const char *file_name, u8 *dest, long dest_size)
+{
+    struct extract_buffer_s extract;
+
+    assert(dest || dest_size == 0);
+
+    extract.dest      = dest;
+    extract.dest_size = dest_size;
+    extract.length    = 0;
+
+    if (cpm_extract_sink(fp, file_name, extract_buffer_sink, &extract) != 0) {
+        return -1;
+    }
+
+    return extract.length;
+}
+
+int cpm_file_ranges(FILE *fp, const char *file_name, int raw, struct cpm_range_s *ranges, int max_ranges)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    struct amsdos_header_s header;
+    int num_ranges;
+    int num_diren;
+    int skip;
+    int first;
+    int extent;
+    int index;
+
+    assert(fp);
+    assert(file_name);
+    assert(ranges);
+
+    num_diren = cpm_read_dir(fp, table);
+
+    first = cpm_find_file(table, num_diren, file_name);
+    if (first < 0) {
+        return -1;
+    }
+
+    /* The header record still counts towards RC */
+    skip       = !raw && cpm_read_amsdos_header(fp, &table[first], &header) ? g_record_size : 0;
+    num_ranges = 0;
+
+    for (extent = 0; (index = cpm_find_extent(table, num_diren, &table[first], extent)) >= 0; extent++) {
+        struct cpm_diren_s *dir = &table[index];
+        long remaining;
+        unsigned k;
+
+        remaining = (long) dir->RC * g_record_size;
+
+        for (k = 0; k < sizeof(dir->AL) && dir->AL[k] && remaining > 0; k++) {
+            int track;
+            int sector;
+            int s;
+
+            if (dir->AL[k] > DPB->dsm) {
+                return -1;
+            }
+
+            convert_AL_to_track_sector(dir->AL[k], &track, &sector);
+
+            for (s = 0; s < g_num_sector_per_block && remaining > 0; s++) {
+                long offset;
+                long length;
+
+                if (track >= NUM_TRACK) {
+                    return -1;
+                }
+
+                offset     = logical_sector_offset(track, sector) + skip;
+                length     = (remaining < SIZ_SECTOR ? remaining : SIZ_SECTOR) - skip;
+                remaining -= length + skip;
+                skip       = 0;
+
+                add_offset_to_track_sector(&track, &sector, 1);
+
+                if (length <= 0) {
+                    continue;
+                }
+
+                if (   num_ranges > 0
+                    && ranges[num_ranges - 1].offset + ranges[num_ranges - 1].length == offset) {
+                    ranges[num_ranges - 1].length += length;
+                    continue;
+                }
+
+                if (num_ranges == max_ranges) {
+                    return -1;
+                }
+
+                ranges[num_ranges].offset = offset;
+                ranges[num_ranges].length = length;
+                num_ranges++;
+            }
+        }
+    }
+
+    return num_ranges;
+}
+
+/* Writes len bytes at offset of the file data, after the AMSDOS header, or
+   at its end when offset is CPM_END_OF_FILE. Only the sectors in the range
+   are written. A file that grows fills its last block first, then gets new
+   blocks in its last extent and new extents after that, and the RC of its
+   extents and the length and checksum of its AMSDOS header are updated.
+   Nothing is written unless the whole range fits. */
+int cpm_write_at(FILE *fp, const char *file_name, long offset, const u8 *data, long len)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    struct amsdos_header_s header;
+    int slots[CPM_MAX_DIREN];
+    int blocks[256];
+    u8 dirty[CPM_MAX_DIREN];
+    int num_diren;
+    int first;
+    int num_slots;
+    int num_old_blocks;
+    int num_old_records;
+    int num_blocks;
+    int num_records;
+    int num_extents;
+    int blocks_per_extent;
+    int records_per_extent;
+    int has_header;
+    int extent;
+    int index;
+    long data_start;
+    long old_end;
+    long length;
+    long new_length;
+    long pos;
+    long stop;
+    int i;
+
+    assert(fp);
+    assert(file_name);
+    assert(data || len == 0);
+
+    num_diren = cpm_read_dir(fp, table);
+
+    first = cpm_find_file(table, num_diren, file_name);
+    if (first < 0) {
+        fprintf(stderr, "File %s not found.\n", file_name);
+        return -1;
+    }
+
+    blocks_per_extent  = sizeof(table->AL);
+    records_per_extent = blocks_per_extent * g_num_record_per_block;
+
+    num_slots      = 0;
+    num_old_blocks = 0;
+
+    for (extent = 0; (index = cpm_find_extent(table, num_diren, &table[first], extent)) >= 0; extent++) {
+        int k;
+
+        slots[num_slots++] = index;
+
+        for (k = 0; k < blocks_per_extent && table[index].AL[k]; k++) {
+            if (   table[index].AL[k] > DPB->dsm
+                || num_old_blocks == (int) (sizeof(blocks) / sizeof(blocks[0]))) {
+                fprintf(stderr, "File %s has a broken allocation table.\n", file_name);
+                return -1;
+            }
+
+            blocks[num_old_blocks++] = table[index].AL[k];
+        }
+    }
+
+    num_old_records = cpm_file_records(table, num_diren, first);
+    old_end         = (long) num_old_records * g_record_size;
+    has_header      = cpm_read_amsdos_header(fp, &table[first], &header);
+    data_start      = has_header ? g_record_size : 0;
+    length          = old_end - data_start;
+
+    if (has_header && amsdos_get_length(&header) < length) {
+        length = amsdos_get_length(&header);
+    }
+
+    if (offset == CPM_END_OF_FILE) {
+        offset = length;
+    }
+
+    if (offset < 0 || offset > length) {
+        fprintf(stderr, "Offset %ld is past the end of %s, which has %ld bytes.\n",
+                offset, file_name, length);
+        return -1;
+    }
+
+    new_length  = offset + len > length ? offset + len : length;
+    num_records = (data_start + new_length + g_record_size - 1) / g_record_size;
+    if (num_records < num_old_records) {
+        num_records = num_old_records;
+    }
+
+    num_blocks = (num_records + g_num_record_per_block - 1) / g_num_record_per_block;
+    if (num_blocks < num_old_blocks) {
+        num_blocks = num_old_blocks;
+    }
+
+    if (num_blocks > (int) (sizeof(blocks) / sizeof(blocks[0]))) {
+        fprintf(stderr, "No space left on disk.\n");
+        return -1;
+    }
+
+    num_extents = (num_blocks + blocks_per_extent - 1) / blocks_per_extent;
+
+    if (num_extents > num_slots) {
+        int num_free_slots = 0;
+
+        for (i = 0; i < num_diren; i++) {
+            if (table[i].user_number == CPM_NO_FILE) {
+                num_free_slots++;
+            }
+        }
+
+        if (num_extents - num_slots > num_free_slots) {
+            fprintf(stderr, "No empty slot left in directory entry table\n");
+            return -1;
+        }
+    }
+
+    if (num_blocks > num_old_blocks) {
+        init_alloc_table(fp);
+
+        for (i = num_old_blocks; i < num_blocks; i++) {
+            blocks[i] = get_free_alloc_index(g_base_track + g_diren_table_index);
+
+            if (blocks[i] < 0) {
+                fprintf(stderr, "No space left on disk.\n");
+                return -1;
+            }
+        }
+    }
+
+    pos  = data_start + offset;
+    stop = data_start + offset + len;
+
+    while (pos < stop) {
+        u8 buffer[SIZ_SECTOR];
+        long sector_start;
+        int block_index;
+        int track;
+        int sector;
+        long n;
+
+        sector_start = pos / SIZ_SECTOR * SIZ_SECTOR;
+        block_index  = sector_start / g_block_size;
+
+        convert_AL_to_track_sector((u8) blocks[block_index], &track, &sector);
+        add_offset_to_track_sector(&track, &sector, (sector_start % g_block_size) / SIZ_SECTOR);
+
+        /* Whatever was past the last record is padding */
+        if (block_index < num_old_blocks) {
+            read_logical_sector(fp, track, sector, buffer);
+        }
+
+        if (sector_start + SIZ_SECTOR > old_end) {
+            long keep = old_end > sector_start ? old_end - sector_start : 0;
+
+            memset(buffer + keep, CPM_NO_FILE, SIZ_SECTOR - keep);
+        }
+
+        n = SIZ_SECTOR - (pos - sector_start);
+        if (n > stop - pos) {
+            n = stop - pos;
+        }
+
+        memcpy(buffer + (pos - sector_start), data + (pos - data_start - offset), n);
+        write_logical_sector(fp, track, sector, buffer);
+
+        pos += n;
+    }
+
+    if (has_header && new_length != length) {
+        u8 buffer[SIZ_SECTOR];
+        int track;
+        int sector;
+
+        convert_AL_to_track_sector((u8) blocks[0], &track, &sector);
+        read_logical_sector(fp, track, sector, buffer);
+        amsdos_set_length(&header, new_length);
+        memcpy(buffer, &header, sizeof(header));
+        write_logical_sector(fp, track, sector, buffer);
+    }
+
+    memset(dirty, 0, sizeof(dirty));
+
+    for (i = 0; i < num_extents; i++) {
+        struct cpm_diren_s dir;
+        int slot;
+        int k;
+
+        if (i < num_slots) {
+            slot = slots[i];
+        } else {
+            for (slot = 0; table[slot].user_number != CPM_NO_FILE; slot++) {
+            }
+        }
+
+        memcpy(&dir, &table[i < num_slots ? slot : first], sizeof(dir));
+        dir.EX = i & 0x1f;
+        dir.S2 = i >> 5;
+        dir.RC = num_records - i * records_per_extent > records_per_extent
+            ? records_per_extent
+            : num_records - i * records_per_extent;
+        memset(dir.AL, 0, sizeof(dir.AL));
+
+        for (k = 0; k < blocks_per_extent && i * blocks_per_extent + k < num_blocks; k++) {
+            dir.AL[k] = blocks[i * blocks_per_extent + k];
+        }
+
+        if (memcmp(&table[slot], &dir, sizeof(dir)) != 0) {
+            memcpy(&table[slot], &dir, sizeof(dir));
+            dirty[slot / g_num_file_per_sector] = 1;
+        }
+    }
+
+    for (i = 0; i < g_num_sector_in_diren_table; i++) {
+        if (dirty[i]) {
+            write_logical_sector(fp, g_base_track, i, (u8 *) &table[i * g_num_file_per_sector]);
+        }
+    }
+
+    return 0;
+}
+
+void cpm_new(FILE *fp)
+{
+    struct cpcemu_disc_info_s disk_info;
+    int track;
+    int sector;
+    u8 skew_table[] = { 0, 5, 1, 6, 2, 7, 3, 8, 4 }; /* ?? */
+
+    memcpy(g_sector_skew_table, skew_table, sizeof(skew_table));
+
+    init_disk_info(&disk_info, CPCEMU_HEADER_STD, CPCEMU_CREATOR, NUM_TRACK, 1, SIZ_TRACK);
+    write_disc_info(fp, &disk_info);
+
+    for (track = 0; track < NUM_TRACK; track++) {
+        struct cpcemu_track_info_s track_info;
+
+        init_track_info(&track_info, CPCEMU_TRACK_HEADER, track, 0);
+        write_track_info(fp, track, &track_info);
+
+        for (sector = 0; sector < NUM_SECTOR; sector++) {
+            u8 buffer[SIZ_SECTOR];
+
+            memset(buffer, CPM_NO_FILE, SIZ_SECTOR);
+            write_logical_sector(fp, track, sector, buffer);
+        }
+    }
+}
+
+
+int cpm_init(FILE *fp)
+{
+    int is_system_disk;
+
+    is_system_disk = check_disk_type(fp, CPM_SYSTEM_DISK);
+
+    if (is_system_disk) {
+        DPB = &DPB_CPC_system;
+    } else if (check_disk_type(fp, CPM_DATA_DISK)) {
+        DPB = &DPB_CPC_data;
+    } else {
+        return -1;
+    }
+
+    g_base_track                 = check_disk_type(fp, CPM_SYSTEM_DISK) ? 2 : 0;
+    g_block_size                 = g_record_size << DPB->bsh;
+    g_num_sector_per_block       = g_block_size / SIZ_SECTOR;
+    g_diren_table_index          = ((DPB->drm + 1) * g_num_diren) / g_block_size;
+    g_num_record_per_sector      = SIZ_SECTOR / g_record_size;
+    g_num_record_per_block       = g_block_size / g_record_size;
+    g_num_sector_in_diren_table  = ((DPB->drm + 1) * g_num_diren) / SIZ_SECTOR;
+    g_num_file_per_sector        = SIZ_SECTOR / g_num_diren;
+
+#if 0
+    printf("g_base_track                 = %d\n", g_base_track);
+    printf("g_block_size                 = %d\n", g_block_size);
+    printf("g_num_sector_per_block       = %d\n", g_num_sector_per_block);
+    printf("g_diren_table_index          = %d\n", g_diren_table_index);
+    printf("g_num_record_per_sector      = %d\n", g_num_record_per_sector);
+    printf("g_num_record_per_block       = %d\n", g_num_record_per_block);
+    printf("g_num_sector_in_diren_table  = %d\n", g_num_sector_in_diren_table);
+    printf("g_num_file_per_sector        = %d\n", g_num_file_per_sector);
+#endif
+
+    init_sector_skew_table(fp);
+
+    return 0;
 }
@@ -6,6 +6,8 @@
 #include "types.h"
 #include "cpcemu.h"
 
+struct amsdos_header_s;
+
 struct cpm_diren_s {
     u8 user_number;
     u8 file_name[8];
@@ -22,6 +24,19 @@ struct cpm_diren_s {
 #define CPM_DATA_DISK           0xC1
 #define CPM_IBM_DISK            0x01
 
+#define CPM_MAX_DIREN           64
+
+/* Offset for cpm_write_at that appends to the file */
+#define CPM_END_OF_FILE         -1
+
+/* Attribute bits kept in the high bits of the extension */
+#define CPM_ATTR_READ_ONLY      0x01
+#define CPM_ATTR_SYSTEM         0x02
+#define CPM_ATTR_ARCHIVE        0x04
+
+/* Receives file records in order. Return -1 to stop early */
+typedef int (*cpm_sink_fn)(void *ctx, u8 *buf, size_t len);
+
 /* Disc Parameter Block, taken from https://www.seasip.info/Cpm/amsform.html */
 struct DPB_s {
     u16 spt;   /* Number of 128-byte records per track              */
@@ -41,15 +56,80 @@ struct DPB_s {
                /* 1 => 256-byte sectors, 3 => 512-byte sectors...   */
 };
 
+extern THREAD_LOCAL int g_base_track;
+extern THREAD_LOCAL int g_block_size;
+extern THREAD_LOCAL int g_num_sector_per_block;
+
 int cpm_find_empty_diren_index(FILE *fp);
 void cpm_write_diren(FILE *fp, struct cpm_diren_s *dir, int diren_index);
 void cpm_insert(FILE *fp, const char *file_name, u16 entry_addr, u16 exec_addr, int amsdos);
 int cpm_del(FILE *fp, const char *file_name);
 void cpm_dir(FILE *fp);
-void cpm_info(FILE *fp, const char *file_name, int tracks_only);
+/* Prints the directory entries, sectors and AMSDOS header of a file to out.
+   Returns -1 if the file is not found. */
+int cpm_info(FILE *fp, FILE *out, const char *file_name, int tracks_only);
 void cpm_dump(FILE *fp, const char *file_name, int to_file, int text);
+int cpm_read_dir(FILE *fp, struct cpm_diren_s *dest);
+int cpm_find_extent(struct cpm_diren_s *table, int num_diren, struct cpm_diren_s *file, int extent);
+int cpm_find_file(struct cpm_diren_s *table, int num_diren, const char *file_name);
+int cpm_file_records(struct cpm_diren_s *table, int num_diren, int first);
+int cpm_read_file(FILE *fp, struct cpm_diren_s *table, int num_diren, int first,
+                  cpm_sink_fn sink, void *ctx);
+/* Like cpm_read_file, but passes every record, AMSDOS header included */
+int cpm_read_records(FILE *fp, struct cpm_diren_s *table, int num_diren, int first,
+                     cpm_sink_fn sink, void *ctx);
+long cpm_read_at(FILE *fp, struct cpm_diren_s *table, int num_diren, int first,
+                 long offset, u8 *dest, long len);
+int cpm_read(FILE *fp, const char *file_name, long offset, long len);
+void convert_AL_to_track_sector(u8 AL, int *track, int *sector);
+void add_offset_to_track_sector(int *track, int *sector, int offset);
+int cpm_num_blocks(void);
+int cpm_read_amsdos_header(FILE *fp, struct cpm_diren_s *dir, struct amsdos_header_s *dest);
+u8 cpm_get_attributes(struct cpm_diren_s *dir);
+int cpm_match_filename(const char *pattern, const char *full_file_name);
+int cpm_valid_filename(const char *full_file_name);
+int cpm_write_file(FILE *fp, const char *file_name, const u8 *data, long size);
+int cpm_write_entry(FILE *fp, const struct cpm_diren_s *entry, const u8 *data, long size);
+
+/* Blocks and directory entries that cpm_write_entry takes for size bytes,
+   from the DPB of the current disk. Returns the number of records. */
+int cpm_file_cost(long size, int *num_blocks, int *num_extents);
+
+/* Blocks and directory entries an empty disk has room for */
+void cpm_capacity(int *num_blocks, int *num_diren);
+
+/* Tracks, sectors per track and sector size the DPB describes, reserved
+   tracks included */
+void cpm_geometry(int *num_tracks, int *num_sectors, int *sector_size);
+
+int cpm_write_at(FILE *fp, const char *file_name, long offset, const u8 *data, long len);
+
+/* In-memory counterparts of insert and extract. cpm_insert_buffer stores
+   data as file_name in user 0, with an AMSDOS header made from the load and
+   exec addresses when amsdos is set, replacing a file of the same name.
+   Extraction passes the file data to sink, or copies up to dest_size bytes
+   of it into dest, without the AMSDOS header and cut to the length the
+   header gives. cpm_extract_buffer returns the full data length, so it can
+   be called with no buffer to size one. Both return -1 on errors. */
+int cpm_insert_buffer(FILE *fp, const char *file_name, const u8 *data, long size,
+                      u16 entry_addr, u16 exec_addr, int amsdos);
+int cpm_extract_sink(FILE *fp, const char *file_name, cpm_sink_fn sink, void *ctx);
+long cpm_extract_buffer(FILE *fp, const char *file_name, u8 *dest, long dest_size);
+
+/* A byte range of the image file */
+struct cpm_range_s {
+    long offset;
+    long length;
+};
+
+/* Fills ranges with where the records of file_name lie in the image file, in
+   file order, without the AMSDOS header record unless raw is set. Sectors
+   that follow each other in the file and in the image share one range.
+   Returns the number of ranges, or -1 if the file is not found or damaged. */
+int cpm_file_ranges(FILE *fp, const char *file_name, int raw, struct cpm_range_s *ranges, int max_ranges);
 void cpm_new(FILE *fp);
-void cpm_init(FILE *fp);
+int cpm_init(FILE *fp);
+void normalize_filename(char *full_file_name, struct cpm_diren_s *dir);
 void denormalize_filename(const char *full_file_name, struct cpm_diren_s *dest);
 
 #endif
@@ -0,0 +1,546 @@
+#include "diff.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "shadow.h"
+
+#define MAX_CHANGED_FILES CPM_MAX_DIREN
+
+struct image_s {
+    u8 *data;
+    long size;
+    char owners[NUM_TRACK][NUM_SECTOR][13]; /* By physical sector */
+};
+
+/* Records which file every physical sector of the image belongs to, so that
+   changed sectors can be reported by file name */
+static
+void map_owners(FILE *fp, struct image_s *image)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    int num_diren;
+    int num_dir_sectors;
+    int i;
+
+    num_diren       = cpm_read_dir(fp, table);
+    num_dir_sectors = num_diren * sizeof(struct cpm_diren_s) / SIZ_SECTOR;
+
+    for (i = 0; i < num_dir_sectors; i++) {
+        strcpy(image->owners[g_base_track][g_sector_skew_table[i]], "(directory)");
+    }
+
+    for (i = 0; i < num_diren; i++) {
+        struct cpm_diren_s *dir = &table[i];
+        char full_file_name[13];
+        int k;
+
+        if (dir->user_number > 15) {
+            continue;
+        }
+
+        normalize_filename(full_file_name, dir);
+
+        for (k = 0; k < 16 && dir->AL[k]; k++) {
+            int track;
+            int sector;
+            int s;
+
+            if (dir->AL[k] >= cpm_num_blocks()) {
+                break;
+            }
+
+            convert_AL_to_track_sector(dir->AL[k], &track, &sector);
+
+            for (s = 0; s < g_num_sector_per_block && track < NUM_TRACK; s++) {
+                char *owner = image->owners[track][g_sector_skew_table[sector]];
+
+                if (!owner[0]) {
+                    strcpy(owner, full_file_name);
+                }
+
+                add_offset_to_track_sector(&track, &sector, 1);
+            }
+        }
+    }
+}
+
+static
+u8 *load_file(const char *file_name, long *size)
+{
+    FILE *fp;
+    u8 *data;
+
+    fp = fopen(file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s.\n", file_name);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    data = (u8 *) malloc(*size + 1);
+    if (!data || fread(data, 1, *size, fp) != (size_t) *size) {
+        fprintf(stderr, "Failed to read file %s.\n", file_name);
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+static
+int load_image(const char *file_name, struct image_s *image)
+{
+    FILE *fp;
+
+    memset(image, 0, sizeof(*image));
+
+    image->data = load_file(file_name, &image->size);
+    if (!image->data) {
+        return -1;
+    }
+
+    fp = fopen(file_name, "rb");
+    if (!fp) {
+        return 0;
+    }
+
+    if (check_disc_info(fp) && cpm_init(fp) == 0) {
+        map_owners(fp, image);
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+/* Units are the disc info, then every track info and sector of the tracks,
+   then sector sized slices of anything trailing */
+static
+long unit_size(long offset)
+{
+    if (offset < CPCEMU_INFO_OFFSET) {
+        return CPCEMU_INFO_OFFSET - offset;
+    }
+
+    if (offset < CPCEMU_INFO_OFFSET + SIZ_TOTAL) {
+        long in_track = (offset - CPCEMU_INFO_OFFSET) % SIZ_TRACK;
+
+        if (in_track < CPCEMU_TRACK_OFFSET) {
+            return CPCEMU_TRACK_OFFSET - in_track;
+        }
+
+        return SIZ_SECTOR - (in_track - CPCEMU_TRACK_OFFSET) % SIZ_SECTOR;
+    }
+
+    return SIZ_SECTOR;
+}
+
+static
+int region_differs(struct image_s *a, struct image_s *b, long offset, long len)
+{
+    int a_has = offset + len <= a->size;
+    int b_has = offset + len <= b->size;
+
+    if (!a_has || !b_has) {
+        return a_has != b_has || a->size != b->size;
+    }
+
+    return memcmp(a->data + offset, b->data + offset, len) != 0;
+}
+
+static
+void add_changed_file(char changed[MAX_CHANGED_FILES][13], int *num_changed, const char *file_name)
+{
+    int i;
+
+    if (!file_name[0] || file_name[0] == '(') {
+        return;
+    }
+
+    for (i = 0; i < *num_changed; i++) {
+        if (strcmp(changed[i], file_name) == 0) {
+            return;
+        }
+    }
+
+    if (*num_changed < MAX_CHANGED_FILES) {
+        strcpy(changed[(*num_changed)++], file_name);
+    }
+}
+
+static
+int get_sector_id(struct image_s *image, int track, int sector)
+{
+    long offset = CPCEMU_INFO_OFFSET + track * SIZ_TRACK;
+    struct cpcemu_track_info_s *track_info;
+
+    if (offset + (long) sizeof(*track_info) > image->size) {
+        return -1;
+    }
+
+    track_info = (struct cpcemu_track_info_s *) (image->data + offset);
+
+    return track_info->sector_info_table[sector].sector_id;
+}
+
+int diff_images(const char *source_file_name, const char *target_file_name)
+{
+    struct image_s *a;
+    struct image_s *b;
+    char changed[MAX_CHANGED_FILES][13];
+    int num_changed;
+    int num_sectors;
+    int num_infos;
+    int differs;
+    long size;
+    long offset;
+    int track;
+    int i;
+
+    assert(source_file_name);
+    assert(target_file_name);
+
+    a = (struct image_s *) malloc(sizeof(struct image_s));
+    b = (struct image_s *) malloc(sizeof(struct image_s));
+
+    if (!a || !b || load_image(source_file_name, a) != 0) {
+        free(a);
+        free(b);
+        return -1;
+    }
+
+    if (load_image(target_file_name, b) != 0) {
+        free(a->data);
+        free(a);
+        free(b);
+        return -1;
+    }
+
+    num_changed = 0;
+    num_sectors = 0;
+    num_infos   = 0;
+    size        = a->size > b->size ? a->size : b->size;
+
+    if (a->size != b->size) {
+        printf("Image sizes differ: %ld and %ld bytes.\n", a->size, b->size);
+    }
+
+    if (region_differs(a, b, 0, CPCEMU_INFO_OFFSET)) {
+        printf("Disc info differs\n");
+        num_infos++;
+    }
+
+    for (track = 0; track < NUM_TRACK; track++) {
+        long track_offset = CPCEMU_INFO_OFFSET + track * SIZ_TRACK;
+        int sector;
+
+        if (track_offset >= size) {
+            break;
+        }
+
+        /* Only descend into sectors when the track hashes differ */
+        if (track_offset + SIZ_TRACK <= a->size && track_offset + SIZ_TRACK <= b->size) {
+            u8 hash_a[HASH_SIZE];
+            u8 hash_b[HASH_SIZE];
+
+            hash_buffer(a->data + track_offset, SIZ_TRACK, hash_a);
+            hash_buffer(b->data + track_offset, SIZ_TRACK, hash_b);
+
+            if (memcmp(hash_a, hash_b, HASH_SIZE) == 0) {
+                continue;
+            }
+        }
+
+        if (region_differs(a, b, track_offset, CPCEMU_TRACK_OFFSET)) {
+            printf("Track %.2d info differs\n", track);
+            num_infos++;
+        }
+
+        for (sector = 0; sector < NUM_SECTOR; sector++) {
+            long sector_offset = track_offset + CPCEMU_TRACK_OFFSET + sector * SIZ_SECTOR;
+            const char *owner;
+            int sector_id;
+
+            if (!region_differs(a, b, sector_offset, SIZ_SECTOR)) {
+                continue;
+            }
+
+            owner = a->owners[track][sector][0] ? a->owners[track][sector] : b->owners[track][sector];
+
+            sector_id = get_sector_id(a, track, sector);
+            if (sector_id < 0) {
+                sector_id = get_sector_id(b, track, sector);
+            }
+
+            printf("Track %.2d sector 0x%.2x differs", track, sector_id & 0xff);
+            if (owner[0]) {
+                printf(" %s", owner);
+            }
+            printf("\n");
+
+            add_changed_file(changed, &num_changed, a->owners[track][sector]);
+            add_changed_file(changed, &num_changed, b->owners[track][sector]);
+            num_sectors++;
+        }
+    }
+
+    for (offset = CPCEMU_INFO_OFFSET + SIZ_TOTAL; offset < size; offset += SIZ_SECTOR) {
+        if (region_differs(a, b, offset, SIZ_SECTOR)) {
+            printf("Bytes at offset 0x%.6lx differ\n", offset);
+            num_sectors++;
+        }
+    }
+
+    if (num_sectors || num_infos) {
+        printf("%d sectors and %d info blocks differ.\n", num_sectors, num_infos);
+    }
+
+    if (num_changed) {
+        printf("Changed files:");
+        for (i = 0; i < num_changed; i++) {
+            printf(" %s", changed[i]);
+        }
+        printf("\n");
+    }
+
+    differs = num_sectors || num_infos || a->size != b->size;
+
+    free(a->data);
+    free(b->data);
+    free(a);
+    free(b);
+
+    return differs;
+}
+
+int diff_make_patch(const char *source_file_name, const char *target_file_name,
+                    const char *patch_file_name)
+{
+    struct patch_header_s header;
+    struct patch_record_s record;
+    u8 *source;
+    u8 *target;
+    long source_size;
+    long target_size;
+    long offset;
+    long patch_bytes;
+    FILE *fp;
+
+    assert(source_file_name);
+    assert(target_file_name);
+    assert(patch_file_name);
+
+    source = load_file(source_file_name, &source_size);
+    if (!source) {
+        return -1;
+    }
+
+    target = load_file(target_file_name, &target_size);
+    if (!target) {
+        free(source);
+        return -1;
+    }
+
+    fp = fopen(patch_file_name, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", patch_file_name);
+        free(source);
+        free(target);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PATCH_MAGIC, sizeof(PATCH_MAGIC));
+    header.version     = PATCH_VERSION;
+    header.source_size = source_size;
+    header.target_size = target_size;
+    hash_buffer(source, source_size, header.source_hash);
+    hash_buffer(target, target_size, header.target_hash);
+
+    fwrite(&header, 1, sizeof(header), fp);
+
+    memset(&record, 0, sizeof(record));
+    patch_bytes = 0;
+
+    for (offset = 0; offset < target_size; ) {
+        long len = unit_size(offset);
+        int differs;
+
+        if (offset + len > target_size) {
+            len = target_size - offset;
+        }
+
+        differs = offset + len > source_size
+            || memcmp(source + offset, target + offset, len) != 0;
+
+        if (differs) {
+            if (record.size && record.offset + record.size == (u32) offset) {
+                record.size += len;
+            } else {
+                if (record.size) {
+                    fwrite(&record, 1, sizeof(record), fp);
+                    fwrite(target + record.offset, 1, record.size, fp);
+                    header.num_records++;
+                }
+
+                record.offset = offset;
+                record.size   = len;
+            }
+
+            patch_bytes += len;
+        }
+
+        offset += len;
+    }
+
+    if (record.size) {
+        fwrite(&record, 1, sizeof(record), fp);
+        fwrite(target + record.offset, 1, record.size, fp);
+        header.num_records++;
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, 1, sizeof(header), fp);
+
+    free(source);
+    free(target);
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Error writing to file %s.\n", patch_file_name);
+        return -1;
+    }
+
+    printf("Wrote %lu records (%ld bytes) into %s.\n",
+           (unsigned long) header.num_records, patch_bytes, patch_file_name);
+
+    return 0;
+}
+
+int diff_apply_patch(const char *image_file_name, const char *patch_file_name)
+{
+    struct patch_header_s header;
+    u8 hash[HASH_SIZE];
+    u8 *patch;
+    u8 *image;
+    u8 *target;
+    long patch_size;
+    long image_size;
+    long offset;
+    u32 i;
+    int result;
+
+    assert(image_file_name);
+    assert(patch_file_name);
+
+    patch = load_file(patch_file_name, &patch_size);
+    if (!patch) {
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+
+    if (patch_size >= (long) sizeof(header)) {
+        memcpy(&header, patch, sizeof(header));
+    }
+
+    if (   patch_size < (long) sizeof(header)
+        || memcmp(header.magic, PATCH_MAGIC, sizeof(PATCH_MAGIC)) != 0
+        || header.version != PATCH_VERSION) {
+        fprintf(stderr, "%s is not a valid patch.\n", patch_file_name);
+        free(patch);
+        return -1;
+    }
+
+    image = load_file(image_file_name, &image_size);
+    if (!image) {
+        free(patch);
+        return -1;
+    }
+
+    hash_buffer(image, image_size, hash);
+
+    if (   (u32) image_size == header.target_size
+        && memcmp(hash, header.target_hash, HASH_SIZE) == 0) {
+        printf("Patch is already applied to %s.\n", image_file_name);
+        free(image);
+        free(patch);
+        return 0;
+    }
+
+    if (   (u32) image_size != header.source_size
+        || memcmp(hash, header.source_hash, HASH_SIZE) != 0) {
+        fprintf(stderr, "%s does not match the source image of the patch.\n", image_file_name);
+        free(image);
+        free(patch);
+        return -1;
+    }
+
+    target = (u8 *) calloc(header.target_size + 1, 1);
+    if (!target) {
+        fprintf(stderr, "Out of memory.\n");
+        free(image);
+        free(patch);
+        return -1;
+    }
+
+    memcpy(target, image, header.source_size < header.target_size ? header.source_size : header.target_size);
+
+    /* Build the whole target in memory and check it before touching the file */
+    result = 0;
+    offset = sizeof(header);
+
+    for (i = 0; i < header.num_records && result == 0; i++) {
+        struct patch_record_s record;
+
+        if (offset + (long) sizeof(record) > patch_size) {
+            result = -1;
+            break;
+        }
+
+        memcpy(&record, patch + offset, sizeof(record));
+        offset += sizeof(record);
+
+        if (   offset + (long) record.size > patch_size
+            || record.size > header.target_size
+            || record.offset > header.target_size - record.size) {
+            result = -1;
+            break;
+        }
+
+        memcpy(target + record.offset, patch + offset, record.size);
+        offset += record.size;
+    }
+
+    hash_buffer(target, header.target_size, hash);
+
+    if (result != 0 || memcmp(hash, header.target_hash, HASH_SIZE) != 0) {
+        fprintf(stderr, "%s is corrupt.\n", patch_file_name);
+        free(target);
+        free(image);
+        free(patch);
+        return -1;
+    }
+
+    if (shadow_write_file(image_file_name, target, header.target_size) != 0) {
+        result = -1;
+    } else {
+        printf("Applied %lu records to %s.\n", (unsigned long) header.num_records, image_file_name);
+    }
+
+    free(target);
+    free(image);
+    free(patch);
+
+    return result;
+}
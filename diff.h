@@ -0,0 +1,36 @@
+#ifndef DIFF_H_
+#define DIFF_H_
+
+#include "types.h"
+#include "hash.h"
+
+#define PATCH_MAGIC             "SCPCPAT"
+#define PATCH_VERSION           1
+
+/* A patch is a header followed by num_records patch_record_s, each directly
+   followed by its data. Records cover whole disc info, track info and sector
+   units of the target image, adjacent units merged. */
+#pragma pack(push)
+#pragma pack(1)
+struct patch_header_s {
+    char magic[8];                      /* PATCH_MAGIC */
+    u32 version;
+    u32 source_size;
+    u32 target_size;
+    u32 num_records;
+    u8 source_hash[HASH_SIZE];
+    u8 target_hash[HASH_SIZE];
+};
+
+struct patch_record_s {
+    u32 offset;
+    u32 size;
+};
+#pragma pack(pop)
+
+int diff_images(const char *source_file_name, const char *target_file_name);
+int diff_make_patch(const char *source_file_name, const char *target_file_name,
+                    const char *patch_file_name);
+int diff_apply_patch(const char *image_file_name, const char *patch_file_name);
+
+#endif
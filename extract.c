@@ -0,0 +1,164 @@
+#if defined (__linux__)
+#define _GNU_SOURCE
+#endif
+#define _POSIX_C_SOURCE 200809L
+
+#include "extract.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpcemu.h"
+#include "cpm.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_PWRITE
+#endif
+
+#if defined (__linux__)
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+#define MAX_RANGES      (NUM_TRACK * NUM_SECTOR)
+
+#if defined (HAVE_PWRITE)
+static
+int copy_range(int in_fd, long in_offset, int out_fd, long out_offset, long length)
+{
+    u8 buffer[NUM_SECTOR * SIZ_SECTOR];
+
+#if defined (HAVE_COPY_FILE_RANGE)
+    {
+        loff_t in_pos = in_offset;
+        loff_t out_pos = out_offset;
+
+        while (length > 0) {
+            ssize_t n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, length, 0);
+
+            if (n <= 0) {
+                break;
+            }
+
+            length -= n;
+        }
+
+        in_offset  = in_pos;
+        out_offset = out_pos;
+    }
+#endif
+
+    /* Whatever the kernel did not copy goes through a buffer */
+    while (length > 0) {
+        long chunk = length < (long) sizeof(buffer) ? length : (long) sizeof(buffer);
+
+        if (   pread(in_fd, buffer, chunk, in_offset) != chunk
+            || pwrite(out_fd, buffer, chunk, out_offset) != chunk) {
+            return -1;
+        }
+
+        in_offset  += chunk;
+        out_offset += chunk;
+        length     -= chunk;
+    }
+
+    return 0;
+}
+#endif
+
+int extract_zero_copy(const char *image_name, FILE *fp, const char *file_name)
+{
+#if !defined (HAVE_PWRITE)
+    (void) image_name;
+    (void) fp;
+    (void) file_name;
+
+    return -1;
+#else
+    struct cpm_range_s *ranges;
+    char out_name[13];
+    long out_offset;
+    int num_ranges;
+    int result;
+    int in_fd;
+    int out_fd;
+    int i;
+
+    assert(image_name);
+    assert(fp);
+    assert(file_name);
+
+    if (strlen(file_name) >= sizeof(out_name)) {
+        return -1;
+    }
+
+    ranges = (struct cpm_range_s *) malloc(MAX_RANGES * sizeof(*ranges));
+    if (!ranges) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    num_ranges = cpm_file_ranges(fp, file_name, 0, ranges, MAX_RANGES);
+
+    in_fd = num_ranges >= 0 ? open(image_name, O_RDONLY) : -1;
+    if (in_fd < 0) {
+        free(ranges);
+        return -1;
+    }
+
+    /* Named as listed, like cpm_dump does */
+    for (i = 0; file_name[i]; i++) {
+        out_name[i] = toupper((unsigned char) file_name[i]);
+    }
+    out_name[i] = 0;
+
+    out_fd = open(out_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", out_name);
+        close(in_fd);
+        free(ranges);
+        exit(1);
+    }
+
+    out_offset = 0;
+    for (i = 0; i < num_ranges; i++) {
+        out_offset += ranges[i].length;
+    }
+
+    /* The whole file is allocated at once, not range by range */
+    if (out_offset > 0) {
+        posix_fallocate(out_fd, 0, out_offset);
+    }
+
+    result     = 0;
+    out_offset = 0;
+
+    for (i = 0; i < num_ranges && result == 0; i++) {
+        result      = copy_range(in_fd, ranges[i].offset, out_fd, out_offset, ranges[i].length);
+        out_offset += ranges[i].length;
+    }
+
+    close(in_fd);
+
+    if (close(out_fd) != 0) {
+        result = -1;
+    }
+
+    free(ranges);
+
+    if (result != 0) {
+        fprintf(stderr, "Error writing to file.\n");
+        exit(1);
+    }
+
+    printf("Extracted file %s.\n", file_name);
+
+    return 0;
+#endif
+}
@@ -0,0 +1,16 @@
+#ifndef EXTRACT_H_
+#define EXTRACT_H_
+
+#include <stdio.h>
+
+/* Extracts file_name like cpm_dump does, but moves its sectors from the
+   image file straight into the host file. Runs of sectors that lie back to
+   back in the image are copied in one copy_file_range call, which lets the
+   kernel move the data without it passing through the process, and plain
+   pread and pwrite are used where the kernel can not. fp is the image opened
+   as image_name. Returns -1 without writing anything if the file is not
+   found or this is not supported here, so the caller can fall back to
+   cpm_dump. */
+int extract_zero_copy(const char *image_name, FILE *fp, const char *file_name);
+
+#endif
@@ -0,0 +1,257 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "fanout.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "pool.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define HAVE_SPAWN
+extern char **environ;
+#endif
+
+#if defined (HAVE_PTHREAD)
+#include <pthread.h>
+#define FANOUT_LOCK(fanout)   pthread_mutex_lock(&(fanout)->lock)
+#define FANOUT_UNLOCK(fanout) pthread_mutex_unlock(&(fanout)->lock)
+#else
+#define FANOUT_LOCK(fanout)
+#define FANOUT_UNLOCK(fanout)
+#endif
+
+struct fanout_job_s {
+    char *output;
+    size_t length;
+    int status;                         /* Exit status, or -1 if not run */
+    int done;
+};
+
+struct fanout_s {
+    struct corpus_s *corpus;
+    int argc;
+    char **argv;
+    int files_index;
+    struct fanout_job_s *jobs;
+    int next_to_print;
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_t lock;
+    pthread_mutex_t spawn_lock;
+#endif
+};
+
+/* Prints finished jobs in order, up to the first one still running */
+static
+void print_ready(struct fanout_s *fanout)
+{
+    while (   fanout->next_to_print < fanout->corpus->num_paths
+           && fanout->jobs[fanout->next_to_print].done) {
+        struct fanout_job_s *job = &fanout->jobs[fanout->next_to_print];
+
+        printf("== %s ==\n", fanout->corpus->paths[fanout->next_to_print]);
+        fwrite(job->output, 1, job->length, stdout);
+
+        if (job->length && job->output[job->length - 1] != '\n') {
+            printf("\n");
+        }
+
+        fflush(stdout);
+
+        free(job->output);
+        job->output = NULL;
+        fanout->next_to_print++;
+    }
+}
+
+#if defined (HAVE_SPAWN)
+/* Starts the command on one image with its standard output and error going
+   into a pipe. Returns the read end, or -1 on errors. */
+static
+int spawn_image(struct fanout_s *fanout, const char *image, pid_t *pid)
+{
+    posix_spawn_file_actions_t actions;
+    char **argv;
+    int fds[2];
+    int result;
+    int i;
+
+    argv = (char **) malloc((fanout->argc + 1) * sizeof(char *));
+    if (!argv) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < fanout->argc; i++) {
+        argv[i] = fanout->argv[i];
+    }
+
+    argv[fanout->files_index]     = "--file";
+    argv[fanout->files_index + 1] = (char *) image;
+    argv[fanout->argc]            = NULL;
+
+    /* Pipes are marked close-on-exec before any other worker spawns, so no
+       child keeps another image's pipe open */
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_lock(&fanout->spawn_lock);
+#endif
+
+    result = -1;
+
+    if (pipe(fds) == 0) {
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+
+        if (posix_spawnp(pid, argv[0], &actions, NULL, argv, environ) == 0) {
+            result = fds[0];
+        } else {
+            close(fds[0]);
+        }
+
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+    }
+
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_unlock(&fanout->spawn_lock);
+#endif
+
+    free(argv);
+
+    return result;
+}
+
+static
+void run_job(void *ctx, int index)
+{
+    struct fanout_s *fanout = (struct fanout_s *) ctx;
+    struct fanout_job_s *job = &fanout->jobs[index];
+    size_t capacity;
+    pid_t pid;
+    int status;
+    int fd;
+
+    job->status = -1;
+
+    fd = spawn_image(fanout, fanout->corpus->paths[index], &pid);
+
+    if (fd >= 0) {
+        capacity = 4096;
+        job->output = (char *) malloc(capacity);
+
+        while (job->output) {
+            ssize_t n;
+
+            if (job->length == capacity) {
+                capacity *= 2;
+                job->output = (char *) realloc(job->output, capacity);
+                continue;
+            }
+
+            n = read(fd, job->output + job->length, capacity - job->length);
+            if (n <= 0) {
+                break;
+            }
+
+            job->length += n;
+        }
+
+        if (!job->output) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        close(fd);
+
+        if (waitpid(pid, &status, 0) == pid) {
+            job->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+    }
+
+    FANOUT_LOCK(fanout);
+    job->done = 1;
+    print_ready(fanout);
+    FANOUT_UNLOCK(fanout);
+}
+#endif
+
+int fanout_run(struct corpus_s *corpus, int argc, char *argv[], int files_index, int num_workers)
+{
+    struct fanout_s fanout;
+    int num_failed;
+    int i;
+
+    assert(corpus);
+    assert(argv);
+    assert(files_index + 1 < argc);
+
+#if !defined (HAVE_SPAWN)
+    (void) num_workers;
+    fprintf(stderr, "--files is not supported on this platform.\n");
+    return -1;
+#else
+    if (corpus->num_paths == 0) {
+        fprintf(stderr, "No images given.\n");
+        return -1;
+    }
+
+    memset(&fanout, 0, sizeof(fanout));
+    fanout.corpus      = corpus;
+    fanout.argc        = argc;
+    fanout.argv        = argv;
+    fanout.files_index = files_index;
+
+    fanout.jobs = (struct fanout_job_s *) calloc(corpus->num_paths, sizeof(*fanout.jobs));
+    if (!fanout.jobs) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_init(&fanout.lock, NULL);
+    pthread_mutex_init(&fanout.spawn_lock, NULL);
+#endif
+
+    pool_run(num_workers, corpus->num_paths, run_job, &fanout);
+
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_destroy(&fanout.lock);
+    pthread_mutex_destroy(&fanout.spawn_lock);
+#endif
+
+    num_failed = 0;
+
+    for (i = 0; i < corpus->num_paths; i++) {
+        if (fanout.jobs[i].status != 0) {
+            num_failed++;
+        }
+    }
+
+    if (num_failed) {
+        fprintf(stderr, "%d of %d images failed:\n", num_failed, corpus->num_paths);
+
+        for (i = 0; i < corpus->num_paths; i++) {
+            if (fanout.jobs[i].status < 0) {
+                fprintf(stderr, "  %s (not run)\n", corpus->paths[i]);
+            } else if (fanout.jobs[i].status != 0) {
+                fprintf(stderr, "  %s (exit %d)\n", corpus->paths[i], fanout.jobs[i].status);
+            }
+        }
+    }
+
+    free(fanout.jobs);
+
+    return num_failed;
+#endif
+}
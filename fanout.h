@@ -0,0 +1,14 @@
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include "corpus.h"
+
+/* Runs the command line once for every image of the corpus, with the
+   --files option at files_index replaced by --file and the image. Images run
+   on num_workers pool workers, each in its own process since commands print
+   to standard output and exit on errors. The output of every image is
+   printed whole, in corpus order, and failed images are listed at the end.
+   Returns the number of failed images, or -1 if none could be run. */
+int fanout_run(struct corpus_s *corpus, int argc, char *argv[], int files_index, int num_workers);
+
+#endif
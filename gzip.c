@@ -0,0 +1,819 @@
+#include "gzip.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+
+#define GZIP_ID1            0x1f
+#define GZIP_ID2            0x8b
+#define GZIP_DEFLATE        8
+
+#define GZIP_FHCRC          0x02
+#define GZIP_FEXTRA         0x04
+#define GZIP_FNAME          0x08
+#define GZIP_FCOMMENT       0x10
+
+#define INPUT_CHUNK         16384
+
+#define MAX_BITS            15
+#define NUM_LITLEN          288
+#define NUM_DIST            30
+#define END_OF_BLOCK        256
+
+#define WINDOW_SIZE         32768
+#define WINDOW_MASK         (WINDOW_SIZE - 1)
+#define HASH_BITS           15
+#define HASH_MASK           ((1 << HASH_BITS) - 1)
+#define MIN_MATCH           3
+#define MAX_MATCH           258
+#define MAX_CHAIN           64
+#define MAX_STORED          65535
+
+static const u16 g_length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const u8 g_length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const u16 g_dist_base[NUM_DIST] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const u8 g_dist_extra[NUM_DIST] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Order the code length code lengths are stored in */
+static const u8 g_clen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+struct huffman_s {
+    short count[MAX_BITS + 1];          /* Number of codes of each length */
+    short symbol[NUM_LITLEN];           /* Symbols ordered by code */
+};
+
+struct inflate_s {
+    FILE *fp;                           /* Streamed input, or else src */
+    const u8 *src;
+    long src_size;
+    long src_pos;
+    u8 *in;
+    long in_len;
+
+    unsigned long bit_buf;
+    int bit_count;
+
+    u8 *out;
+    long out_size;
+    long out_capacity;
+
+    int error;
+};
+
+struct bits_s {
+    u8 *out;
+    long out_size;
+    long out_capacity;
+    unsigned long bit_buf;
+    int bit_count;
+};
+
+int gzip_is_name(const char *file_name)
+{
+    size_t len;
+
+    assert(file_name);
+
+    len = strlen(file_name);
+
+    return len > 3 && stricmp(file_name + len - 3, ".gz") == 0;
+}
+
+static
+void crc32_table(u32 table[256])
+{
+    u32 n;
+
+    for (n = 0; n < 256; n++) {
+        u32 c = n;
+        int k;
+
+        for (k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+        }
+
+        table[n] = c;
+    }
+}
+
+static
+u32 crc32_update(const u32 table[256], u32 crc, const u8 *data, long size)
+{
+    long i;
+
+    crc = ~crc;
+    for (i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+/* Inflate */
+
+/* Returns the next input byte, or -1 at the end of the input */
+static
+int next_byte(struct inflate_s *s)
+{
+    if (s->fp) {
+        if (s->src_pos == s->in_len) {
+            s->in_len  = (long) fread(s->in, 1, INPUT_CHUNK, s->fp);
+            s->src_pos = 0;
+
+            if (s->in_len == 0) {
+                return -1;
+            }
+        }
+
+        return s->in[s->src_pos++];
+    }
+
+    if (s->src_pos == s->src_size) {
+        return -1;
+    }
+
+    return s->src[s->src_pos++];
+}
+
+static
+int get_byte(struct inflate_s *s)
+{
+    int c = next_byte(s);
+
+    if (c < 0) {
+        s->error = 1;
+        return 0;
+    }
+
+    return c;
+}
+
+static
+unsigned long get_bits(struct inflate_s *s, int n)
+{
+    unsigned long value;
+
+    while (s->bit_count < n) {
+        s->bit_buf |= (unsigned long) get_byte(s) << s->bit_count;
+        s->bit_count += 8;
+    }
+
+    value = s->bit_buf & ((1UL << n) - 1);
+    s->bit_buf >>= n;
+    s->bit_count -= n;
+
+    return value;
+}
+
+static
+void put_byte(struct inflate_s *s, u8 c)
+{
+    if (s->out_size == s->out_capacity) {
+        s->out_capacity = s->out_capacity ? 2 * s->out_capacity : 65536;
+        s->out = (u8 *) realloc(s->out, s->out_capacity + 1);
+
+        if (!s->out) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    s->out[s->out_size++] = c;
+}
+
+/* Builds canonical codes from code lengths. Returns -1 for lengths that
+   make more codes than fit. */
+static
+int build_huffman(struct huffman_s *h, const u8 *lengths, int n)
+{
+    short offsets[MAX_BITS + 1];
+    int left;
+    int len;
+    int i;
+
+    memset(h->count, 0, sizeof(h->count));
+
+    for (i = 0; i < n; i++) {
+        h->count[lengths[i]]++;
+    }
+
+    left = 1;
+    for (len = 1; len <= MAX_BITS; len++) {
+        left = (left << 1) - h->count[len];
+        if (left < 0) {
+            return -1;
+        }
+    }
+
+    offsets[1] = 0;
+    for (len = 1; len < MAX_BITS; len++) {
+        offsets[len + 1] = offsets[len] + h->count[len];
+    }
+
+    for (i = 0; i < n; i++) {
+        if (lengths[i]) {
+            h->symbol[offsets[lengths[i]]++] = (short) i;
+        }
+    }
+
+    return 0;
+}
+
+/* Codes are read one bit at a time, first bit first */
+static
+int decode(struct inflate_s *s, const struct huffman_s *h)
+{
+    int code;
+    int first;
+    int index;
+    int len;
+
+    code  = 0;
+    first = 0;
+    index = 0;
+
+    for (len = 1; len <= MAX_BITS; len++) {
+        int count;
+
+        code |= (int) get_bits(s, 1);
+        count = h->count[len];
+
+        if (code - count < first) {
+            return h->symbol[index + (code - first)];
+        }
+
+        index += count;
+        first  = (first + count) << 1;
+        code <<= 1;
+    }
+
+    s->error = 1;
+
+    return -1;
+}
+
+static
+void inflate_codes(struct inflate_s *s, const struct huffman_s *litlen, const struct huffman_s *dist)
+{
+    while (!s->error) {
+        int symbol = decode(s, litlen);
+
+        if (symbol < 0 || symbol == END_OF_BLOCK) {
+            return;
+        }
+
+        if (symbol < END_OF_BLOCK) {
+            put_byte(s, (u8) symbol);
+        } else {
+            long length;
+            long distance;
+
+            symbol -= END_OF_BLOCK + 1;
+            if (symbol >= 29) {
+                s->error = 1;
+                return;
+            }
+
+            length = g_length_base[symbol] + (long) get_bits(s, g_length_extra[symbol]);
+
+            symbol = decode(s, dist);
+            if (symbol < 0 || symbol >= NUM_DIST) {
+                s->error = 1;
+                return;
+            }
+
+            distance = g_dist_base[symbol] + (long) get_bits(s, g_dist_extra[symbol]);
+
+            if (distance > s->out_size) {
+                s->error = 1;
+                return;
+            }
+
+            while (length-- > 0) {
+                put_byte(s, s->out[s->out_size - distance]);
+            }
+        }
+    }
+}
+
+static
+void inflate_stored(struct inflate_s *s)
+{
+    unsigned len;
+    unsigned nlen;
+
+    /* The rest of the current byte is padding */
+    s->bit_buf   = 0;
+    s->bit_count = 0;
+
+    len   = get_byte(s);
+    len  |= get_byte(s) << 8;
+    nlen  = get_byte(s);
+    nlen |= get_byte(s) << 8;
+
+    if (len != (~nlen & 0xffff)) {
+        s->error = 1;
+        return;
+    }
+
+    while (len-- > 0 && !s->error) {
+        put_byte(s, (u8) get_byte(s));
+    }
+}
+
+static
+void inflate_fixed(struct inflate_s *s)
+{
+    struct huffman_s litlen;
+    struct huffman_s dist;
+    u8 lengths[NUM_LITLEN];
+    int i;
+
+    for (i = 0; i < NUM_LITLEN; i++) {
+        lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    build_huffman(&litlen, lengths, NUM_LITLEN);
+
+    for (i = 0; i < NUM_DIST; i++) {
+        lengths[i] = 5;
+    }
+    build_huffman(&dist, lengths, NUM_DIST);
+
+    inflate_codes(s, &litlen, &dist);
+}
+
+static
+void inflate_dynamic(struct inflate_s *s)
+{
+    struct huffman_s litlen;
+    struct huffman_s dist;
+    u8 lengths[NUM_LITLEN + NUM_DIST];
+    int num_litlen;
+    int num_dist;
+    int num_clen;
+    int i;
+
+    num_litlen = (int) get_bits(s, 5) + 257;
+    num_dist   = (int) get_bits(s, 5) + 1;
+    num_clen   = (int) get_bits(s, 4) + 4;
+
+    if (num_litlen > 286 || num_dist > NUM_DIST) {
+        s->error = 1;
+        return;
+    }
+
+    memset(lengths, 0, sizeof(lengths));
+    for (i = 0; i < num_clen; i++) {
+        lengths[g_clen_order[i]] = (u8) get_bits(s, 3);
+    }
+
+    if (build_huffman(&litlen, lengths, 19) != 0) {
+        s->error = 1;
+        return;
+    }
+
+    for (i = 0; i < num_litlen + num_dist && !s->error; ) {
+        int symbol = decode(s, &litlen);
+        int repeat;
+        u8 value;
+
+        if (symbol < 0) {
+            return;
+        }
+
+        if (symbol < 16) {
+            lengths[i++] = (u8) symbol;
+            continue;
+        }
+
+        if (symbol == 16) {
+            if (i == 0) {
+                s->error = 1;
+                return;
+            }
+            value  = lengths[i - 1];
+            repeat = 3 + (int) get_bits(s, 2);
+        } else if (symbol == 17) {
+            value  = 0;
+            repeat = 3 + (int) get_bits(s, 3);
+        } else {
+            value  = 0;
+            repeat = 11 + (int) get_bits(s, 7);
+        }
+
+        if (i + repeat > num_litlen + num_dist) {
+            s->error = 1;
+            return;
+        }
+
+        while (repeat-- > 0) {
+            lengths[i++] = value;
+        }
+    }
+
+    if (   s->error
+        || build_huffman(&litlen, lengths, num_litlen) != 0
+        || build_huffman(&dist, lengths + num_litlen, num_dist) != 0) {
+        s->error = 1;
+        return;
+    }
+
+    inflate_codes(s, &litlen, &dist);
+}
+
+/* Reads one gzip member onto the output */
+static
+void inflate_member(struct inflate_s *s, const u32 crc_table[256])
+{
+    long start;
+    u32 crc;
+    u32 isize;
+    int flags;
+    int last;
+    int i;
+
+    if (get_byte(s) != GZIP_ID1 || get_byte(s) != GZIP_ID2 || get_byte(s) != GZIP_DEFLATE) {
+        s->error = 1;
+        return;
+    }
+
+    flags = get_byte(s);
+
+    /* Time, extra flags and system */
+    for (i = 0; i < 6; i++) {
+        get_byte(s);
+    }
+
+    if (flags & GZIP_FEXTRA) {
+        int len = get_byte(s);
+
+        len |= get_byte(s) << 8;
+        while (len-- > 0 && !s->error) {
+            get_byte(s);
+        }
+    }
+
+    if (flags & GZIP_FNAME) {
+        while (get_byte(s) != 0 && !s->error) {
+        }
+    }
+
+    if (flags & GZIP_FCOMMENT) {
+        while (get_byte(s) != 0 && !s->error) {
+        }
+    }
+
+    if (flags & GZIP_FHCRC) {
+        get_byte(s);
+        get_byte(s);
+    }
+
+    start = s->out_size;
+
+    do {
+        int type;
+
+        last = (int) get_bits(s, 1);
+        type = (int) get_bits(s, 2);
+
+        if (type == 0) {
+            inflate_stored(s);
+        } else if (type == 1) {
+            inflate_fixed(s);
+        } else if (type == 2) {
+            inflate_dynamic(s);
+        } else {
+            s->error = 1;
+        }
+    } while (!last && !s->error);
+
+    if (s->error) {
+        return;
+    }
+
+    s->bit_buf   = 0;
+    s->bit_count = 0;
+
+    crc    = (u32) get_bits(s, 16);
+    crc   |= (u32) get_bits(s, 16) << 16;
+    isize  = (u32) get_bits(s, 16);
+    isize |= (u32) get_bits(s, 16) << 16;
+
+    if (   crc   != crc32_update(crc_table, 0, s->out + start, s->out_size - start)
+        || isize != (u32) (s->out_size - start)) {
+        s->error = 1;
+    }
+}
+
+static
+u8 *inflate_stream(struct inflate_s *s, long *size)
+{
+    u32 crc_table[256];
+
+    crc32_table(crc_table);
+
+    do {
+        inflate_member(s, crc_table);
+
+        /* Another member may follow, its first byte is put back */
+        if (!s->error) {
+            if (next_byte(s) < 0) {
+                break;
+            }
+
+            s->src_pos--;
+        }
+    } while (!s->error);
+
+    if (s->error) {
+        free(s->out);
+        return NULL;
+    }
+
+    if (!s->out) {
+        s->out = (u8 *) malloc(1);
+        if (!s->out) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    *size = s->out_size;
+
+    return s->out;
+}
+
+u8 *gzip_inflate_file(FILE *fp, long *size)
+{
+    struct inflate_s s;
+    u8 *data;
+
+    assert(fp);
+    assert(size);
+
+    memset(&s, 0, sizeof(s));
+    s.fp = fp;
+    s.in = (u8 *) malloc(INPUT_CHUNK);
+
+    if (!s.in) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    data = inflate_stream(&s, size);
+    free(s.in);
+
+    return data;
+}
+
+u8 *gzip_inflate_buffer(const u8 *src, long src_size, long *size)
+{
+    struct inflate_s s;
+
+    assert(src || src_size == 0);
+    assert(size);
+
+    memset(&s, 0, sizeof(s));
+    s.src      = src;
+    s.src_size = src_size;
+
+    return inflate_stream(&s, size);
+}
+
+/* Deflate */
+
+static
+void put_bits(struct bits_s *b, unsigned long value, int n)
+{
+    b->bit_buf |= value << b->bit_count;
+    b->bit_count += n;
+
+    while (b->bit_count >= 8) {
+        if (b->out_size == b->out_capacity) {
+            b->out_capacity = 2 * b->out_capacity + 65536;
+            b->out = (u8 *) realloc(b->out, b->out_capacity);
+
+            if (!b->out) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+        }
+
+        b->out[b->out_size++] = (u8) b->bit_buf;
+        b->bit_buf >>= 8;
+        b->bit_count -= 8;
+    }
+}
+
+/* Huffman codes go out first bit first, the reverse of how other fields
+   are packed */
+static
+void put_code(struct bits_s *b, unsigned code, int n)
+{
+    unsigned reversed;
+    int i;
+
+    reversed = 0;
+    for (i = 0; i < n; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+
+    put_bits(b, reversed, n);
+}
+
+static
+void put_litlen(struct bits_s *b, int symbol)
+{
+    if (symbol < 144) {
+        put_code(b, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(b, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(b, symbol - 256, 7);
+    } else {
+        put_code(b, 0xc0 + symbol - 280, 8);
+    }
+}
+
+static
+void put_match(struct bits_s *b, int length, int distance)
+{
+    int code;
+
+    for (code = 28; g_length_base[code] > length; code--) {
+    }
+
+    put_litlen(b, END_OF_BLOCK + 1 + code);
+    put_bits(b, length - g_length_base[code], g_length_extra[code]);
+
+    for (code = NUM_DIST - 1; g_dist_base[code] > distance; code--) {
+    }
+
+    put_code(b, code, 5);
+    put_bits(b, distance - g_dist_base[code], g_dist_extra[code]);
+}
+
+/* Data that does not compress goes out as it is, in stored blocks */
+static
+void put_stored(struct bits_s *b, const u8 *data, long size)
+{
+    long pos;
+
+    pos = 0;
+
+    do {
+        long len = size - pos < MAX_STORED ? size - pos : MAX_STORED;
+        long i;
+
+        put_bits(b, pos + len == size, 1);
+        put_bits(b, 0, 2);
+        put_bits(b, 0, (8 - b->bit_count) & 7);
+        put_bits(b, len, 16);
+        put_bits(b, ~len & 0xffff, 16);
+
+        for (i = 0; i < len; i++) {
+            put_bits(b, data[pos + i], 8);
+        }
+
+        pos += len;
+    } while (pos < size);
+}
+
+static
+unsigned hash3(const u8 *p)
+{
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & HASH_MASK;
+}
+
+u8 *gzip_deflate_buffer(const u8 *data, long size, long *out_size)
+{
+    static const u8 header[10] = { GZIP_ID1, GZIP_ID2, GZIP_DEFLATE, 0, 0, 0, 0, 0, 0, 0xff };
+    struct bits_s b;
+    u32 crc_table[256];
+    long *head;
+    long *prev;
+    long pos;
+    u32 crc;
+    int i;
+
+    assert(data || size == 0);
+    assert(out_size);
+
+    memset(&b, 0, sizeof(b));
+
+    head = (long *) malloc((HASH_MASK + 1) * sizeof(long));
+    prev = (long *) malloc(WINDOW_SIZE * sizeof(long));
+
+    if (!head || !prev) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i <= HASH_MASK; i++) {
+        head[i] = -1;
+    }
+
+    for (i = 0; i < (int) sizeof(header); i++) {
+        put_bits(&b, header[i], 8);
+    }
+
+    /* A single final block of fixed codes */
+    put_bits(&b, 1, 1);
+    put_bits(&b, 1, 2);
+
+    for (pos = 0; pos < size; ) {
+        long best_length;
+        long best_distance;
+
+        best_length   = 0;
+        best_distance = 0;
+
+        if (pos + MIN_MATCH <= size) {
+            unsigned h = hash3(data + pos);
+            long candidate = head[h];
+            int chain;
+
+            for (chain = 0; candidate >= 0 && pos - candidate <= WINDOW_SIZE && chain < MAX_CHAIN; chain++) {
+                long max_length = size - pos < MAX_MATCH ? size - pos : MAX_MATCH;
+                long length;
+
+                for (length = 0; length < max_length && data[candidate + length] == data[pos + length]; length++) {
+                }
+
+                if (length > best_length) {
+                    best_length   = length;
+                    best_distance = pos - candidate;
+
+                    if (length == max_length) {
+                        break;
+                    }
+                }
+
+                candidate = prev[candidate & WINDOW_MASK];
+            }
+        }
+
+        if (best_length >= MIN_MATCH) {
+            put_match(&b, (int) best_length, (int) best_distance);
+        } else {
+            best_length = 1;
+            put_litlen(&b, data[pos]);
+        }
+
+        /* Every position passed over goes into the chains */
+        while (best_length-- > 0) {
+            if (pos + MIN_MATCH <= size) {
+                unsigned h = hash3(data + pos);
+
+                prev[pos & WINDOW_MASK] = head[h];
+                head[h] = pos;
+            }
+
+            pos++;
+        }
+    }
+
+    put_litlen(&b, END_OF_BLOCK);
+
+    /* Pad to a byte */
+    put_bits(&b, 0, (8 - b.bit_count) & 7);
+
+    if (b.out_size > (long) sizeof(header) + size + 5 * (size / MAX_STORED + 1)) {
+        b.out_size = sizeof(header);
+        put_stored(&b, data, size);
+    }
+
+    crc32_table(crc_table);
+    crc = crc32_update(crc_table, 0, data, size);
+
+    put_bits(&b, crc & 0xffff, 16);
+    put_bits(&b, crc >> 16, 16);
+    put_bits(&b, (unsigned long) size & 0xffff, 16);
+    put_bits(&b, ((unsigned long) size >> 16) & 0xffff, 16);
+
+    free(head);
+    free(prev);
+
+    *out_size = b.out_size;
+
+    return b.out;
+}
@@ -0,0 +1,27 @@
+#ifndef GZIP_H_
+#define GZIP_H_
+
+#include <stdio.h>
+
+#include "types.h"
+
+/* Images kept as .dsk.gz are decompressed into memory and compressed again
+   when written back, with no library and no temporary file. Inflate reads
+   every deflate block type and concatenated members. Deflate writes one
+   block of fixed Huffman codes, with matches found through hash chains over
+   a 32K window, which suits the long runs of filler bytes in images. The
+   output carries no name or time, so the same image compresses to the same
+   bytes. */
+int gzip_is_name(const char *file_name);
+
+/* Decompresses the gzip stream of fp as it is read. Returns the data, freed
+   by the caller, or NULL if the stream is damaged. */
+u8 *gzip_inflate_file(FILE *fp, long *size);
+
+/* Same for a gzip stream already in memory */
+u8 *gzip_inflate_buffer(const u8 *src, long src_size, long *size);
+
+/* Returns the gzip stream of data, freed by the caller */
+u8 *gzip_deflate_buffer(const u8 *data, long size, long *out_size);
+
+#endif
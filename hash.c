@@ -0,0 +1,174 @@
+#include "hash.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static const u32 C1 = 0x239b961b;
+static const u32 C2 = 0xab0e9789;
+static const u32 C3 = 0x38b34ae5;
+static const u32 C4 = 0xa1e38b93;
+
+static
+u32 read_u32(const u8 *p)
+{
+    return (u32) p[0] | ((u32) p[1] << 8) | ((u32) p[2] << 16) | ((u32) p[3] << 24);
+}
+
+static
+u32 fmix32(u32 h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static
+void hash_block(struct hash_s *hash, const u8 *block)
+{
+    u32 k1, k2, k3, k4;
+    u32 *h = hash->h;
+
+    k1 = read_u32(block);
+    k2 = read_u32(block + 4);
+    k3 = read_u32(block + 8);
+    k4 = read_u32(block + 12);
+
+    k1 *= C1; k1 = ROTL32(k1, 15); k1 *= C2; h[0] ^= k1;
+    h[0] = ROTL32(h[0], 19); h[0] += h[1]; h[0] = h[0] * 5 + 0x561ccd1b;
+
+    k2 *= C2; k2 = ROTL32(k2, 16); k2 *= C3; h[1] ^= k2;
+    h[1] = ROTL32(h[1], 17); h[1] += h[2]; h[1] = h[1] * 5 + 0x0bcaa747;
+
+    k3 *= C3; k3 = ROTL32(k3, 17); k3 *= C4; h[2] ^= k3;
+    h[2] = ROTL32(h[2], 15); h[2] += h[3]; h[2] = h[2] * 5 + 0x96cd1c35;
+
+    k4 *= C4; k4 = ROTL32(k4, 18); k4 *= C1; h[3] ^= k4;
+    h[3] = ROTL32(h[3], 13); h[3] += h[0]; h[3] = h[3] * 5 + 0x32ac3b17;
+}
+
+void hash_init(struct hash_s *hash, u32 seed)
+{
+    assert(hash);
+
+    memset(hash, 0, sizeof(*hash));
+    hash->h[0] = seed;
+    hash->h[1] = seed;
+    hash->h[2] = seed;
+    hash->h[3] = seed;
+}
+
+void hash_update(struct hash_s *hash, const u8 *data, size_t len)
+{
+    assert(hash);
+    assert(data || len == 0);
+
+    hash->total_len += (u32) len;
+
+    if (hash->tail_len) {
+        size_t n = sizeof(hash->tail) - hash->tail_len;
+
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(hash->tail + hash->tail_len, data, n);
+        hash->tail_len += (u32) n;
+        data += n;
+        len -= n;
+
+        if (hash->tail_len < sizeof(hash->tail)) {
+            return;
+        }
+
+        hash_block(hash, hash->tail);
+        hash->tail_len = 0;
+    }
+
+    for (; len >= 16; data += 16, len -= 16) {
+        hash_block(hash, data);
+    }
+
+    memcpy(hash->tail, data, len);
+    hash->tail_len = (u32) len;
+}
+
+void hash_final(struct hash_s *hash, u8 digest[HASH_SIZE])
+{
+    u32 k[4];
+    u32 *h = hash->h;
+    unsigned int i;
+
+    assert(hash);
+    assert(digest);
+
+    memset(k, 0, sizeof(k));
+
+    for (i = 0; i < hash->tail_len; i++) {
+        k[i / 4] ^= (u32) hash->tail[i] << (8 * (i % 4));
+    }
+
+    if (hash->tail_len > 12) {
+        k[3] *= C4; k[3] = ROTL32(k[3], 18); k[3] *= C1; h[3] ^= k[3];
+    }
+
+    if (hash->tail_len > 8) {
+        k[2] *= C3; k[2] = ROTL32(k[2], 17); k[2] *= C4; h[2] ^= k[2];
+    }
+
+    if (hash->tail_len > 4) {
+        k[1] *= C2; k[1] = ROTL32(k[1], 16); k[1] *= C3; h[1] ^= k[1];
+    }
+
+    if (hash->tail_len > 0) {
+        k[0] *= C1; k[0] = ROTL32(k[0], 15); k[0] *= C2; h[0] ^= k[0];
+    }
+
+    for (i = 0; i < 4; i++) {
+        h[i] ^= hash->total_len;
+    }
+
+    h[0] += h[1]; h[0] += h[2]; h[0] += h[3];
+    h[1] += h[0]; h[2] += h[0]; h[3] += h[0];
+
+    for (i = 0; i < 4; i++) {
+        h[i] = fmix32(h[i]);
+    }
+
+    h[0] += h[1]; h[0] += h[2]; h[0] += h[3];
+    h[1] += h[0]; h[2] += h[0]; h[3] += h[0];
+
+    for (i = 0; i < 4; i++) {
+        digest[i * 4 + 0] = (u8) (h[i]);
+        digest[i * 4 + 1] = (u8) (h[i] >> 8);
+        digest[i * 4 + 2] = (u8) (h[i] >> 16);
+        digest[i * 4 + 3] = (u8) (h[i] >> 24);
+    }
+}
+
+void hash_buffer(const u8 *data, size_t len, u8 digest[HASH_SIZE])
+{
+    struct hash_s hash;
+
+    hash_init(&hash, 0);
+    hash_update(&hash, data, len);
+    hash_final(&hash, digest);
+}
+
+void hash_to_hex(const u8 digest[HASH_SIZE], char hex[HASH_SIZE * 2 + 1])
+{
+    int i;
+
+    assert(digest);
+    assert(hex);
+
+    for (i = 0; i < HASH_SIZE; i++) {
+        sprintf(hex + i * 2, "%.2x", (unsigned int) digest[i]);
+    }
+}
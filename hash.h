@@ -0,0 +1,26 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <stddef.h>
+
+#include "types.h"
+
+#define HASH_SIZE 16
+
+/* Incremental MurmurHash3 (x86, 128-bit). It only needs 32-bit arithmetic,
+   and is fast enough to hash every block of a disk image. Not a cryptographic
+   hash. */
+struct hash_s {
+    u32 h[4];
+    u8 tail[16];
+    u32 tail_len;
+    u32 total_len;
+};
+
+void hash_init(struct hash_s *hash, u32 seed);
+void hash_update(struct hash_s *hash, const u8 *data, size_t len);
+void hash_final(struct hash_s *hash, u8 digest[HASH_SIZE]);
+void hash_buffer(const u8 *data, size_t len, u8 digest[HASH_SIZE]);
+void hash_to_hex(const u8 digest[HASH_SIZE], char hex[HASH_SIZE * 2 + 1]);
+
+#endif
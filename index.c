@@ -0,0 +1,449 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "index.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "amsdos.h"
+#include "gzip.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "shadow.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+struct image_result_s {
+    u8 format;
+    u8 num_tracks;
+    int num_files;
+    struct index_file_s *files;
+};
+
+struct index_build_s {
+    struct corpus_s *corpus;
+    struct prefetch_s *prefetch;
+    struct image_result_s *results;
+};
+
+struct file_hash_s {
+    struct hash_s hash;
+    u32 size;
+    long remaining;                     /* AMSDOS length left, or -1 */
+};
+
+static
+int hash_sink(void *ctx, u8 *buf, size_t len)
+{
+    struct file_hash_s *file_hash = (struct file_hash_s *) ctx;
+
+    /* The padding of the last record is not part of the file */
+    if (file_hash->remaining >= 0) {
+        if ((long) len > file_hash->remaining) {
+            len = (size_t) file_hash->remaining;
+        }
+        file_hash->remaining -= (long) len;
+    }
+
+    hash_update(&file_hash->hash, buf, len);
+    file_hash->size += (u32) len;
+
+    return 0;
+}
+
+static
+void index_file(FILE *fp, struct cpm_diren_s *table, int num_diren, int first,
+                struct index_file_s *dest)
+{
+    struct cpm_diren_s *dir = &table[first];
+    struct amsdos_header_s header;
+    struct file_hash_s file_hash;
+    int k;
+
+    memset(dest, 0, sizeof(*dest));
+
+    dest->user_number = dir->user_number;
+    dest->attributes  = cpm_get_attributes(dir);
+    dest->filetype    = INDEX_NO_AMSDOS;
+
+    for (k = 0; k < 8; k++) {
+        dest->file_name[k] = dir->file_name[k] & 0x7f;
+    }
+
+    for (k = 0; k < 3; k++) {
+        dest->ext[k] = dir->ext[k] & 0x7f;
+    }
+
+    hash_init(&file_hash.hash, 0);
+    file_hash.size      = 0;
+    file_hash.remaining = -1;
+
+    if (cpm_read_amsdos_header(fp, dir, &header)) {
+        dest->filetype       = header.filetype;
+        dest->data_location  = header.data_location;
+        dest->entry_address  = header.entry_address;
+        dest->logical_length = header.logical_length;
+
+        file_hash.remaining = amsdos_get_length(&header);
+    }
+
+    cpm_read_file(fp, table, num_diren, first, hash_sink, &file_hash);
+
+    hash_final(&file_hash.hash, dest->hash);
+    dest->size = file_hash.size;
+}
+
+/* Parses an image the prefetcher has read whole into memory */
+static
+void index_memory_image(struct image_result_s *result, FILE *fp)
+{
+    struct cpcemu_disc_info_s disc_info;
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    int num_diren;
+    int i;
+
+    if (!check_disc_info(fp) || cpm_init(fp) != 0) {
+        return;
+    }
+
+    read_disc_info(fp, &disc_info);
+
+    result->format     = check_disk_type(fp, CPM_SYSTEM_DISK) ? INDEX_FORMAT_SYSTEM : INDEX_FORMAT_DATA;
+    result->num_tracks = disc_info.num_tracks;
+
+    if (check_extended(fp)) {
+        result->format |= INDEX_FORMAT_EXTENDED;
+    }
+
+    num_diren = cpm_read_dir(fp, table);
+
+    result->files = (struct index_file_s *) malloc(num_diren * sizeof(struct index_file_s));
+    if (!result->files) {
+        return;
+    }
+
+    for (i = 0; i < num_diren; i++) {
+        struct cpm_diren_s *dir = &table[i];
+
+        if (dir->user_number > 15 || dir->EX != 0) {
+            continue;
+        }
+
+        index_file(fp, table, num_diren, i, &result->files[result->num_files++]);
+    }
+}
+
+/* Runs on a worker thread. All CP/M layer state is thread local, so each
+   worker can have its own image initialized. */
+static
+void index_image(void *ctx, int job)
+{
+    struct index_build_s *build = (struct index_build_s *) ctx;
+    struct image_result_s *result = &build->results[job];
+    struct shadow_s shadow;
+    u8 *data;
+    long size;
+
+    result->format = INDEX_FORMAT_INVALID;
+
+    data = prefetch_wait(build->prefetch, job, &size);
+
+    if (data && gzip_is_name(build->corpus->paths[job])) {
+        u8 *compressed = data;
+
+        data = gzip_inflate_buffer(compressed, size, &size);
+        free(compressed);
+    }
+
+    if (data && size < CPCEMU_INFO_OFFSET) {
+        free(data);
+        data = NULL;
+    }
+
+    if (data && shadow_adopt(&shadow, build->corpus->paths[job], data, size) == 0) {
+        index_memory_image(result, shadow.fp);
+        shadow_close(&shadow);
+    }
+
+    prefetch_done(build->prefetch, job);
+}
+
+int index_build(const char *index_file_name, struct corpus_s *corpus, int num_workers, int queue_depth)
+{
+    struct index_build_s build;
+    struct index_header_s header;
+    FILE *fp;
+    u32 num_files;
+    u32 strings_size;
+    int num_invalid;
+    int i;
+
+    assert(index_file_name);
+    assert(corpus);
+
+    build.corpus  = corpus;
+    build.results = (struct image_result_s *) calloc(corpus->num_paths + 1, sizeof(struct image_result_s));
+    if (!build.results) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    build.prefetch = prefetch_start(corpus->paths, corpus->num_paths, queue_depth);
+    pool_run(num_workers, corpus->num_paths, index_image, &build);
+    prefetch_finish(build.prefetch);
+
+    num_files    = 0;
+    strings_size = 0;
+    num_invalid  = 0;
+
+    for (i = 0; i < corpus->num_paths; i++) {
+        num_files    += build.results[i].num_files;
+        strings_size += strlen(corpus->paths[i]) + 1;
+
+        if (build.results[i].format & INDEX_FORMAT_INVALID) {
+            fprintf(stderr, "Skipped unrecognized image %s.\n", corpus->paths[i]);
+            num_invalid++;
+        }
+    }
+
+    fp = fopen(index_file_name, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", index_file_name);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version      = INDEX_VERSION;
+    header.num_images   = corpus->num_paths;
+    header.num_files    = num_files;
+    header.strings_size = strings_size;
+
+    fwrite(&header, 1, sizeof(header), fp);
+
+    num_files    = 0;
+    strings_size = 0;
+
+    for (i = 0; i < corpus->num_paths; i++) {
+        struct index_image_s image;
+
+        memset(&image, 0, sizeof(image));
+        image.path_offset = strings_size;
+        image.first_file  = num_files;
+        image.num_files   = build.results[i].num_files;
+        image.format      = build.results[i].format;
+        image.num_tracks  = build.results[i].num_tracks;
+
+        fwrite(&image, 1, sizeof(image), fp);
+
+        num_files    += build.results[i].num_files;
+        strings_size += strlen(corpus->paths[i]) + 1;
+    }
+
+    for (i = 0; i < corpus->num_paths; i++) {
+        int j;
+
+        for (j = 0; j < build.results[i].num_files; j++) {
+            build.results[i].files[j].image = i;
+        }
+
+        fwrite(build.results[i].files, sizeof(struct index_file_s), build.results[i].num_files, fp);
+        free(build.results[i].files);
+    }
+
+    for (i = 0; i < corpus->num_paths; i++) {
+        fwrite(corpus->paths[i], 1, strlen(corpus->paths[i]) + 1, fp);
+    }
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Error writing to file %s.\n", index_file_name);
+        free(build.results);
+        return -1;
+    }
+
+    printf("Indexed %lu files in %d images (%d unrecognized).\n",
+           (unsigned long) num_files, corpus->num_paths - num_invalid, num_invalid);
+
+    free(build.results);
+
+    return 0;
+}
+
+static
+u8 *load_index(const char *index_file_name, size_t *size)
+{
+#if defined (HAVE_MMAP)
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(index_file_name, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = st.st_size;
+
+    return (u8 *) data;
+#else
+    FILE *fp;
+    u8 *data;
+    long n;
+
+    fp = fopen(index_file_name, "rb");
+    if (!fp) {
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    n = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    data = (u8 *) malloc(n > 0 ? n : 1);
+    if (!data || fread(data, 1, n, fp) != (size_t) n) {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+    *size = n;
+
+    return data;
+#endif
+}
+
+static
+void unload_index(u8 *data, size_t size)
+{
+#if defined (HAVE_MMAP)
+    munmap(data, size);
+#else
+    (void) size;
+    free(data);
+#endif
+}
+
+static
+const char *get_filetype_name(u8 filetype)
+{
+    switch (filetype) {
+    case 0:
+        return "bas";
+    case 1:
+        return "prot";
+    case 2:
+        return "bin";
+    case INDEX_NO_AMSDOS:
+        return "-";
+    }
+
+    return "?";
+}
+
+int index_query(const char *index_file_name, const char *pattern)
+{
+    struct index_header_s *header;
+    struct index_image_s *images;
+    struct index_file_s *files;
+    char *strings;
+    size_t size;
+    u8 *data;
+    u32 i;
+
+    assert(index_file_name);
+
+    data = load_index(index_file_name, &size);
+    if (!data) {
+        fprintf(stderr, "Failed to open index %s.\n", index_file_name);
+        return -1;
+    }
+
+    header = (struct index_header_s *) data;
+
+    if (   size < sizeof(*header)
+        || memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+        || header->version != INDEX_VERSION
+        || size < sizeof(*header)
+                  + header->num_images * sizeof(struct index_image_s)
+                  + header->num_files * sizeof(struct index_file_s)
+                  + header->strings_size) {
+        fprintf(stderr, "%s is not a valid index file.\n", index_file_name);
+        unload_index(data, size);
+        return -1;
+    }
+
+    images  = (struct index_image_s *) (data + sizeof(*header));
+    files   = (struct index_file_s *) (images + header->num_images);
+    strings = (char *) (files + header->num_files);
+
+    /* The file comes from disk, so every path must end inside the table */
+    if (header->strings_size > 0 && strings[header->strings_size - 1] != 0) {
+        fprintf(stderr, "%s is not a valid index file.\n", index_file_name);
+        unload_index(data, size);
+        return -1;
+    }
+
+    for (i = 0; i < header->num_files; i++) {
+        struct index_file_s *file = &files[i];
+        struct cpm_diren_s dir;
+        char full_file_name[13];
+        char hex[HASH_SIZE * 2 + 1];
+
+        memset(&dir, 0, sizeof(dir));
+        memcpy(dir.file_name, file->file_name, sizeof(dir.file_name));
+        memcpy(dir.ext, file->ext, sizeof(dir.ext));
+        normalize_filename(full_file_name, &dir);
+
+        if (pattern && !cpm_match_filename(pattern, full_file_name)) {
+            continue;
+        }
+
+        if (   file->image >= header->num_images
+            || images[file->image].path_offset >= header->strings_size) {
+            continue;
+        }
+
+        hash_to_hex(file->hash, hex);
+
+        printf("%s\t%2d\t%12s\t%6lu\t%c%c%c\t%s\t%.4x\t%.4x\t%s\n",
+               strings + images[file->image].path_offset,
+               file->user_number,
+               full_file_name,
+               (unsigned long) file->size,
+               file->attributes & CPM_ATTR_READ_ONLY ? 'R' : '-',
+               file->attributes & CPM_ATTR_SYSTEM ? 'S' : '-',
+               file->attributes & CPM_ATTR_ARCHIVE ? 'A' : '-',
+               get_filetype_name(file->filetype),
+               file->data_location,
+               file->entry_address,
+               hex);
+    }
+
+    unload_index(data, size);
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#include "types.h"
+#include "hash.h"
+#include "corpus.h"
+
+#define INDEX_MAGIC             "SCPCIDX"
+#define INDEX_VERSION           1
+
+/* index_image_s format bits */
+#define INDEX_FORMAT_DATA       0x01
+#define INDEX_FORMAT_SYSTEM     0x02
+#define INDEX_FORMAT_EXTENDED   0x04
+#define INDEX_FORMAT_INVALID    0x80
+
+#define INDEX_NO_AMSDOS         0xFF
+
+/* The index file is laid out as a header, followed by the image table, the
+   file table and the string table holding image paths. Everything is fixed
+   size and little endian, so the file can be mapped and used in place. */
+#pragma pack(push)
+#pragma pack(1)
+struct index_header_s {
+    char magic[8];                      /* INDEX_MAGIC */
+    u32 version;
+    u32 num_images;
+    u32 num_files;
+    u32 strings_size;
+};
+
+struct index_image_s {
+    u32 path_offset;                    /* Offset into the string table */
+    u32 first_file;
+    u16 num_files;
+    u8 format;
+    u8 num_tracks;
+};
+
+struct index_file_s {
+    u32 image;
+    u32 size;                           /* Data bytes, AMSDOS header excluded */
+    u8 user_number;
+    u8 file_name[8];
+    u8 ext[3];
+    u8 attributes;                      /* CPM_ATTR_* */
+    u8 filetype;                        /* AMSDOS filetype, or INDEX_NO_AMSDOS */
+    u16 data_location;
+    u16 entry_address;
+    u16 logical_length;
+    u8 hash[HASH_SIZE];
+};
+#pragma pack(pop)
+
+/* Images are read ahead of the num_workers threads parsing them, with up to
+   queue_depth reads in flight */
+int index_build(const char *index_file_name, struct corpus_s *corpus, int num_workers, int queue_depth);
+int index_query(const char *index_file_name, const char *pattern);
+
+#endif
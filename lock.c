@@ -0,0 +1,166 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+
+#include "lock.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#define HAVE_FLOCK
+#endif
+
+#if defined (HAVE_FLOCK)
+#define RETRY_INTERVAL_MS 10
+
+static
+int try_lock(int fd, int exclusive, double timeout)
+{
+    struct timespec interval;
+    double waited;
+
+    if (timeout < 0) {
+        while (flock(fd, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    interval.tv_sec  = 0;
+    interval.tv_nsec = RETRY_INTERVAL_MS * 1000000L;
+
+    for (waited = 0; ; waited += RETRY_INTERVAL_MS / 1000.0) {
+        if (flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == 0) {
+            return 0;
+        }
+
+        if ((errno != EWOULDBLOCK && errno != EINTR) || waited >= timeout) {
+            return -1;
+        }
+
+        nanosleep(&interval, NULL);
+    }
+}
+
+int lock_acquire(struct lock_s *lock, const char *file_name, int exclusive, double timeout)
+{
+    assert(lock);
+    assert(file_name);
+
+    while (1) {
+        struct stat locked;
+        struct stat current;
+
+        lock->fd = open(file_name, O_RDONLY);
+        if (lock->fd < 0) {
+            if (exclusive && errno == ENOENT) {
+                return 0;
+            }
+
+            fprintf(stderr, "Failed to open file %s.\n", file_name);
+            return -1;
+        }
+
+        if (try_lock(lock->fd, exclusive, timeout) != 0) {
+            fprintf(stderr, "Timed out waiting for the lock on %s.\n", file_name);
+            lock_release(lock);
+            return -1;
+        }
+
+        /* A writer may have replaced the file while we waited */
+        if (   fstat(lock->fd, &locked) == 0
+            && stat(file_name, &current) == 0
+            && locked.st_dev == current.st_dev
+            && locked.st_ino == current.st_ino) {
+            return 0;
+        }
+
+        lock_release(lock);
+    }
+}
+
+void lock_release(struct lock_s *lock)
+{
+    assert(lock);
+
+    if (lock->fd >= 0) {
+        close(lock->fd);
+        lock->fd = -1;
+    }
+}
+#else
+int lock_acquire(struct lock_s *lock, const char *file_name, int exclusive, double timeout)
+{
+    (void) file_name;
+    (void) exclusive;
+    (void) timeout;
+
+    lock->fd = -1;
+
+    return 0;
+}
+
+void lock_release(struct lock_s *lock)
+{
+    lock->fd = -1;
+}
+#endif
+
+int lock_acquire_pair(struct lock_s *shared_lock, const char *shared_name,
+                      struct lock_s *exclusive_lock, const char *exclusive_name, double timeout)
+{
+    char *shared_path;
+    char *exclusive_path;
+    int exclusive_first;
+
+    assert(shared_lock);
+    assert(exclusive_lock);
+
+    /* Resolved paths stay the same when the files are replaced, unlike
+       their inodes */
+#if defined (HAVE_FLOCK)
+    shared_path    = realpath(shared_name, NULL);
+    exclusive_path = realpath(exclusive_name, NULL);
+#else
+    shared_path    = NULL;
+    exclusive_path = NULL;
+#endif
+
+    exclusive_first = strcmp(exclusive_path ? exclusive_path : exclusive_name,
+                             shared_path ? shared_path : shared_name) < 0;
+
+    free(shared_path);
+    free(exclusive_path);
+
+    if (exclusive_first) {
+        if (lock_acquire(exclusive_lock, exclusive_name, 1, timeout) != 0) {
+            return -1;
+        }
+
+        if (lock_acquire(shared_lock, shared_name, 0, timeout) != 0) {
+            lock_release(exclusive_lock);
+            return -1;
+        }
+    } else {
+        if (lock_acquire(shared_lock, shared_name, 0, timeout) != 0) {
+            return -1;
+        }
+
+        if (lock_acquire(exclusive_lock, exclusive_name, 1, timeout) != 0) {
+            lock_release(shared_lock);
+            return -1;
+        }
+    }
+
+    return 0;
+}
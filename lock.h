@@ -0,0 +1,25 @@
+#ifndef LOCK_H_
+#define LOCK_H_
+
+/* Advisory lock on an image file. Readers share the lock, writers hold it
+   exclusively while they load, change and replace the image. Since images
+   are replaced by renaming a new file over them, a lock is only kept once
+   the path still names the file that was locked. */
+struct lock_s {
+    int fd;
+};
+
+/* Waits up to timeout seconds for the lock, or forever when timeout is
+   negative. An exclusive lock on a file that does not exist yet succeeds
+   without locking anything. */
+int lock_acquire(struct lock_s *lock, const char *file_name, int exclusive, double timeout);
+void lock_release(struct lock_s *lock);
+
+/* Takes a shared lock on one file and an exclusive lock on another, always
+   in the order of their resolved paths, so two commands locking the same
+   pair the other way round never wait on each other forever. The files must
+   differ, since a process waits for its own exclusive lock. */
+int lock_acquire_pair(struct lock_s *shared_lock, const char *shared_name,
+                      struct lock_s *exclusive_lock, const char *exclusive_name, double timeout);
+
+#endif
@@ -0,0 +1,1053 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+
+#include "master.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "amsdos.h"
+#include "hash.h"
+#include "lock.h"
+#include "shadow.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <sys/stat.h>
+#define HAVE_STAT
+#endif
+
+#define MAX_LINE_LENGTH     4096
+#define MAX_NODES           (1L << 20)
+#define MAX_STAT_LENGTH     96
+
+#define CACHE_SUFFIX        ".build"
+#define CACHE_HEADER        "sector-cpc build 1\n"
+
+struct master_file_s {
+    char *path;                         /* Resolved once the data is loaded */
+    char name[13];
+    int user;
+    int type;                           /* -1 for the default of the extension */
+    u16 load;
+    u16 exec;
+    int raw;
+    int disk;                           /* Required disk, from 1, or 0 */
+    char after_name[13];
+    int after;                          /* Index of the file it follows, or -1 */
+    u8 *data;                           /* AMSDOS header included */
+    long size;
+    char stat[MAX_STAT_LENGTH];         /* As it was before reading, or empty */
+    int num_blocks;
+    int num_extents;
+};
+
+struct master_cost_s {
+    int num_blocks;
+    int num_extents;
+    int index;
+};
+
+struct master_s {
+    struct master_file_s *files;
+    int num_files;
+    int num_free_files;                 /* Without disk=N, in order */
+    int *order;                         /* Free files, largest first */
+    long *remaining_blocks;             /* Of order[i] onwards */
+    int *disk_of;                       /* From 0, or -1 while unplaced */
+    int *used_blocks;
+    int *used_diren;
+    int num_disks;
+    int capacity_blocks;
+    int capacity_diren;
+    long free_blocks;
+    long num_nodes;
+    int has_after;
+    char manifest_stat[MAX_STAT_LENGTH];
+};
+
+/* Size and modification time of a file, in the form kept in the cache */
+static
+int stat_line(const char *path, char *dest)
+{
+#if defined (HAVE_STAT)
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+
+#if defined (__linux__)
+    sprintf(dest, "%ld %ld %ld", (long) st.st_size, (long) st.st_mtime, (long) st.st_mtim.tv_nsec);
+#else
+    sprintf(dest, "%ld %ld 0", (long) st.st_size, (long) st.st_mtime);
+#endif
+
+    return 0;
+#else
+    (void) path;
+    (void) dest;
+
+    return -1;
+#endif
+}
+
+/* Turns a name into NAME.EXT as it is listed, or returns -1 if it is not a
+   valid CP/M file name */
+static
+int canonical_name(const char *file_name, char *dest)
+{
+    struct cpm_diren_s dir;
+
+    if (!cpm_valid_filename(file_name) || !strcspn(file_name, ".")) {
+        return -1;
+    }
+
+    memset(&dir, 0, sizeof(dir));
+    denormalize_filename(file_name, &dir);
+    normalize_filename(dest, &dir);
+
+    return 0;
+}
+
+static
+int load_data(struct master_file_s *file, const char *base_dir, int amsdos)
+{
+    char *path;
+    long header_size;
+    FILE *fp;
+
+    path = (char *) malloc(strlen(base_dir) + strlen(file->path) + 2);
+    if (!path) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if (file->path[0] == '/' || !base_dir[0]) {
+        strcpy(path, file->path);
+    } else {
+        sprintf(path, "%s/%s", base_dir, file->path);
+    }
+
+    free(file->path);
+    file->path = path;
+
+    /* Taken before the data is read, so a change made while reading shows
+       at the next build */
+    if (stat_line(path, file->stat) != 0) {
+        file->stat[0] = 0;
+    }
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", path);
+        return -1;
+    }
+
+    header_size = amsdos && !file->raw ? (long) sizeof(struct amsdos_header_s) : 0;
+
+    fseek(fp, 0, SEEK_END);
+    file->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    file->data = (u8 *) malloc(header_size + file->size + 1);
+    if (!file->data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if (file->size > 0 && fread(file->data + header_size, file->size, 1, fp) != 1) {
+        fprintf(stderr, "Failed to read file %s.\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    if (header_size) {
+        struct amsdos_header_s header;
+
+        amsdos_new_header(&header, file->name, file->size, file->load, file->exec);
+        header.user_number = (u8) file->user;
+
+        if (file->type >= 0) {
+            header.filetype = (u8) file->type;
+        }
+
+        amsdos_set_length(&header, file->size);
+        memcpy(file->data, &header, sizeof(header));
+
+        file->size += header_size;
+    }
+
+    cpm_file_cost(file->size, &file->num_blocks, &file->num_extents);
+
+    return 0;
+}
+
+static
+int parse_line(struct master_s *master, char *line, int line_number)
+{
+    struct master_file_s *file;
+    const char *base_name;
+    char *token;
+    int i;
+
+    token = strtok(line, " \t\r\n");
+    if (!token || token[0] == '#') {
+        return 0;
+    }
+
+    file = &master->files[master->num_files];
+    memset(file, 0, sizeof(*file));
+
+    file->path  = (char *) malloc(strlen(token) + 1);
+    file->type  = -1;
+    file->after = -1;
+
+    if (!file->path) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    strcpy(file->path, token);
+
+    base_name = strrchr(token, '/') ? strrchr(token, '/') + 1 : token;
+
+    if (canonical_name(base_name, file->name) != 0) {
+        file->name[0] = 0;
+    }
+
+    while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+        if (strncmp(token, "name=", 5) == 0) {
+            if (canonical_name(token + 5, file->name) != 0) {
+                fprintf(stderr, "Line %d: %s is not a valid file name.\n", line_number, token + 5);
+                free(file->path);
+                return -1;
+            }
+        } else if (strncmp(token, "user=", 5) == 0) {
+            file->user = atoi(token + 5);
+        } else if (strncmp(token, "type=", 5) == 0) {
+            file->type = atoi(token + 5);
+        } else if (strncmp(token, "load=", 5) == 0) {
+            file->load = (u16) strtol(token + 5, NULL, 16);
+        } else if (strncmp(token, "exec=", 5) == 0) {
+            file->exec = (u16) strtol(token + 5, NULL, 16);
+        } else if (strcmp(token, "raw") == 0) {
+            file->raw = 1;
+        } else if (strncmp(token, "disk=", 5) == 0) {
+            file->disk = atoi(token + 5);
+        } else if (strncmp(token, "after=", 6) == 0) {
+            if (canonical_name(token + 6, file->after_name) != 0) {
+                fprintf(stderr, "Line %d: %s is not a valid file name.\n", line_number, token + 6);
+                free(file->path);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Line %d: unknown option %s.\n", line_number, token);
+            free(file->path);
+            return -1;
+        }
+    }
+
+    if (!file->name[0] || file->user < 0 || file->user > 15 || file->disk < 0) {
+        fprintf(stderr, "Line %d: %s is not a valid file for user %d.\n", line_number, file->path, file->user);
+        free(file->path);
+        return -1;
+    }
+
+    /* Load order follows the manifest, so a file can only follow one listed
+       before it */
+    if (file->after_name[0]) {
+        for (i = 0; i < master->num_files && strcmp(master->files[i].name, file->after_name) != 0; i++) {
+        }
+
+        if (i == master->num_files) {
+            fprintf(stderr, "Line %d: %s must follow %s, which is not listed before it.\n",
+                    line_number, file->name, file->after_name);
+            free(file->path);
+            return -1;
+        }
+
+        file->after = i;
+        master->has_after = 1;
+    }
+
+    for (i = 0; i < master->num_files; i++) {
+        if (strcmp(master->files[i].name, file->name) == 0 && master->files[i].user == file->user) {
+            fprintf(stderr, "Line %d: %s is listed twice.\n", line_number, file->name);
+            free(file->path);
+            return -1;
+        }
+    }
+
+    master->num_files++;
+
+    return 0;
+}
+
+static
+int read_manifest(struct master_s *master, const char *manifest_name, int amsdos)
+{
+    char line[MAX_LINE_LENGTH];
+    char base_dir[MAX_LINE_LENGTH];
+    const char *slash;
+    FILE *manifest;
+    int capacity;
+    int line_number;
+    int failed;
+    int i;
+
+    if (stat_line(manifest_name, master->manifest_stat) != 0) {
+        master->manifest_stat[0] = 0;
+    }
+
+    manifest = fopen(manifest_name, "r");
+    if (!manifest) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", manifest_name);
+        return -1;
+    }
+
+    slash = strrchr(manifest_name, '/');
+    if (slash && slash - manifest_name < (long) sizeof(base_dir)) {
+        memcpy(base_dir, manifest_name, slash - manifest_name);
+        base_dir[slash - manifest_name] = 0;
+    } else {
+        base_dir[0] = 0;
+    }
+
+    capacity    = 16;
+    line_number = 0;
+    failed      = 0;
+
+    master->files = (struct master_file_s *) malloc(capacity * sizeof(*master->files));
+
+    while (master->files && fgets(line, sizeof(line), manifest)) {
+        line_number++;
+
+        if (master->num_files == capacity) {
+            capacity *= 2;
+            master->files = (struct master_file_s *) realloc(master->files, capacity * sizeof(*master->files));
+            if (!master->files) {
+                break;
+            }
+        }
+
+        if (parse_line(master, line, line_number) != 0) {
+            failed = 1;
+        }
+    }
+
+    fclose(manifest);
+
+    if (!master->files) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < master->num_files && !failed; i++) {
+        if (load_data(&master->files[i], base_dir, amsdos) != 0) {
+            failed = 1;
+        }
+    }
+
+    return failed ? -1 : 0;
+}
+
+static
+int fits(struct master_s *master, struct master_file_s *file, int disk)
+{
+    return master->used_blocks[disk] + file->num_blocks <= master->capacity_blocks
+        && master->used_diren[disk] + file->num_extents <= master->capacity_diren;
+}
+
+static
+void assign(struct master_s *master, int index, int disk)
+{
+    struct master_file_s *file = &master->files[index];
+
+    if (disk >= 0) {
+        master->used_blocks[disk] += file->num_blocks;
+        master->used_diren[disk]  += file->num_extents;
+        master->free_blocks       -= file->num_blocks;
+    } else {
+        disk = master->disk_of[index];
+        master->used_blocks[disk] -= file->num_blocks;
+        master->used_diren[disk]  -= file->num_extents;
+        master->free_blocks       += file->num_blocks;
+        disk = -1;
+    }
+
+    master->disk_of[index] = disk;
+}
+
+/* Places the free files from depth on, largest first, each into the lowest
+   disk it fits on, so the first solution found is first fit decreasing and
+   the slack collects on the last disk. Backtracks when a file fits nowhere,
+   until MAX_NODES placements have been tried. */
+static
+int place(struct master_s *master, int depth)
+{
+    struct master_file_s *file;
+    int tried_empty;
+    int lowest;
+    int highest;
+    int index;
+    int disk;
+    int i;
+
+    if (depth == master->num_free_files) {
+        return 1;
+    }
+
+    if (   ++master->num_nodes > MAX_NODES
+        || master->remaining_blocks[depth] > master->free_blocks) {
+        return 0;
+    }
+
+    index   = master->order[depth];
+    file    = &master->files[index];
+    lowest  = 0;
+    highest = master->num_disks - 1;
+
+    if (file->after >= 0 && master->disk_of[file->after] >= 0) {
+        lowest = master->disk_of[file->after];
+    }
+
+    for (i = 0; i < master->num_files; i++) {
+        if (   master->files[i].after == index
+            && master->disk_of[i] >= 0
+            && master->disk_of[i] < highest) {
+            highest = master->disk_of[i];
+        }
+    }
+
+    tried_empty = 0;
+
+    for (disk = lowest; disk <= highest; disk++) {
+        if (!fits(master, file, disk)) {
+            continue;
+        }
+
+        /* Empty disks are alike unless the order of disks matters */
+        if (master->used_diren[disk] == 0 && !master->has_after) {
+            if (tried_empty) {
+                continue;
+            }
+            tried_empty = 1;
+        }
+
+        assign(master, index, disk);
+
+        if (place(master, depth + 1)) {
+            return 1;
+        }
+
+        assign(master, index, -1);
+    }
+
+    return 0;
+}
+
+static
+int compare_cost(const void *a, const void *b)
+{
+    const struct master_cost_s *x = (const struct master_cost_s *) a;
+    const struct master_cost_s *y = (const struct master_cost_s *) b;
+
+    if (x->num_blocks != y->num_blocks) {
+        return y->num_blocks - x->num_blocks;
+    }
+
+    if (x->num_extents != y->num_extents) {
+        return y->num_extents - x->num_extents;
+    }
+
+    return x->index - y->index;
+}
+
+/* Places files with disk=N first, then searches for the fewest disks that
+   hold the rest. Returns the number of disks, or -1 if there is none. */
+static
+int plan(struct master_s *master, int span)
+{
+    struct master_cost_s *costs;
+    long total_blocks;
+    long total_diren;
+    int max_disks;
+    int min_disks;
+    int i;
+
+    master->order            = (int *) malloc((master->num_files + 1) * sizeof(int));
+    master->remaining_blocks = (long *) malloc((master->num_files + 1) * sizeof(long));
+    master->disk_of          = (int *) malloc((master->num_files + 1) * sizeof(int));
+    costs                    = (struct master_cost_s *) malloc((master->num_files + 1) * sizeof(*costs));
+
+    if (!master->order || !master->remaining_blocks || !master->disk_of || !costs) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    total_blocks = 0;
+    total_diren  = 0;
+    max_disks    = 0;
+    min_disks    = 1;
+
+    for (i = 0; i < master->num_files; i++) {
+        struct master_file_s *file = &master->files[i];
+
+        if (   file->num_blocks > master->capacity_blocks
+            || file->num_extents > master->capacity_diren) {
+            fprintf(stderr, "%s needs %d blocks and %d entries, a disk holds %d and %d.\n",
+                    file->name, file->num_blocks, file->num_extents,
+                    master->capacity_blocks, master->capacity_diren);
+            free(costs);
+            return -1;
+        }
+
+        if (file->disk > 0) {
+            if (!span && file->disk > 1) {
+                fprintf(stderr, "%s is meant for disk %d, use --span.\n", file->name, file->disk);
+                free(costs);
+                return -1;
+            }
+
+            if (file->disk > min_disks) {
+                min_disks = file->disk;
+            }
+        } else {
+            costs[master->num_free_files].num_blocks  = file->num_blocks;
+            costs[master->num_free_files].num_extents = file->num_extents;
+            costs[master->num_free_files].index       = i;
+            master->num_free_files++;
+        }
+
+        total_blocks += file->num_blocks;
+        total_diren  += file->num_extents;
+        master->disk_of[i] = -1;
+    }
+
+    max_disks = span ? min_disks + master->num_free_files : 1;
+
+    if (min_disks < (total_blocks + master->capacity_blocks - 1) / master->capacity_blocks) {
+        min_disks = (total_blocks + master->capacity_blocks - 1) / master->capacity_blocks;
+    }
+
+    if (min_disks < (total_diren + master->capacity_diren - 1) / master->capacity_diren) {
+        min_disks = (total_diren + master->capacity_diren - 1) / master->capacity_diren;
+    }
+
+    qsort(costs, master->num_free_files, sizeof(*costs), compare_cost);
+
+    for (i = 0; i < master->num_free_files; i++) {
+        master->order[i] = costs[i].index;
+    }
+
+    free(costs);
+
+    master->remaining_blocks[master->num_free_files] = 0;
+    for (i = master->num_free_files - 1; i >= 0; i--) {
+        master->remaining_blocks[i] = master->remaining_blocks[i + 1]
+                                    + master->files[master->order[i]].num_blocks;
+    }
+
+    master->used_blocks = (int *) calloc(max_disks + 1, sizeof(int));
+    master->used_diren  = (int *) calloc(max_disks + 1, sizeof(int));
+
+    if (!master->used_blocks || !master->used_diren) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < master->num_files; i++) {
+        struct master_file_s *file = &master->files[i];
+
+        if (file->disk > 0) {
+            if (   file->after >= 0
+                && master->files[file->after].disk > file->disk) {
+                fprintf(stderr, "%s is meant for disk %d, before %s it must follow.\n",
+                        file->name, file->disk, master->files[file->after].name);
+                return -1;
+            }
+
+            master->used_blocks[file->disk - 1] += file->num_blocks;
+            master->used_diren[file->disk - 1]  += file->num_extents;
+            master->disk_of[i] = file->disk - 1;
+
+            if (   master->used_blocks[file->disk - 1] > master->capacity_blocks
+                || master->used_diren[file->disk - 1] > master->capacity_diren) {
+                fprintf(stderr, "Files meant for disk %d do not fit on it.\n", file->disk);
+                return -1;
+            }
+        }
+    }
+
+    for (master->num_disks = min_disks; master->num_disks <= max_disks; master->num_disks++) {
+        master->free_blocks = 0;
+        for (i = 0; i < master->num_disks; i++) {
+            master->free_blocks += master->capacity_blocks - master->used_blocks[i];
+        }
+
+        master->num_nodes = 0;
+
+        if (place(master, 0)) {
+            return master->num_disks;
+        }
+    }
+
+    if (span) {
+        fprintf(stderr, "Files can not be placed, check their disk and after constraints.\n");
+    } else {
+        fprintf(stderr, "Files need %ld blocks and %ld entries, a disk holds %d and %d. Use --span.\n",
+                total_blocks, total_diren, master->capacity_blocks, master->capacity_diren);
+    }
+
+    return -1;
+}
+
+/* Inserts -N before the extension of image_name */
+static
+void span_name(const char *image_name, int disk, char *dest)
+{
+    const char *slash;
+    const char *dot;
+
+    slash = strrchr(image_name, '/');
+    dot   = strrchr(image_name, '.');
+
+    if (!dot || (slash && dot < slash)) {
+        sprintf(dest, "%s-%d", image_name, disk);
+    } else {
+        sprintf(dest, "%.*s-%d%s", (int) (dot - image_name), image_name, disk, dot);
+    }
+}
+
+static
+int write_disk(struct master_s *master, int disk, FILE *fp)
+{
+    int i;
+
+    cpm_new(fp);
+
+    if (cpm_init(fp) != 0) {
+        fprintf(stderr, "Unrecognized disk type\n");
+        return -1;
+    }
+
+    for (i = 0; i < master->num_files; i++) {
+        struct master_file_s *file = &master->files[i];
+        struct cpm_diren_s entry;
+
+        if (master->disk_of[i] != disk) {
+            continue;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        denormalize_filename(file->name, &entry);
+        entry.user_number = (u8) file->user;
+
+        if (cpm_write_entry(fp, &entry, file->data, file->size) < 0) {
+            fprintf(stderr, "Failed to insert %s, not enough space on disk.\n", file->name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static
+void print_plan(struct master_s *master, int disk, const char *name)
+{
+    int num_files;
+    int i;
+
+    num_files = 0;
+    for (i = 0; i < master->num_files; i++) {
+        num_files += master->disk_of[i] == disk;
+    }
+
+    printf("%s: %d files, %d of %d blocks, %d of %d entries.\n", name, num_files,
+           master->used_blocks[disk], master->capacity_blocks,
+           master->used_diren[disk], master->capacity_diren);
+
+    for (i = 0; i < master->num_files; i++) {
+        if (master->disk_of[i] == disk) {
+            printf("  %-12s %3d blocks %2d entries\n", master->files[i].name,
+                   master->files[i].num_blocks, master->files[i].num_extents);
+        }
+    }
+}
+
+static
+void image_name_of(const char *image_name, int span, int disk, char *dest)
+{
+    if (span) {
+        span_name(image_name, disk + 1, dest);
+    } else {
+        strcpy(dest, image_name);
+    }
+}
+
+/* Builds every image in memory, and only writes them once all are complete */
+static
+int build_images(struct master_s *master, int num_disks, const char *image_name, int span,
+                 double lock_timeout)
+{
+    struct shadow_s *shadows;
+    struct lock_s *locks;
+    int num_built;
+    int result;
+    int i;
+
+    shadows = (struct shadow_s *) calloc(num_disks, sizeof(*shadows));
+    locks   = (struct lock_s *) calloc(num_disks, sizeof(*locks));
+
+    if (!shadows || !locks) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    result = 0;
+
+    for (num_built = 0; num_built < num_disks; num_built++) {
+        char name[MAX_LINE_LENGTH + 16];
+
+        image_name_of(image_name, span, num_built, name);
+        print_plan(master, num_built, name);
+
+        if (lock_acquire(&locks[num_built], name, 1, lock_timeout) != 0) {
+            result = -1;
+            break;
+        }
+
+        if (shadow_new(&shadows[num_built], name, CPCEMU_INFO_OFFSET + SIZ_TOTAL) != 0) {
+            lock_release(&locks[num_built]);
+            result = -1;
+            break;
+        }
+
+        if (write_disk(master, num_built, shadows[num_built].fp) != 0) {
+            shadow_close(&shadows[num_built]);
+            lock_release(&locks[num_built]);
+            result = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < num_built; i++) {
+        if (result == 0 && shadow_commit(&shadows[i]) != 0) {
+            result = -1;
+        }
+
+        shadow_close(&shadows[i]);
+        lock_release(&locks[i]);
+    }
+
+    free(shadows);
+    free(locks);
+
+    return result;
+}
+
+static
+void hash_int(struct hash_s *hash, long value)
+{
+    u8 bytes[4];
+
+    bytes[0] = (u8) value;
+    bytes[1] = (u8) (value >> 8);
+    bytes[2] = (u8) (value >> 16);
+    bytes[3] = (u8) (value >> 24);
+
+    hash_update(hash, bytes, sizeof(bytes));
+}
+
+/* Everything that decides the images besides the manifest contents. The
+   manifest itself is included, so building from another one is never up to
+   date. */
+static
+void options_key(struct master_s *master, const char *manifest_name, int span, int amsdos,
+                 char hex[HASH_SIZE * 2 + 1])
+{
+    struct hash_s hash;
+    u8 digest[HASH_SIZE];
+    char *resolved;
+
+#if defined (HAVE_STAT)
+    resolved = realpath(manifest_name, NULL);
+#else
+    resolved = NULL;
+#endif
+
+    hash_init(&hash, 0);
+    hash_update(&hash, (const u8 *) CACHE_HEADER, strlen(CACHE_HEADER));
+
+    if (resolved) {
+        hash_update(&hash, (const u8 *) resolved, strlen(resolved) + 1);
+        free(resolved);
+    } else {
+        hash_update(&hash, (const u8 *) manifest_name, strlen(manifest_name) + 1);
+    }
+
+    hash_int(&hash, span);
+    hash_int(&hash, amsdos);
+    hash_int(&hash, master->capacity_blocks);
+    hash_int(&hash, master->capacity_diren);
+    hash_final(&hash, digest);
+    hash_to_hex(digest, hex);
+}
+
+/* The files as they go on disk, AMSDOS headers included, and their
+   constraints. Comments and layout of the manifest do not count. */
+static
+void content_key(struct master_s *master, const char *options, char hex[HASH_SIZE * 2 + 1])
+{
+    struct hash_s hash;
+    u8 digest[HASH_SIZE];
+    int i;
+
+    hash_init(&hash, 0);
+    hash_update(&hash, (const u8 *) options, strlen(options));
+
+    for (i = 0; i < master->num_files; i++) {
+        struct master_file_s *file = &master->files[i];
+
+        hash_update(&hash, (const u8 *) file->name, strlen(file->name) + 1);
+        hash_int(&hash, file->user);
+        hash_int(&hash, file->disk);
+        hash_int(&hash, file->after);
+        hash_int(&hash, file->size);
+        hash_update(&hash, file->data, file->size);
+    }
+
+    hash_final(&hash, digest);
+    hash_to_hex(digest, hex);
+}
+
+struct master_cache_s {
+    char options[HASH_SIZE * 2 + 1];
+    char key[HASH_SIZE * 2 + 1];
+    int num_images;
+    int inputs_fresh;                   /* Same size and time as recorded */
+    int images_fresh;
+};
+
+/* Reads the cache of a previous build and compares the recorded inputs and
+   images against the file system, without reading them. Returns -1 if
+   there is no usable cache. */
+static
+int read_cache(const char *cache_name, struct master_cache_s *cache)
+{
+    char line[MAX_LINE_LENGTH + 128];
+    FILE *fp;
+    int result;
+
+    memset(cache, 0, sizeof(*cache));
+
+    fp = fopen(cache_name, "r");
+    if (!fp) {
+        return -1;
+    }
+
+    result = -1;
+
+    if (fgets(line, sizeof(line), fp) && strcmp(line, CACHE_HEADER) == 0) {
+        cache->inputs_fresh = 1;
+        cache->images_fresh = 1;
+        result = 0;
+    }
+
+    while (result == 0 && fgets(line, sizeof(line), fp)) {
+        char path[MAX_LINE_LENGTH];
+        char recorded[MAX_STAT_LENGTH];
+        char current[MAX_STAT_LENGTH];
+        char kind[8];
+        long size;
+        long mtime;
+        long nsec;
+        int fresh;
+
+        if (   sscanf(line, "options %32s", cache->options) == 1
+            || sscanf(line, "key %32s", cache->key) == 1) {
+            continue;
+        }
+
+        if (sscanf(line, "%7s %ld %ld %ld %4095[^\n]", kind, &size, &mtime, &nsec, path) != 5) {
+            result = -1;
+            break;
+        }
+
+        sprintf(recorded, "%ld %ld %ld", size, mtime, nsec);
+        fresh = stat_line(path, current) == 0 && strcmp(recorded, current) == 0;
+
+        if (strcmp(kind, "image") == 0) {
+            cache->images_fresh &= fresh;
+            cache->num_images++;
+        } else {
+            cache->inputs_fresh &= fresh;
+        }
+    }
+
+    fclose(fp);
+
+    if (!cache->options[0] || !cache->key[0] || cache->num_images == 0) {
+        result = -1;
+    }
+
+    return result;
+}
+
+static
+int write_cache(const char *cache_name, const char *options, const char *key,
+                const char *manifest_name, struct master_s *master,
+                const char *image_name, int span, int num_disks)
+{
+    char name[MAX_LINE_LENGTH + 16];
+    char current[MAX_STAT_LENGTH];
+    FILE *fp;
+    int result;
+    int i;
+
+    fp = fopen(cache_name, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", cache_name);
+        return -1;
+    }
+
+    fprintf(fp, "%s", CACHE_HEADER);
+    fprintf(fp, "options %s\n", options);
+    fprintf(fp, "key %s\n", key);
+
+    /* Inputs as they were before they were read */
+    result = master->manifest_stat[0] ? 0 : -1;
+    if (result == 0) {
+        fprintf(fp, "input %s %s\n", master->manifest_stat, manifest_name);
+    }
+
+    for (i = 0; i < master->num_files && result == 0; i++) {
+        result = master->files[i].stat[0] ? 0 : -1;
+        if (result == 0) {
+            fprintf(fp, "input %s %s\n", master->files[i].stat, master->files[i].path);
+        }
+    }
+
+    for (i = 0; i < num_disks && result == 0; i++) {
+        image_name_of(image_name, span, i, name);
+
+        result = stat_line(name, current);
+        if (result == 0) {
+            fprintf(fp, "image %s %s\n", current, name);
+        }
+    }
+
+    fclose(fp);
+
+    /* A cache that can not be checked is no cache */
+    if (result != 0) {
+        remove(cache_name);
+    }
+
+    return result;
+}
+
+static
+void free_master(struct master_s *master)
+{
+    int i;
+
+    for (i = 0; i < master->num_files; i++) {
+        free(master->files[i].path);
+        free(master->files[i].data);
+    }
+
+    free(master->files);
+    free(master->order);
+    free(master->remaining_blocks);
+    free(master->disk_of);
+    free(master->used_blocks);
+    free(master->used_diren);
+}
+
+int master_build(const char *manifest_name, const char *image_name, int span, int amsdos,
+                 double lock_timeout)
+{
+    struct master_cache_s cache;
+    struct master_s master;
+    struct shadow_s probe;
+    char options[HASH_SIZE * 2 + 1];
+    char key[HASH_SIZE * 2 + 1];
+    char *cache_name;
+    int num_disks;
+    int has_cache;
+
+    assert(manifest_name);
+    assert(image_name);
+
+    if (strlen(image_name) >= MAX_LINE_LENGTH) {
+        fprintf(stderr, "Image name %s is too long.\n", image_name);
+        return -1;
+    }
+
+    memset(&master, 0, sizeof(master));
+
+    /* Costs come from the DPB of a new data disk */
+    if (shadow_new(&probe, image_name, CPCEMU_INFO_OFFSET + SIZ_TOTAL) != 0) {
+        return -1;
+    }
+
+    cpm_new(probe.fp);
+    cpm_init(probe.fp);
+    cpm_capacity(&master.capacity_blocks, &master.capacity_diren);
+    shadow_close(&probe);
+
+    cache_name = (char *) malloc(strlen(image_name) + strlen(CACHE_SUFFIX) + 1);
+    if (!cache_name) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    sprintf(cache_name, "%s%s", image_name, CACHE_SUFFIX);
+
+    options_key(&master, manifest_name, span, amsdos, options);
+    has_cache = read_cache(cache_name, &cache) == 0 && strcmp(cache.options, options) == 0;
+
+    /* Nothing was touched since the last build, so nothing is read */
+    if (has_cache && cache.inputs_fresh && cache.images_fresh) {
+        printf("%s is up to date.\n", image_name);
+        free(cache_name);
+        return cache.num_images;
+    }
+
+    num_disks = -1;
+
+    if (read_manifest(&master, manifest_name, amsdos) == 0) {
+        content_key(&master, options, key);
+
+        if (has_cache && cache.images_fresh && strcmp(cache.key, key) == 0) {
+            /* Inputs were touched but hold the same bytes */
+            printf("%s is up to date.\n", image_name);
+            num_disks = cache.num_images;
+        } else {
+            remove(cache_name);
+            num_disks = plan(&master, span);
+
+            if (num_disks > 0 && build_images(&master, num_disks, image_name, span, lock_timeout) != 0) {
+                num_disks = -1;
+            }
+        }
+
+        if (num_disks > 0) {
+            write_cache(cache_name, options, key, manifest_name, &master, image_name, span, num_disks);
+        }
+    }
+
+    free_master(&master);
+    free(cache_name);
+
+    return num_disks;
+}
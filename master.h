@@ -0,0 +1,29 @@
+#ifndef MASTER_H_
+#define MASTER_H_
+
+/* Builds new data disk images from a manifest of host files, one per line:
+
+       host_path [name=NAME] [user=N] [type=N] [load=HEX] [exec=HEX] [raw]
+                 [disk=N] [after=NAME]
+
+   Paths are relative to the manifest. Files get an AMSDOS header when amsdos
+   is set, unless marked raw, and are written in manifest order. Without span
+   everything goes on image_name. With span the files are packed into the
+   fewest images, named image_name with -1, -2, ... before the extension,
+   keeping files marked disk=N on disk N and files marked after=NAME on the
+   disk of NAME or a later one. Costs are counted in blocks and directory
+   entries as the DPB allocates them. All images are built in memory and
+   only written once every file is in place.
+
+   Images are the same bytes for the same inputs: files take directory slots
+   and blocks in manifest order on a fresh disk, and unused bytes are 0xE5.
+   image_name.build keeps a hash of the manifest path, the file data, their
+   constraints and the options, with the sizes and times of the inputs and
+   images. When none of
+   them changed nothing is read, and when only the times changed the hash
+   decides. Returns the number of images written or up to date, or -1 on
+   errors. */
+int master_build(const char *manifest_name, const char *image_name, int span, int amsdos,
+                 double lock_timeout);
+
+#endif
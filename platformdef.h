@@ -12,4 +12,14 @@
 #define isprint iswprint
 #endif
 
+/* Per-thread storage for the CP/M layer state, so that images can be processed
+   on several worker threads at once. */
+#if defined (_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#elif defined (__GNUC__)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
 #endif
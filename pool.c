@@ -0,0 +1,114 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "pool.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined (HAVE_PTHREAD)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define MAX_WORKERS 64
+
+struct pool_s {
+    pool_job_fn job_fn;
+    void *ctx;
+    int num_jobs;
+    int next_job;
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_t lock;
+#endif
+};
+
+int pool_default_workers(void)
+{
+#if defined (HAVE_PTHREAD) && defined (_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n > MAX_WORKERS) {
+        return MAX_WORKERS;
+    }
+
+    return n > 0 ? (int) n : 1;
+#else
+    return 1;
+#endif
+}
+
+#if defined (HAVE_PTHREAD)
+static
+void *worker_main(void *arg)
+{
+    struct pool_s *pool = (struct pool_s *) arg;
+
+    while (1) {
+        int job;
+
+        pthread_mutex_lock(&pool->lock);
+        job = pool->next_job++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (job >= pool->num_jobs) {
+            break;
+        }
+
+        pool->job_fn(pool->ctx, job);
+    }
+
+    return NULL;
+}
+#endif
+
+void pool_run(int num_workers, int num_jobs, pool_job_fn job_fn, void *ctx)
+{
+    struct pool_s pool;
+    int i;
+
+    assert(job_fn);
+
+    pool.job_fn   = job_fn;
+    pool.ctx      = ctx;
+    pool.num_jobs = num_jobs;
+    pool.next_job = 0;
+
+    if (num_workers > num_jobs) {
+        num_workers = num_jobs;
+    }
+
+    if (num_workers > MAX_WORKERS) {
+        num_workers = MAX_WORKERS;
+    }
+
+#if defined (HAVE_PTHREAD)
+    if (num_workers > 1) {
+        pthread_t threads[MAX_WORKERS];
+        int num_threads;
+
+        pthread_mutex_init(&pool.lock, NULL);
+
+        for (num_threads = 0; num_threads < num_workers; num_threads++) {
+            if (pthread_create(&threads[num_threads], NULL, worker_main, &pool) != 0) {
+                break;
+            }
+        }
+
+        if (num_threads == 0) {
+            worker_main(&pool);
+        }
+
+        for (i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        pthread_mutex_destroy(&pool.lock);
+        return;
+    }
+#endif
+
+    for (i = 0; i < num_jobs; i++) {
+        job_fn(ctx, i);
+    }
+}
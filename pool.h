@@ -0,0 +1,12 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+/* Runs job_fn(ctx, job) for every job in [0, num_jobs) on a bounded number of
+   worker threads. Jobs are handed out in order, and pool_run returns once all
+   of them are done. Without thread support the jobs run serially. */
+typedef void (*pool_job_fn)(void *ctx, int job);
+
+int pool_default_workers(void);
+void pool_run(int num_workers, int num_jobs, pool_job_fn job_fn, void *ctx);
+
+#endif
@@ -0,0 +1,607 @@
+#if defined (__linux__)
+#define _GNU_SOURCE
+#endif
+#define _POSIX_C_SOURCE 200809L
+
+#include "prefetch.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_POSIX_IO
+#endif
+
+#if defined (HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
+#if defined (HAVE_IO_URING) && defined (HAVE_PTHREAD) && defined (__GNUC__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define USE_IO_URING
+#endif
+
+#define MAX_QUEUE_DEPTH     4096
+
+#define FILE_PENDING        0
+#define FILE_READY          1
+#define FILE_FAILED         2
+
+struct prefetch_file_s {
+    u8 *data;
+    long size;
+    long done;
+    int fd;
+    int state;
+};
+
+struct prefetch_s {
+    char **paths;
+    struct prefetch_file_s *files;
+    int num_paths;
+    int queue_depth;
+    int window;
+    int num_held;
+    int stopping;
+#if defined (HAVE_PTHREAD)
+    pthread_t reader;
+    int reader_started;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#endif
+};
+
+#if defined (HAVE_PTHREAD)
+#define PREFETCH_LOCK(p)    pthread_mutex_lock(&(p)->lock)
+#define PREFETCH_UNLOCK(p)  pthread_mutex_unlock(&(p)->lock)
+#define PREFETCH_NOTIFY(p)  pthread_cond_broadcast(&(p)->changed)
+#else
+#define PREFETCH_LOCK(p)
+#define PREFETCH_UNLOCK(p)
+#define PREFETCH_NOTIFY(p)
+#endif
+
+#if defined (HAVE_POSIX_IO)
+/* Opens a regular file and allocates room for all of it */
+static
+int open_file(struct prefetch_file_s *file, const char *path)
+{
+    struct stat st;
+
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0) {
+        return -1;
+    }
+
+    if (fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(file->fd);
+        file->fd = -1;
+        return -1;
+    }
+
+    file->size = st.st_size;
+    file->done = 0;
+    file->data = (u8 *) malloc(file->size + 1);
+
+    if (!file->data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    return 0;
+}
+
+static
+int read_rest(struct prefetch_file_s *file)
+{
+    while (file->done < file->size) {
+        ssize_t n = read(file->fd, file->data + file->done, file->size - file->done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        file->done += n;
+    }
+
+    return 0;
+}
+#endif
+
+/* Marks a file read, or failed and without data */
+static
+void publish(struct prefetch_s *prefetch, int job, int ok)
+{
+    struct prefetch_file_s *file = &prefetch->files[job];
+
+#if defined (HAVE_POSIX_IO)
+    if (file->fd >= 0) {
+        close(file->fd);
+        file->fd = -1;
+    }
+#endif
+
+    if (!ok) {
+        free(file->data);
+        file->data = NULL;
+    }
+
+    PREFETCH_LOCK(prefetch);
+    file->state = ok ? FILE_READY : FILE_FAILED;
+    PREFETCH_NOTIFY(prefetch);
+    PREFETCH_UNLOCK(prefetch);
+}
+
+/* Reads a whole file with blocking calls */
+static
+void load_file(struct prefetch_s *prefetch, int job)
+{
+    struct prefetch_file_s *file = &prefetch->files[job];
+    int ok;
+
+#if defined (HAVE_POSIX_IO)
+    ok = open_file(file, prefetch->paths[job]) == 0 && read_rest(file) == 0;
+#else
+    FILE *fp;
+
+    ok = 0;
+    fp = fopen(prefetch->paths[job], "rb");
+
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        file->size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        file->data = (u8 *) malloc(file->size + 1);
+        if (!file->data) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        ok = fread(file->data, 1, file->size, fp) == (size_t) file->size;
+        fclose(fp);
+    }
+#endif
+
+    publish(prefetch, job, ok);
+}
+
+#if defined (HAVE_PTHREAD)
+/* Takes room for one more file, waiting for the workers to free some when
+   wait is set. Returns 0, or -1 when there is none, or the reads are being
+   stopped. */
+static
+int acquire_slot(struct prefetch_s *prefetch, int wait)
+{
+    int result;
+
+    PREFETCH_LOCK(prefetch);
+
+    while (wait && !prefetch->stopping && prefetch->num_held >= prefetch->window) {
+        pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+    }
+
+    result = -1;
+    if (!prefetch->stopping && prefetch->num_held < prefetch->window) {
+        prefetch->num_held++;
+        result = 0;
+    }
+
+    PREFETCH_UNLOCK(prefetch);
+
+    return result;
+}
+
+static
+int is_stopping(struct prefetch_s *prefetch)
+{
+    int stopping;
+
+    PREFETCH_LOCK(prefetch);
+    stopping = prefetch->stopping;
+    PREFETCH_UNLOCK(prefetch);
+
+    return stopping;
+}
+
+static
+void read_serially(struct prefetch_s *prefetch)
+{
+    int job;
+
+    for (job = 0; job < prefetch->num_paths; job++) {
+        if (acquire_slot(prefetch, 1) != 0) {
+            break;
+        }
+
+        load_file(prefetch, job);
+    }
+}
+#endif
+
+#if defined (USE_IO_URING)
+/* The rings shared with the kernel, driven through the raw system calls so
+   that no library is needed */
+struct uring_s {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static
+void uring_teardown(struct uring_s *ring)
+{
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    close(ring->fd);
+}
+
+/* Returns 0, or -1 when io_uring is missing or not allowed */
+static
+int uring_setup(struct uring_s *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    u8 *sq;
+    u8 *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         ring->fd, IORING_OFF_SQ_RING);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             ring->fd, IORING_OFF_CQ_RING);
+    }
+
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                              ring->fd, IORING_OFF_SQES);
+
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_teardown(ring);
+        return -1;
+    }
+
+    sq = (u8 *) ring->sq_ring;
+    cq = (u8 *) ring->cq_ring;
+
+    ring->sq_tail  = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask  = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head  = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask  = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+/* Queues a read of the rest of file job */
+static
+void uring_queue_read(struct uring_s *ring, struct prefetch_file_s *file, int job)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail;
+    unsigned index;
+
+    tail  = *ring->sq_tail;
+    index = tail & *ring->sq_mask;
+    sqe   = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = file->fd;
+    sqe->addr      = (unsigned long) (file->data + file->done);
+    sqe->len       = (unsigned) (file->size - file->done);
+    sqe->off       = (unsigned long) file->done;
+    sqe->user_data = (unsigned long) job;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Takes the next completion, if there is one */
+static
+int uring_reap(struct uring_s *ring, int *job, int *res)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    cqe  = &ring->cqes[head & *ring->cq_mask];
+    *job = (int) cqe->user_data;
+    *res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* Keeps up to queue_depth reads in flight, and hands each file over as soon
+   as its read completes, whatever the order they complete in */
+static
+void read_uring(struct prefetch_s *prefetch, struct uring_s *ring)
+{
+    int next;
+    int in_flight;
+    int to_submit;
+
+    next      = 0;
+    in_flight = 0;
+    to_submit = 0;
+
+    while (next < prefetch->num_paths || in_flight > 0) {
+        int job;
+        int res;
+
+        /* Only block for room when nothing is left to complete */
+        while (next < prefetch->num_paths && in_flight < prefetch->queue_depth) {
+            struct prefetch_file_s *file = &prefetch->files[next];
+
+            if (acquire_slot(prefetch, in_flight == 0) != 0) {
+                if (is_stopping(prefetch)) {
+                    next = prefetch->num_paths;
+                }
+                break;
+            }
+
+            if (open_file(file, prefetch->paths[next]) != 0) {
+                publish(prefetch, next, 0);
+            } else if (file->size == 0) {
+                publish(prefetch, next, 1);
+            } else {
+                uring_queue_read(ring, file, next);
+                to_submit++;
+                in_flight++;
+            }
+
+            next++;
+        }
+
+        if (in_flight == 0) {
+            continue;
+        }
+
+        res = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+
+            fprintf(stderr, "io_uring failed: %s.\n", strerror(errno));
+            exit(1);
+        }
+
+        to_submit -= res;
+
+        while (uring_reap(ring, &job, &res)) {
+            struct prefetch_file_s *file = &prefetch->files[job];
+
+            if (res == -EINTR || res == -EAGAIN) {
+                uring_queue_read(ring, file, job);
+                to_submit++;
+                continue;
+            }
+
+            /* Kernels before 5.6 have the ring but not this operation */
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                publish(prefetch, job, read_rest(file) == 0);
+                in_flight--;
+                continue;
+            }
+
+            if (res > 0) {
+                file->done += res;
+
+                if (file->done < file->size) {
+                    uring_queue_read(ring, file, job);
+                    to_submit++;
+                    continue;
+                }
+            }
+
+            publish(prefetch, job, file->done == file->size);
+            in_flight--;
+        }
+    }
+}
+#endif
+
+#if defined (HAVE_PTHREAD)
+static
+void *reader_main(void *arg)
+{
+    struct prefetch_s *prefetch = (struct prefetch_s *) arg;
+
+#if defined (USE_IO_URING)
+    struct uring_s ring;
+
+    if (uring_setup(&ring, (unsigned) prefetch->queue_depth) == 0) {
+        read_uring(prefetch, &ring);
+        uring_teardown(&ring);
+        return NULL;
+    }
+#endif
+
+    read_serially(prefetch);
+
+    return NULL;
+}
+#endif
+
+struct prefetch_s *prefetch_start(char **paths, int num_paths, int queue_depth)
+{
+    struct prefetch_s *prefetch;
+    int i;
+
+    assert(paths || num_paths == 0);
+
+    if (queue_depth < 1) {
+        queue_depth = 1;
+    }
+
+    if (queue_depth > MAX_QUEUE_DEPTH) {
+        queue_depth = MAX_QUEUE_DEPTH;
+    }
+
+    prefetch = (struct prefetch_s *) calloc(1, sizeof(*prefetch));
+    if (prefetch) {
+        prefetch->files = (struct prefetch_file_s *) calloc(num_paths + 1, sizeof(struct prefetch_file_s));
+    }
+
+    if (!prefetch || !prefetch->files) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    prefetch->paths       = paths;
+    prefetch->num_paths   = num_paths;
+    prefetch->queue_depth = queue_depth;
+    prefetch->window      = 2 * queue_depth;
+
+    for (i = 0; i < num_paths; i++) {
+        prefetch->files[i].fd = -1;
+    }
+
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->changed, NULL);
+
+    prefetch->reader_started = num_paths > 0
+                            && pthread_create(&prefetch->reader, NULL, reader_main, prefetch) == 0;
+#endif
+
+    return prefetch;
+}
+
+u8 *prefetch_wait(struct prefetch_s *prefetch, int job, long *size)
+{
+    struct prefetch_file_s *file;
+    u8 *data;
+
+    assert(prefetch);
+    assert(job >= 0 && job < prefetch->num_paths);
+    assert(size);
+
+    file = &prefetch->files[job];
+
+#if defined (HAVE_PTHREAD)
+    if (prefetch->reader_started) {
+        PREFETCH_LOCK(prefetch);
+        while (file->state == FILE_PENDING) {
+            pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+        }
+        PREFETCH_UNLOCK(prefetch);
+    } else {
+        load_file(prefetch, job);
+    }
+#else
+    load_file(prefetch, job);
+#endif
+
+    data       = file->data;
+    *size      = file->size;
+    file->data = NULL;
+
+    return data;
+}
+
+void prefetch_done(struct prefetch_s *prefetch, int job)
+{
+    assert(prefetch);
+    assert(job >= 0 && job < prefetch->num_paths);
+
+    PREFETCH_LOCK(prefetch);
+    prefetch->num_held--;
+    PREFETCH_NOTIFY(prefetch);
+    PREFETCH_UNLOCK(prefetch);
+}
+
+void prefetch_finish(struct prefetch_s *prefetch)
+{
+    int i;
+
+    assert(prefetch);
+
+#if defined (HAVE_PTHREAD)
+    /* Files nobody waited for never make room, so the reader is told to stop
+       rather than left waiting */
+    PREFETCH_LOCK(prefetch);
+    prefetch->stopping = 1;
+    PREFETCH_NOTIFY(prefetch);
+    PREFETCH_UNLOCK(prefetch);
+
+    if (prefetch->reader_started) {
+        pthread_join(prefetch->reader, NULL);
+    }
+
+    pthread_cond_destroy(&prefetch->changed);
+    pthread_mutex_destroy(&prefetch->lock);
+#endif
+
+    for (i = 0; i < prefetch->num_paths; i++) {
+        free(prefetch->files[i].data);
+    }
+
+    free(prefetch->files);
+    free(prefetch);
+}
@@ -0,0 +1,29 @@
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+#include "types.h"
+
+#define PREFETCH_DEFAULT_QUEUE_DEPTH    32
+
+/* Reads whole files into memory ahead of the workers that parse them. A
+   reader thread keeps up to queue_depth reads in flight at once through
+   io_uring where the kernel allows it, or reads the files one after another
+   otherwise, and holds at most twice queue_depth files that are read but not
+   yet done with. Files are read in the order given, which is the order pool
+   workers take their jobs in. Without thread support each file is read when
+   it is waited for. */
+struct prefetch_s;
+
+struct prefetch_s *prefetch_start(char **paths, int num_paths, int queue_depth);
+
+/* Waits until file job is read and hands over its data, which the caller
+   frees. Returns NULL if the file could not be read. */
+u8 *prefetch_wait(struct prefetch_s *prefetch, int job, long *size);
+
+/* Tells the reader that the data of file job is gone, making room for
+   further reads */
+void prefetch_done(struct prefetch_s *prefetch, int job);
+
+void prefetch_finish(struct prefetch_s *prefetch);
+
+#endif
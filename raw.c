@@ -0,0 +1,166 @@
+#include "raw.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpcemu.h"
+#include "cpm.h"
+
+#define TRACK_DATA_SIZE     (NUM_SECTOR * SIZ_SECTOR)
+
+int raw_parse_geometry(const char *text, struct raw_geometry_s *geometry)
+{
+    char end;
+
+    assert(text);
+    assert(geometry);
+
+    if (sscanf(text, "%dx%dx%d%c", &geometry->num_tracks, &geometry->num_sectors,
+               &geometry->sector_size, &end) != 3) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Takes the geometry of the DPB, or checks that a given one fits in it */
+static
+int resolve_geometry(const struct raw_geometry_s *given, struct raw_geometry_s *geometry)
+{
+    cpm_geometry(&geometry->num_tracks, &geometry->num_sectors, &geometry->sector_size);
+
+    if (geometry->num_tracks > NUM_TRACK) {
+        geometry->num_tracks = NUM_TRACK;
+    }
+
+    if (!given) {
+        return 0;
+    }
+
+    if (   given->sector_size != geometry->sector_size
+        || given->num_sectors != geometry->num_sectors
+        || given->num_tracks  < 1
+        || given->num_tracks  > geometry->num_tracks) {
+        fprintf(stderr, "Geometry %dx%dx%d does not fit the disk, which is %dx%dx%d.\n",
+                given->num_tracks, given->num_sectors, given->sector_size,
+                geometry->num_tracks, geometry->num_sectors, geometry->sector_size);
+        return -1;
+    }
+
+    geometry->num_tracks = given->num_tracks;
+
+    return 0;
+}
+
+int raw_export(FILE *fp, const char *raw_name, const struct raw_geometry_s *given)
+{
+    struct raw_geometry_s geometry;
+    u8 physical[TRACK_DATA_SIZE];
+    u8 logical[TRACK_DATA_SIZE];
+    FILE *out;
+    int track;
+    int result;
+
+    assert(fp);
+    assert(raw_name);
+
+    if (resolve_geometry(given, &geometry) != 0) {
+        return -1;
+    }
+
+    out = fopen(raw_name, "wb");
+    if (!out) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", raw_name);
+        return -1;
+    }
+
+    result = 0;
+
+    for (track = 0; track < geometry.num_tracks && result == 0; track++) {
+        int sector;
+
+        read_track_data(fp, (u8) track, physical);
+
+        for (sector = 0; sector < geometry.num_sectors; sector++) {
+            memcpy(logical + sector * SIZ_SECTOR, physical + g_sector_skew_table[sector] * SIZ_SECTOR,
+                   SIZ_SECTOR);
+        }
+
+        if (fwrite(logical, 1, TRACK_DATA_SIZE, out) != TRACK_DATA_SIZE) {
+            result = -1;
+        }
+    }
+
+    if (fclose(out) != 0 || result != 0) {
+        fprintf(stderr, "Error writing to file %s.\n", raw_name);
+        return -1;
+    }
+
+    printf("Exported %d tracks of %d sectors to %s.\n", geometry.num_tracks, geometry.num_sectors, raw_name);
+
+    return geometry.num_tracks;
+}
+
+int raw_import(FILE *fp, const char *raw_name, const struct raw_geometry_s *given)
+{
+    struct raw_geometry_s geometry;
+    u8 physical[TRACK_DATA_SIZE];
+    u8 logical[TRACK_DATA_SIZE];
+    FILE *in;
+    long size;
+    int track;
+
+    assert(fp);
+    assert(raw_name);
+
+    if (resolve_geometry(given, &geometry) != 0) {
+        return -1;
+    }
+
+    in = fopen(raw_name, "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", raw_name);
+        return -1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    if (size != (long) geometry.num_tracks * TRACK_DATA_SIZE) {
+        fprintf(stderr, "%s holds %ld bytes, %d tracks of %d sectors need %ld.\n", raw_name, size,
+                geometry.num_tracks, geometry.num_sectors, (long) geometry.num_tracks * TRACK_DATA_SIZE);
+        fclose(in);
+        return -1;
+    }
+
+    for (track = 0; track < geometry.num_tracks; track++) {
+        int sector;
+
+        if (fread(logical, 1, TRACK_DATA_SIZE, in) != TRACK_DATA_SIZE) {
+            fprintf(stderr, "Failed to read file %s.\n", raw_name);
+            fclose(in);
+            return -1;
+        }
+
+        /* Sectors the dump does not cover keep their data */
+        read_track_data(fp, (u8) track, physical);
+
+        for (sector = 0; sector < geometry.num_sectors; sector++) {
+            memcpy(physical + g_sector_skew_table[sector] * SIZ_SECTOR, logical + sector * SIZ_SECTOR,
+                   SIZ_SECTOR);
+        }
+
+        write_track_data(fp, (u8) track, physical);
+    }
+
+    fclose(in);
+
+    printf("Imported %d tracks of %d sectors from %s.\n", geometry.num_tracks, geometry.num_sectors, raw_name);
+
+    return geometry.num_tracks;
+}
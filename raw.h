@@ -0,0 +1,25 @@
+#ifndef RAW_H_
+#define RAW_H_
+
+#include <stdio.h>
+
+/* Flat sector dumps, as emulators and conversion tools take them: every
+   sector of every track in logical order, with no disc or track headers.
+   Whole tracks are moved at once, de-skewed through the sector map. */
+struct raw_geometry_s {
+    int num_tracks;
+    int num_sectors;                    /* Per track */
+    int sector_size;
+};
+
+/* Parses a geometry given as TRACKSxSECTORSxSIZE, e.g. 40x9x512. Returns 0,
+   or -1 if it is not one. */
+int raw_parse_geometry(const char *text, struct raw_geometry_s *geometry);
+
+/* With geometry NULL the geometry comes from the DPB. A given geometry may
+   cover fewer tracks than the disk has. Both return the number of tracks
+   copied, or -1 on errors. */
+int raw_export(FILE *fp, const char *raw_name, const struct raw_geometry_s *geometry);
+int raw_import(FILE *fp, const char *raw_name, const struct raw_geometry_s *geometry);
+
+#endif
@@ -0,0 +1,365 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "replay.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpcemu.h"
+#include "shadow.h"
+#include "trace.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+#define SCRATCH_SUFFIX  ".replay"
+
+struct replay_s {
+    const char *file_name;
+    FILE *fp;
+    u8 *map;
+    long size;
+    struct shadow_s shadow;
+    u8 buffer[SIZ_TRACK];
+};
+
+struct backend_s {
+    const char *name;
+    int (*open)(struct replay_s *replay);
+    void (*access)(struct replay_s *replay, long offset, long length, int write);
+    void (*close)(struct replay_s *replay);
+};
+
+static
+int stdio_open(struct replay_s *replay)
+{
+    replay->fp = fopen(replay->file_name, "r+b");
+    if (!replay->fp) {
+        fprintf(stderr, "Failed to open file %s.\n", replay->file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* The same calls cpcemu.c makes */
+static
+void stdio_access(struct replay_s *replay, long offset, long length, int write)
+{
+    fseek(replay->fp, offset, SEEK_SET);
+
+    if (write) {
+        fwrite(replay->buffer, 1, length, replay->fp);
+    } else {
+        fread(replay->buffer, 1, length, replay->fp);
+    }
+}
+
+static
+void stdio_close(struct replay_s *replay)
+{
+    fclose(replay->fp);
+}
+
+/* The image as commands see it, loaded into memory by shadow_open */
+static
+int cached_open(struct replay_s *replay)
+{
+    if (shadow_open(&replay->shadow, replay->file_name) != 0) {
+        return -1;
+    }
+
+    replay->fp = replay->shadow.fp;
+
+    return 0;
+}
+
+static
+void cached_close(struct replay_s *replay)
+{
+    shadow_close(&replay->shadow);
+}
+
+#if defined (HAVE_MMAP)
+static
+int mmap_open(struct replay_s *replay)
+{
+    void *map;
+    int fd;
+
+    fd = open(replay->file_name, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file %s.\n", replay->file_name);
+        return -1;
+    }
+
+    map = mmap(NULL, replay->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map file %s.\n", replay->file_name);
+        return -1;
+    }
+
+    replay->map = (u8 *) map;
+
+    return 0;
+}
+
+static
+void mmap_access(struct replay_s *replay, long offset, long length, int write)
+{
+    if (write) {
+        memcpy(replay->map + offset, replay->buffer, length);
+    } else {
+        memcpy(replay->buffer, replay->map + offset, length);
+    }
+}
+
+static
+void mmap_close(struct replay_s *replay)
+{
+    munmap(replay->map, replay->size);
+}
+#endif
+
+static const struct backend_s g_backends[] = {
+    { "stdio",  stdio_open,  stdio_access, stdio_close  },
+#if defined (HAVE_MMAP)
+    { "mmap",   mmap_open,   mmap_access,  mmap_close   },
+#endif
+    { "cached", cached_open, stdio_access, cached_close }
+};
+
+static
+int compare_u32(const void *a, const void *b)
+{
+    u32 x = *(const u32 *) a;
+    u32 y = *(const u32 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static
+u32 elapsed_ns(u32 start_seconds, u32 start_nanoseconds)
+{
+    u32 seconds;
+    u32 nanoseconds;
+
+    trace_now(&seconds, &nanoseconds);
+
+    return (seconds - start_seconds) * 1000000000UL + nanoseconds - start_nanoseconds;
+}
+
+static
+void print_latencies(const char *backend, const char *kind, u32 *latencies, long count)
+{
+    double total;
+    long i;
+
+    if (count == 0) {
+        return;
+    }
+
+    qsort(latencies, count, sizeof(*latencies), compare_u32);
+
+    total = 0;
+    for (i = 0; i < count; i++) {
+        total += latencies[i];
+    }
+
+    printf("%-7s %-6s %8ld %9lu %9lu %9lu %9lu %9lu %11.0f\n", backend, kind, count,
+           (unsigned long) latencies[(long) (0.5 * (count - 1))],
+           (unsigned long) latencies[(long) (0.9 * (count - 1))],
+           (unsigned long) latencies[(long) (0.99 * (count - 1))],
+           (unsigned long) latencies[(long) (0.999 * (count - 1))],
+           (unsigned long) latencies[count - 1],
+           total / 1000);
+}
+
+static
+int run_backend(const struct backend_s *backend, struct replay_s *replay,
+                struct trace_record_s *records, long num_records, int num_passes)
+{
+    u32 *reads;
+    u32 *writes;
+    long num_reads;
+    long num_writes;
+    int pass;
+    long i;
+
+    reads  = (u32 *) malloc((num_records * num_passes + 1) * sizeof(u32));
+    writes = (u32 *) malloc((num_records * num_passes + 1) * sizeof(u32));
+
+    if (!reads || !writes) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if (backend->open(replay) != 0) {
+        free(reads);
+        free(writes);
+        return -1;
+    }
+
+    num_reads  = 0;
+    num_writes = 0;
+
+    for (pass = 0; pass < num_passes; pass++) {
+        for (i = 0; i < num_records; i++) {
+            struct trace_record_s *record = &records[i];
+            u32 start_seconds;
+            u32 start_nanoseconds;
+            long offset;
+            long length;
+            int write;
+
+            offset = CPCEMU_INFO_OFFSET + (long) record->track * SIZ_TRACK;
+
+            if (record->op == TRACE_READ_TRACK_INFO || record->op == TRACE_WRITE_TRACK_INFO) {
+                length = sizeof(struct cpcemu_track_info_s);
+            } else if (record->op == TRACE_READ_TRACK || record->op == TRACE_WRITE_TRACK) {
+                offset += CPCEMU_TRACK_OFFSET;
+                length  = NUM_SECTOR * SIZ_SECTOR;
+            } else {
+                offset += CPCEMU_TRACK_OFFSET + (long) record->physical * SIZ_SECTOR;
+                length  = SIZ_SECTOR;
+            }
+
+            write = record->op == TRACE_WRITE_SECTOR
+                 || record->op == TRACE_WRITE_TRACK_INFO
+                 || record->op == TRACE_WRITE_TRACK;
+
+            trace_now(&start_seconds, &start_nanoseconds);
+            backend->access(replay, offset, length, write);
+
+            if (write) {
+                writes[num_writes++] = elapsed_ns(start_seconds, start_nanoseconds);
+            } else {
+                reads[num_reads++] = elapsed_ns(start_seconds, start_nanoseconds);
+            }
+        }
+    }
+
+    backend->close(replay);
+
+    print_latencies(backend->name, "read", reads, num_reads);
+    print_latencies(backend->name, "write", writes, num_writes);
+
+    free(reads);
+    free(writes);
+
+    return 0;
+}
+
+int replay_trace(const char *trace_name, const char *image_name, const char *backend, int num_passes)
+{
+    struct trace_record_s *records;
+    struct shadow_s image;
+    struct replay_s *replay;
+    char *scratch_name;
+    long num_records;
+    long num_valid;
+    int num_run;
+    int result;
+    unsigned i;
+
+    assert(trace_name);
+    assert(image_name);
+
+    num_run = 0;
+    for (i = 0; i < sizeof(g_backends) / sizeof(g_backends[0]); i++) {
+        num_run += !backend || strcmp(backend, g_backends[i].name) == 0;
+    }
+
+    if (num_run == 0) {
+        fprintf(stderr, "Unknown backend %s.\n", backend);
+        return -1;
+    }
+
+    num_records = trace_load(trace_name, &records);
+    if (num_records < 0) {
+        return -1;
+    }
+
+    /* Records the trace could not have come from are left out */
+    num_valid = 0;
+    for (i = 0; i < (unsigned long) num_records; i++) {
+        struct trace_record_s *record = &records[i];
+
+        if (   record->track >= NUM_TRACK
+            || (   (record->op == TRACE_READ_SECTOR || record->op == TRACE_WRITE_SECTOR)
+                && record->physical >= NUM_SECTOR)
+            || !strchr("rwRWtT", record->op)) {
+            continue;
+        }
+
+        records[num_valid++] = *record;
+    }
+
+    if (num_valid == 0) {
+        fprintf(stderr, "%s holds no accesses.\n", trace_name);
+        free(records);
+        return -1;
+    }
+
+    /* Writes in the trace go to a scratch copy, never to the image */
+    if (shadow_open(&image, image_name) != 0) {
+        free(records);
+        return -1;
+    }
+
+    if (image.size < CPCEMU_INFO_OFFSET + SIZ_TOTAL) {
+        fprintf(stderr, "%s is too small for the trace.\n", image_name);
+        shadow_close(&image);
+        free(records);
+        return -1;
+    }
+
+    scratch_name = (char *) malloc(strlen(image_name) + strlen(SCRATCH_SUFFIX) + 1);
+    replay       = (struct replay_s *) calloc(1, sizeof(*replay));
+
+    if (!scratch_name || !replay) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    sprintf(scratch_name, "%s%s", image_name, SCRATCH_SUFFIX);
+
+    result = shadow_write_file(scratch_name, image.data, image.size);
+
+    replay->file_name = scratch_name;
+    replay->size      = image.size;
+    shadow_close(&image);
+
+    if (result == 0) {
+        printf("Replaying %ld accesses of %s on %s %d times.\n", num_valid, trace_name, image_name,
+               num_passes);
+        printf("%-7s %-6s %8s %9s %9s %9s %9s %9s %11s\n", "backend", "op", "count",
+               "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "total us");
+    }
+
+    for (i = 0; i < sizeof(g_backends) / sizeof(g_backends[0]) && result == 0; i++) {
+        if (backend && strcmp(backend, g_backends[i].name) != 0) {
+            continue;
+        }
+
+        result = run_backend(&g_backends[i], replay, records, num_valid, num_passes);
+    }
+
+    remove(scratch_name);
+
+    free(scratch_name);
+    free(replay);
+    free(records);
+
+    return result;
+}
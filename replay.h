@@ -0,0 +1,12 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+/* Runs the accesses of a trace recorded with --trace against a scratch copy
+   of image_name, through each backend in turn: stdio on the file, mmap of
+   the file, and the in-memory copy that commands work on. backend limits
+   the run to one of them when not NULL. The trace is run num_passes times,
+   and the latency of every access is reported in percentiles. Returns 0,
+   or -1 on errors. */
+int replay_trace(const char *trace_name, const char *image_name, const char *backend, int num_passes);
+
+#endif
@@ -0,0 +1,344 @@
+#if defined (__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "search.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "amsdos.h"
+
+#if defined (__linux__)
+#define HAVE_MEMMEM
+#endif
+
+#define RECORD_SIZE     128
+
+#define OWNER_FREE      -1
+#define OWNER_DIRECTORY -2
+#define OWNER_RESERVED  -3
+
+/* Records of a file, and where each of their sectors lies */
+struct search_file_s {
+    char name[13];
+    u8 *data;
+    long size;
+    long data_offset;                   /* Past the AMSDOS header, if any */
+    long data_end;
+    int tracks[NUM_TRACK * NUM_SECTOR];
+    int sectors[NUM_TRACK * NUM_SECTOR];
+    int num_sectors;
+};
+
+struct search_owner_s {
+    int file;
+    long offset;                        /* Of the sector in the file records */
+};
+
+struct search_s {
+    const u8 *pattern;
+    long len;
+    struct search_file_s *files;
+    int num_files;
+    struct search_owner_s owners[NUM_TRACK][NUM_SECTOR];
+};
+
+/* Finds the next occurrence of pattern in [start, end). glibc runs memmem
+   as the two-way matcher, linear in the data whatever the pattern. Elsewhere
+   candidates come from memchr, which the C library runs over whole words or
+   vector registers at a time, and only those are compared in full. */
+static
+const u8 *find_next(const u8 *start, const u8 *end, const u8 *pattern, long len)
+{
+#if defined (HAVE_MEMMEM)
+    return (const u8 *) memmem(start, end - start, pattern, len);
+#else
+    const u8 *last;
+
+    if (end - start < len) {
+        return NULL;
+    }
+
+    last = end - len;
+
+    while (start <= last) {
+        const u8 *candidate = (const u8 *) memchr(start, pattern[0], last - start + 1);
+
+        if (!candidate) {
+            return NULL;
+        }
+
+        if (memcmp(candidate + 1, pattern + 1, len - 1) == 0) {
+            return candidate;
+        }
+
+        start = candidate + 1;
+    }
+
+    return NULL;
+#endif
+}
+
+/* Reads the records of the file at first in order, noting their sectors */
+static
+int load_file(FILE *fp, struct cpm_diren_s *table, int num_diren, int first, struct search_file_s *file)
+{
+    int extent;
+    int index;
+
+    normalize_filename(file->name, &table[first]);
+
+    file->size        = (long) cpm_file_records(table, num_diren, first) * RECORD_SIZE;
+    file->num_sectors = 0;
+    file->data        = (u8 *) malloc(file->size + SIZ_SECTOR);
+
+    if (!file->data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (extent = 0; (index = cpm_find_extent(table, num_diren, &table[first], extent)) >= 0; extent++) {
+        struct cpm_diren_s *dir = &table[index];
+        long remaining;
+        unsigned k;
+
+        remaining = (long) dir->RC * RECORD_SIZE;
+
+        for (k = 0; k < sizeof(dir->AL) && dir->AL[k] && remaining > 0; k++) {
+            int track;
+            int sector;
+            int s;
+
+            if (dir->AL[k] >= cpm_num_blocks()) {
+                free(file->data);
+                return -1;
+            }
+
+            convert_AL_to_track_sector(dir->AL[k], &track, &sector);
+
+            for (s = 0; s < g_num_sector_per_block && remaining > 0; s++) {
+                long offset = (long) file->num_sectors * SIZ_SECTOR;
+
+                if (   track >= NUM_TRACK
+                    || offset >= file->size
+                    || file->num_sectors == NUM_TRACK * NUM_SECTOR) {
+                    free(file->data);
+                    return -1;
+                }
+
+                read_logical_sector(fp, track, sector, file->data + offset);
+
+                file->tracks[file->num_sectors]  = track;
+                file->sectors[file->num_sectors] = sector;
+                file->num_sectors++;
+
+                remaining -= SIZ_SECTOR;
+                add_offset_to_track_sector(&track, &sector, 1);
+            }
+        }
+    }
+
+    file->data_offset = 0;
+    file->data_end    = file->size;
+
+    if (   file->size >= (long) sizeof(struct amsdos_header_s)
+        && amsdos_header_exists((struct amsdos_header_s *) file->data)) {
+        long length = amsdos_get_length((struct amsdos_header_s *) file->data);
+
+        file->data_offset = sizeof(struct amsdos_header_s);
+
+        if (file->data_offset + length < file->data_end) {
+            file->data_end = file->data_offset + length;
+        }
+    }
+
+    return 0;
+}
+
+static
+void load_files(FILE *fp, struct search_s *search)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    int num_diren;
+    int num_dir_sectors;
+    int track;
+    int sector;
+    int i;
+
+    for (track = 0; track < NUM_TRACK; track++) {
+        for (sector = 0; sector < NUM_SECTOR; sector++) {
+            search->owners[track][sector].file = track < g_base_track ? OWNER_RESERVED : OWNER_FREE;
+        }
+    }
+
+    num_diren       = cpm_read_dir(fp, table);
+    num_dir_sectors = num_diren * sizeof(struct cpm_diren_s) / SIZ_SECTOR;
+
+    convert_AL_to_track_sector(0, &track, &sector);
+
+    for (i = 0; i < num_dir_sectors; i++) {
+        search->owners[track][sector].file = OWNER_DIRECTORY;
+        add_offset_to_track_sector(&track, &sector, 1);
+    }
+
+    search->files     = (struct search_file_s *) malloc(CPM_MAX_DIREN * sizeof(*search->files));
+    search->num_files = 0;
+
+    if (!search->files) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < num_diren; i++) {
+        struct search_file_s *file = &search->files[search->num_files];
+        int s;
+
+        if (   table[i].user_number > 15
+            || table[i].EX          != 0
+            || table[i].S2          != 0) {
+            continue;
+        }
+
+        if (load_file(fp, table, num_diren, i, file) != 0) {
+            fprintf(stderr, "Skipped %s, its directory entry is damaged.\n", file->name);
+            continue;
+        }
+
+        for (s = 0; s < file->num_sectors; s++) {
+            struct search_owner_s *owner = &search->owners[file->tracks[s]][file->sectors[s]];
+
+            owner->file   = search->num_files;
+            owner->offset = (long) s * SIZ_SECTOR;
+        }
+
+        search->num_files++;
+    }
+}
+
+static
+int search_files(struct search_s *search)
+{
+    int num_hits;
+    int i;
+
+    num_hits = 0;
+
+    for (i = 0; i < search->num_files; i++) {
+        struct search_file_s *file = &search->files[i];
+        const u8 *end = file->data + file->data_end;
+        const u8 *hit;
+
+        for (hit = file->data + file->data_offset;
+             (hit = find_next(hit, end, search->pattern, search->len)) != NULL;
+             hit++) {
+            long offset = hit - file->data;
+
+            printf("%12s offset 0x%05lx  track %2d sector %d\n", file->name,
+                   offset - file->data_offset,
+                   file->tracks[offset / SIZ_SECTOR], file->sectors[offset / SIZ_SECTOR]);
+            num_hits++;
+        }
+    }
+
+    return num_hits;
+}
+
+static
+int search_sectors(FILE *fp, struct search_s *search)
+{
+    u8 *image;
+    const u8 *hit;
+    int num_hits;
+    int track;
+    int sector;
+
+    image = (u8 *) malloc((long) NUM_TRACK * NUM_SECTOR * SIZ_SECTOR);
+    if (!image) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    /* Sectors in logical order, so matches can run across them */
+    for (track = 0; track < NUM_TRACK; track++) {
+        for (sector = 0; sector < NUM_SECTOR; sector++) {
+            read_logical_sector(fp, track, sector,
+                                image + ((long) track * NUM_SECTOR + sector) * SIZ_SECTOR);
+        }
+    }
+
+    num_hits = 0;
+
+    for (hit = image;
+         (hit = find_next(hit, image + (long) NUM_TRACK * NUM_SECTOR * SIZ_SECTOR,
+                          search->pattern, search->len)) != NULL;
+         hit++) {
+        struct search_owner_s *owner;
+        long offset;
+        int byte;
+
+        offset = hit - image;
+        track  = offset / (NUM_SECTOR * SIZ_SECTOR);
+        sector = offset / SIZ_SECTOR % NUM_SECTOR;
+        byte   = offset % SIZ_SECTOR;
+        owner  = &search->owners[track][sector];
+
+        printf("track %2d sector %d +0x%03x  ", track, sector, byte);
+
+        if (owner->file >= 0) {
+            struct search_file_s *file = &search->files[owner->file];
+
+            printf("%s offset 0x%05lx\n", file->name, owner->offset + byte - file->data_offset);
+        } else if (owner->file == OWNER_DIRECTORY) {
+            printf("(directory)\n");
+        } else if (owner->file == OWNER_RESERVED) {
+            printf("(reserved)\n");
+        } else {
+            printf("(free)\n");
+        }
+
+        num_hits++;
+    }
+
+    free(image);
+
+    return num_hits;
+}
+
+int search_image(FILE *fp, const u8 *pattern, long len, int raw)
+{
+    struct search_s *search;
+    int num_hits;
+    int i;
+
+    assert(fp);
+    assert(pattern);
+    assert(len > 0);
+
+    search = (struct search_s *) malloc(sizeof(*search));
+    if (!search) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    search->pattern = pattern;
+    search->len     = len;
+
+    load_files(fp, search);
+
+    num_hits = raw ? search_sectors(fp, search) : search_files(search);
+
+    for (i = 0; i < search->num_files; i++) {
+        free(search->files[i].data);
+    }
+
+    free(search->files);
+    free(search);
+
+    return num_hits;
+}
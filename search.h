@@ -0,0 +1,15 @@
+#ifndef SEARCH_H_
+#define SEARCH_H_
+
+#include <stdio.h>
+
+#include "types.h"
+
+/* Prints every occurrence of pattern, either in the data of each file, with
+   matches across block and extent boundaries, or when raw is set in the
+   sectors of the whole image. Every hit is shown with the file and offset it
+   falls in, counted after the AMSDOS header, and its track and sector.
+   Returns the number of hits. */
+int search_image(FILE *fp, const u8 *pattern, long len, int raw);
+
+#endif
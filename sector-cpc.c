@@ -118,15 +118,76 @@
 #include "types.h"
 #include "cpm.h"
 #include "cpcemu.h"
+#include "archive.h"
+#include "batch.h"
+#include "clone.h"
+#include "copy.h"
+#include "corpus.h"
+#include "diff.h"
+#include "extract.h"
+#include "fanout.h"
+#include "index.h"
+#include "lock.h"
+#include "master.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "raw.h"
+#include "replay.h"
+#include "search.h"
+#include "serve.h"
+#include "shadow.h"
+#include "sync.h"
+#include "tar.h"
+#include "trace.h"
+#include "verify.h"
+#include "watch.h"
 
 #define VERSION "0.2.1"
 
 void print_usage_and_exit()
 {
     printf("Arguments:\n");
-    printf("  --file filename.dsk <command>\n");
+    printf("  --file filename.dsk <command>       Images named .dsk.gz are read and written gzipped. [11]\n");
+    printf("  --files <glob|@list> <command>      Run the command on many images in parallel, printing\n"
+           "                                      the output of each in order. [6]\n");
     printf("  --no-amsdos                         Do not add AMSDOS header.\n");
     printf("  --text                              Treat file as text, and SUB byte as EOF marker. [0]\n");
+    printf("  --jobs <n>                          Number of worker threads for corpus commands. [2]\n");
+    printf("  --queue-depth <n>                   Number of image reads index, pack-archive and --files\n"
+           "                                      verify keep in flight. [10]\n");
+    printf("  --lock-timeout <seconds>            Give up waiting for other commands using the image\n"
+           "                                      after this long. [3]\n");
+    printf("  --trace <trace_file>                Record every track header and sector access into a\n"
+           "                                      trace file. [9]\n");
+    printf("  --socket <socket_path>              Send dir, insert, extract, del and info commands to\n"
+           "                                      a running server instead of opening the image.\n");
+    printf("  index <index_file> <path>...        Catalog disk images, directories of them or globs\n"
+           "                                      into an index file.\n");
+    printf("  query <index_file> [<pattern>]      List indexed files matching pattern, e.g. *.BIN.\n");
+    printf("  pack-archive <archive> <path>...    Store disk images into a deduplicated archive.\n");
+    printf("  unpack-archive <archive> <dest_dir> [<image>...]\n"
+           "                                      Restore all, or the given images from an archive.\n");
+    printf("  diff <source.dsk> <target.dsk>      List sectors and files that differ between images.\n");
+    printf("  make-patch <source.dsk> <target.dsk> <patch_file>\n"
+           "                                      Write the changed sectors into a patch.\n");
+    printf("  apply-patch <image.dsk> <patch_file>\n"
+           "                                      Turn the source image into the target image.\n");
+    printf("  copy <src.dsk:file>... <dest.dsk[:new_name]>\n"
+           "                                      Copy files between images, keeping their AMSDOS\n"
+           "                                      header, user and attributes. Wildcards are allowed.\n");
+    printf("  clone <base.dsk> <new.dsk> [insert <host_file[:name]>|del <name>]...\n"
+           "                                      Create new.dsk as a copy of base.dsk with the edits\n"
+           "                                      applied, sharing unchanged blocks where the file\n"
+           "                                      system allows and writing only changed sectors.\n");
+    printf("  master <manifest> <dest.dsk> [--span]\n"
+           "                                      Build a new image from a manifest of host files, or\n"
+           "                                      with --span as few images as the files fit on. [8]\n");
+    printf("  replay <trace_file> <image.dsk> [--backend stdio|mmap|cached] [--repeat <n>]\n"
+           "                                      Run the accesses of a trace against a scratch copy\n"
+           "                                      of the image and print latency percentiles. [9]\n");
+    printf("  serve <socket_path>                 Serve image commands on a Unix domain socket, keeping\n"
+           "                                      images open between requests.\n");
+    printf("  serve-stats <socket_path>           Print per command latency histograms of a server.\n");
     printf("Options:\n");
     printf("  <command>:\n");
     printf("    new                               Create a new empty disk image.\n");
@@ -136,7 +197,38 @@ void print_usage_and_exit()
     printf("    insert <file_name> [<entry_addr>, <exec_addr>]\n"
            "                                      Insert file on host system into disk.\n");
     printf("    del <file_name>                   Delete file from disk.\n");
+    printf("    read <file_name> <offset> <length>\n"
+           "                                      Write length bytes of file from offset to standard\n"
+           "                                      output, reading only the sectors that hold them. [4]\n");
     printf("    info <file_name> [--tracks]       Print info about file in disk.\n");
+    printf("    patch <file_name> <offset> <hex_bytes|host_file>\n"
+           "                                      Overwrite bytes of file in its own sectors, growing it\n"
+           "                                      if they run past the end. E.g. c30040. [4]\n");
+    printf("    append <file_name> <host_file>    Add the contents of host file to the end of file.\n");
+    printf("    extract-all [<dir>]               Extract every file into dir, users other than 0 into\n"
+           "                                      userN subdirectories, with a manifest of their\n"
+           "                                      attributes and AMSDOS headers. [5]\n");
+    printf("    insert-all <dir>                  Insert the files listed in the manifest of dir.\n");
+    printf("    search <text|0xhex> [--raw]       List where the bytes occur in file data, or with --raw\n"
+           "                                      anywhere on the disk, by file, offset, track and\n"
+           "                                      sector. [7]\n");
+    printf("    verify                            Check track headers, directory, block allocation and\n"
+           "                                      AMSDOS headers, listing every problem. Exits with 1\n"
+           "                                      if any is found.\n");
+    printf("    export-tar                        Write all files to standard output as a tar stream.\n");
+    printf("    import-tar                        Insert the files of a tar stream from standard input.\n"
+           "                                      User, attributes and AMSDOS addresses travel in pax\n"
+           "                                      extended attributes.\n");
+    printf("    export-raw <file.img> [<geometry>]\n"
+           "                                      Write the sectors of every track in logical order,\n"
+           "                                      without headers. [12]\n");
+    printf("    import-raw <file.img> [<geometry>]\n"
+           "                                      Write such a dump over the sectors of the disk.\n");
+    printf("    sync <dir>                        Insert new and changed files of a host directory,\n"
+           "                                      rewriting changed files in their existing blocks.\n");
+    printf("    watch <dir>                       Sync, then keep syncing files as they are written\n"
+           "                                      into the directory. The image is kept in memory and\n"
+           "                                      replaced atomically after every change.\n");
     printf("\n");
     printf("Notes:\n");
     printf(" - [0] In CP/M 2.2 there is no way to distinguish if a file is text or binary. When\n"
@@ -147,6 +239,43 @@ void print_usage_and_exit()
            "    Also give space between the two."
            "    E.g. 0x8000, or &8000 and 8000h are valid.\n");
     printf("\n");
+    printf(" - [2] Defaults to the number of online processors.\n");
+    printf("\n");
+    printf(" - [3] Commands that read an image share a lock on it, commands that change it hold\n"
+           "    the lock alone. By default they wait as long as it takes.\n");
+    printf("\n");
+    printf(" - [4] Offsets count from the start of the file data, after the AMSDOS header.\n"
+           "    Decimal by default, 0x for hexadecimal.\n");
+    printf("\n");
+    printf(" - [5] Defaults to the current directory. Host files are written on --jobs threads.\n");
+    printf("\n");
+    printf(" - [6] Images are given like for index: files, directories, globs, or @list for a\n"
+           "    file with one per line. Up to --jobs images run at once, and the images that\n"
+           "    failed are listed at the end.\n");
+    printf("\n");
+    printf(" - [7] A pattern starting with 0x is searched as bytes, anything else as text.\n"
+           "    Use --files to search many images at once.\n");
+    printf("\n");
+    printf(" - [8] One host file per line, followed by options: name=, user=, type=,\n"
+           "    load= and exec= in hex, raw for no AMSDOS header, disk=N to keep it on disk N,\n"
+           "    after=NAME to keep it on the disk of NAME or a later one. With --span the\n"
+           "    images are named dest-1.dsk, dest-2.dsk and so on. Nothing is rebuilt while\n"
+           "    the inputs match the hash kept in dest.dsk.build.\n");
+    printf("\n");
+    printf(" - [9] Backends are stdio on the file, mmap of the file, and the in-memory copy\n"
+           "    commands work on. All of them by default. The image itself is never written.\n");
+    printf("\n");
+    printf(" - [10] Defaults to 32. Reads go through io_uring on Linux where it is allowed,\n"
+           "    and one after another otherwise, always ahead of the parsing.\n");
+    printf("\n");
+    printf(" - [11] They are decompressed into memory as they are read, with no temporary\n"
+           "    file, and compressed again when a command changes them. Give new, clone or\n"
+           "    master a .dsk.gz name to write a compressed image. index finds them too,\n"
+           "    pack-archive leaves them out as deflated data does not deduplicate.\n");
+    printf("\n");
+    printf(" - [12] Geometry is tracks x sectors x sector size, e.g. 40x9x512. It defaults to\n"
+           "    that of the DPB, and may cover fewer tracks than the disk has.\n");
+    printf("\n");
     printf("sector-cpc " VERSION " 2019\n");
     exit(0);
 }
@@ -193,8 +322,92 @@ struct args_s {
             char *file_name;
             int valid;
         } del;
+
+        struct {
+            char *file_name;
+            long offset;
+            long length;
+
+            int valid;
+        } read;
+
+        struct {
+            char *file_name;
+            long offset;
+            char *source;
+
+            int valid;
+        } patch;
+
+        struct {
+            char *file_name;
+            char *host_file_name;
+
+            int valid;
+        } append;
+
+        struct {
+            char *dir_name;
+            int valid;
+        } extract_all;
+
+        struct {
+            char *dir_name;
+            int valid;
+        } insert_all;
+
+        struct {
+            char *pattern;
+            int raw;
+
+            int valid;
+        } search;
+
+        struct {
+            int valid;
+        } verify;
+
+        struct {
+            int valid;
+        } export_tar;
+
+        struct {
+            int valid;
+        } import_tar;
+
+        struct {
+            char *raw_file_name;
+            struct raw_geometry_s geometry;
+            int has_geometry;
+
+            int valid;
+        } export_raw;
+
+        struct {
+            char *raw_file_name;
+            struct raw_geometry_s geometry;
+            int has_geometry;
+
+            int valid;
+        } import_raw;
+
+        struct {
+            char *dir_name;
+            int valid;
+        } sync;
+
+        struct {
+            char *dir_name;
+            int valid;
+        } watch;
     } file;
 
+    struct {
+        char *pattern;
+        int index;
+        int valid;
+    } files;
+
     struct {
         int valid;
     } no_amsdos;
@@ -206,8 +419,165 @@ struct args_s {
     struct {
         int valid;
     } version;
+
+    struct {
+        int num_workers;
+        int valid;
+    } jobs;
+
+    struct {
+        int queue_depth;
+        int valid;
+    } queue_depth;
+
+    struct {
+        double seconds;
+        int valid;
+    } lock_timeout;
+
+    struct {
+        char *socket_path;
+        int valid;
+    } socket;
+
+    struct {
+        char *socket_path;
+        int valid;
+    } serve;
+
+    struct {
+        char *socket_path;
+        int valid;
+    } serve_stats;
+
+    struct {
+        char *index_file_name;
+        char **paths;
+        int num_paths;
+
+        int valid;
+    } index;
+
+    struct {
+        char *index_file_name;
+        char *pattern;
+
+        int valid;
+    } query;
+
+    struct {
+        char *archive_file_name;
+        char **paths;
+        int num_paths;
+
+        int valid;
+    } pack_archive;
+
+    struct {
+        char *archive_file_name;
+        char *dest_dir;
+        char **names;
+        int num_names;
+
+        int valid;
+    } unpack_archive;
+
+    struct {
+        char *source_file_name;
+        char *target_file_name;
+
+        int valid;
+    } diff;
+
+    struct {
+        char *source_file_name;
+        char *target_file_name;
+        char *patch_file_name;
+
+        int valid;
+    } make_patch;
+
+    struct {
+        char *image_file_name;
+        char *patch_file_name;
+
+        int valid;
+    } apply_patch;
+
+    struct {
+        char **sources;
+        int num_sources;
+        char *dest;
+
+        int valid;
+    } copy;
+
+    struct {
+        char *base_file_name;
+        char *new_file_name;
+        char **edits;
+        int num_edits;
+
+        int valid;
+    } clone;
+
+    struct {
+        char *manifest_file_name;
+        char *image_file_name;
+        int span;
+
+        int valid;
+    } master;
+
+    struct {
+        char *trace_file_name;
+        int valid;
+    } trace;
+
+    struct {
+        char *trace_file_name;
+        char *image_file_name;
+        char *backend;
+        int num_passes;
+
+        int valid;
+    } replay;
 };
 
+/* Offsets and lengths are decimal, even with leading zeros, unless they
+   start with 0x */
+static
+long parse_number(const char *text)
+{
+    return strtol(text, NULL, strncmp(text, "0x", 2) == 0 || strncmp(text, "0X", 2) == 0 ? 16 : 10);
+}
+
+/* Number of commands given for the image of --file or --files */
+static
+int num_file_commands(struct args_s *opts)
+{
+    return opts->file.dump.valid
+        + opts->file.new.valid
+        + opts->file.dir.valid
+        + opts->file.info.valid
+        + opts->file.extract.valid
+        + opts->file.insert.valid
+        + opts->file.del.valid
+        + opts->file.read.valid
+        + opts->file.patch.valid
+        + opts->file.append.valid
+        + opts->file.extract_all.valid
+        + opts->file.insert_all.valid
+        + opts->file.search.valid
+        + opts->file.verify.valid
+        + opts->file.export_tar.valid
+        + opts->file.import_tar.valid
+        + opts->file.export_raw.valid
+        + opts->file.import_raw.valid
+        + opts->file.sync.valid
+        + opts->file.watch.valid;
+}
+
 void parse_args(struct args_s *opts, int argc, char *argv[])
 {
     int i;
@@ -226,6 +596,19 @@ void parse_args(struct args_s *opts, int argc, char *argv[])
             opts->file.file_name = argv[i + 1];
         }
 
+        /* Commands are parsed as for --file, then run once per image */
+        if (strcmp(argv[i], "--files") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->file.valid = 1;
+            opts->file.file_name = argv[i + 1];
+            opts->files.valid = 1;
+            opts->files.pattern = argv[i + 1];
+            opts->files.index = i;
+        }
+
         if (strcmp(argv[i], "--no-amsdos") == 0) {
             opts->no_amsdos.valid = 1;
         }
@@ -234,6 +617,241 @@ void parse_args(struct args_s *opts, int argc, char *argv[])
             opts->text.valid = 1;
         }
 
+        if (strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->jobs.valid = 1;
+            opts->jobs.num_workers = atoi(argv[i + 1]);
+        }
+
+        if (strcmp(argv[i], "--queue-depth") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->queue_depth.valid = 1;
+            opts->queue_depth.queue_depth = atoi(argv[i + 1]);
+        }
+
+        if (strcmp(argv[i], "--lock-timeout") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->lock_timeout.valid = 1;
+            opts->lock_timeout.seconds = atof(argv[i + 1]);
+        }
+
+        if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->trace.valid = 1;
+            opts->trace.trace_file_name = argv[i + 1];
+        }
+
+        if (strcmp(argv[i], "--socket") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->socket.valid = 1;
+            opts->socket.socket_path = argv[i + 1];
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "serve") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->serve.valid = 1;
+            opts->serve.socket_path = argv[i + 1];
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "serve-stats") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->serve_stats.valid = 1;
+            opts->serve_stats.socket_path = argv[i + 1];
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "index") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->index.valid = 1;
+            opts->index.index_file_name = argv[i + 1];
+            opts->index.paths = &argv[i + 2];
+
+            for (i += 2; i < argc && strncmp(argv[i], "--", 2) != 0; i++) {
+                opts->index.num_paths++;
+            }
+
+            i--;
+            continue;
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "pack-archive") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->pack_archive.valid = 1;
+            opts->pack_archive.archive_file_name = argv[i + 1];
+            opts->pack_archive.paths = &argv[i + 2];
+
+            for (i += 2; i < argc && strncmp(argv[i], "--", 2) != 0; i++) {
+                opts->pack_archive.num_paths++;
+            }
+
+            i--;
+            continue;
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "unpack-archive") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->unpack_archive.valid = 1;
+            opts->unpack_archive.archive_file_name = argv[i + 1];
+            opts->unpack_archive.dest_dir = argv[i + 2];
+            opts->unpack_archive.names = &argv[i + 3];
+
+            for (i += 3; i < argc && strncmp(argv[i], "--", 2) != 0; i++) {
+                opts->unpack_archive.num_names++;
+            }
+
+            i--;
+            continue;
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "copy") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->copy.valid = 1;
+            opts->copy.sources = &argv[i + 1];
+
+            for (i += 1; i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0; i++) {
+                opts->copy.num_sources++;
+            }
+
+            if (opts->copy.num_sources == 0) {
+                print_usage_and_exit();
+            }
+
+            opts->copy.dest = argv[i];
+            continue;
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "clone") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->clone.valid = 1;
+            opts->clone.base_file_name = argv[i + 1];
+            opts->clone.new_file_name = argv[i + 2];
+            opts->clone.edits = &argv[i + 3];
+
+            for (i += 3; i < argc && strncmp(argv[i], "--", 2) != 0; i++) {
+                opts->clone.num_edits++;
+            }
+
+            i--;
+            continue;
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "master") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->master.valid = 1;
+            opts->master.manifest_file_name = argv[i + 1];
+            opts->master.image_file_name = argv[i + 2];
+
+            if (i + 3 != argc && strcmp("--span", argv[i + 3]) == 0) {
+                opts->master.span = 1;
+            }
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "replay") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->replay.valid = 1;
+            opts->replay.trace_file_name = argv[i + 1];
+            opts->replay.image_file_name = argv[i + 2];
+            opts->replay.num_passes = 1;
+
+            for (i += 3; i + 1 < argc; i += 2) {
+                if (strcmp(argv[i], "--backend") == 0) {
+                    opts->replay.backend = argv[i + 1];
+                } else if (strcmp(argv[i], "--repeat") == 0) {
+                    opts->replay.num_passes = atoi(argv[i + 1]);
+                } else {
+                    break;
+                }
+            }
+
+            i--;
+            continue;
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "diff") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->diff.valid = 1;
+            opts->diff.source_file_name = argv[i + 1];
+            opts->diff.target_file_name = argv[i + 2];
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "make-patch") == 0) {
+            if (i + 3 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->make_patch.valid = 1;
+            opts->make_patch.source_file_name = argv[i + 1];
+            opts->make_patch.target_file_name = argv[i + 2];
+            opts->make_patch.patch_file_name = argv[i + 3];
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "apply-patch") == 0) {
+            if (i + 2 >= argc) {
+                print_usage_and_exit();
+            }
+
+            opts->apply_patch.valid = 1;
+            opts->apply_patch.image_file_name = argv[i + 1];
+            opts->apply_patch.patch_file_name = argv[i + 2];
+        }
+
+        if (!opts->file.valid && strcmp(argv[i], "query") == 0) {
+            if (i + 1 == argc) {
+                print_usage_and_exit();
+            }
+
+            opts->query.valid = 1;
+            opts->query.index_file_name = argv[i + 1];
+
+            if (i + 2 < argc) {
+                opts->query.pattern = argv[i + 2];
+            }
+        }
+
         if (opts->file.valid) {
             if (strcmp(argv[i], "new") == 0) {
                 opts->file.new.valid = 1;
@@ -299,57 +917,478 @@ void parse_args(struct args_s *opts, int argc, char *argv[])
                 opts->file.del.valid = 1;
                 opts->file.del.file_name = argv[i + 1];
             }
+
+            if (strcmp(argv[i], "read") == 0) {
+                if (i + 3 >= argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.read.valid = 1;
+                opts->file.read.file_name = argv[i + 1];
+                opts->file.read.offset = parse_number(argv[i + 2]);
+                opts->file.read.length = parse_number(argv[i + 3]);
+            }
+
+            if (strcmp(argv[i], "patch") == 0) {
+                if (i + 3 >= argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.patch.valid = 1;
+                opts->file.patch.file_name = argv[i + 1];
+                opts->file.patch.offset = parse_number(argv[i + 2]);
+                opts->file.patch.source = argv[i + 3];
+            }
+
+            if (strcmp(argv[i], "append") == 0) {
+                if (i + 2 >= argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.append.valid = 1;
+                opts->file.append.file_name = argv[i + 1];
+                opts->file.append.host_file_name = argv[i + 2];
+            }
+
+            if (strcmp(argv[i], "extract-all") == 0) {
+                opts->file.extract_all.valid = 1;
+                opts->file.extract_all.dir_name = ".";
+
+                if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                    opts->file.extract_all.dir_name = argv[i + 1];
+                }
+            }
+
+            if (strcmp(argv[i], "insert-all") == 0) {
+                if (i + 1 == argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.insert_all.valid = 1;
+                opts->file.insert_all.dir_name = argv[i + 1];
+            }
+
+            if (strcmp(argv[i], "search") == 0) {
+                if (i + 1 == argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.search.valid = 1;
+                opts->file.search.pattern = argv[i + 1];
+
+                if (i + 2 != argc && strcmp("--raw", argv[i + 2]) == 0) {
+                    opts->file.search.raw = 1;
+                }
+            }
+
+            if (strcmp(argv[i], "verify") == 0) {
+                opts->file.verify.valid = 1;
+            }
+
+            if (strcmp(argv[i], "export-tar") == 0) {
+                opts->file.export_tar.valid = 1;
+            }
+
+            if (strcmp(argv[i], "export-raw") == 0) {
+                if (i + 1 == argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.export_raw.valid = 1;
+                opts->file.export_raw.raw_file_name = argv[i + 1];
+
+                if (i + 2 < argc && strncmp(argv[i + 2], "--", 2) != 0) {
+                    if (raw_parse_geometry(argv[i + 2], &opts->file.export_raw.geometry) != 0) {
+                        print_usage_and_exit();
+                    }
+                    opts->file.export_raw.has_geometry = 1;
+                }
+            }
+
+            if (strcmp(argv[i], "import-raw") == 0) {
+                if (i + 1 == argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.import_raw.valid = 1;
+                opts->file.import_raw.raw_file_name = argv[i + 1];
+
+                if (i + 2 < argc && strncmp(argv[i + 2], "--", 2) != 0) {
+                    if (raw_parse_geometry(argv[i + 2], &opts->file.import_raw.geometry) != 0) {
+                        print_usage_and_exit();
+                    }
+                    opts->file.import_raw.has_geometry = 1;
+                }
+            }
+
+            if (strcmp(argv[i], "import-tar") == 0) {
+                opts->file.import_tar.valid = 1;
+            }
+
+            if (strcmp(argv[i], "sync") == 0) {
+                if (i + 1 == argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.sync.valid = 1;
+                opts->file.sync.dir_name = argv[i + 1];
+            }
+
+            if (strcmp(argv[i], "watch") == 0) {
+                if (i + 1 == argc) {
+                    print_usage_and_exit();
+                }
+
+                opts->file.watch.valid = 1;
+                opts->file.watch.dir_name = argv[i + 1];
+            }
         }
     }
 
+    if (   opts->index.valid
+        || opts->query.valid
+        || opts->pack_archive.valid
+        || opts->unpack_archive.valid
+        || opts->diff.valid
+        || opts->make_patch.valid
+        || opts->apply_patch.valid
+        || opts->copy.valid
+        || opts->clone.valid
+        || opts->master.valid
+        || opts->replay.valid
+        || opts->serve.valid
+        || opts->serve_stats.valid) {
+        return;
+    }
+
     if (!opts->file.valid) {
         print_usage_and_exit();
     }
 
-    if (opts->file.valid
-        && !opts->file.dump.valid
-        && !opts->file.new.valid
-        && !opts->file.dir.valid
-        && !opts->file.info.valid
-        && !opts->file.extract.valid
-        && !opts->file.insert.valid
-        && !opts->file.del.valid) {
+    if (opts->file.valid && num_file_commands(opts) == 0) {
         print_usage_and_exit();
     }
 }
 
+/* Bytes of a hex string like c30040, where spaces, commas and colons between
+   bytes are ignored. Returns NULL when source is not such a string. */
+static
+u8 *parse_hex(const char *source, long *len)
+{
+    u8 *data;
+    const char *c;
+
+    data = (u8 *) malloc(strlen(source) / 2 + 1);
+    if (!data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    *len = 0;
+
+    for (c = source; *c; c++) {
+        char digits[3];
+
+        if (*c == ' ' || *c == ',' || *c == ':') {
+            continue;
+        }
+
+        if (!isxdigit((unsigned char) c[0]) || !isxdigit((unsigned char) c[1])) {
+            free(data);
+            return NULL;
+        }
+
+        digits[0] = c[0];
+        digits[1] = c[1];
+        digits[2] = 0;
+
+        data[(*len)++] = (u8) strtol(digits, NULL, 16);
+        c++;
+    }
+
+    return data;
+}
+
+/* Contents of a host file, or else, when allow_hex is set, the bytes of a
+   hex string */
+static
+u8 *load_bytes(const char *source, long *len, int allow_hex)
+{
+    FILE *fp;
+    u8 *data;
+
+    fp = fopen(source, "rb");
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        *len = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        data = (u8 *) malloc(*len + 1);
+        if (!data || fread(data, 1, *len, fp) != (size_t) *len) {
+            fprintf(stderr, "Failed to read file %s.\n", source);
+            exit(1);
+        }
+
+        fclose(fp);
+        return data;
+    }
+
+    if (!allow_hex) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", source);
+        exit(1);
+    }
+
+    data = parse_hex(source, len);
+    if (!data) {
+        fprintf(stderr, "%s is neither a file nor hex bytes.\n", source);
+        exit(1);
+    }
+
+    return data;
+}
+
 int main(int argc, char *argv[])
 {
     struct args_s opts;
 
     parse_args(&opts, argc, argv);
 
+    if (!opts.jobs.valid || opts.jobs.num_workers < 1) {
+        opts.jobs.num_workers = pool_default_workers();
+    }
+
+    if (!opts.queue_depth.valid || opts.queue_depth.queue_depth < 1) {
+        opts.queue_depth.queue_depth = PREFETCH_DEFAULT_QUEUE_DEPTH;
+    }
+
+    if (!opts.lock_timeout.valid) {
+        opts.lock_timeout.seconds = -1;
+    }
+
+    if (opts.trace.valid && trace_open(opts.trace.trace_file_name) != 0) {
+        return 1;
+    }
+
+    if (opts.index.valid) {
+        struct corpus_s corpus;
+        int i;
+        int result;
+
+        corpus_init(&corpus);
+
+        for (i = 0; i < opts.index.num_paths; i++) {
+            corpus_add(&corpus, opts.index.paths[i]);
+        }
+
+        result = index_build(opts.index.index_file_name, &corpus, opts.jobs.num_workers,
+                             opts.queue_depth.queue_depth);
+        corpus_free(&corpus);
+
+        return result == 0 ? 0 : 1;
+    }
+
+    if (opts.query.valid) {
+        return index_query(opts.query.index_file_name, opts.query.pattern) == 0 ? 0 : 1;
+    }
+
+    if (opts.pack_archive.valid) {
+        struct corpus_s corpus;
+        int i;
+        int result;
+
+        corpus_init(&corpus);
+
+        for (i = 0; i < opts.pack_archive.num_paths; i++) {
+            corpus_add(&corpus, opts.pack_archive.paths[i]);
+        }
+
+        result = archive_pack(opts.pack_archive.archive_file_name, &corpus, opts.queue_depth.queue_depth);
+        corpus_free(&corpus);
+
+        return result == 0 ? 0 : 1;
+    }
+
+    if (opts.diff.valid) {
+        int result = diff_images(opts.diff.source_file_name, opts.diff.target_file_name);
+
+        return result < 0 ? 2 : result;
+    }
+
+    if (opts.make_patch.valid) {
+        return diff_make_patch(opts.make_patch.source_file_name,
+                               opts.make_patch.target_file_name,
+                               opts.make_patch.patch_file_name) == 0 ? 0 : 1;
+    }
+
+    if (opts.apply_patch.valid) {
+        struct lock_s lock;
+        int result;
+
+        if (lock_acquire(&lock, opts.apply_patch.image_file_name, 1, opts.lock_timeout.seconds) != 0) {
+            return 1;
+        }
+
+        result = diff_apply_patch(opts.apply_patch.image_file_name, opts.apply_patch.patch_file_name);
+        lock_release(&lock);
+
+        return result == 0 ? 0 : 1;
+    }
+
+    if (opts.copy.valid) {
+        return copy_files(opts.copy.sources, opts.copy.num_sources, opts.copy.dest,
+                          opts.lock_timeout.seconds) < 0 ? 1 : 0;
+    }
+
+    if (opts.clone.valid) {
+        return clone_image(opts.clone.base_file_name, opts.clone.new_file_name,
+                           opts.clone.edits, opts.clone.num_edits,
+                           !opts.no_amsdos.valid, opts.lock_timeout.seconds) < 0 ? 1 : 0;
+    }
+
+    if (opts.master.valid) {
+        return master_build(opts.master.manifest_file_name, opts.master.image_file_name,
+                            opts.master.span, !opts.no_amsdos.valid, opts.lock_timeout.seconds) < 0 ? 1 : 0;
+    }
+
+    if (opts.replay.valid) {
+        if (opts.replay.num_passes < 1) {
+            print_usage_and_exit();
+        }
+
+        return replay_trace(opts.replay.trace_file_name, opts.replay.image_file_name,
+                            opts.replay.backend, opts.replay.num_passes) == 0 ? 0 : 1;
+    }
+
+    if (opts.unpack_archive.valid) {
+        return archive_unpack(opts.unpack_archive.archive_file_name,
+                              opts.unpack_archive.dest_dir,
+                              opts.unpack_archive.names,
+                              opts.unpack_archive.num_names) == 0 ? 0 : 1;
+    }
+
+    if (opts.serve.valid) {
+        return serve(opts.serve.socket_path) == 0 ? 0 : 1;
+    }
+
+    if (opts.serve_stats.valid) {
+        return serve_call(opts.serve_stats.socket_path, NULL, SERVE_OP_STATS, NULL, 0, 0, 0) == 0 ? 0 : 1;
+    }
+
+    if (opts.files.valid) {
+        struct corpus_s corpus;
+        int num_failed;
+
+        corpus_init(&corpus);
+        corpus_add(&corpus, opts.files.pattern);
+
+        /* verify only reads, so it runs in this process on images read ahead
+           rather than once per image in a child */
+        if (num_file_commands(&opts) == 1 && opts.file.verify.valid) {
+            num_failed = verify_corpus(&corpus, opts.jobs.num_workers, opts.queue_depth.queue_depth);
+        } else {
+            num_failed = fanout_run(&corpus, argc, argv, opts.files.index, opts.jobs.num_workers);
+        }
+        corpus_free(&corpus);
+
+        return num_failed == 0 ? 0 : 1;
+    }
+
+    if (opts.socket.valid && opts.file.valid) {
+        int flags;
+        int result;
+
+        flags  = opts.no_amsdos.valid ? 0 : SERVE_FLAG_AMSDOS;
+        flags |= opts.text.valid ? SERVE_FLAG_TEXT : 0;
+        flags |= opts.file.info.tracks ? SERVE_FLAG_TRACKS : 0;
+        result = 1;
+
+        if (opts.file.dir.valid) {
+            result = serve_call(opts.socket.socket_path, opts.file.file_name, SERVE_OP_DIR,
+                                NULL, 0, 0, flags);
+        } else if (opts.file.info.valid) {
+            result = serve_call(opts.socket.socket_path, opts.file.file_name, SERVE_OP_INFO,
+                                opts.file.info.file_name, 0, 0, flags);
+        } else if (opts.file.extract.valid) {
+            result = serve_call(opts.socket.socket_path, opts.file.file_name, SERVE_OP_EXTRACT,
+                                opts.file.extract.file_name, 0, 0, flags);
+        } else if (opts.file.insert.valid) {
+            result = serve_call(opts.socket.socket_path, opts.file.file_name, SERVE_OP_INSERT,
+                                opts.file.insert.file_name, opts.file.insert.entry_addr,
+                                opts.file.insert.exec_addr, flags);
+        } else if (opts.file.del.valid) {
+            result = serve_call(opts.socket.socket_path, opts.file.file_name, SERVE_OP_DEL,
+                                opts.file.del.file_name, 0, 0, flags);
+        } else {
+            fprintf(stderr, "Command is not supported with --socket.\n");
+        }
+
+        return result == 0 ? 0 : 1;
+    }
+
+    if (opts.file.watch.valid) {
+        return watch_dir(opts.file.file_name, opts.file.watch.dir_name, !opts.no_amsdos.valid,
+                         opts.lock_timeout.seconds) == 0 ? 0 : 1;
+    }
+
     if (opts.file.valid) {
+        struct shadow_s shadow;
+        struct lock_s lock;
         FILE *fp;
-        char *fopen_flags = "rb+";
+        int mutating;
+        int changed;
+        int result;
+
+        /* Changes are made to a copy in memory and committed at the end with
+           one atomic write, so an interrupted command leaves the image as it
+           was */
+        mutating = opts.file.new.valid
+            || opts.file.insert.valid
+            || opts.file.del.valid
+            || opts.file.patch.valid
+            || opts.file.append.valid
+            || opts.file.insert_all.valid
+            || opts.file.import_tar.valid
+            || opts.file.import_raw.valid
+            || opts.file.sync.valid;
+
+        if (lock_acquire(&lock, opts.file.file_name, mutating, opts.lock_timeout.seconds) != 0) {
+            exit(1);
+        }
 
         if (opts.file.new.valid) {
-            fopen_flags = "wb+";
+            result = shadow_new(&shadow, opts.file.file_name, CPCEMU_INFO_OFFSET + SIZ_TOTAL);
+        } else if (mutating) {
+            result = shadow_open(&shadow, opts.file.file_name);
+        } else {
+            result = shadow_map(&shadow, opts.file.file_name);
         }
 
-        fp = fopen(opts.file.file_name, fopen_flags);
-        if (!fp) {
-            fprintf(stderr, "Failed to open file %s.\n", opts.file.file_name);
+        if (result != 0) {
             exit(1);
         }
 
+        fp = shadow.fp;
+
         if (opts.file.new.valid) {
             cpm_new(fp);
         }
 
-        cpm_init(fp);
+        if (cpm_init(fp) != 0) {
+            fprintf(stderr, "Unrecognized disk type\n");
+            exit(1);
+        }
+
+        changed = opts.file.new.valid;
+        result  = 0;
 
         if (opts.file.dir.valid) {
             cpm_dir(fp);
         }
 
         if (opts.file.info.valid) {
-            cpm_info(fp, opts.file.info.file_name, opts.file.info.tracks);
+            if (cpm_info(fp, stdout, opts.file.info.file_name, opts.file.info.tracks) != 0) {
+                exit(0);
+            }
         }
 
         if (opts.file.dump.valid) {
@@ -357,21 +1396,167 @@ int main(int argc, char *argv[])
         }
 
         if (opts.file.extract.valid) {
-            cpm_dump(fp, opts.file.extract.file_name, 1, opts.text.valid);
+            /* Text files end at their first SUB, which only shows in the bytes,
+               and compressed images have no sectors to copy from */
+            if (   opts.text.valid
+                || shadow.compressed
+                || extract_zero_copy(opts.file.file_name, fp, opts.file.extract.file_name) != 0) {
+                cpm_dump(fp, opts.file.extract.file_name, 1, opts.text.valid);
+            }
+        }
+
+        if (opts.file.read.valid) {
+            if (cpm_read(fp, opts.file.read.file_name, opts.file.read.offset,
+                         opts.file.read.length) != 0) {
+                result = 1;
+            }
         }
 
         if (opts.file.insert.valid) {
             cpm_insert(fp, opts.file.insert.file_name, opts.file.insert.entry_addr,
                        opts.file.insert.exec_addr, !opts.no_amsdos.valid);
+            changed = 1;
         }
 
         if (opts.file.del.valid) {
             if (cpm_del(fp, opts.file.del.file_name)) {
                 printf("%s is deleted.\n", opts.file.del.file_name);
+                changed = 1;
             }
         }
 
-        fclose(fp);
+        if (opts.file.patch.valid || opts.file.append.valid) {
+            char *file_name;
+            long offset;
+            u8 *data;
+            long len;
+
+            if (opts.file.patch.valid) {
+                file_name = opts.file.patch.file_name;
+                offset    = opts.file.patch.offset;
+                data      = load_bytes(opts.file.patch.source, &len, 1);
+            } else {
+                file_name = opts.file.append.file_name;
+                offset    = CPM_END_OF_FILE;
+                data      = load_bytes(opts.file.append.host_file_name, &len, 0);
+            }
+
+            if (cpm_write_at(fp, file_name, offset, data, len) == 0) {
+                printf("Wrote %ld bytes into %s.\n", len, file_name);
+                changed = 1;
+            } else {
+                result = 1;
+            }
+
+            free(data);
+        }
+
+        if (opts.file.extract_all.valid) {
+            if (batch_extract_all(fp, opts.file.extract_all.dir_name, opts.text.valid,
+                                  opts.jobs.num_workers) < 0) {
+                result = 1;
+            }
+        }
+
+        if (opts.file.insert_all.valid) {
+            int num_written = batch_insert_all(fp, opts.file.insert_all.dir_name);
+
+            /* A missing manifest or a failed file leaves the image as it was */
+            if (num_written < 0) {
+                result = 1;
+            }
+            changed = num_written > 0;
+        }
+
+        if (opts.file.search.valid) {
+            u8 *pattern;
+            long len;
+
+            /* A 0x prefix makes bytes, anything else is searched as text */
+            if (   strncmp(opts.file.search.pattern, "0x", 2) == 0
+                || strncmp(opts.file.search.pattern, "0X", 2) == 0) {
+                pattern = parse_hex(opts.file.search.pattern + 2, &len);
+                if (!pattern) {
+                    fprintf(stderr, "%s is not a hex string.\n",
+                            opts.file.search.pattern);
+                    result = 1;
+                }
+            } else {
+                len = strlen(opts.file.search.pattern);
+                pattern = (u8 *) malloc(len + 1);
+                if (!pattern) {
+                    fprintf(stderr, "Out of memory.\n");
+                    exit(1);
+                }
+                memcpy(pattern, opts.file.search.pattern, len);
+            }
+
+            if (pattern && len == 0) {
+                fprintf(stderr, "Search pattern is empty.\n");
+                result = 1;
+            } else if (pattern) {
+                search_image(fp, pattern, len, opts.file.search.raw);
+            }
+
+            free(pattern);
+        }
+
+        if (opts.file.verify.valid) {
+            if (verify_image(fp, stdout) != 0) {
+                result = 1;
+            }
+        }
+
+        if (opts.file.export_tar.valid) {
+            if (tar_export(fp, stdout) < 0) {
+                result = 1;
+            }
+        }
+
+        if (opts.file.export_raw.valid) {
+            if (raw_export(fp, opts.file.export_raw.raw_file_name,
+                           opts.file.export_raw.has_geometry ? &opts.file.export_raw.geometry : NULL) < 0) {
+                result = 1;
+            }
+        }
+
+        if (opts.file.import_raw.valid) {
+            if (raw_import(fp, opts.file.import_raw.raw_file_name,
+                           opts.file.import_raw.has_geometry ? &opts.file.import_raw.geometry : NULL) < 0) {
+                result = 1;
+            } else {
+                changed = 1;
+            }
+        }
+
+        if (opts.file.import_tar.valid) {
+            int num_written = tar_import(fp, stdin, !opts.no_amsdos.valid);
+
+            /* A cut or damaged stream leaves the image as it was */
+            if (num_written < 0) {
+                result = 1;
+            }
+            changed = num_written > 0;
+        }
+
+        if (opts.file.sync.valid) {
+            int num_written = sync_dir(fp, opts.file.sync.dir_name, !opts.no_amsdos.valid);
+
+            /* Files that were synced are kept even if others failed */
+            if (num_written < 0) {
+                result = 1;
+            }
+            changed = num_written != 0;
+        }
+
+        if (mutating && changed && shadow_commit(&shadow) != 0) {
+            result = 1;
+        }
+
+        shadow_close(&shadow);
+        lock_release(&lock);
+
+        return result;
     }
 
     return 0;
@@ -0,0 +1,1038 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "serve.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "amsdos.h"
+#include "lock.h"
+#include "shadow.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#define HAVE_UNIX_SOCKETS
+#endif
+
+#if defined (HAVE_UNIX_SOCKETS)
+
+#if defined (HAVE_PTHREAD)
+#include <pthread.h>
+typedef pthread_mutex_t mutex_t;
+#define mutex_init(m)       pthread_mutex_init(m, NULL)
+#define mutex_lock(m)       pthread_mutex_lock(m)
+#define mutex_unlock(m)     pthread_mutex_unlock(m)
+#else
+typedef int mutex_t;
+#define mutex_init(m)       (*(m) = 0)
+#define mutex_lock(m)       ((void) (m))
+#define mutex_unlock(m)     ((void) (m))
+#endif
+
+#define MAX_IMAGES          32
+#define MAX_IMAGE_NAME      4096
+#define NUM_BUCKETS         24
+#define LOCK_TIMEOUT        10.0
+#define SUB                 0x1a
+
+struct image_s {
+    char file_name[MAX_IMAGE_NAME];   /* Empty while the slot is free */
+    struct shadow_s shadow;           /* shadow.fp is NULL until loaded */
+    struct stat st;                   /* The image file when it was loaded */
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    int num_diren;                    /* 0 until the directory is read */
+    int users;
+    unsigned long last_used;
+    mutex_t lock;
+};
+
+/* Latencies are counted in power of two buckets, bucket i holding the ones
+   below 2^i microseconds */
+struct op_stats_s {
+    unsigned long count;
+    double total_us;
+    double max_us;
+    unsigned long buckets[NUM_BUCKETS];
+};
+
+struct buffer_s {
+    u8 *data;
+    size_t length;
+    size_t capacity;
+};
+
+struct extract_s {
+    struct buffer_s *out;
+    int text;
+};
+
+static struct image_s g_images[MAX_IMAGES];
+static unsigned long g_clock;
+static mutex_t g_images_lock;
+
+static struct op_stats_s g_stats[SERVE_NUM_OPS];
+static mutex_t g_stats_lock;
+
+static const char *g_op_names[SERVE_NUM_OPS] = {
+    "", "dir", "insert", "extract", "del", "info", "stats"
+};
+
+static
+int buffer_append(struct buffer_s *buffer, const void *data, size_t length)
+{
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity;
+        u8 *new_data;
+
+        for (capacity = buffer->capacity ? buffer->capacity : 1024;
+             capacity < buffer->length + length;
+             capacity *= 2) {
+        }
+
+        new_data = (u8 *) realloc(buffer->data, capacity);
+        if (!new_data) {
+            return -1;
+        }
+
+        buffer->data     = new_data;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+
+    return 0;
+}
+
+static
+void buffer_puts(struct buffer_s *buffer, const char *text)
+{
+    buffer_append(buffer, text, strlen(text));
+}
+
+static
+int set_error(struct buffer_s *out, const char *format, const char *arg)
+{
+    char line[MAX_IMAGE_NAME + 128];
+
+    sprintf(line, format, arg);
+    out->length = 0;
+    buffer_puts(out, line);
+
+    return SERVE_STATUS_ERROR;
+}
+
+static
+int read_full(int fd, void *buf, size_t length)
+{
+    u8 *p = (u8 *) buf;
+
+    while (length) {
+        ssize_t n = read(fd, p, length);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        p      += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static
+int write_full(int fd, const void *buf, size_t length)
+{
+    const u8 *p = (const u8 *) buf;
+
+    while (length) {
+        ssize_t n = write(fd, p, length);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        p      += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static
+int read_message(int fd, u8 **body, u32 *length)
+{
+    u8 prefix[4];
+
+    if (read_full(fd, prefix, sizeof(prefix)) != 0) {
+        return -1;
+    }
+
+    *length = (u32) prefix[0] | (u32) prefix[1] << 8 | (u32) prefix[2] << 16 | (u32) prefix[3] << 24;
+
+    if (*length > SERVE_MAX_MESSAGE) {
+        return -1;
+    }
+
+    *body = (u8 *) malloc(*length + 1);
+    if (!*body) {
+        return -1;
+    }
+
+    if (read_full(fd, *body, *length) != 0) {
+        free(*body);
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+int write_message(int fd, const u8 *head, size_t head_length, const u8 *body, size_t body_length)
+{
+    u8 prefix[4];
+    u32 length;
+
+    length = (u32) (head_length + body_length);
+
+    prefix[0] = (u8) length;
+    prefix[1] = (u8) (length >> 8);
+    prefix[2] = (u8) (length >> 16);
+    prefix[3] = (u8) (length >> 24);
+
+    if (   write_full(fd, prefix, sizeof(prefix)) != 0
+        || write_full(fd, head, head_length) != 0
+        || (body_length && write_full(fd, body, body_length) != 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static
+double now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+static
+void record_latency(int op, double us)
+{
+    struct op_stats_s *stats = &g_stats[op];
+    int bucket;
+
+    for (bucket = 0; bucket < NUM_BUCKETS - 1 && us >= (double) (1UL << bucket); bucket++) {
+    }
+
+    mutex_lock(&g_stats_lock);
+
+    stats->count++;
+    stats->total_us += us;
+    stats->buckets[bucket]++;
+
+    if (stats->max_us < us) {
+        stats->max_us = us;
+    }
+
+    mutex_unlock(&g_stats_lock);
+}
+
+static
+void print_stats(struct buffer_s *out)
+{
+    struct op_stats_s stats[SERVE_NUM_OPS];
+    int op;
+
+    mutex_lock(&g_stats_lock);
+    memcpy(stats, g_stats, sizeof(stats));
+    mutex_unlock(&g_stats_lock);
+
+    for (op = 1; op < SERVE_NUM_OPS; op++) {
+        char line[128];
+        int bucket;
+
+        if (!stats[op].count) {
+            continue;
+        }
+
+        sprintf(line, "%s: %lu requests, mean %.1f us, max %.1f us\n", g_op_names[op],
+                stats[op].count, stats[op].total_us / stats[op].count, stats[op].max_us);
+        buffer_puts(out, line);
+
+        for (bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+            if (!stats[op].buckets[bucket]) {
+                continue;
+            }
+
+            if (bucket == NUM_BUCKETS - 1) {
+                sprintf(line, "  >= %8lu us: %lu\n", 1UL << (bucket - 1), stats[op].buckets[bucket]);
+            } else {
+                sprintf(line, "  <  %8lu us: %lu\n", 1UL << bucket, stats[op].buckets[bucket]);
+            }
+            buffer_puts(out, line);
+        }
+    }
+}
+
+static
+void unload_image(struct image_s *image)
+{
+    if (image->shadow.fp) {
+        shadow_close(&image->shadow);
+    }
+
+    image->num_diren = 0;
+}
+
+/* Commands run without the server write the image in place, so the
+   modification time is compared to the nanosecond where it is available */
+static
+int image_changed(struct image_s *image, struct stat *st)
+{
+    return st->st_dev   != image->st.st_dev
+        || st->st_ino   != image->st.st_ino
+        || st->st_size  != image->st.st_size
+        || st->st_mtime != image->st.st_mtime
+        || st->st_ctime != image->st.st_ctime
+#if defined (__linux__)
+        || st->st_mtim.tv_nsec != image->st.st_mtim.tv_nsec
+#endif
+        ;
+}
+
+static
+void release_image(struct image_s *image)
+{
+    mutex_unlock(&image->lock);
+
+    mutex_lock(&g_images_lock);
+    image->users--;
+    mutex_unlock(&g_images_lock);
+}
+
+/* Returns the image locked and ready for the CP/M layer of this thread, or
+   NULL with the error in out. Images changed on disk by anyone else are
+   loaded again. */
+static
+struct image_s *acquire_image(const char *file_name, struct buffer_s *out)
+{
+    struct image_s *image;
+    struct stat st;
+    int i;
+
+    image = NULL;
+
+    mutex_lock(&g_images_lock);
+
+    for (i = 0; i < MAX_IMAGES; i++) {
+        if (strcmp(g_images[i].file_name, file_name) == 0) {
+            image = &g_images[i];
+            break;
+        }
+    }
+
+    /* Take a free slot, or evict the least recently used idle image */
+    if (!image) {
+        for (i = 0; i < MAX_IMAGES; i++) {
+            struct image_s *candidate = &g_images[i];
+
+            if (candidate->users) {
+                continue;
+            }
+
+            if (!candidate->file_name[0]) {
+                image = candidate;
+                break;
+            }
+
+            if (!image || candidate->last_used < image->last_used) {
+                image = candidate;
+            }
+        }
+
+        if (image) {
+            unload_image(image);
+            strcpy(image->file_name, file_name);
+        }
+    }
+
+    if (image) {
+        image->users++;
+        image->last_used = ++g_clock;
+    }
+
+    mutex_unlock(&g_images_lock);
+
+    if (!image) {
+        set_error(out, "Too many images in use, %s is not opened.\n", file_name);
+        return NULL;
+    }
+
+    mutex_lock(&image->lock);
+
+    if (stat(file_name, &st) != 0) {
+        unload_image(image);
+        release_image(image);
+        set_error(out, "Failed to open file %s.\n", file_name);
+        return NULL;
+    }
+
+    if (image->shadow.fp && image_changed(image, &st)) {
+        unload_image(image);
+    }
+
+    if (!image->shadow.fp) {
+        if (shadow_open(&image->shadow, file_name) != 0) {
+            release_image(image);
+            set_error(out, "Failed to open file %s.\n", file_name);
+            return NULL;
+        }
+
+        image->st = st;
+    }
+
+    if (cpm_init(image->shadow.fp) != 0) {
+        unload_image(image);
+        release_image(image);
+        set_error(out, "Unrecognized disk type of %s.\n", file_name);
+        return NULL;
+    }
+
+    return image;
+}
+
+static
+int commit_image(struct image_s *image, struct buffer_s *out)
+{
+    image->num_diren = 0;
+
+    if (shadow_commit(&image->shadow) != 0 || stat(image->file_name, &image->st) != 0) {
+        unload_image(image);
+        return set_error(out, "Failed to write %s.\n", image->file_name);
+    }
+
+    return SERVE_STATUS_OK;
+}
+
+static
+int find_file(struct image_s *image, const char *file_name)
+{
+    if (!image->num_diren) {
+        image->num_diren = cpm_read_dir(image->shadow.fp, image->table);
+    }
+
+    return cpm_find_file(image->table, image->num_diren, file_name);
+}
+
+static
+int run_dir(struct image_s *image, struct buffer_s *out)
+{
+    int i;
+
+    if (!image->num_diren) {
+        image->num_diren = cpm_read_dir(image->shadow.fp, image->table);
+    }
+
+    for (i = 0; i < image->num_diren; i++) {
+        struct cpm_diren_s *dir = &image->table[i];
+        char full_file_name[13];
+        char line[64];
+        int num_records;
+        u8 attributes;
+
+        if (   dir->user_number == CPM_NO_FILE
+            || dir->AL[0]       == 0
+            || dir->EX          != 0) {
+            continue;
+        }
+
+        normalize_filename(full_file_name, dir);
+        num_records = cpm_file_records(image->table, image->num_diren, i);
+        attributes  = cpm_get_attributes(dir);
+
+        sprintf(line, "%13s\t%3dK\t%.6s\t%.9s\n", full_file_name, (num_records * 128 + 1023) / 1024,
+                attributes & CPM_ATTR_SYSTEM ? "system" : "",
+                attributes & CPM_ATTR_READ_ONLY ? "read-only" : "");
+        buffer_puts(out, line);
+    }
+
+    return SERVE_STATUS_OK;
+}
+
+static
+int run_info(struct image_s *image, const char *file_name, int tracks_only, struct buffer_s *out)
+{
+    FILE *memory;
+    char *text;
+    size_t length;
+
+    /* Written by the same code as the local command, so the text matches */
+    memory = open_memstream(&text, &length);
+    if (!memory) {
+        return set_error(out, "Failed to describe %s.\n", file_name);
+    }
+
+    cpm_info(image->shadow.fp, memory, file_name, tracks_only);
+    fclose(memory);
+
+    buffer_append(out, text, length);
+    free(text);
+
+    return SERVE_STATUS_OK;
+}
+
+static
+int extract_sink(void *ctx, u8 *buf, size_t len)
+{
+    struct extract_s *extract = (struct extract_s *) ctx;
+
+    if (extract->text) {
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+            if (buf[i] == SUB) {
+                buffer_append(extract->out, buf, i);
+                return -1;
+            }
+        }
+    }
+
+    return buffer_append(extract->out, buf, len);
+}
+
+static
+int run_extract(struct image_s *image, const char *file_name, int text, struct buffer_s *out)
+{
+    struct extract_s extract;
+    int first;
+
+    first = find_file(image, file_name);
+    if (first < 0) {
+        return set_error(out, "File %s not found.\n", file_name);
+    }
+
+    extract.out  = out;
+    extract.text = text;
+
+    cpm_read_file(image->shadow.fp, image->table, image->num_diren, first, extract_sink, &extract);
+
+    return SERVE_STATUS_OK;
+}
+
+static
+int run_insert(struct image_s *image, struct serve_request_s *request, const char *file_name,
+               const u8 *data, size_t data_length, struct buffer_s *out)
+{
+    char line[64];
+    int result;
+
+    /* The checks of cpm_insert_buffer, whose message would stay here */
+    if (!strcspn(file_name, ".")) {
+        return set_error(out, "%s is not a valid file name.\n", file_name);
+    }
+
+    result = cpm_insert_buffer(image->shadow.fp, file_name, data, (long) data_length,
+                               request->entry_addr, request->exec_addr,
+                               request->flags & SERVE_FLAG_AMSDOS);
+
+    if (result < 0) {
+        unload_image(image);
+        return set_error(out, "Failed to insert %s, not enough space on disk.\n", file_name);
+    }
+
+    if (commit_image(image, out) != SERVE_STATUS_OK) {
+        return SERVE_STATUS_ERROR;
+    }
+
+    sprintf(line, "Wrote %s into disk.\n", file_name);
+    buffer_puts(out, line);
+
+    return SERVE_STATUS_OK;
+}
+
+static
+int run_del(struct image_s *image, const char *file_name, struct buffer_s *out)
+{
+    char line[64];
+
+    if (!cpm_del(image->shadow.fp, file_name)) {
+        return set_error(out, "File %s not found.\n", file_name);
+    }
+
+    if (commit_image(image, out) != SERVE_STATUS_OK) {
+        return SERVE_STATUS_ERROR;
+    }
+
+    sprintf(line, "%s is deleted.\n", file_name);
+    buffer_puts(out, line);
+
+    return SERVE_STATUS_OK;
+}
+
+static
+int handle_request(const u8 *body, u32 length, struct buffer_s *out)
+{
+    struct serve_request_s request;
+    struct image_s *image;
+    struct lock_s lock;
+    char image_name[MAX_IMAGE_NAME];
+    char file_name[16];
+    const u8 *data;
+    size_t data_length;
+    int status;
+
+    if (length < sizeof(request)) {
+        return set_error(out, "Malformed request.%s\n", "");
+    }
+
+    memcpy(&request, body, sizeof(request));
+
+    if (   request.op == 0
+        || request.op >= SERVE_NUM_OPS
+        || request.image_name_length >= sizeof(image_name)
+        || request.file_name_length >= sizeof(file_name)
+        || sizeof(request) + request.image_name_length + request.file_name_length > length) {
+        return set_error(out, "Malformed request.%s\n", "");
+    }
+
+    memcpy(image_name, body + sizeof(request), request.image_name_length);
+    image_name[request.image_name_length] = 0;
+
+    memcpy(file_name, body + sizeof(request) + request.image_name_length, request.file_name_length);
+    file_name[request.file_name_length] = 0;
+
+    data        = body + sizeof(request) + request.image_name_length + request.file_name_length;
+    data_length = length - (data - body);
+
+    if (request.op == SERVE_OP_STATS) {
+        print_stats(out);
+        return SERVE_STATUS_OK;
+    }
+
+    if (request.op != SERVE_OP_DIR && (!file_name[0] || !cpm_valid_filename(file_name))) {
+        return set_error(out, "Invalid file name %s.\n", file_name);
+    }
+
+    /* Changes hold the image file lock from loading until the commit, like
+       the local commands do. Reads are answered from memory. */
+    lock.fd = -1;
+
+    if (   (request.op == SERVE_OP_INSERT || request.op == SERVE_OP_DEL)
+        && lock_acquire(&lock, image_name, 1, LOCK_TIMEOUT) != 0) {
+        return set_error(out, "Timed out waiting for the lock on %s.\n", image_name);
+    }
+
+    image = acquire_image(image_name, out);
+    if (!image) {
+        lock_release(&lock);
+        return SERVE_STATUS_ERROR;
+    }
+
+    if (request.op == SERVE_OP_DIR) {
+        status = run_dir(image, out);
+    } else if (request.op == SERVE_OP_INFO) {
+        status = run_info(image, file_name, request.flags & SERVE_FLAG_TRACKS, out);
+    } else if (request.op == SERVE_OP_EXTRACT) {
+        status = run_extract(image, file_name, request.flags & SERVE_FLAG_TEXT, out);
+    } else if (request.op == SERVE_OP_INSERT) {
+        status = run_insert(image, &request, file_name, data, data_length, out);
+    } else {
+        status = run_del(image, file_name, out);
+    }
+
+    release_image(image);
+    lock_release(&lock);
+
+    return status;
+}
+
+/* Answers requests on one connection until the client hangs up */
+static
+void serve_connection(int fd)
+{
+    u8 *body;
+    u32 length;
+
+    while (read_message(fd, &body, &length) == 0) {
+        struct buffer_s out;
+        double start;
+        u8 status;
+        int op;
+
+        memset(&out, 0, sizeof(out));
+
+        start  = now_us();
+        status = (u8) handle_request(body, length, &out);
+        op     = length > 0 && body[0] < SERVE_NUM_OPS ? body[0] : 0;
+
+        if (op) {
+            record_latency(op, now_us() - start);
+        }
+
+        free(body);
+
+        if (write_message(fd, &status, 1, out.data, out.length) != 0) {
+            free(out.data);
+            break;
+        }
+
+        free(out.data);
+    }
+
+    close(fd);
+}
+
+#if defined (HAVE_PTHREAD)
+static
+void *connection_main(void *arg)
+{
+    serve_connection((int) (size_t) arg);
+
+    return NULL;
+}
+#endif
+
+static
+int make_address(struct sockaddr_un *addr, const char *socket_path)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path %s is too long.\n", socket_path);
+        return -1;
+    }
+
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
+
+    return 0;
+}
+
+int serve(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    int fd;
+    int i;
+
+    assert(socket_path);
+
+    if (make_address(&addr, socket_path) != 0) {
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    mutex_init(&g_images_lock);
+    mutex_init(&g_stats_lock);
+
+    for (i = 0; i < MAX_IMAGES; i++) {
+        mutex_init(&g_images[i].lock);
+    }
+
+    /* A socket file is only replaced when nobody answers on it */
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Already serving on %s.\n", socket_path);
+        close(fd);
+        return -1;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    unlink(socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (   fd < 0
+        || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || listen(fd, 64) != 0) {
+        fprintf(stderr, "Failed to listen on %s.\n", socket_path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    printf("Serving on %s.\n", socket_path);
+    fflush(stdout);
+
+    while (1) {
+        int client = accept(fd, NULL, NULL);
+
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+
+#if defined (HAVE_PTHREAD)
+        {
+            pthread_t thread;
+
+            if (pthread_create(&thread, NULL, connection_main, (void *) (size_t) client) == 0) {
+                pthread_detach(thread);
+                continue;
+            }
+        }
+#endif
+
+        serve_connection(client);
+    }
+
+    fprintf(stderr, "Failed to accept connections on %s.\n", socket_path);
+    close(fd);
+    unlink(socket_path);
+
+    return -1;
+}
+
+static
+u8 *read_host_file(const char *host_file_name, long *size)
+{
+    FILE *fp;
+    u8 *data;
+
+    fp = fopen(host_file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", host_file_name);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    data = (u8 *) malloc(*size + 1);
+    if (!data || fread(data, 1, *size, fp) != (size_t) *size) {
+        fprintf(stderr, "Failed to read file %s.\n", host_file_name);
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+/* The server resolves relative paths against its own directory */
+static
+char *absolute_path(const char *path)
+{
+    char cwd[MAX_IMAGE_NAME];
+    char *result;
+
+    if (path[0] == '/') {
+        result = (char *) malloc(strlen(path) + 1);
+        if (result) {
+            strcpy(result, path);
+        }
+        return result;
+    }
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return NULL;
+    }
+
+    result = (char *) malloc(strlen(cwd) + strlen(path) + 2);
+    if (result) {
+        sprintf(result, "%s/%s", cwd, path);
+    }
+
+    return result;
+}
+
+static
+int write_extracted_file(const char *file_name, const u8 *data, size_t length)
+{
+    struct cpm_diren_s dir;
+    char full_file_name[13];
+    FILE *fp;
+
+    memset(&dir, 0, sizeof(dir));
+    denormalize_filename(file_name, &dir);
+    normalize_filename(full_file_name, &dir);
+
+    fp = fopen(full_file_name, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", full_file_name);
+        return -1;
+    }
+
+    if (fwrite(data, 1, length, fp) != length) {
+        fprintf(stderr, "Error writing to file.\n");
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    printf("Extracted file %s.\n", file_name);
+
+    return 0;
+}
+
+int serve_call(const char *socket_path, const char *image_file_name, int op,
+               const char *file_name, u16 entry_addr, u16 exec_addr, int flags)
+{
+    struct sockaddr_un addr;
+    struct serve_request_s request;
+    char *image_name;
+    const char *cpm_file_name;
+    u8 *data;
+    long data_length;
+    u8 *head;
+    size_t head_length;
+    u8 *body;
+    u32 length;
+    int fd;
+    int result;
+
+    assert(socket_path);
+    assert(op > 0 && op < SERVE_NUM_OPS);
+
+    if (make_address(&addr, socket_path) != 0) {
+        return -1;
+    }
+
+    cpm_file_name = file_name ? file_name : "";
+    data          = NULL;
+    data_length   = 0;
+
+    /* Inserted files are named after the host file, without its directory */
+    if (op == SERVE_OP_INSERT) {
+        cpm_file_name = strrchr(file_name, '/') ? strrchr(file_name, '/') + 1 : file_name;
+    }
+
+    if (op != SERVE_OP_DIR && op != SERVE_OP_STATS && !cpm_valid_filename(cpm_file_name)) {
+        fprintf(stderr, "Invalid file name %s.\n", cpm_file_name);
+        return -1;
+    }
+
+    image_name = NULL;
+    if (op != SERVE_OP_STATS) {
+        image_name = absolute_path(image_file_name);
+        if (!image_name) {
+            fprintf(stderr, "Failed to open file %s.\n", image_file_name);
+            return -1;
+        }
+    }
+
+    if (op == SERVE_OP_INSERT) {
+        data = read_host_file(file_name, &data_length);
+        if (!data) {
+            free(image_name);
+            return -1;
+        }
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.op                = (u8) op;
+    request.flags             = (u8) flags;
+    request.entry_addr        = entry_addr;
+    request.exec_addr         = exec_addr;
+    request.image_name_length = (u16) (image_name ? strlen(image_name) : 0);
+    request.file_name_length  = (u16) strlen(cpm_file_name);
+
+    head_length = sizeof(request) + request.image_name_length + request.file_name_length;
+    head        = (u8 *) malloc(head_length);
+    if (!head) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    memcpy(head, &request, sizeof(request));
+    memcpy(head + sizeof(request), image_name ? image_name : "", request.image_name_length);
+    memcpy(head + sizeof(request) + request.image_name_length, cpm_file_name, request.file_name_length);
+
+    free(image_name);
+
+    body   = NULL;
+    length = 0;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Failed to connect to %s.\n", socket_path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(head);
+        free(data);
+        return -1;
+    }
+
+    result = write_message(fd, head, head_length, data, data_length);
+    if (result == 0) {
+        result = read_message(fd, &body, &length);
+    }
+
+    close(fd);
+    free(head);
+    free(data);
+
+    if (result != 0 || length < 1) {
+        fprintf(stderr, "No response from %s.\n", socket_path);
+        free(body);
+        return -1;
+    }
+
+    if (body[0] != SERVE_STATUS_OK) {
+        fwrite(body + 1, 1, length - 1, stderr);
+        result = -1;
+    } else if (op == SERVE_OP_EXTRACT) {
+        result = write_extracted_file(cpm_file_name, body + 1, length - 1);
+    } else {
+        fwrite(body + 1, 1, length - 1, stdout);
+    }
+
+    free(body);
+
+    return result;
+}
+#else
+int serve(const char *socket_path)
+{
+    fprintf(stderr, "Serving on %s is not supported on this platform.\n", socket_path);
+
+    return -1;
+}
+
+int serve_call(const char *socket_path, const char *image_file_name, int op,
+               const char *file_name, u16 entry_addr, u16 exec_addr, int flags)
+{
+    (void) image_file_name;
+    (void) op;
+    (void) file_name;
+    (void) entry_addr;
+    (void) exec_addr;
+    (void) flags;
+
+    fprintf(stderr, "Connecting to %s is not supported on this platform.\n", socket_path);
+
+    return -1;
+}
+#endif
@@ -0,0 +1,50 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include "types.h"
+
+#define SERVE_OP_DIR            1
+#define SERVE_OP_INSERT         2
+#define SERVE_OP_EXTRACT        3
+#define SERVE_OP_DEL            4
+#define SERVE_OP_INFO           5
+#define SERVE_OP_STATS          6
+#define SERVE_NUM_OPS           7
+
+#define SERVE_FLAG_AMSDOS       0x01
+#define SERVE_FLAG_TEXT         0x02
+#define SERVE_FLAG_TRACKS       0x04
+
+#define SERVE_STATUS_OK         0
+#define SERVE_STATUS_ERROR      1
+
+#define SERVE_MAX_MESSAGE       (4 * 1024 * 1024)
+
+/* Every message is a 32-bit little endian length followed by that many
+   bytes. A request is a serve_request_s, the image path, the file name, and
+   for insert the file data. A response is a status byte followed by the
+   command output, the file data for extract, or an error message. */
+#pragma pack(push)
+#pragma pack(1)
+struct serve_request_s {
+    u8 op;
+    u8 flags;
+    u16 entry_addr;
+    u16 exec_addr;
+    u16 image_name_length;
+    u16 file_name_length;
+};
+#pragma pack(pop)
+
+/* Accepts requests on a Unix domain socket until killed. Opened images stay
+   in memory with their directory cached, requests on different images run
+   concurrently, and every change is committed to the image file before the
+   response is sent. */
+int serve(const char *socket_path);
+
+/* Sends one request to a running server and prints or writes out the
+   response the way the local command would. */
+int serve_call(const char *socket_path, const char *image_file_name, int op,
+               const char *file_name, u16 entry_addr, u16 exec_addr, int flags);
+
+#endif
@@ -0,0 +1,331 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "shadow.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gzip.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_FMEMOPEN
+#define HAVE_FSYNC
+#define HAVE_MMAP
+#endif
+
+static
+int open_memory(struct shadow_s *shadow)
+{
+#if defined (HAVE_FMEMOPEN)
+    shadow->fp = fmemopen(shadow->data, shadow->size, shadow->mapped ? "r" : "r+");
+#else
+    shadow->fp = tmpfile();
+    if (shadow->fp) {
+        fwrite(shadow->data, 1, shadow->size, shadow->fp);
+    }
+#endif
+
+    if (!shadow->fp) {
+        fprintf(stderr, "Failed to open %s in memory.\n", shadow->file_name);
+        shadow_close(shadow);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Decompresses straight from the file into memory */
+static
+int open_compressed(struct shadow_s *shadow, const char *file_name, FILE *fp)
+{
+    shadow->compressed = 1;
+    shadow->data       = gzip_inflate_file(fp, &shadow->size);
+    shadow->file_name  = (char *) malloc(strlen(file_name) + 1);
+
+    fclose(fp);
+
+    if (!shadow->data) {
+        fprintf(stderr, "Failed to decompress file %s.\n", file_name);
+        shadow_close(shadow);
+        return -1;
+    }
+
+    if (!shadow->file_name) {
+        fprintf(stderr, "Out of memory.\n");
+        shadow_close(shadow);
+        return -1;
+    }
+
+    strcpy(shadow->file_name, file_name);
+
+    return open_memory(shadow);
+}
+
+int shadow_open(struct shadow_s *shadow, const char *file_name)
+{
+    FILE *fp;
+
+    assert(shadow);
+    assert(file_name);
+
+    memset(shadow, 0, sizeof(*shadow));
+
+    fp = fopen(file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s.\n", file_name);
+        return -1;
+    }
+
+    if (gzip_is_name(file_name)) {
+        return open_compressed(shadow, file_name, fp);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    shadow->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    shadow->file_name = (char *) malloc(strlen(file_name) + 1);
+    shadow->data      = (u8 *) malloc(shadow->size + 1);
+
+    if (   !shadow->file_name
+        || !shadow->data
+        || fread(shadow->data, 1, shadow->size, fp) != (size_t) shadow->size) {
+        fprintf(stderr, "Failed to read file %s.\n", file_name);
+        fclose(fp);
+        shadow_close(shadow);
+        return -1;
+    }
+
+    fclose(fp);
+    strcpy(shadow->file_name, file_name);
+
+    return open_memory(shadow);
+}
+
+int shadow_map(struct shadow_s *shadow, const char *file_name)
+{
+#if defined (HAVE_MMAP)
+    struct stat st;
+    void *data;
+    int fd;
+
+    assert(shadow);
+    assert(file_name);
+
+    if (gzip_is_name(file_name)) {
+        return shadow_open(shadow, file_name);
+    }
+
+    memset(shadow, 0, sizeof(*shadow));
+
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file %s.\n", file_name);
+        return -1;
+    }
+
+    data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+
+    /* Empty files can not be mapped, copy them like anything else that
+       fails to map */
+    if (data == MAP_FAILED) {
+        return shadow_open(shadow, file_name);
+    }
+
+    shadow->file_name = (char *) malloc(strlen(file_name) + 1);
+    if (!shadow->file_name) {
+        munmap(data, st.st_size);
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+    strcpy(shadow->file_name, file_name);
+    shadow->data   = (u8 *) data;
+    shadow->size   = st.st_size;
+    shadow->mapped = 1;
+
+    return open_memory(shadow);
+#else
+    return shadow_open(shadow, file_name);
+#endif
+}
+
+int shadow_new(struct shadow_s *shadow, const char *file_name, long size)
+{
+    assert(shadow);
+    assert(file_name);
+
+    memset(shadow, 0, sizeof(*shadow));
+
+    shadow->size       = size;
+    shadow->compressed = gzip_is_name(file_name);
+    shadow->file_name  = (char *) malloc(strlen(file_name) + 1);
+    shadow->data       = (u8 *) calloc(size + 1, 1);
+
+    if (!shadow->file_name || !shadow->data) {
+        fprintf(stderr, "Out of memory.\n");
+        shadow_close(shadow);
+        return -1;
+    }
+
+    strcpy(shadow->file_name, file_name);
+
+    return open_memory(shadow);
+}
+
+int shadow_adopt(struct shadow_s *shadow, const char *file_name, u8 *data, long size)
+{
+    assert(shadow);
+    assert(file_name);
+    assert(data);
+
+    memset(shadow, 0, sizeof(*shadow));
+
+    shadow->size      = size;
+    shadow->data      = data;
+    shadow->file_name = (char *) malloc(strlen(file_name) + 1);
+
+    if (!shadow->file_name) {
+        fprintf(stderr, "Out of memory.\n");
+        shadow_close(shadow);
+        return -1;
+    }
+
+    strcpy(shadow->file_name, file_name);
+
+    return open_memory(shadow);
+}
+
+int shadow_commit(struct shadow_s *shadow)
+{
+    assert(shadow);
+    assert(shadow->fp);
+    assert(!shadow->mapped);
+
+    fflush(shadow->fp);
+
+#if !defined (HAVE_FMEMOPEN)
+    fseek(shadow->fp, 0, SEEK_SET);
+    fread(shadow->data, 1, shadow->size, shadow->fp);
+#endif
+
+    return shadow_save_file(shadow->file_name, shadow->data, shadow->size);
+}
+
+int shadow_save_file(const char *file_name, const u8 *data, long size)
+{
+    u8 *compressed;
+    long compressed_size;
+    int result;
+
+    assert(file_name);
+
+    if (!gzip_is_name(file_name)) {
+        return shadow_write_file(file_name, data, size);
+    }
+
+    compressed = gzip_deflate_buffer(data, size, &compressed_size);
+    result     = shadow_write_file(file_name, compressed, compressed_size);
+    free(compressed);
+
+    return result;
+}
+
+int shadow_write_file(const char *file_name, const u8 *data, long size)
+{
+    char *tmp_file_name;
+    FILE *fp;
+    int result;
+
+    assert(file_name);
+    assert(data || size == 0);
+
+    tmp_file_name = (char *) malloc(strlen(file_name) + 5);
+    if (!tmp_file_name) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+    sprintf(tmp_file_name, "%s.tmp", file_name);
+
+    fp = fopen(tmp_file_name, "wb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", tmp_file_name);
+        free(tmp_file_name);
+        return -1;
+    }
+
+    result = fwrite(data, 1, size, fp) == (size_t) size ? 0 : -1;
+
+    if (result == 0 && fflush(fp) != 0) {
+        result = -1;
+    }
+
+#if defined (HAVE_FSYNC)
+    if (result == 0) {
+        struct stat st;
+
+        /* Keep the permissions of the file being replaced */
+        if (stat(file_name, &st) == 0) {
+            fchmod(fileno(fp), st.st_mode & 07777);
+        }
+
+        if (fsync(fileno(fp)) != 0) {
+            result = -1;
+        }
+    }
+#endif
+
+    if (fclose(fp) != 0) {
+        result = -1;
+    }
+
+#if !defined (HAVE_FSYNC)
+    /* rename does not replace existing files everywhere */
+    if (result == 0) {
+        remove(file_name);
+    }
+#endif
+
+    if (result == 0 && rename(tmp_file_name, file_name) != 0) {
+        result = -1;
+    }
+
+    if (result != 0) {
+        fprintf(stderr, "Failed to write %s.\n", file_name);
+        remove(tmp_file_name);
+    }
+
+    free(tmp_file_name);
+
+    return result;
+}
+
+void shadow_close(struct shadow_s *shadow)
+{
+    assert(shadow);
+
+    if (shadow->fp) {
+        fclose(shadow->fp);
+    }
+
+#if defined (HAVE_MMAP)
+    if (shadow->mapped) {
+        munmap(shadow->data, shadow->size);
+        shadow->data = NULL;
+    }
+#endif
+
+    free(shadow->data);
+    free(shadow->file_name);
+    memset(shadow, 0, sizeof(*shadow));
+}
@@ -0,0 +1,44 @@
+#ifndef SHADOW_H_
+#define SHADOW_H_
+
+#include <stdio.h>
+
+#include "types.h"
+
+/* An image loaded into memory, or created there by shadow_new. All reads
+   and writes go through fp, and nothing reaches the image file until
+   shadow_commit writes it back with a single write, one fsync and an atomic
+   rename. Files named .gz are decompressed as they are read and compressed
+   again when committed. */
+struct shadow_s {
+    char *file_name;
+    u8 *data;
+    long size;
+    int mapped;                         /* Read only, set by shadow_map */
+    int compressed;                     /* Kept gzipped on disk */
+    FILE *fp;
+};
+
+int shadow_open(struct shadow_s *shadow, const char *file_name);
+int shadow_new(struct shadow_s *shadow, const char *file_name, long size);
+
+/* Maps the image read only where mmap is available, for commands that only
+   read. Such shadows can not be committed. Compressed images are read like
+   shadow_open does. */
+int shadow_map(struct shadow_s *shadow, const char *file_name);
+
+/* Opens data, read by the caller, in memory. The shadow takes over data,
+   which must come from malloc. */
+int shadow_adopt(struct shadow_s *shadow, const char *file_name, u8 *data, long size);
+
+int shadow_commit(struct shadow_s *shadow);
+void shadow_close(struct shadow_s *shadow);
+
+/* Replaces file_name with data through a temporary file that is fsynced
+   and renamed over it, so the file is either old or new after a crash. */
+int shadow_write_file(const char *file_name, const u8 *data, long size);
+
+/* Same, gzipping data first when file_name ends in .gz */
+int shadow_save_file(const char *file_name, const u8 *data, long size);
+
+#endif
@@ -0,0 +1,263 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "sync.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "amsdos.h"
+#include "hash.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#include <dirent.h>
+#include <sys/stat.h>
+#define HAVE_DIRENT
+#endif
+
+struct file_hash_s {
+    struct hash_s hash;
+    long size;
+};
+
+static
+int hash_sink(void *ctx, u8 *buf, size_t len)
+{
+    struct file_hash_s *file_hash = (struct file_hash_s *) ctx;
+
+    hash_update(&file_hash->hash, buf, len);
+    file_hash->size += len;
+
+    return 0;
+}
+
+static
+const char *get_base_name(const char *path)
+{
+    const char *base = strrchr(path, '/');
+
+    return base ? base + 1 : path;
+}
+
+static
+u8 *read_host_file(const char *host_file_name, long *size)
+{
+    FILE *fp;
+    u8 *data;
+
+    fp = fopen(host_file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", host_file_name);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    /* Room for the AMSDOS header in front of the data */
+    data = (u8 *) malloc(*size + sizeof(struct amsdos_header_s));
+    if (!data || fread(data + sizeof(struct amsdos_header_s), 1, *size, fp) != (size_t) *size) {
+        fprintf(stderr, "Failed to read file %s.\n", host_file_name);
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+int sync_file(FILE *fp, const char *host_file_name, int amsdos, int verbose)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    struct cpm_diren_s file;
+    struct amsdos_header_s header;
+    struct amsdos_header_s old_header;
+    const char *file_name;
+    u8 *data;
+    long size;
+    int num_diren;
+    int first;
+    int has_header;
+    int new_blocks;
+    u16 entry_addr;
+    u16 exec_addr;
+
+    assert(fp);
+    assert(host_file_name);
+
+    file_name = get_base_name(host_file_name);
+
+    if (!cpm_valid_filename(file_name)) {
+        if (verbose) {
+            printf("Skipped %s, not a valid CP/M file name.\n", file_name);
+        }
+        return 2;
+    }
+
+    data = read_host_file(host_file_name, &size);
+    if (!data) {
+        return -1;
+    }
+
+    num_diren = cpm_read_dir(fp, table);
+
+    memset(&file, 0, sizeof(file));
+    denormalize_filename(file_name, &file);
+    first = cpm_find_extent(table, num_diren, &file, 0);
+
+    has_header = amsdos;
+    entry_addr = 0;
+    exec_addr  = 0;
+
+    /* Existing files keep their header choice and addresses */
+    if (first >= 0) {
+        has_header = cpm_read_amsdos_header(fp, &table[first], &old_header);
+
+        if (has_header) {
+            entry_addr = old_header.data_location;
+            exec_addr  = old_header.entry_address;
+        }
+    }
+
+    if (first >= 0) {
+        struct file_hash_s disk_hash;
+        struct file_hash_s host_hash;
+        u8 disk_digest[HASH_SIZE];
+        u8 host_digest[HASH_SIZE];
+        u8 padding[128];
+        long padded_size;
+
+        hash_init(&disk_hash.hash, 0);
+        disk_hash.size = 0;
+        cpm_read_file(fp, table, num_diren, first, hash_sink, &disk_hash);
+        hash_final(&disk_hash.hash, disk_digest);
+
+        /* Records are padded the way cpm_write_file pads them */
+        padded_size = (size + 127) / 128 * 128;
+        if (padded_size == 0 && !has_header) {
+            padded_size = 128;
+        }
+
+        memset(padding, CPM_NO_FILE, sizeof(padding));
+        hash_init(&host_hash.hash, 0);
+        hash_update(&host_hash.hash, data + sizeof(header), size);
+        hash_update(&host_hash.hash, padding, padded_size - size);
+        hash_final(&host_hash.hash, host_digest);
+
+        if (   disk_hash.size == padded_size
+            && memcmp(disk_digest, host_digest, HASH_SIZE) == 0
+            && (!has_header || old_header.logical_length == (u16) size)) {
+            if (verbose) {
+                printf("Unchanged %s.\n", file_name);
+            }
+            free(data);
+            return 0;
+        }
+    }
+
+    if (has_header) {
+        amsdos_new_header(&header, file_name, size, entry_addr, exec_addr);
+        memcpy(data, &header, sizeof(header));
+        new_blocks = cpm_write_file(fp, file_name, data, size + sizeof(header));
+    } else {
+        new_blocks = cpm_write_file(fp, file_name, data + sizeof(header), size);
+    }
+
+    free(data);
+
+    if (new_blocks < 0) {
+        return -1;
+    }
+
+    if (verbose) {
+        if (first < 0) {
+            printf("Added %s.\n", file_name);
+        } else if (new_blocks == 0) {
+            printf("Updated %s in place.\n", file_name);
+        } else {
+            printf("Updated %s, allocated %d new blocks.\n", file_name, new_blocks);
+        }
+    }
+
+    return 1;
+}
+
+int sync_dir(FILE *fp, const char *dir_name, int amsdos)
+{
+#if defined (HAVE_DIRENT)
+    DIR *dir;
+    struct dirent *entry;
+    int num_written;
+    int num_unchanged;
+    int num_skipped;
+    int num_failed;
+
+    assert(fp);
+    assert(dir_name);
+
+    dir = opendir(dir_name);
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory %s.\n", dir_name);
+        return -1;
+    }
+
+    num_written   = 0;
+    num_unchanged = 0;
+    num_skipped   = 0;
+    num_failed    = 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        char *path;
+        struct stat st;
+        int result;
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        path = (char *) malloc(strlen(dir_name) + strlen(entry->d_name) + 2);
+        if (!path) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        sprintf(path, "%s/%s", dir_name, entry->d_name);
+
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            free(path);
+            continue;
+        }
+
+        result = sync_file(fp, path, amsdos, 1);
+        free(path);
+
+        if (result < 0) {
+            num_failed++;
+        } else if (result == 0) {
+            num_unchanged++;
+        } else if (result == 1) {
+            num_written++;
+        } else {
+            num_skipped++;
+        }
+    }
+
+    closedir(dir);
+
+    printf("Synced %s: %d written, %d unchanged, %d skipped, %d failed.\n",
+           dir_name, num_written, num_unchanged, num_skipped, num_failed);
+
+    return num_failed == 0 ? num_written : -1;
+#else
+    (void) fp;
+    (void) amsdos;
+
+    fprintf(stderr, "Syncing %s is not supported on this platform.\n", dir_name);
+
+    return -1;
+#endif
+}
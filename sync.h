@@ -0,0 +1,17 @@
+#ifndef SYNC_H_
+#define SYNC_H_
+
+#include <stdio.h>
+
+/* Brings the files of a host directory into the image. Unchanged files are
+   skipped, changed files are rewritten in their existing blocks, and files
+   that are only in the image are left alone. Returns the number of files
+   written, or -1 if any file failed. */
+int sync_dir(FILE *fp, const char *dir_name, int amsdos);
+
+/* Syncs a single host file. Returns 0 when unchanged, 1 when the image was
+   written, 2 when the host file name is not a valid CP/M name, and -1 on
+   errors. */
+int sync_file(FILE *fp, const char *host_file_name, int amsdos, int verbose);
+
+#endif
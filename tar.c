@@ -0,0 +1,564 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "tar.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpm.h"
+#include "amsdos.h"
+
+#define TAR_BLOCK_SIZE  512
+#define RECORD_SIZE     128
+#define MAX_PAX_SIZE    4096
+#define MAX_FILE_SIZE   (1024 * 1024)
+
+#define XATTR_USER          "SCHILY.xattr.user.cpm.user"
+#define XATTR_ATTRIBUTES    "SCHILY.xattr.user.cpm.attributes"
+#define XATTR_TYPE          "SCHILY.xattr.user.amsdos.type"
+#define XATTR_LOAD          "SCHILY.xattr.user.amsdos.load"
+#define XATTR_EXEC          "SCHILY.xattr.user.amsdos.exec"
+
+/* ustar header, one tar block */
+struct tar_header_s {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+/* Values of the pax records a file came with */
+struct tar_entry_s {
+    char path[512];
+    long size;
+    int user;                           /* -1 when not given */
+    char attributes[8];
+    int type;                           /* -1 without an AMSDOS header */
+    u16 load;
+    u16 exec;
+};
+
+struct tar_out_s {
+    FILE *out;
+    long remaining;
+};
+
+static
+void octal_field(char *dest, int width, long value)
+{
+    char buffer[32];
+
+    sprintf(buffer, "%0*lo", width - 1, value);
+    memcpy(dest, buffer, width - 1);
+    dest[width - 1] = 0;
+}
+
+static
+unsigned header_checksum(struct tar_header_s *header)
+{
+    unsigned char *c;
+    unsigned sum;
+    unsigned i;
+
+    sum = 0;
+    c   = (unsigned char *) header;
+
+    for (i = 0; i < sizeof(*header); i++) {
+        /* The checksum field counts as spaces */
+        sum += i >= offsetof(struct tar_header_s, chksum)
+            && i <  offsetof(struct tar_header_s, chksum) + sizeof(header->chksum) ? ' ' : c[i];
+    }
+
+    return sum;
+}
+
+static
+int write_header(FILE *out, const char *name, char typeflag, long size, int mode)
+{
+    struct tar_header_s header;
+
+    memset(&header, 0, sizeof(header));
+
+    strncpy(header.name, name, sizeof(header.name) - 1);
+    octal_field(header.mode, sizeof(header.mode), mode);
+    octal_field(header.uid, sizeof(header.uid), 0);
+    octal_field(header.gid, sizeof(header.gid), 0);
+    octal_field(header.size, sizeof(header.size), size);
+    octal_field(header.mtime, sizeof(header.mtime), 0);
+    header.typeflag = typeflag;
+    memcpy(header.magic, "ustar", 6);
+    memcpy(header.version, "00", 2);
+
+    sprintf(header.chksum, "%06o", header_checksum(&header));
+    header.chksum[7] = ' ';
+
+    return fwrite(&header, sizeof(header), 1, out) == 1 ? 0 : -1;
+}
+
+static
+int write_padding(FILE *out, long size)
+{
+    static const u8 zeros[TAR_BLOCK_SIZE];
+    long padding;
+
+    padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+    return padding == 0 || fwrite(zeros, padding, 1, out) == 1 ? 0 : -1;
+}
+
+/* Two zero blocks end the archive */
+static
+int write_end(FILE *out)
+{
+    static const u8 zeros[2 * TAR_BLOCK_SIZE];
+
+    return fwrite(zeros, sizeof(zeros), 1, out) == 1 && fflush(out) == 0 ? 0 : -1;
+}
+
+/* Appends a "<length> key=value\n" record, where length counts itself */
+static
+void pax_add(char *records, long *len, const char *key, const char *value)
+{
+    long length;
+    long n;
+
+    n = strlen(key) + strlen(value) + 3;
+
+    /* Find the length whose decimal digits and the record add up to it */
+    for (length = n + 1; ; length++) {
+        char number[24];
+
+        sprintf(number, "%ld", length);
+        if ((long) strlen(number) + n == length) {
+            break;
+        }
+    }
+
+    *len += sprintf(records + *len, "%ld %s=%s\n", length, key, value);
+}
+
+static
+int tar_data_sink(void *ctx, u8 *buf, size_t len)
+{
+    struct tar_out_s *tar_out = (struct tar_out_s *) ctx;
+
+    if ((long) len > tar_out->remaining) {
+        len = tar_out->remaining;
+    }
+
+    if (len > 0 && fwrite(buf, len, 1, tar_out->out) != 1) {
+        return -1;
+    }
+
+    tar_out->remaining -= len;
+
+    return 0;
+}
+
+int tar_export(FILE *fp, FILE *out)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    int num_diren;
+    int num_files;
+    int i;
+
+    assert(fp);
+    assert(out);
+
+    num_diren = cpm_read_dir(fp, table);
+    num_files = 0;
+
+    for (i = 0; i < num_diren; i++) {
+        struct amsdos_header_s header;
+        struct tar_out_s tar_out;
+        char records[MAX_PAX_SIZE];
+        char full_file_name[13];
+        char path[64];
+        char pax_name[80];
+        char value[16];
+        u8 attributes;
+        long records_len;
+        long size;
+        int has_header;
+
+        if (   table[i].user_number > 15
+            || table[i].EX          != 0
+            || table[i].S2          != 0) {
+            continue;
+        }
+
+        normalize_filename(full_file_name, &table[i]);
+
+        if (table[i].user_number == 0) {
+            strcpy(path, full_file_name);
+        } else {
+            sprintf(path, "user%d/%s", table[i].user_number, full_file_name);
+        }
+
+        attributes = cpm_get_attributes(&table[i]);
+        has_header = cpm_read_amsdos_header(fp, &table[i], &header);
+        size       = (long) cpm_file_records(table, num_diren, i) * RECORD_SIZE;
+
+        if (has_header) {
+            size = amsdos_get_length(&header);
+        }
+
+        records_len = 0;
+
+        sprintf(value, "%d", table[i].user_number);
+        pax_add(records, &records_len, XATTR_USER, value);
+
+        sprintf(value, "%c%c%c",
+                attributes & CPM_ATTR_READ_ONLY ? 'R' : '-',
+                attributes & CPM_ATTR_SYSTEM    ? 'S' : '-',
+                attributes & CPM_ATTR_ARCHIVE   ? 'A' : '-');
+        pax_add(records, &records_len, XATTR_ATTRIBUTES, value);
+
+        if (has_header) {
+            sprintf(value, "%d", header.filetype);
+            pax_add(records, &records_len, XATTR_TYPE, value);
+            sprintf(value, "%04x", header.data_location);
+            pax_add(records, &records_len, XATTR_LOAD, value);
+            sprintf(value, "%04x", header.entry_address);
+            pax_add(records, &records_len, XATTR_EXEC, value);
+        }
+
+        sprintf(pax_name, "PaxHeaders/%s", path);
+
+        if (   write_header(out, pax_name, 'x', records_len, 0644) != 0
+            || fwrite(records, records_len, 1, out) != 1
+            || write_padding(out, records_len) != 0
+            || write_header(out, path, '0', size, attributes & CPM_ATTR_READ_ONLY ? 0444 : 0644) != 0) {
+            fprintf(stderr, "Failed to write tar stream.\n");
+            return -1;
+        }
+
+        /* The data goes out record by record as the extents are read */
+        tar_out.out       = out;
+        tar_out.remaining = size;
+
+        if (cpm_read_file(fp, table, num_diren, i, tar_data_sink, &tar_out) != 0) {
+            fprintf(stderr, "Failed to read %s, its directory entry is damaged.\n", full_file_name);
+            return -1;
+        }
+
+        /* Headers may claim more than the file holds, keep the stream valid */
+        for (; tar_out.remaining > 0; tar_out.remaining--) {
+            fputc(0, out);
+        }
+
+        if (write_padding(out, size) != 0) {
+            fprintf(stderr, "Failed to write tar stream.\n");
+            return -1;
+        }
+
+        num_files++;
+    }
+
+    if (write_end(out) != 0) {
+        fprintf(stderr, "Failed to write tar stream.\n");
+        return -1;
+    }
+
+    return num_files;
+}
+
+static
+void pax_parse(const char *records, long len, struct tar_entry_s *entry)
+{
+    const char *record;
+
+    for (record = records; record < records + len; ) {
+        const char *key;
+        const char *value;
+        const char *end;
+        long length;
+        char buffer[256];
+
+        length = strtol(record, (char **) &key, 10);
+        if (length <= 0 || record + length > records + len || *key != ' ') {
+            return;
+        }
+
+        key++;
+        end   = record + length - 1;
+        value = strchr(key, '=');
+
+        if (value && value < end && (size_t) (end - value - 1) < sizeof(buffer)) {
+            size_t key_length = value - key;
+
+            memcpy(buffer, value + 1, end - value - 1);
+            buffer[end - value - 1] = 0;
+
+            if (key_length == strlen("path") && strncmp(key, "path", key_length) == 0) {
+                strncpy(entry->path, buffer, sizeof(entry->path) - 1);
+            } else if (key_length == strlen("size") && strncmp(key, "size", key_length) == 0) {
+                entry->size = strtol(buffer, NULL, 10);
+            } else if (key_length == strlen(XATTR_USER) && strncmp(key, XATTR_USER, key_length) == 0) {
+                entry->user = atoi(buffer);
+            } else if (key_length == strlen(XATTR_ATTRIBUTES) && strncmp(key, XATTR_ATTRIBUTES, key_length) == 0) {
+                strncpy(entry->attributes, buffer, sizeof(entry->attributes) - 1);
+            } else if (key_length == strlen(XATTR_TYPE) && strncmp(key, XATTR_TYPE, key_length) == 0) {
+                entry->type = atoi(buffer);
+            } else if (key_length == strlen(XATTR_LOAD) && strncmp(key, XATTR_LOAD, key_length) == 0) {
+                entry->load = (u16) strtol(buffer, NULL, 16);
+            } else if (key_length == strlen(XATTR_EXEC) && strncmp(key, XATTR_EXEC, key_length) == 0) {
+                entry->exec = (u16) strtol(buffer, NULL, 16);
+            }
+        }
+
+        record += length;
+    }
+}
+
+/* Length of a header field that is not terminated when it is full */
+static
+size_t field_length(const char *field, size_t size)
+{
+    const char *end = (const char *) memchr(field, 0, size);
+
+    return end ? (size_t) (end - field) : size;
+}
+
+static
+void reset_entry(struct tar_entry_s *entry)
+{
+    memset(entry, 0, sizeof(*entry));
+    entry->size = -1;
+    entry->user = -1;
+    entry->type = -1;
+}
+
+/* Reads size bytes and the padding after them. Returns the data, or NULL
+   when the stream ends early. */
+static
+u8 *read_data(FILE *in, long size)
+{
+    long padded;
+    u8 *data;
+
+    padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+
+    data = (u8 *) malloc(sizeof(struct amsdos_header_s) + padded + 1);
+    if (!data) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    if (padded > 0 && fread(data + sizeof(struct amsdos_header_s), padded, 1, in) != 1) {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+/* Inserts one file, data holding room for an AMSDOS header in front */
+static
+int insert_entry(FILE *fp, struct tar_entry_s *entry, u8 *data, int amsdos)
+{
+    struct cpm_diren_s dir;
+    const char *file_name;
+    int user;
+    int result;
+
+    file_name = strrchr(entry->path, '/') ? strrchr(entry->path, '/') + 1 : entry->path;
+
+    /* Without a user record, a userN parent directory gives the user */
+    user = entry->user;
+    if (user < 0) {
+        const char *dir_name;
+
+        user = 0;
+
+        if (file_name > entry->path) {
+            for (dir_name = file_name - 1; dir_name > entry->path && dir_name[-1] != '/'; dir_name--) {
+            }
+
+            if (strncmp(dir_name, "user", 4) == 0) {
+                user = atoi(dir_name + 4);
+            }
+        }
+    }
+
+    if (!cpm_valid_filename(file_name) || !strcspn(file_name, ".") || user < 0 || user > 15) {
+        fprintf(stderr, "Skipped %s, not a valid CP/M file.\n", entry->path);
+        return -1;
+    }
+
+    memset(&dir, 0, sizeof(dir));
+    denormalize_filename(file_name, &dir);
+    dir.user_number = (u8) user;
+
+    if (strchr(entry->attributes, 'R')) {
+        dir.ext[0] |= 0x80;
+    }
+
+    if (strchr(entry->attributes, 'S')) {
+        dir.ext[1] |= 0x80;
+    }
+
+    if (strchr(entry->attributes, 'A')) {
+        dir.ext[2] |= 0x80;
+    }
+
+    /* Files from tar_export carry their header in the records, others
+       follow the amsdos flag */
+    if (entry->type >= 0 || (entry->user < 0 && amsdos)) {
+        struct amsdos_header_s header;
+
+        amsdos_new_header(&header, file_name, entry->size, 0, 0);
+        header.user_number = (u8) user;
+
+        if (entry->type >= 0) {
+            header.filetype      = (u8) entry->type;
+            header.data_location = entry->load;
+            header.entry_address = entry->exec;
+        }
+
+        amsdos_set_length(&header, entry->size);
+        memcpy(data, &header, sizeof(header));
+
+        result = cpm_write_entry(fp, &dir, data, sizeof(header) + entry->size);
+    } else {
+        result = cpm_write_entry(fp, &dir, data + sizeof(struct amsdos_header_s), entry->size);
+    }
+
+    if (result < 0) {
+        fprintf(stderr, "Failed to insert %s, not enough space on disk.\n", entry->path);
+        return -1;
+    }
+
+    printf("Wrote %s into disk.\n", entry->path);
+
+    return 0;
+}
+
+int tar_import(FILE *fp, FILE *in, int amsdos)
+{
+    struct tar_header_s header;
+    struct tar_entry_s entry;
+    int num_written;
+    int failed;
+    int ended;
+
+    assert(fp);
+    assert(in);
+
+    reset_entry(&entry);
+
+    num_written = 0;
+    failed      = 0;
+    ended       = 0;
+
+    while (fread(&header, sizeof(header), 1, in) == 1) {
+        char checksum[sizeof(header.chksum) + 1];
+        char size_field[sizeof(header.size) + 1];
+        long size;
+        u8 *data;
+
+        /* Two zero blocks end the archive, a stream that stops before them
+           was cut short */
+        if (header.name[0] == 0) {
+            ended = fread(&header, sizeof(header), 1, in) == 1 && header.name[0] == 0;
+            break;
+        }
+
+        memcpy(checksum, header.chksum, sizeof(header.chksum));
+        checksum[sizeof(header.chksum)] = 0;
+
+        if ((unsigned) strtol(checksum, NULL, 8) != header_checksum(&header)) {
+            fprintf(stderr, "Tar stream is damaged.\n");
+            return -1;
+        }
+
+        memcpy(size_field, header.size, sizeof(header.size));
+        size_field[sizeof(header.size)] = 0;
+        size = strtol(size_field, NULL, 8);
+
+        if (header.typeflag == 'x' || header.typeflag == 'g') {
+            if (size > MAX_PAX_SIZE) {
+                fprintf(stderr, "Tar stream has oversized pax records.\n");
+                return -1;
+            }
+
+            data = read_data(in, size);
+            if (!data) {
+                fprintf(stderr, "Tar stream ends in the middle of a file.\n");
+                return -1;
+            }
+
+            /* Global records apply to every file, but none of ours are global */
+            if (header.typeflag == 'x') {
+                pax_parse((char *) data + sizeof(struct amsdos_header_s), size, &entry);
+            }
+
+            free(data);
+            continue;
+        }
+
+        if (entry.size >= 0) {
+            size = entry.size;
+        }
+
+        if (size > MAX_FILE_SIZE) {
+            fprintf(stderr, "Tar stream holds a file too large for a disk.\n");
+            return -1;
+        }
+
+        data = read_data(in, size);
+        if (!data) {
+            fprintf(stderr, "Tar stream ends in the middle of a file.\n");
+            return -1;
+        }
+
+        if (header.typeflag == '0' || header.typeflag == 0) {
+            if (!entry.path[0]) {
+                size_t prefix_length = field_length(header.prefix, sizeof(header.prefix));
+
+                if (prefix_length) {
+                    memcpy(entry.path, header.prefix, prefix_length);
+                    entry.path[prefix_length++] = '/';
+                }
+
+                memcpy(entry.path + prefix_length, header.name, field_length(header.name, sizeof(header.name)));
+            }
+
+            entry.size = size;
+
+            if (insert_entry(fp, &entry, data, amsdos) != 0) {
+                failed = 1;
+            } else {
+                num_written++;
+            }
+        }
+
+        free(data);
+        reset_entry(&entry);
+    }
+
+    if (!ended) {
+        fprintf(stderr, "Tar stream ends before its end of archive marker.\n");
+        return -1;
+    }
+
+    return failed ? -1 : num_written;
+}
@@ -0,0 +1,22 @@
+#ifndef TAR_H_
+#define TAR_H_
+
+#include <stdio.h>
+
+/* Writes every file of the image to out as a pax tar stream. Names follow
+   extract-all, with users other than 0 in userN directories. The user number
+   and attributes, and the AMSDOS type, load and exec addresses go into
+   SCHILY.xattr.user.* records, which tar tools restore as extended
+   attributes. File data goes straight from the image sectors to out. Returns
+   the number of files written, or -1 on errors. */
+int tar_export(FILE *fp, FILE *out);
+
+/* Inserts the regular files of a tar stream read from in. Files exported by
+   tar_export get back their user, attributes and AMSDOS header, other files
+   go to the user of their userN directory, or user 0, and get an AMSDOS
+   header when amsdos is set. Returns the number of files written, or -1 if
+   any failed or the stream ends before its end of archive marker, in which
+   case the image should not be kept. */
+int tar_import(FILE *fp, FILE *in, int amsdos);
+
+#endif
@@ -2,19 +2,85 @@
 #include <assert.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "platformdef.h"
 #include "types.h"
 #include "cpm.h"
 #include "cpcemu.h"
+#include "archive.h"
+#include "diff.h"
 
 const char *TEST_FILE = "TEST.BIN";
 const char *TEST_COPY_FILE = "test-orig.bin";
 const char *TEST_DISK = "test.dsk";
+const char *TEST_RAW_FILE = "test-raw.bin";
+const char *TEST_ARCHIVE = "test.sca";
+const char *TEST_UNPACK_DIR = "test-unpack";
+const char *TEST_PATCH = "test.patch";
+const char *TEST_CUT_PATCH = "test-cut.patch";
+const char *TEST_PATCH_SOURCE = "test-source.dsk";
+const char *TEST_PATCH_OTHER = "test-other.dsk";
+const char *TEST_PATCH_EXPECTED = "test-expected.dsk";
 
 #define ONE_TRACK_SIZE_BYTES 16384
 const int TEST_FILE_SIZE_BYTES = ONE_TRACK_SIZE_BYTES + 1;
 
+/* Returns 1 if both files hold the same bytes */
+static
+int same_file(const char *file_name1, const char *file_name2)
+{
+    FILE *fp1;
+    FILE *fp2;
+    int c1;
+    int c2;
+
+    fp1 = fopen(file_name1, "rb");
+    fp2 = fopen(file_name2, "rb");
+
+    if (!fp1 || !fp2) {
+        if (fp1) {
+            fclose(fp1);
+        }
+        if (fp2) {
+            fclose(fp2);
+        }
+        return 0;
+    }
+
+    do {
+        c1 = fgetc(fp1);
+        c2 = fgetc(fp2);
+    } while (c1 == c2 && c1 != EOF);
+
+    fclose(fp1);
+    fclose(fp2);
+
+    return c1 == c2;
+}
+
+/* Copies the first length bytes of a file, or all of it if length is
+   negative */
+static
+void copy_file(const char *source_name, const char *dest_name, long length)
+{
+    FILE *source;
+    FILE *dest;
+    int c;
+
+    source = fopen(source_name, "rb");
+    dest   = fopen(dest_name, "wb");
+    assert(source);
+    assert(dest);
+
+    while (length-- != 0 && (c = fgetc(source)) != EOF) {
+        fputc(c, dest);
+    }
+
+    fclose(source);
+    fclose(dest);
+}
+
 int main(int argc, char *argv[])
 {
     int i;
@@ -71,6 +137,168 @@ int main(int argc, char *argv[])
     }
     printf("Test passed, files are identical.\n");
 
+    /* Read across the end of the first extent by offset */
+    {
+        struct cpm_diren_s table[CPM_MAX_DIREN];
+        u8 buffer[64];
+        int num_diren;
+        int first;
+        long n;
+
+        image = fopen(TEST_DISK, "rb");
+        num_diren = cpm_read_dir(image, table);
+        first = cpm_find_file(table, num_diren, TEST_FILE);
+        assert(first >= 0);
+
+        n = cpm_read_at(image, table, num_diren, first, ONE_TRACK_SIZE_BYTES - 32, buffer, sizeof(buffer));
+        fclose(image);
+
+        /* Without an AMSDOS header the file ends at its last record */
+        if (n != (long) sizeof(buffer)) {
+            fprintf(stderr, "Read %ld bytes at the end of the file.\n", n);
+            exit(1);
+        }
+
+        fseek(test_file2, ONE_TRACK_SIZE_BYTES - 32, SEEK_SET);
+
+        for (i = 0; i < TEST_FILE_SIZE_BYTES - (ONE_TRACK_SIZE_BYTES - 32); i++) {
+            if (fgetc(test_file2) != buffer[i]) {
+                fprintf(stderr, "Found byte mismatch at offset %d.\n", ONE_TRACK_SIZE_BYTES - 32 + i);
+                exit(1);
+            }
+        }
+    }
+    printf("Test passed, read by offset.\n");
+
+    /* Insert from memory with an AMSDOS header and extract it back */
+    {
+        u8 data[300];
+        u8 buffer[sizeof(data)];
+        long n;
+
+        for (i = 0; i < (int) sizeof(data); i++) {
+            data[i] = (u8) (i * 7);
+        }
+
+        image = fopen(TEST_DISK, "r+b");
+        if (cpm_insert_buffer(image, "MEM.BIN", data, sizeof(data), 0x4000, 0x4000, 1) != 0) {
+            fprintf(stderr, "Failed to insert buffer.\n");
+            exit(1);
+        }
+        n = cpm_extract_buffer(image, "MEM.BIN", NULL, 0);
+        if (n == (long) sizeof(data)) {
+            n = cpm_extract_buffer(image, "MEM.BIN", buffer, sizeof(buffer));
+        }
+        fclose(image);
+
+        if (n != (long) sizeof(data) || memcmp(data, buffer, sizeof(data)) != 0) {
+            fprintf(stderr, "Extracted buffer differs from the inserted one.\n");
+            exit(1);
+        }
+    }
+    printf("Test passed, buffer insert and extract.\n");
+
+    /* Pack a disk image and a file that is not one, and restore both bit
+       exact */
+    {
+        struct corpus_s corpus;
+        char path[64];
+
+        test_file = fopen(TEST_RAW_FILE, "wb");
+        assert(test_file);
+        for (i = 0; i < 3 * ARCHIVE_RAW_CHUNK_SIZE + 100; i++) {
+            fputc(i < ARCHIVE_RAW_CHUNK_SIZE * 2 ? i / ARCHIVE_RAW_CHUNK_SIZE : rand(), test_file);
+        }
+        fclose(test_file);
+
+        corpus_init(&corpus);
+        corpus_add(&corpus, TEST_DISK);
+        corpus_add(&corpus, TEST_RAW_FILE);
+
+        if (   archive_pack(TEST_ARCHIVE, &corpus, 1) != 0
+            || archive_unpack(TEST_ARCHIVE, TEST_UNPACK_DIR, NULL, 0) != 0) {
+            fprintf(stderr, "Failed to pack and unpack the images.\n");
+            exit(1);
+        }
+        corpus_free(&corpus);
+
+        for (i = 0; i < 2; i++) {
+            const char *file_name = i == 0 ? TEST_DISK : TEST_RAW_FILE;
+
+            sprintf(path, "%s/%s", TEST_UNPACK_DIR, file_name);
+
+            if (!same_file(file_name, path)) {
+                fprintf(stderr, "Restored %s differs from the packed one.\n", file_name);
+                exit(1);
+            }
+
+            remove(path);
+        }
+
+        remove(TEST_UNPACK_DIR);
+        remove(TEST_ARCHIVE);
+        remove(TEST_RAW_FILE);
+    }
+    printf("Test passed, archive pack and unpack.\n");
+
+    /* Patch an empty disk into the test disk, after checking that a patch
+       made for another image or cut short leaves the image as it was */
+    {
+        long patch_size;
+
+        image = fopen(TEST_PATCH_SOURCE, "wb+");
+        assert(image);
+        cpm_new(image);
+        fclose(image);
+
+        if (diff_make_patch(TEST_PATCH_SOURCE, TEST_DISK, TEST_PATCH) != 0) {
+            fprintf(stderr, "Failed to make a patch.\n");
+            exit(1);
+        }
+
+        copy_file(TEST_PATCH_SOURCE, TEST_PATCH_OTHER, -1);
+        image = fopen(TEST_PATCH_OTHER, "rb+");
+        assert(image);
+        fseek(image, CPCEMU_INFO_OFFSET + 0x100, SEEK_SET);
+        fputc(0x42, image);
+        fclose(image);
+        copy_file(TEST_PATCH_OTHER, TEST_PATCH_EXPECTED, -1);
+
+        if (   diff_apply_patch(TEST_PATCH_OTHER, TEST_PATCH) == 0
+            || !same_file(TEST_PATCH_OTHER, TEST_PATCH_EXPECTED)) {
+            fprintf(stderr, "Patch was applied to an image it was not made for.\n");
+            exit(1);
+        }
+
+        test_file = fopen(TEST_PATCH, "rb");
+        assert(test_file);
+        fseek(test_file, 0, SEEK_END);
+        patch_size = ftell(test_file);
+        fclose(test_file);
+
+        copy_file(TEST_PATCH, TEST_CUT_PATCH, patch_size - 16);
+        copy_file(TEST_PATCH_SOURCE, TEST_PATCH_EXPECTED, -1);
+
+        if (   diff_apply_patch(TEST_PATCH_SOURCE, TEST_CUT_PATCH) == 0
+            || !same_file(TEST_PATCH_SOURCE, TEST_PATCH_EXPECTED)) {
+            fprintf(stderr, "Truncated patch was applied.\n");
+            exit(1);
+        }
+
+        if (   diff_apply_patch(TEST_PATCH_SOURCE, TEST_PATCH) != 0
+            || !same_file(TEST_PATCH_SOURCE, TEST_DISK)) {
+            fprintf(stderr, "Patched image differs from the target.\n");
+            exit(1);
+        }
+
+        remove(TEST_PATCH);
+        remove(TEST_CUT_PATCH);
+        remove(TEST_PATCH_SOURCE);
+        remove(TEST_PATCH_OTHER);
+        remove(TEST_PATCH_EXPECTED);
+    }
+    printf("Test passed, make and apply patch.\n");
+
     remove(TEST_FILE);
     remove(TEST_COPY_FILE);
     remove(TEST_DISK);
@@ -0,0 +1,176 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "platformdef.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#define HAVE_CLOCK_GETTIME
+#endif
+
+#if defined (HAVE_PTHREAD)
+#include <pthread.h>
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#define TRACE_LOCK()    pthread_mutex_lock(&g_trace_lock)
+#define TRACE_UNLOCK()  pthread_mutex_unlock(&g_trace_lock)
+#else
+#define TRACE_LOCK()
+#define TRACE_UNLOCK()
+#endif
+
+int g_trace_enabled;
+
+static FILE *g_trace_fp;
+static u32 g_start_seconds;
+static u32 g_start_nanoseconds;
+
+void trace_now(u32 *seconds, u32 *nanoseconds)
+{
+#if defined (HAVE_CLOCK_GETTIME)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *seconds     = (u32) ts.tv_sec;
+    *nanoseconds = (u32) ts.tv_nsec;
+#else
+    clock_t ticks = clock();
+
+    *seconds     = (u32) (ticks / CLOCKS_PER_SEC);
+    *nanoseconds = (u32) ((ticks % CLOCKS_PER_SEC) * (1000000000.0 / CLOCKS_PER_SEC));
+#endif
+}
+
+static
+void put_u32(u8 *dest, u32 value)
+{
+    dest[0] = (u8) value;
+    dest[1] = (u8) (value >> 8);
+    dest[2] = (u8) (value >> 16);
+    dest[3] = (u8) (value >> 24);
+}
+
+static
+u32 get_u32(const u8 *src)
+{
+    return (u32) src[0] | ((u32) src[1] << 8) | ((u32) src[2] << 16) | ((u32) src[3] << 24);
+}
+
+int trace_open(const char *file_name)
+{
+    assert(file_name);
+    assert(!g_trace_fp);
+
+    g_trace_fp = fopen(file_name, "wb");
+    if (!g_trace_fp) {
+        fprintf(stderr, "Failed to open file %s for writing.\n", file_name);
+        return -1;
+    }
+
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), g_trace_fp);
+
+    trace_now(&g_start_seconds, &g_start_nanoseconds);
+    g_trace_enabled = 1;
+
+    /* Commands leave through exit() on errors too */
+    atexit(trace_close);
+
+    return 0;
+}
+
+void trace_close(void)
+{
+    TRACE_LOCK();
+
+    if (g_trace_fp) {
+        g_trace_enabled = 0;
+        fclose(g_trace_fp);
+        g_trace_fp = NULL;
+    }
+
+    TRACE_UNLOCK();
+}
+
+void trace_access(u8 op, u8 track, u8 sector, u8 physical)
+{
+    u8 record[TRACE_RECORD_SIZE];
+    u32 seconds;
+    u32 nanoseconds;
+
+    trace_now(&seconds, &nanoseconds);
+
+    if (nanoseconds < g_start_nanoseconds) {
+        seconds--;
+        nanoseconds += 1000000000UL;
+    }
+
+    record[0] = op;
+    record[1] = track;
+    record[2] = sector;
+    record[3] = physical;
+    put_u32(record + 4, seconds - g_start_seconds);
+    put_u32(record + 8, nanoseconds - g_start_nanoseconds);
+
+    TRACE_LOCK();
+
+    if (g_trace_fp) {
+        fwrite(record, 1, sizeof(record), g_trace_fp);
+    }
+
+    TRACE_UNLOCK();
+}
+
+long trace_load(const char *file_name, struct trace_record_s **records)
+{
+    u8 record[TRACE_RECORD_SIZE];
+    char magic[8];
+    long num_records;
+    long size;
+    FILE *fp;
+
+    assert(file_name);
+    assert(records);
+
+    fp = fopen(file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file %s for reading.\n", file_name);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (   fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+        || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a trace.\n", file_name);
+        fclose(fp);
+        return -1;
+    }
+
+    *records = (struct trace_record_s *) malloc((size / TRACE_RECORD_SIZE + 1) * sizeof(**records));
+    if (!*records) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    for (num_records = 0; fread(record, 1, sizeof(record), fp) == sizeof(record); num_records++) {
+        struct trace_record_s *dest = &(*records)[num_records];
+
+        dest->op          = record[0];
+        dest->track       = record[1];
+        dest->sector      = record[2];
+        dest->physical    = record[3];
+        dest->seconds     = get_u32(record + 4);
+        dest->nanoseconds = get_u32(record + 8);
+    }
+
+    fclose(fp);
+
+    return num_records;
+}
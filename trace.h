@@ -0,0 +1,51 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "types.h"
+
+/* Every track header and sector access that goes through cpcemu.c can be
+   recorded into a trace file, to be replayed later as a benchmark. The file
+   starts with TRACE_MAGIC and holds one TRACE_RECORD_SIZE record per access:
+   the operation, the track, the logical and physical sector, 0xFF for track
+   headers and whole tracks, and the seconds and nanoseconds since recording
+   started, both as 32-bit little endian. */
+#define TRACE_MAGIC             "SCTRACE1"
+#define TRACE_RECORD_SIZE       12
+
+#define TRACE_READ_SECTOR       'r'
+#define TRACE_WRITE_SECTOR      'w'
+#define TRACE_READ_TRACK_INFO   'R'
+#define TRACE_WRITE_TRACK_INFO  'W'
+#define TRACE_READ_TRACK        't'
+#define TRACE_WRITE_TRACK       'T'
+
+#define TRACE_NO_SECTOR         0xFF
+
+struct trace_record_s {
+    u8 op;
+    u8 track;
+    u8 sector;
+    u8 physical;
+    u32 seconds;
+    u32 nanoseconds;
+};
+
+/* Set while a trace is being recorded, so untraced runs only pay a test */
+extern int g_trace_enabled;
+
+/* Starts recording into file_name. The trace is flushed at exit. */
+int trace_open(const char *file_name);
+void trace_close(void);
+void trace_access(u8 op, u8 track, u8 sector, u8 physical);
+
+#define TRACE_ACCESS(op, track, sector, physical) \
+    do { if (g_trace_enabled) trace_access(op, track, sector, physical); } while (0)
+
+/* Reads the records of a trace. Returns the number of records, or -1 on
+   errors. The records are freed by the caller. */
+long trace_load(const char *file_name, struct trace_record_s **records);
+
+/* Monotonic time in seconds and nanoseconds */
+void trace_now(u32 *seconds, u32 *nanoseconds);
+
+#endif
@@ -0,0 +1,568 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "verify.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platformdef.h"
+#include "types.h"
+#include "cpcemu.h"
+#include "cpm.h"
+#include "amsdos.h"
+#include "gzip.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "shadow.h"
+
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
+#define HAVE_MEMSTREAM
+#endif
+
+#if defined (HAVE_PTHREAD)
+#include <pthread.h>
+#define VERIFY_LOCK(corpus)   pthread_mutex_lock(&(corpus)->lock)
+#define VERIFY_UNLOCK(corpus) pthread_mutex_unlock(&(corpus)->lock)
+#else
+#define VERIFY_LOCK(corpus)
+#define VERIFY_UNLOCK(corpus)
+#endif
+
+#define RECORD_SIZE         128
+#define MAX_BLOCKS          256
+#define MAX_EXTENTS         (32 * 64)
+
+#define CLAIM_FREE          0
+#define CLAIM_DIRECTORY     -1
+
+struct verify_s {
+    FILE *out;
+    int num_problems;
+};
+
+struct verify_job_s {
+    char *output;
+    size_t length;
+    int num_problems;                   /* -1 if the image was not verified */
+    int done;
+};
+
+struct verify_corpus_s {
+    struct corpus_s *corpus;
+    struct prefetch_s *prefetch;
+    struct verify_job_s *jobs;
+    int next_to_print;
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_t lock;
+#endif
+};
+
+static
+void problem(struct verify_s *verify, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(verify->out, format, args);
+    va_end(args);
+
+    fprintf(verify->out, "\n");
+    verify->num_problems++;
+}
+
+static
+void verify_tracks(FILE *fp, struct verify_s *verify)
+{
+    u8 first_id;
+    int track;
+
+    first_id = g_base_track ? CPM_SYSTEM_DISK : CPM_DATA_DISK;
+
+    for (track = 0; track < NUM_TRACK; track++) {
+        struct cpcemu_track_info_s info;
+        int seen[NUM_SECTOR];
+        int s;
+
+        read_track_info(fp, track, &info);
+
+        if (strncmp(info.header, CPCEMU_TRACK_HEADER, 10) != 0) {
+            problem(verify, "track %d: missing Track-Info header", track);
+            continue;
+        }
+
+        if (info.track_num != track || info.head_num != 0) {
+            problem(verify, "track %d: header says track %d, head %d", track, info.track_num, info.head_num);
+        }
+
+        if (info.num_sectors != NUM_SECTOR || info.sector_size != 2) {
+            problem(verify, "track %d: %d sectors of size code %d, expected %d of size code 2",
+                    track, info.num_sectors, info.sector_size, NUM_SECTOR);
+            continue;
+        }
+
+        memset(seen, 0, sizeof(seen));
+
+        for (s = 0; s < NUM_SECTOR; s++) {
+            struct cpcemu_sector_info_s *sector = &info.sector_info_table[s];
+            int index = sector->sector_id - first_id;
+
+            if (index < 0 || index >= NUM_SECTOR) {
+                problem(verify, "track %d: sector %d has ID 0x%02x, expected 0x%02x to 0x%02x",
+                        track, s, sector->sector_id, first_id, first_id + NUM_SECTOR - 1);
+            } else if (seen[index]++) {
+                problem(verify, "track %d: sector ID 0x%02x appears twice", track, sector->sector_id);
+            }
+
+            if (sector->track != track || sector->sector_size != 2) {
+                problem(verify, "track %d: sector 0x%02x says track %d, size code %d",
+                        track, sector->sector_id, sector->track, sector->sector_size);
+            }
+        }
+    }
+}
+
+static
+int same_file(struct cpm_diren_s *a, struct cpm_diren_s *b)
+{
+    int k;
+
+    if (a->user_number != b->user_number) {
+        return 0;
+    }
+
+    for (k = 0; k < 8; k++) {
+        if ((a->file_name[k] & 0x7f) != (b->file_name[k] & 0x7f)) {
+            return 0;
+        }
+    }
+
+    for (k = 0; k < 3; k++) {
+        if ((a->ext[k] & 0x7f) != (b->ext[k] & 0x7f)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Claims the blocks of every entry in a bitmap of owners, and checks that
+   each entry holds the blocks its RC needs and no more */
+static
+void verify_blocks(struct cpm_diren_s *table, int num_diren, struct verify_s *verify)
+{
+    int claims[MAX_BLOCKS];
+    int num_dir_blocks;
+    int num_blocks;
+    int records_per_block;
+    int i;
+
+    num_blocks        = cpm_num_blocks();
+    num_dir_blocks    = num_diren * sizeof(struct cpm_diren_s) / g_block_size;
+    records_per_block = g_block_size / RECORD_SIZE;
+
+    memset(claims, 0, sizeof(claims));
+
+    for (i = 0; i < num_dir_blocks; i++) {
+        claims[i] = CLAIM_DIRECTORY;
+    }
+
+    for (i = 0; i < num_diren; i++) {
+        struct cpm_diren_s *dir = &table[i];
+        char name[13];
+        int extent;
+        int num_used;
+        int needed;
+        unsigned k;
+
+        if (dir->user_number > 15) {
+            continue;
+        }
+
+        normalize_filename(name, dir);
+        extent   = dir->EX + 32 * dir->S2;
+        num_used = 0;
+
+        for (k = 0; k < 8; k++) {
+            int c = dir->file_name[k] & 0x7f;
+
+            if (!isprint(c) || (c == ' ' && k == 0) || islower(c)) {
+                problem(verify, "%s (user %d): invalid character 0x%02x in name", name, dir->user_number, c);
+                break;
+            }
+        }
+
+        if (dir->RC > 0x80) {
+            problem(verify, "%s (user %d) extent %d: RC %d is over 128", name, dir->user_number, extent, dir->RC);
+        }
+
+        for (k = 0; k < sizeof(dir->AL); k++) {
+            int block = dir->AL[k];
+
+            if (!block) {
+                continue;
+            }
+
+            num_used++;
+
+            if (k > 0 && !dir->AL[k - 1]) {
+                problem(verify, "%s (user %d) extent %d: block %d follows an empty slot",
+                        name, dir->user_number, extent, block);
+            }
+
+            if (block >= num_blocks) {
+                problem(verify, "%s (user %d) extent %d: block %d is past the end of the disk",
+                        name, dir->user_number, extent, block);
+            } else if (claims[block] == CLAIM_DIRECTORY) {
+                problem(verify, "%s (user %d) extent %d: block %d belongs to the directory",
+                        name, dir->user_number, extent, block);
+            } else if (claims[block] != CLAIM_FREE) {
+                char other[13];
+
+                normalize_filename(other, &table[claims[block] - 1]);
+                problem(verify, "%s (user %d) extent %d: block %d is also claimed by %s (user %d)",
+                        name, dir->user_number, extent, block, other, table[claims[block] - 1].user_number);
+            } else {
+                claims[block] = i + 1;
+            }
+        }
+
+        needed = (dir->RC + records_per_block - 1) / records_per_block;
+
+        if (num_used > needed) {
+            problem(verify, "%s (user %d) extent %d: %d blocks leaked past RC %d",
+                    name, dir->user_number, extent, num_used - needed, dir->RC);
+        } else if (num_used < needed) {
+            problem(verify, "%s (user %d) extent %d: RC %d needs %d blocks, only %d allocated",
+                    name, dir->user_number, extent, dir->RC, needed, num_used);
+        }
+    }
+}
+
+/* Checks that the extents of every file run from 0 without gaps or
+   duplicates, and that all but the last are full */
+static
+void verify_extents(struct cpm_diren_s *table, int num_diren, struct verify_s *verify)
+{
+    int checked[CPM_MAX_DIREN];
+    int i;
+
+    memset(checked, 0, sizeof(checked));
+
+    for (i = 0; i < num_diren; i++) {
+        int count[MAX_EXTENTS];
+        int full[MAX_EXTENTS];
+        char name[13];
+        int max_extent;
+        int extent;
+        int j;
+
+        if (table[i].user_number > 15 || checked[i]) {
+            continue;
+        }
+
+        memset(count, 0, sizeof(count));
+        max_extent = -1;
+
+        normalize_filename(name, &table[i]);
+
+        for (j = i; j < num_diren; j++) {
+            if (!checked[j] && same_file(&table[i], &table[j])) {
+                checked[j] = 1;
+
+                /* EX only counts up to 31 on CP/M 2.2 */
+                if (table[j].EX > 31) {
+                    problem(verify, "%s (user %d): directory entry %d has EX %d, over 31",
+                            name, table[i].user_number, j, table[j].EX);
+                    continue;
+                }
+
+                extent = table[j].EX + 32 * (table[j].S2 & 0x3f);
+
+                count[extent]++;
+                full[extent] = table[j].RC == 0x80;
+
+                if (extent > max_extent) {
+                    max_extent = extent;
+                }
+            }
+        }
+
+        for (extent = 0; extent <= max_extent; extent++) {
+            if (count[extent] == 0) {
+                problem(verify, "%s (user %d): extent %d is missing", name, table[i].user_number, extent);
+            } else if (count[extent] > 1) {
+                problem(verify, "%s (user %d): extent %d appears %d times",
+                        name, table[i].user_number, extent, count[extent]);
+            } else if (extent < max_extent && !full[extent]) {
+                problem(verify, "%s (user %d): extent %d is not full but later extents follow",
+                        name, table[i].user_number, extent);
+            }
+        }
+    }
+}
+
+/* A first record that names the file like an AMSDOS header does, but fails
+   the checksum, is a damaged header */
+static
+void verify_headers(FILE *fp, struct cpm_diren_s *table, int num_diren, struct verify_s *verify)
+{
+    int i;
+
+    for (i = 0; i < num_diren; i++) {
+        struct cpm_diren_s *dir = &table[i];
+        struct amsdos_header_s header;
+        u8 buffer[SIZ_SECTOR];
+        char name[13];
+        long length;
+        long data_size;
+        int track;
+        int sector;
+
+        if (   dir->user_number > 15
+            || dir->EX          != 0
+            || dir->S2          != 0
+            || dir->RC          == 0
+            || !dir->AL[0]
+            || dir->AL[0]       >= cpm_num_blocks()) {
+            continue;
+        }
+
+        normalize_filename(name, dir);
+
+        convert_AL_to_track_sector(dir->AL[0], &track, &sector);
+        read_logical_sector(fp, track, sector, buffer);
+        memcpy(&header, buffer, sizeof(header));
+
+        if (!amsdos_header_exists(&header)) {
+            int k;
+
+            for (k = 0; k < 8 && (header.filename[k] & 0x7f) == (dir->file_name[k] & 0x7f); k++) {
+            }
+
+            if (k == 8) {
+                for (k = 0; k < 3 && (header.extension[k] & 0x7f) == (dir->ext[k] & 0x7f); k++) {
+                }
+
+                if (k == 3) {
+                    problem(verify, "%s (user %d): AMSDOS header checksum is wrong", name, dir->user_number);
+                }
+            }
+
+            continue;
+        }
+
+        length    = amsdos_get_length(&header);
+        data_size = (long) cpm_file_records(table, num_diren, i) * RECORD_SIZE - sizeof(header);
+
+        if (length > data_size) {
+            problem(verify, "%s (user %d): AMSDOS header gives %ld bytes, the file holds %ld",
+                    name, dir->user_number, length, data_size);
+        }
+    }
+}
+
+int verify_image(FILE *fp, FILE *out)
+{
+    struct cpm_diren_s table[CPM_MAX_DIREN];
+    struct verify_s verify;
+    int num_diren;
+    int i;
+
+    assert(fp);
+    assert(out);
+
+    verify.out          = out;
+    verify.num_problems = 0;
+
+    verify_tracks(fp, &verify);
+
+    num_diren = cpm_read_dir(fp, table);
+
+    for (i = 0; i < num_diren; i++) {
+        u8 user = table[i].user_number;
+
+        if (user > 15 && user != CPM_NO_FILE) {
+            problem(&verify, "directory entry %d: unknown user number 0x%02x", i, user);
+        }
+    }
+
+    verify_blocks(table, num_diren, &verify);
+    verify_extents(table, num_diren, &verify);
+    verify_headers(fp, table, num_diren, &verify);
+
+    if (verify.num_problems == 0) {
+        fprintf(out, "No problems found.\n");
+    } else {
+        fprintf(out, "%d problems found.\n", verify.num_problems);
+    }
+
+    return verify.num_problems;
+}
+
+/* The report of an image is kept in memory until the images before it are
+   printed. Without open_memstream it goes through a temporary file. */
+static
+FILE *open_output(struct verify_job_s *job)
+{
+#if defined (HAVE_MEMSTREAM)
+    return open_memstream(&job->output, &job->length);
+#else
+    (void) job;
+    return tmpfile();
+#endif
+}
+
+static
+void close_output(struct verify_job_s *job, FILE *out)
+{
+#if !defined (HAVE_MEMSTREAM)
+    long length = ftell(out);
+
+    job->output = length > 0 ? (char *) malloc(length) : NULL;
+
+    if (job->output) {
+        rewind(out);
+        job->length = fread(job->output, 1, length, out);
+    }
+#else
+    (void) job;
+#endif
+
+    fclose(out);
+}
+
+/* Prints finished reports in order, up to the first image still running */
+static
+void print_ready(struct verify_corpus_s *verify)
+{
+    while (   verify->next_to_print < verify->corpus->num_paths
+           && verify->jobs[verify->next_to_print].done) {
+        struct verify_job_s *job = &verify->jobs[verify->next_to_print];
+
+        printf("== %s ==\n", verify->corpus->paths[verify->next_to_print]);
+        fwrite(job->output, 1, job->length, stdout);
+        fflush(stdout);
+
+        free(job->output);
+        job->output = NULL;
+        verify->next_to_print++;
+    }
+}
+
+/* Runs on a worker thread. All CP/M layer state is thread local, so each
+   worker can have its own image initialized. */
+static
+void verify_job(void *ctx, int index)
+{
+    struct verify_corpus_s *verify = (struct verify_corpus_s *) ctx;
+    struct verify_job_s *job = &verify->jobs[index];
+    const char *path = verify->corpus->paths[index];
+    struct shadow_s shadow;
+    FILE *out;
+    u8 *data;
+    long size;
+
+    job->num_problems = -1;
+
+    data = prefetch_wait(verify->prefetch, index, &size);
+
+    if (data && gzip_is_name(path)) {
+        u8 *compressed = data;
+
+        data = gzip_inflate_buffer(compressed, size, &size);
+        free(compressed);
+    }
+
+    out = open_output(job);
+
+    if (!out) {
+        free(data);
+    } else if (!data) {
+        fprintf(out, "Failed to read %s.\n", path);
+    } else if (size < CPCEMU_INFO_OFFSET) {
+        fprintf(out, "Unrecognized disk type\n");
+        free(data);
+    } else if (shadow_adopt(&shadow, path, data, size) == 0) {
+        if (check_disc_info(shadow.fp) && cpm_init(shadow.fp) == 0) {
+            job->num_problems = verify_image(shadow.fp, out);
+        } else {
+            fprintf(out, "Unrecognized disk type\n");
+        }
+
+        shadow_close(&shadow);
+    }
+
+    if (out) {
+        close_output(job, out);
+    }
+
+    prefetch_done(verify->prefetch, index);
+
+    VERIFY_LOCK(verify);
+    job->done = 1;
+    print_ready(verify);
+    VERIFY_UNLOCK(verify);
+}
+
+int verify_corpus(struct corpus_s *corpus, int num_workers, int queue_depth)
+{
+    struct verify_corpus_s verify;
+    int num_failed;
+    int i;
+
+    assert(corpus);
+
+    if (corpus->num_paths == 0) {
+        fprintf(stderr, "No images given.\n");
+        return -1;
+    }
+
+    memset(&verify, 0, sizeof(verify));
+    verify.corpus = corpus;
+
+    verify.jobs = (struct verify_job_s *) calloc(corpus->num_paths, sizeof(*verify.jobs));
+    if (!verify.jobs) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_init(&verify.lock, NULL);
+#endif
+
+    verify.prefetch = prefetch_start(corpus->paths, corpus->num_paths, queue_depth);
+    pool_run(num_workers, corpus->num_paths, verify_job, &verify);
+    prefetch_finish(verify.prefetch);
+
+#if defined (HAVE_PTHREAD)
+    pthread_mutex_destroy(&verify.lock);
+#endif
+
+    num_failed = 0;
+
+    for (i = 0; i < corpus->num_paths; i++) {
+        if (verify.jobs[i].num_problems != 0) {
+            num_failed++;
+        }
+    }
+
+    if (num_failed) {
+        fprintf(stderr, "%d of %d images failed:\n", num_failed, corpus->num_paths);
+
+        for (i = 0; i < corpus->num_paths; i++) {
+            if (verify.jobs[i].num_problems < 0) {
+                fprintf(stderr, "  %s (not verified)\n", corpus->paths[i]);
+            } else if (verify.jobs[i].num_problems != 0) {
+                fprintf(stderr, "  %s (%d problems)\n", corpus->paths[i], verify.jobs[i].num_problems);
+            }
+        }
+    }
+
+    free(verify.jobs);
+
+    return num_failed;
+}
@@ -0,0 +1,22 @@
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include <stdio.h>
+
+#include "corpus.h"
+
+/* Checks the track headers, the directory and the AMSDOS headers of an
+   image in one pass, and prints every problem found to out: blocks claimed
+   twice or outside the disk, blocks claimed past what RC needs, gaps and
+   duplicates in extent chains, bad names and bad header checksums or lengths.
+   Returns the number of problems. */
+int verify_image(FILE *fp, FILE *out);
+
+/* Verifies every image of the corpus on num_workers pool workers, with the
+   images read ahead by a prefetcher keeping queue_depth reads in flight.
+   Reports are printed whole, in corpus order, like --files prints them, and
+   images with problems are listed at the end. Returns the number of such
+   images, or -1 if none could be verified. */
+int verify_corpus(struct corpus_s *corpus, int num_workers, int queue_depth);
+
+#endif
@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "watch.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpm.h"
+#include "lock.h"
+#include "shadow.h"
+#include "sync.h"
+
+#if defined (__linux__)
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#define HAVE_INOTIFY
+#endif
+
+#if defined (HAVE_INOTIFY)
+static
+double elapsed_ms(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static
+int is_image_file(const char *name, const char *image_file_name)
+{
+    const char *base = strrchr(image_file_name, '/');
+    size_t len;
+
+    base = base ? base + 1 : image_file_name;
+    len  = strlen(base);
+
+    return strncmp(name, base, len) == 0 && (name[len] == 0 || strcmp(name + len, ".tmp") == 0);
+}
+
+/* Remembers which file the image was when this process last wrote it */
+static
+int note_image(const char *image_file_name, struct stat *last)
+{
+    if (stat(image_file_name, last) != 0) {
+        fprintf(stderr, "Failed to open file %s.\n", image_file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Loads the image again when another process replaced or changed it since
+   this process last wrote it, so its changes are not written over */
+static
+int reload_if_changed(struct shadow_s *shadow, const char *image_file_name, struct stat *last)
+{
+    struct shadow_s reloaded;
+    struct stat st;
+
+    if (stat(image_file_name, &st) != 0) {
+        fprintf(stderr, "Failed to open file %s.\n", image_file_name);
+        return -1;
+    }
+
+    if (   st.st_dev == last->st_dev
+        && st.st_ino == last->st_ino
+        && st.st_size == last->st_size
+        && st.st_mtim.tv_sec == last->st_mtim.tv_sec
+        && st.st_mtim.tv_nsec == last->st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    if (shadow_open(&reloaded, image_file_name) != 0) {
+        return -1;
+    }
+
+    if (cpm_init(reloaded.fp) != 0) {
+        fprintf(stderr, "Unrecognized disk type\n");
+        shadow_close(&reloaded);
+        return -1;
+    }
+
+    shadow_close(shadow);
+    *shadow = reloaded;
+    *last   = st;
+
+    return 0;
+}
+
+int watch_dir(const char *image_file_name, const char *dir_name, int amsdos, double lock_timeout)
+{
+    struct shadow_s shadow;
+    struct lock_s lock;
+    struct stat last;
+    char events[64 * (sizeof(struct inotify_event) + 256)];
+    int fd;
+
+    assert(image_file_name);
+    assert(dir_name);
+
+    /* The lock is held for each load, sync and commit, and left to other
+       writers while waiting for changes */
+    if (lock_acquire(&lock, image_file_name, 1, lock_timeout) != 0) {
+        return -1;
+    }
+
+    if (shadow_open(&shadow, image_file_name) != 0) {
+        lock_release(&lock);
+        return -1;
+    }
+
+    if (cpm_init(shadow.fp) != 0) {
+        fprintf(stderr, "Unrecognized disk type\n");
+        shadow_close(&shadow);
+        lock_release(&lock);
+        return -1;
+    }
+
+    fd = inotify_init();
+    if (fd < 0 || inotify_add_watch(fd, dir_name, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Failed to watch directory %s.\n", dir_name);
+        shadow_close(&shadow);
+        lock_release(&lock);
+        return -1;
+    }
+
+    sync_dir(shadow.fp, dir_name, amsdos);
+
+    if (shadow_commit(&shadow) != 0 || note_image(image_file_name, &last) != 0) {
+        shadow_close(&shadow);
+        lock_release(&lock);
+        close(fd);
+        return -1;
+    }
+
+    lock_release(&lock);
+
+    printf("Watching %s, press Ctrl-C to stop.\n", dir_name);
+    fflush(stdout);
+
+    while (1) {
+        struct timespec start;
+        ssize_t len;
+        ssize_t i;
+        int changed;
+        int overflowed;
+
+        len = read(fd, events, sizeof(events));
+        if (len <= 0) {
+            break;
+        }
+
+        if (lock_acquire(&lock, image_file_name, 1, lock_timeout) != 0) {
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        changed    = 0;
+        overflowed = 0;
+
+        if (reload_if_changed(&shadow, image_file_name, &last) != 0) {
+            lock_release(&lock);
+            break;
+        }
+
+        /* Everything that arrived in one read is committed together */
+        for (i = 0; i < len; ) {
+            struct inotify_event *event = (struct inotify_event *) (events + i);
+
+            i += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = 1;
+            } else if (   event->len
+                       && !(event->mask & IN_ISDIR)
+                       && !is_image_file(event->name, image_file_name)) {
+                char *path = (char *) malloc(strlen(dir_name) + strlen(event->name) + 2);
+
+                if (!path) {
+                    break;
+                }
+
+                sprintf(path, "%s/%s", dir_name, event->name);
+
+                if (sync_file(shadow.fp, path, amsdos, 1) == 1) {
+                    changed = 1;
+                }
+
+                free(path);
+            }
+        }
+
+        /* The kernel dropped events, so any file may have been missed */
+        if (overflowed && sync_dir(shadow.fp, dir_name, amsdos) != 0) {
+            changed = 1;
+        }
+
+        if (changed) {
+            if (shadow_commit(&shadow) != 0 || note_image(image_file_name, &last) != 0) {
+                lock_release(&lock);
+                break;
+            }
+
+            printf("Wrote %s in %.1f ms.\n", image_file_name, elapsed_ms(&start));
+        }
+
+        lock_release(&lock);
+        fflush(stdout);
+    }
+
+    close(fd);
+    shadow_close(&shadow);
+
+    return -1;
+}
+#else
+int watch_dir(const char *image_file_name, const char *dir_name, int amsdos, double lock_timeout)
+{
+    (void) image_file_name;
+    (void) amsdos;
+    (void) lock_timeout;
+
+    fprintf(stderr, "Watching %s is not supported on this platform.\n", dir_name);
+
+    return -1;
+}
+#endif
@@ -0,0 +1,11 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+/* Keeps the image in memory, syncs it with the host directory, and then
+   syncs every file that is written into the directory as it happens. The
+   image file is replaced atomically after each change, under the exclusive
+   lock, and loaded again first when another writer changed it meanwhile.
+   Does not return unless an error occurs. */
+int watch_dir(const char *image_file_name, const char *dir_name, int amsdos, double lock_timeout);
+
+#endif